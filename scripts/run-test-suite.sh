@@ -40,7 +40,7 @@ Targets:
 # Just perform a single build
 build_one() {
     meson build --buildtype debugoptimized -Db_coverage=true --prefix=/usr --sysconfdir=/etc \
-	  --datadir=/usr/share -Dwith-systemd-system-unit-dir=/lib/systemd/system $*
+	  --datadir=/usr/share -Dwith-systemd-system-unit-dir=/lib/systemd/system -Dwith-null-backend=true $*
     ninja -C build
 }
 
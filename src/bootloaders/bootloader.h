@@ -32,6 +32,11 @@ typedef bool (*boot_loader_update)(const BootManager *);
 typedef bool (*boot_loader_remove)(const BootManager *);
 typedef void (*boot_loader_destroy)(const BootManager *);
 typedef int (*boot_loader_caps)(const BootManager *);
+typedef bool (*boot_loader_begin_transaction)(const BootManager *);
+typedef bool (*boot_loader_install_kernels)(const BootManager *, KernelArray *);
+typedef bool (*boot_loader_remove_kernels)(const BootManager *, KernelArray *);
+typedef bool (*boot_loader_commit)(const BootManager *);
+typedef int (*boot_loader_set_default_installed)(const BootManager *, const Kernel *kernel);
 
 typedef enum {
         BOOTLOADER_CAP_MIN = 1 << 0,
@@ -62,6 +67,16 @@ typedef struct BootLoader {
         boot_loader_remove remove;         /**<Remove this bootloader from the disk */
         boot_loader_destroy destroy;       /**<Perform necessary cleanups */
         boot_loader_caps get_capabilities; /**<Check capabilities */
+
+        /* Optional batch hooks, the per-kernel functions are used when unset */
+        boot_loader_begin_transaction begin_transaction; /**<Start a batch of changes */
+        boot_loader_install_kernels install_kernels;     /**<Install a set of kernels */
+        boot_loader_remove_kernels remove_kernels;       /**<Remove a set of kernels */
+        boot_loader_commit commit;                       /**<Finish a batch of changes */
+
+        /* Optional, set_default_kernel is used after a full scan when unset */
+        boot_loader_set_default_installed
+            set_default_installed; /**<Only repoint the default, 0 if the kernel isn't installed */
 } BootLoader;
 
 #define __cbm_export__ __attribute__((visibility("default")))
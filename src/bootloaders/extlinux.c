@@ -105,7 +105,11 @@ __cbm_export__ const BootLoader extlinux_bootloader = {.name = "extlinux",
                                                        .remove = extlinux_remove,
                                                        .destroy = syslinux_common_destroy,
                                                        .get_capabilities =
-                                                           extlinux_get_capabilities };
+                                                           extlinux_get_capabilities,
+                                                       .install_kernels =
+                                                           syslinux_common_install_kernels,
+                                                       .set_default_installed =
+                                                           syslinux_common_set_default_installed };
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
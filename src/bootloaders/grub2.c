@@ -25,6 +25,8 @@
 #include "bootloader.h"
 #include "config.h"
 #include "files.h"
+#include "fs_stub.h"
+#include "grub2.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
@@ -153,7 +155,7 @@ bool grub2_remove_kernel(const BootManager *manager, const Kernel *kernel)
         autofree(char) *conf_path = NULL;
 
         conf_path = grub2_get_entry_path_for_kernel((BootManager *)manager, kernel);
-        if (nc_file_exists(conf_path) && unlink(conf_path) < 0) {
+        if (cbm_fs_exists(conf_path) && cbm_fs_unlink(conf_path) < 0) {
                 LOG_FATAL("grub2_remove_kernel: Failed to remove %s: %s",
                           conf_path,
                           strerror(errno));
@@ -175,7 +177,15 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         const char *root_tab = config->submenu ? "\t" : "";
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
+        const char *cmdline = NULL;
         autofree(char) *initrd_paths = NULL;
+
+        cmdline = boot_manager_get_kernel_cmdline((BootManager *)config->manager, kernel);
+        if (!cmdline) {
+                LOG_FATAL("Unable to load cmdline for: %s", kernel->source.path);
+                return false;
+        }
+
         initrd_paths = malloc(1);
         initrd_paths[0] = '\0';
 
@@ -242,7 +252,7 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         }
 
         /* Finish it off with the command line options */
-        cbm_writer_append_printf(config->writer, "%s\"\n", kernel->meta.cmdline);
+        cbm_writer_append_printf(config->writer, "%s\"\n", cmdline);
 
         /* Optional initrd */
         if (kernel->target.initrd_path) {
@@ -279,30 +289,21 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         return true;
 }
 
-static bool grub2_write_config(const BootManager *manager, const Kernel *default_kernel)
+bool grub2_render_config(const BootManager *manager, KernelArray *kernels,
+                         const Kernel *default_kernel, CbmWriter *writer)
 {
-        if (!manager) {
+        if (!manager || !kernels || !writer) {
                 return false;
         }
 
-        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
-        autofree(char) *grub_dir = NULL;
         const CbmDeviceProbe *root_dev = NULL;
         const char *os_name = NULL;
         const char *os_id = NULL;
-        autofree(char) *old_conf = NULL;
-        autofree(char) *conf_path = NULL;
         autofree(char) *boot_dir = NULL;
-        const char *prefix = NULL;
         bool is_separate;
         Grub2Config config = { 0 };
         bool wrote_submenu = false;
 
-        if (!cbm_writer_open(writer)) {
-                return false;
-        }
-
-        prefix = boot_manager_get_prefix((BootManager *)manager);
         root_dev = boot_manager_get_root_device((BootManager *)manager);
         if (!root_dev) {
                 LOG_FATAL("Root device unknown, this should never happen!");
@@ -334,28 +335,26 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         /* Try to select a default kernel for update situations whereby CBM
          * has been newly introduced, to ensure a /vmlinuz link
          */
-        if (!default_kernel && kernel_queue->len == 1) {
-                default_kernel = nc_array_get(kernel_queue, 0);
+        if (!default_kernel && kernels->len == 1) {
+                default_kernel = nc_array_get(kernels, 0);
         }
 
         /* Handle default kernel first always */
         if (default_kernel) {
-                /* Attempt to clean out old files in migration, not fatal */
-                grub2_remove_kernel(manager, default_kernel);
                 if (!grub2_write_kernel(&config, default_kernel)) {
                         LOG_FATAL("Unable to write kernel config for %s",
                                   default_kernel->target.legacy_path);
                         return false;
                 }
                 /* Have a default kernel and more than one kernel, use submenus */
-                if (kernel_queue->len > 1) {
+                if (kernels->len > 1) {
                         config.submenu = true;
                 }
         }
 
         /* For every kernel write out a menuentry */
-        for (uint16_t i = 0; i < kernel_queue->len; i++) {
-                const Kernel *k = nc_array_get(kernel_queue, i);
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
                 if (default_kernel && k == default_kernel) {
                         continue;
                 }
@@ -371,8 +370,6 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
                         wrote_submenu = true;
                 }
 
-                /* Attempt to clean out old files in migration, not fatal */
-                grub2_remove_kernel(manager, k);
                 if (!grub2_write_kernel(&config, k)) {
                         LOG_FATAL("Unable to write kernel config for %s", k->target.legacy_path);
                         return false;
@@ -384,6 +381,41 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
                 cbm_writer_append(writer, "echo \"}\"\n\n");
         }
 
+        return true;
+}
+
+static bool grub2_write_config(const BootManager *manager, const Kernel *default_kernel)
+{
+        if (!manager) {
+                return false;
+        }
+
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *grub_dir = NULL;
+        autofree(char) *old_conf = NULL;
+        autofree(char) *conf_path = NULL;
+        const char *prefix = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                return false;
+        }
+
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+
+        /* Attempt to clean out old files in migration, not fatal */
+        if (default_kernel) {
+                grub2_remove_kernel(manager, default_kernel);
+        }
+        for (uint16_t i = 0; i < kernel_queue->len; i++) {
+                const Kernel *k = nc_array_get(kernel_queue, i);
+                if (k != default_kernel) {
+                        grub2_remove_kernel(manager, k);
+                }
+        }
+
+        if (!grub2_render_config(manager, kernel_queue, default_kernel, writer)) {
+                return false;
+        }
         cbm_writer_close(writer);
         if (cbm_writer_error(writer) != 0) {
                 DECLARE_OOM();
@@ -400,7 +432,7 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
 
         /* Ensure the grub.d directory actually exists (should do..) */
         grub_dir = string_printf("%s/etc/grub.d", prefix);
-        if (!nc_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
+        if (!cbm_fs_exists(grub_dir) && !cbm_fs_mkdir_p(grub_dir, 00755)) {
                 LOG_FATAL("Failed to create grub.d dir: %s [%s]", grub_dir, strerror(errno));
                 return false;
         }
@@ -411,7 +443,7 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         }
 
         /* Ensure it's executable */
-        if (chmod(conf_path, 00755) != 0) {
+        if (cbm_fs_chmod(conf_path, 00755) != 0) {
                 LOG_FATAL("Failed to mark loader entry as executable: %s [%s]",
                           conf_path,
                           strerror(errno));
@@ -446,14 +478,14 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
 
         /* Always nuke the files *before* running grub-mkconfig to stop duped
          * entries being created */
-        if (nc_file_exists(vmlinuz_path) && unlink(vmlinuz_path) < 0) {
+        if (cbm_fs_exists(vmlinuz_path) && cbm_fs_unlink(vmlinuz_path) < 0) {
                 LOG_ERROR("grub2_set_default_kernel: Failed to remove %s: %s",
                           vmlinuz_path,
                           strerror(errno));
                 return false;
         }
 
-        if (nc_file_exists(initrd_path) && unlink(initrd_path) < 0) {
+        if (cbm_fs_exists(initrd_path) && cbm_fs_unlink(initrd_path) < 0) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to remove %s: %s",
                           initrd_path,
                           strerror(errno));
@@ -462,7 +494,7 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
 
         /* Ensure the GRUB2 directory tree exists */
         grub_dir = string_printf("%s/grub", boot_dir);
-        if (!nc_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
+        if (!cbm_fs_exists(grub_dir) && !cbm_fs_mkdir_p(grub_dir, 00755)) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to mkdir %s: %s",
                           grub_dir,
                           strerror(errno));
@@ -495,7 +527,7 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
 
         /* /vmlinuz -> boot/kernel-* */
         vmlinuz_rel = string_printf("%s/%s", boot_rel, default_kernel->target.legacy_path);
-        if (symlink(vmlinuz_rel, vmlinuz_path) != 0) {
+        if (cbm_fs_symlink(vmlinuz_rel, vmlinuz_path) != 0) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to update kernel default link: %s",
                           strerror(errno));
                 return false;
@@ -508,7 +540,7 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
 
         /* /initrd.img -> boot/initrd-* */
         initrd_rel = string_printf("%s/%s", boot_rel, default_kernel->target.initrd_path);
-        if (symlink(initrd_rel, initrd_path) != 0) {
+        if (cbm_fs_symlink(initrd_rel, initrd_path) != 0) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to update initrd default link: %s",
                           strerror(errno));
                 return false;
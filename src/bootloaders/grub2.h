@@ -0,0 +1,35 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include "bootloader.h"
+#include "writer.h"
+
+/**
+ * Append the grub.d script for @kernels to the open @writer, with the
+ * menuentry of @default_kernel first and the others in a submenu
+ */
+bool grub2_render_config(const BootManager *manager, KernelArray *kernels,
+                         const Kernel *default_kernel, CbmWriter *writer);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
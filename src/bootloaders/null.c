@@ -0,0 +1,232 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootloader.h"
+#include "bootman.h"
+#include "config.h"
+#include "fs_stub.h"
+#include "log.h"
+#include "nica/files.h"
+#include "null.h"
+#include "util.h"
+
+/**
+ * Kernels are still copied here by the core so its file handling is measured
+ */
+#define NULL_KERNEL_DESTINATION "/EFI/" KERNEL_NAMESPACE
+
+static NullBootLoaderStats null_stats = { 0 };
+static char *null_default_kernel = NULL;
+static int null_remove_budget = -1;
+
+void null_bootloader_get_stats(NullBootLoaderStats *stats)
+{
+        *stats = null_stats;
+}
+
+void null_bootloader_reset(void)
+{
+        memset(&null_stats, 0, sizeof(null_stats));
+        free(null_default_kernel);
+        null_default_kernel = NULL;
+        null_remove_budget = -1;
+}
+
+void null_bootloader_fail_removals_after(int count)
+{
+        null_remove_budget = count;
+}
+
+static bool null_ensure_kernel_dir(const BootManager *manager)
+{
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *kernel_dir = NULL;
+
+        boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
+        OOM_CHECK_RET(boot_dir, false);
+
+        kernel_dir = string_printf("%s%s", boot_dir, NULL_KERNEL_DESTINATION);
+        if (!cbm_fs_mkdir_p(kernel_dir, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", kernel_dir, strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+static bool null_init(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.init++;
+        return true;
+}
+
+static const char *null_get_kernel_destination(__cbm_unused__ const BootManager *manager)
+{
+        return NULL_KERNEL_DESTINATION;
+}
+
+static bool null_install_kernel(__cbm_unused__ const BootManager *manager,
+                                __cbm_unused__ const Kernel *kernel)
+{
+        null_stats.install_kernel++;
+        null_stats.kernels_installed++;
+        return true;
+}
+
+static bool null_remove_kernel(__cbm_unused__ const BootManager *manager,
+                               __cbm_unused__ const Kernel *kernel)
+{
+        null_stats.remove_kernel++;
+        null_stats.kernels_removed++;
+        return true;
+}
+
+static bool null_set_default_kernel(__cbm_unused__ const BootManager *manager,
+                                    const Kernel *kernel)
+{
+        null_stats.set_default_kernel++;
+
+        free(null_default_kernel);
+        null_default_kernel = NULL;
+
+        /* A NULL kernel means "no default", i.e. the timeout menu */
+        if (kernel) {
+                null_default_kernel = strdup(kernel->meta.bpath);
+                OOM_CHECK_RET(null_default_kernel, false);
+        }
+
+        return true;
+}
+
+static char *null_get_default_kernel(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.get_default_kernel++;
+
+        if (!null_default_kernel) {
+                return NULL;
+        }
+        return strdup(null_default_kernel);
+}
+
+static bool null_needs_install(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.needs_install++;
+        return true;
+}
+
+static bool null_needs_update(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.needs_update++;
+        return true;
+}
+
+static bool null_install(const BootManager *manager)
+{
+        null_stats.install++;
+        return null_ensure_kernel_dir(manager);
+}
+
+static bool null_update(const BootManager *manager)
+{
+        null_stats.update++;
+        return null_ensure_kernel_dir(manager);
+}
+
+static bool null_remove(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.remove++;
+        return true;
+}
+
+static void null_destroy(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.destroy++;
+}
+
+static int null_get_capabilities(__cbm_unused__ const BootManager *manager)
+{
+        return BOOTLOADER_CAP_UEFI | BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_LEGACY |
+               BOOTLOADER_CAP_EXTFS | BOOTLOADER_CAP_FATFS;
+}
+
+static bool null_begin_transaction(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.begin_transaction++;
+        return true;
+}
+
+static bool null_install_kernels(__cbm_unused__ const BootManager *manager, KernelArray *kernels)
+{
+        null_stats.install_kernels++;
+        null_stats.kernels_installed += (unsigned int)kernels->len;
+        return true;
+}
+
+static bool null_remove_kernels(__cbm_unused__ const BootManager *manager, KernelArray *kernels)
+{
+        null_stats.remove_kernels++;
+
+        if (null_remove_budget >= 0 && kernels->len > null_remove_budget) {
+                null_stats.kernels_removed += (unsigned int)null_remove_budget;
+                null_remove_budget = 0;
+                return false;
+        }
+        if (null_remove_budget >= 0) {
+                null_remove_budget -= kernels->len;
+        }
+        null_stats.kernels_removed += (unsigned int)kernels->len;
+        return true;
+}
+
+static bool null_commit(__cbm_unused__ const BootManager *manager)
+{
+        null_stats.commit++;
+        return true;
+}
+
+__cbm_export__ const BootLoader null_bootloader = {.name = NULL_BOOTLOADER_NAME,
+                                                   .init = null_init,
+                                                   .get_kernel_destination =
+                                                       null_get_kernel_destination,
+                                                   .install_kernel = null_install_kernel,
+                                                   .remove_kernel = null_remove_kernel,
+                                                   .set_default_kernel = null_set_default_kernel,
+                                                   .get_default_kernel = null_get_default_kernel,
+                                                   .needs_install = null_needs_install,
+                                                   .needs_update = null_needs_update,
+                                                   .install = null_install,
+                                                   .update = null_update,
+                                                   .remove = null_remove,
+                                                   .destroy = null_destroy,
+                                                   .get_capabilities = null_get_capabilities,
+                                                   .begin_transaction = null_begin_transaction,
+                                                   .install_kernels = null_install_kernels,
+                                                   .remove_kernels = null_remove_kernels,
+                                                   .commit = null_commit };
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,78 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include "bootloader.h"
+
+/**
+ * Name used to select the null bootloader via CBM_BOOTLOADER
+ */
+#define NULL_BOOTLOADER_NAME "null"
+
+/**
+ * Calls recorded by the null bootloader since the last reset
+ */
+typedef struct NullBootLoaderStats {
+        unsigned int init;
+        unsigned int install_kernel;
+        unsigned int remove_kernel;
+        unsigned int set_default_kernel;
+        unsigned int get_default_kernel;
+        unsigned int needs_install;
+        unsigned int needs_update;
+        unsigned int install;
+        unsigned int update;
+        unsigned int remove;
+        unsigned int destroy;
+        unsigned int begin_transaction;
+        unsigned int install_kernels;
+        unsigned int remove_kernels;
+        unsigned int commit;
+        unsigned int kernels_installed; /**<Kernels seen by either install path */
+        unsigned int kernels_removed;   /**<Kernels seen by either remove path */
+} NullBootLoaderStats;
+
+/**
+ * A bootloader that advertises every capability and only records what the
+ * core asked of it. Kernel blobs are still copied by the core, but no loader
+ * configuration is ever written. Used for measuring the core's own overhead.
+ */
+extern const BootLoader null_bootloader;
+
+/**
+ * Copy the recorded call counts into @stats
+ */
+void null_bootloader_get_stats(NullBootLoaderStats *stats);
+
+/**
+ * Forget all recorded calls and the current default kernel
+ */
+void null_bootloader_reset(void);
+
+/**
+ * Make remove_kernels fail part way once @count more kernels have been
+ * removed, or never again when @count is negative. Cleared on reset.
+ */
+void null_bootloader_fail_removals_after(int count);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
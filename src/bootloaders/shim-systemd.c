@@ -18,6 +18,7 @@
 #include "bootvar.h"
 #include "config.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "nica/files.h"
 #include "systemd-class.h"
 #include <log.h>
@@ -84,7 +85,12 @@ __cbm_export__ const BootLoader
                                .update = shim_systemd_update,
                                .remove = shim_systemd_remove,
                                .destroy = shim_systemd_destroy,
-                               .get_capabilities = shim_systemd_get_capabilities };
+                               .get_capabilities = shim_systemd_get_capabilities,
+                               .begin_transaction = sd_class_begin_transaction,
+                               .install_kernels = sd_class_install_kernels,
+                               .remove_kernels = sd_class_remove_kernels,
+                               .commit = sd_class_commit,
+                               .set_default_installed = sd_class_set_default_installed };
 
 #if UINTPTR_MAX == 0xffffffffffffffff
 #define EFI_SUFFIX "x64.efi"
@@ -177,7 +183,7 @@ static bool shim_systemd_set_default_kernel(const BootManager *manager, const Ke
 
 static bool exists_identical(const char *path, const char *spath)
 {
-        if (!nc_file_exists(path)) {
+        if (!cbm_fs_exists(path)) {
                 return false;
         }
         if (spath && !cbm_files_match(path, spath)) {
@@ -229,19 +235,19 @@ static bool make_layout(const BootManager *manager)
         autofree(char) *boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         autofree(char) *systemd_config_entries = NULL;
 
-        if (!nc_mkdir_p(config.bin_dst_host, 00755)) {
+        if (!cbm_fs_mkdir_p(config.bin_dst_host, 00755)) {
                 return false;
         }
 
         systemd_config_entries =
             nc_build_case_correct_path(boot_root, SYSTEMD_CONFIG_DIR, SYSTEMD_ENTRIES_DIR, NULL);
-        if (!nc_mkdir_p(systemd_config_entries, 00755)) {
+        if (!cbm_fs_mkdir_p(systemd_config_entries, 00755)) {
                 return false;
         }
         /* in case of image creation, override the fallback bootloader, so the
          * media will be bootable. */
         if (config.is_image_mode) {
-                if (!nc_mkdir_p(config.efi_fallback_dir, 00755)) {
+                if (!cbm_fs_mkdir_p(config.efi_fallback_dir, 00755)) {
                         return false;
                 }
         }
@@ -283,6 +289,9 @@ static bool shim_systemd_install(const BootManager *manager)
                         if (bootvar_create(BOOT_DIRECTORY, config.shim_dst_esp, varname, 9)) {
                                 LOG_ERROR("Cannot create EFI variable (boot entry)");
                                 LOG_ERROR("Please manually update your bios to add a boot entry for Clear Linux");
+                        } else {
+                                /* Don't touch the variables again in this run */
+                                config.has_boot_rec = 1;
                         }
                 }
         } else {
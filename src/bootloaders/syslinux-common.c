@@ -21,14 +21,23 @@
 #include "bootloader.h"
 #include "bootman.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
 #include "mbr.h"
+#include "nica/files.h"
 #include "syslinux-common.h"
 #include "system_stub.h"
 #include "writer.h"
 
 #define CONFIG_FILE "syslinux.cfg"
 
+/* Installed by syslinux/extlinux into the root of the boot partition */
+#define LDLINUX_SYS "ldlinux.sys"
+#define LDLINUX_C32 "ldlinux.c32"
+
+/* Where the syslinux package ships its loadable modules */
+#define SYSLINUX_MODULE_DIR "usr/share/syslinux"
+
 char *syslinux_common_get_default_kernel(const BootManager *manager)
 {
         autofree(char) *config_path = NULL;
@@ -45,7 +54,7 @@ char *syslinux_common_get_default_kernel(const BootManager *manager)
         lplen = strlen(lookup);
         config_path = string_printf("%s/"CONFIG_FILE, ctx->base_path);
 
-        f = fopen(config_path, "r");
+        f = cbm_fs_fopen(config_path, "r");
         CHECK_ERR_RET_VAL(!f, NULL, "Could not open config file: %s", config_path);
 
         while ((read = getline(&buf, &len, f)) != -1) {
@@ -94,18 +103,46 @@ bool syslinux_common_install_kernel(const BootManager *manager, const Kernel *ke
         return true;
 }
 
-bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel *default_kernel)
+bool syslinux_common_install_kernels(const BootManager *manager, KernelArray *kernels)
+{
+        struct SyslinuxContext *ctx = boot_manager_get_data((BootManager *)manager);
+        autofree(NcHashmap) *queued = NULL;
+
+        /* Index the queue once rather than rescanning it for every kernel */
+        queued = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        OOM_CHECK_RET(queued, false);
+
+        for (uint16_t i = 0; i < ctx->kernel_queue->len; i++) {
+                const Kernel *k = nc_array_get(ctx->kernel_queue, i);
+                if (!nc_hashmap_put(queued, k->source.path, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+
+                if (nc_hashmap_contains(queued, k->source.path)) {
+                        continue;
+                }
+                if (!nc_array_add(ctx->kernel_queue, (void *)k) ||
+                    !nc_hashmap_put(queued, k->source.path, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        return true;
+}
+
+bool syslinux_common_render_config(const BootManager *manager, KernelArray *kernels,
+                                   const Kernel *default_kernel, CbmWriter *writer)
 {
-        autofree(char) *config_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
-        autofree(char) *old_conf = NULL;
-        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
         int timeout;
-        struct SyslinuxContext *ctx = NULL;
-
-        ctx = boot_manager_get_data((BootManager *)manager);
 
         root_dev = boot_manager_get_root_device((BootManager *)manager);
         if (!root_dev) {
@@ -113,13 +150,6 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
                 return false;
         }
 
-        config_path = string_printf("%s/"CONFIG_FILE, ctx->base_path);
-
-        if (!cbm_writer_open(writer)) {
-                DECLARE_OOM();
-                abort();
-        }
-
         timeout = boot_manager_get_timeout_value((BootManager *)manager);
 
         /* No default kernel for set timeout */
@@ -129,9 +159,17 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
                 cbm_writer_append_printf(writer, "TIMEOUT %d\n", timeout);
         }
 
-        for (uint16_t i = 0; i < ctx->kernel_queue->len; i++) {
-                const Kernel *k = nc_array_get(ctx->kernel_queue, i);
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
                 autofree(char) *initrd_paths = NULL;
+                const char *cmdline = NULL;
+
+                cmdline = boot_manager_get_kernel_cmdline((BootManager *)manager, k);
+                if (!cmdline) {
+                        LOG_FATAL("Unable to load cmdline for: %s", k->source.path);
+                        return false;
+                }
+
                 initrd_paths = malloc(1);
                 initrd_paths[0] = '\0';
 
@@ -177,9 +215,31 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
                 }
 
                 /* Write out the cmdline */
-                cbm_writer_append_printf(writer, "%s\n", k->meta.cmdline);
+                cbm_writer_append_printf(writer, "%s\n", cmdline);
         }
 
+        return true;
+}
+
+bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel *default_kernel)
+{
+        autofree(char) *config_path = NULL;
+        autofree(char) *old_conf = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        struct SyslinuxContext *ctx = NULL;
+
+        ctx = boot_manager_get_data((BootManager *)manager);
+
+        config_path = string_printf("%s/"CONFIG_FILE, ctx->base_path);
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!syslinux_common_render_config(manager, ctx->kernel_queue, default_kernel, writer)) {
+                return false;
+        }
         cbm_writer_close(writer);
 
         if (cbm_writer_error(writer) != 0) {
@@ -205,6 +265,79 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
         return true;
 }
 
+int syslinux_common_set_default_installed(const BootManager *manager, const Kernel *default_kernel)
+{
+        autofree(char) *config_path = NULL;
+        autofree(char) *kernel_path = NULL;
+        autofree(char) *label = NULL;
+        autofree(char) *old_conf = NULL;
+        autofree(char) *lines = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        struct SyslinuxContext *ctx = NULL;
+        bool has_default = false;
+        bool has_label = false;
+
+        ctx = boot_manager_get_data((BootManager *)manager);
+
+        config_path = string_printf("%s/"CONFIG_FILE, ctx->base_path);
+        kernel_path = string_printf("%s/%s", ctx->base_path, default_kernel->target.legacy_path);
+        label = string_printf("LABEL %s", default_kernel->target.legacy_path);
+
+        if (!cbm_fs_exists(kernel_path) || !file_get_text(config_path, &old_conf)) {
+                return 0;
+        }
+
+        lines = strdup(old_conf);
+        if (!lines || !cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Move the DEFAULT line in front of the kernel's LABEL, keep the rest */
+        for (char *line = lines, *next = NULL; line && *line; line = next) {
+                next = strchr(line, '\n');
+                if (next) {
+                        *next++ = '\0';
+                }
+                if (strncmp(line, "DEFAULT ", 8) == 0) {
+                        has_default = true;
+                        continue;
+                }
+                if (streq(line, label)) {
+                        has_label = true;
+                        cbm_writer_append_printf(writer,
+                                                 "DEFAULT %s\n",
+                                                 default_kernel->target.legacy_path);
+                }
+                cbm_writer_append_printf(writer, "%s\n", line);
+        }
+
+        cbm_writer_close(writer);
+
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Without a default the timeout differs too, leave that to a full rewrite */
+        if (!has_label || !has_default) {
+                return 0;
+        }
+
+        if (streq(old_conf, writer->buffer)) {
+                return 1;
+        }
+
+        if (!file_set_text_durable(config_path, writer->buffer)) {
+                LOG_FATAL("syslinux_set_default_kernel: Failed to write %s: %s",
+                          config_path,
+                          strerror(errno));
+                return -1;
+        }
+
+        return 1;
+}
+
 void syslinux_common_destroy(const BootManager *manager)
 {
         struct SyslinuxContext *ctx = boot_manager_get_data((BootManager *)manager);
@@ -310,6 +443,7 @@ bool syslinux_common_init(const BootManager *manager, command_writer writer)
 
         ctx->sgdisk_cmd = string_printf("%s/usr/bin/sgdisk %s --attributes=%d:set:2",
                                         prefix, parent_disk, partition_index + 1);
+        ctx->partition_index = partition_index;
         return true;
 
  cleanup:
@@ -317,42 +451,121 @@ bool syslinux_common_init(const BootManager *manager, command_writer writer)
         return false;
 }
 
+/**
+ * Determine whether the first MBR_BIN_LEN bytes of @device already match
+ * the wanted boot code in @blob
+ */
+static bool syslinux_common_mbr_matches(const char *device, const unsigned char *blob)
+{
+        unsigned char current[MBR_BIN_LEN] = { 0 };
+        ssize_t count = 0;
+        int fd = -1;
+
+        fd = open(device, O_RDONLY);
+        if (fd < 0) {
+                return false;
+        }
+
+        count = read(fd, current, MBR_BIN_LEN);
+        close(fd);
+
+        if (count != MBR_BIN_LEN) {
+                return false;
+        }
+
+        return memcmp(current, blob, MBR_BIN_LEN) == 0;
+}
+
+/**
+ * Determine whether the syslinux/extlinux installer already ran against
+ * the boot partition with the currently shipped syslinux version.
+ *
+ * ldlinux.sys is patched with its own sector map by the installer, so we can
+ * only verify it is present. ldlinux.c32 is copied verbatim, and will only
+ * match the source when the installed version is current.
+ */
+static bool syslinux_common_ldlinux_installed(const struct SyslinuxContext *ctx,
+                                              const char *prefix)
+{
+        autofree(char) *ldlinux_sys = NULL;
+        autofree(char) *ldlinux_c32 = NULL;
+        autofree(char) *ldlinux_c32_source = NULL;
+
+        ldlinux_sys = string_printf("%s/%s", ctx->base_path, LDLINUX_SYS);
+        ldlinux_c32 = string_printf("%s/%s", ctx->base_path, LDLINUX_C32);
+        ldlinux_c32_source = string_printf("%s/%s/%s", prefix, SYSLINUX_MODULE_DIR, LDLINUX_C32);
+
+        if (!cbm_file_has_content(ldlinux_sys)) {
+                return false;
+        }
+
+        /* Can't verify the version so the installer must run */
+        if (!cbm_fs_exists(ldlinux_c32_source)) {
+                return false;
+        }
+
+        return cbm_files_match(ldlinux_c32_source, ldlinux_c32);
+}
+
 bool syslinux_common_install(const BootManager *manager)
 {
         autofree(char) *boot_device = NULL;
         const char *prefix = NULL;
+        const unsigned char *mbr_bin = NULL;
         int mbr = -1;
         ssize_t count = 0;
         bool is_gpt = false;
+        bool changed = false;
         struct SyslinuxContext *ctx;
 
         ctx = boot_manager_get_data((BootManager *)manager);
 
         prefix = boot_manager_get_prefix((BootManager *)manager);
         boot_device = get_parent_disk((char *)prefix);
-
-        mbr = open(boot_device, O_WRONLY);
-        CHECK_ERR_RET_VAL(mbr < 0, false, "Could not open boot device: %s", boot_device);
+        CHECK_ERR_RET_VAL(!boot_device, false, "Could not determine the boot device");
 
         is_gpt = boot_manager_get_wanted_boot_mask((BootManager *)manager)
                 & BOOTLOADER_CAP_GPT;
-        count = write(mbr, is_gpt ? syslinux_gptmbr_bin : syslinux_mbr_bin,
-                      MBR_BIN_LEN);
-        LOG_DEBUG("wrote \"%s.bin\" to %s", is_gpt ? "gptmbr" : "mbr",
-                  boot_device);
+        mbr_bin = is_gpt ? syslinux_gptmbr_bin : syslinux_mbr_bin;
 
-        CHECK_ERR_GOTO(count != MBR_BIN_LEN, mbr_error,
-                       "Written mbr size doesn't match the expected");
+        if (syslinux_common_mbr_matches(boot_device, mbr_bin)) {
+                LOG_DEBUG("\"%s.bin\" already installed on %s", is_gpt ? "gptmbr" : "mbr",
+                          boot_device);
+        } else {
+                mbr = open(boot_device, O_WRONLY);
+                CHECK_ERR_RET_VAL(mbr < 0, false, "Could not open boot device: %s", boot_device);
 
-        close(mbr);
+                count = write(mbr, mbr_bin, MBR_BIN_LEN);
+                LOG_DEBUG("wrote \"%s.bin\" to %s", is_gpt ? "gptmbr" : "mbr",
+                          boot_device);
 
-        CHECK_ERR_RET_VAL(cbm_system_system(ctx->syslinux_cmd) != 0, false,
-                          "cbm_system_system() returned value != 0");
+                CHECK_ERR_GOTO(count != MBR_BIN_LEN, mbr_error,
+                               "Written mbr size doesn't match the expected");
 
-        CHECK_ERR_RET_VAL(cbm_system_system(ctx->sgdisk_cmd) != 0, false,
-                          "Failed to run sgdisk command: %s", ctx->sgdisk_cmd);
+                close(mbr);
+                changed = true;
+        }
 
-        cbm_sync();
+        if (syslinux_common_ldlinux_installed(ctx, prefix)) {
+                LOG_DEBUG("%s is up to date in %s", LDLINUX_SYS, ctx->base_path);
+        } else {
+                CHECK_ERR_RET_VAL(cbm_system_system(ctx->syslinux_cmd) != 0, false,
+                                  "cbm_system_system() returned value != 0");
+                changed = true;
+        }
+
+        if (get_partition_legacy_boot(prefix, ctx->partition_index)) {
+                LOG_DEBUG("legacy_boot attribute already set on partition %d",
+                          ctx->partition_index + 1);
+        } else {
+                CHECK_ERR_RET_VAL(cbm_system_system(ctx->sgdisk_cmd) != 0, false,
+                                  "Failed to run sgdisk command: %s", ctx->sgdisk_cmd);
+                changed = true;
+        }
+
+        if (changed) {
+                cbm_sync();
+        }
         return true;
 
  mbr_error:
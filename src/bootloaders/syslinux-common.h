@@ -11,11 +11,15 @@
 
 #pragma once
 
+#include "bootman.h"
+#include "writer.h"
+
 struct SyslinuxContext {
         KernelArray *kernel_queue;
         char *syslinux_cmd;
         char *sgdisk_cmd;
         char *base_path;
+        int partition_index;
 };
 
 typedef bool (*command_writer)(struct SyslinuxContext *ctx, const char *prefix, char *boot_device);
@@ -28,9 +32,18 @@ char *syslinux_common_get_default_kernel(const BootManager *manager);
 /* Queue kernel to be added to conf */
 bool syslinux_common_install_kernel(const BootManager *manager, const Kernel *kernel);
 
+bool syslinux_common_install_kernels(const BootManager *manager, KernelArray *kernels);
+
+/* Append the whole conf for @kernels to the open @writer */
+bool syslinux_common_render_config(const BootManager *manager, KernelArray *kernels,
+                                   const Kernel *default_kernel, CbmWriter *writer);
+
 /* Actually creates the whole conf by iterating through the queued kernels */
 bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel *default_kernel);
 
+/* Only moves the DEFAULT line, returns 0 if the kernel has no entry yet */
+int syslinux_common_set_default_installed(const BootManager *manager, const Kernel *default_kernel);
+
 /* Cleans up the syslinux bootmanager's instance/private data */
 void syslinux_common_destroy(const BootManager *manager);
 
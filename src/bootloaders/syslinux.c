@@ -107,7 +107,11 @@ __cbm_export__ const BootLoader syslinux_bootloader = {.name = "syslinux",
                                                        .remove = syslinux_remove,
                                                        .destroy = syslinux_common_destroy,
                                                        .get_capabilities =
-                                                           syslinux_get_capabilities };
+                                                           syslinux_get_capabilities,
+                                                       .install_kernels =
+                                                           syslinux_common_install_kernels,
+                                                       .set_default_installed =
+                                                           syslinux_common_set_default_installed };
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
@@ -37,7 +37,12 @@ __cbm_export__ const BootLoader
                           .update = sd_class_update,
                           .remove = sd_class_remove,
                           .destroy = sd_class_destroy,
-                          .get_capabilities = sd_class_get_capabilities };
+                          .get_capabilities = sd_class_get_capabilities,
+                          .begin_transaction = sd_class_begin_transaction,
+                          .install_kernels = sd_class_install_kernels,
+                          .remove_kernels = sd_class_remove_kernels,
+                          .commit = sd_class_commit,
+                          .set_default_installed = sd_class_set_default_installed };
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
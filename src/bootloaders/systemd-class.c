@@ -20,12 +20,17 @@
 #include "bootman.h"
 #include "config.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
 #include "nica/files.h"
 #include "systemd-class.h"
 #include "util.h"
 #include "writer.h"
 
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#include "bootvar.h"
+#endif
+
 /**
  * Private to systemd-class implementation
  */
@@ -40,10 +45,13 @@ typedef struct SdClassConfig {
         char *loader_config;
         char *kernel_dir;
         char *kernel_dir_esp;
+        const char *entry_variable; /**<Selects the default in place of loader.conf */
+        bool entry_one_shot;        /**<entry_variable only applies to the next boot */
 } SdClassConfig;
 
 static SdClassConfig sd_class_config = { 0 };
 static BootLoaderConfig *sd_config = NULL;
+static bool sd_class_dirty = false;
 
 static const char *(*get_kernel_destination_impl)(const BootManager *);
 
@@ -60,6 +68,102 @@ const char *sd_class_get_kernel_destination_default(__cbm_unused__ const BootMan
         return sd_class_config.kernel_dir_esp;
 }
 
+/**
+ * Check KERNEL_CONF_DIRECTORY/default_entry for how the default entry is
+ * chosen: "conf" writes it to loader.conf, "efivar" sets LoaderEntryDefault
+ * instead and "oneshot" has set-kernel only set LoaderEntryOneShot for the
+ * next boot.
+ */
+static void sd_class_init_entry_variable(const BootManager *manager)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *mode = NULL;
+
+        sd_class_config.entry_variable = NULL;
+        sd_class_config.entry_one_shot = false;
+
+        path = string_printf("%s%s/default_entry",
+                             boot_manager_get_prefix((BootManager *)manager),
+                             KERNEL_CONF_DIRECTORY);
+        if (!cbm_fs_exists(path) || !file_get_text(path, &mode)) {
+                return;
+        }
+        mode[strcspn(mode, " \t\n")] = '\0';
+
+        if (streq(mode, "efivar")) {
+                sd_class_config.entry_variable = "LoaderEntryDefault";
+        } else if (streq(mode, "oneshot")) {
+                sd_class_config.entry_variable = "LoaderEntryOneShot";
+                sd_class_config.entry_one_shot = true;
+        } else if (!streq(mode, "conf") && !streq(mode, "")) {
+                LOG_WARNING("Unknown default entry mode in %s: %s", path, mode);
+                return;
+        }
+
+#if !defined(HAVE_SHIM_SYSTEMD_BOOT)
+        if (sd_class_config.entry_variable) {
+                LOG_WARNING("Built without EFI variable support, using loader.conf");
+                sd_class_config.entry_variable = NULL;
+                sd_class_config.entry_one_shot = false;
+        }
+#endif
+}
+
+/**
+ * Point the configured loader variable at @kernel's entry, returning false
+ * if loader.conf has to be used instead.
+ */
+static bool sd_class_set_entry_variable(const BootManager *manager, const Kernel *kernel)
+{
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        autofree(char) *entry = NULL;
+        int r;
+
+        if (!sd_class_config.entry_variable ||
+            !boot_manager_is_update_efi_vars((BootManager *)manager)) {
+                return false;
+        }
+
+        entry = string_printf("%s-%s-%s-%d.conf",
+                              boot_manager_get_vendor_prefix((BootManager *)manager),
+                              kernel->meta.ktype,
+                              kernel->meta.version,
+                              kernel->meta.release);
+        r = bootvar_set_loader_entry(sd_class_config.entry_variable, entry);
+        if (r) {
+                LOG_WARNING("Failed to set %s (%d), using loader.conf",
+                            sd_class_config.entry_variable,
+                            r);
+                return false;
+        }
+        LOG_DEBUG("%s set to %s", sd_class_config.entry_variable, entry);
+        return true;
+#else
+        (void)manager;
+        (void)kernel;
+        return false;
+#endif
+}
+
+/**
+ * loader.conf holds the default, make sure a LoaderEntryDefault left behind
+ * by an earlier configuration doesn't override it.
+ */
+static void sd_class_clear_entry_variable(void)
+{
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        int r = bootvar_del_loader_entry("LoaderEntryDefault");
+
+        if (r == -EBOOT_VAR_NOSUP) {
+                return;
+        }
+        if (r) {
+                LOG_WARNING("Failed to remove LoaderEntryDefault (%d), it overrides loader.conf",
+                            r);
+        }
+#endif
+}
+
 bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
 {
         char *base_path = NULL;
@@ -127,6 +231,8 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
                                                                 "EFI", KERNEL_NAMESPACE, NULL);
         sd_class_config.kernel_dir_esp = strdup(sd_class_config.kernel_dir + strlen(sd_class_config.base_path));
 
+        sd_class_init_entry_variable(manager);
+
         return true;
 }
 
@@ -180,25 +286,25 @@ static char *get_entry_path_for_kernel(BootManager *manager, const Kernel *kerne
 
 static bool sd_class_ensure_dirs(void)
 {
-        if (!nc_mkdir_p(sd_class_config.efi_dir, 00755)) {
+        if (!cbm_fs_mkdir_p(sd_class_config.efi_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.efi_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.vendor_dir, 00755)) {
+        if (!cbm_fs_mkdir_p(sd_class_config.vendor_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.vendor_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.kernel_dir, 00755)) {
+        if (!cbm_fs_mkdir_p(sd_class_config.kernel_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.kernel_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.entries_dir, 00755)) {
+        if (!cbm_fs_mkdir_p(sd_class_config.entries_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.entries_dir, strerror(errno));
                 return false;
         }
@@ -207,24 +313,21 @@ static bool sd_class_ensure_dirs(void)
         return true;
 }
 
-bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+bool sd_class_render_entry(const BootManager *manager, const Kernel *kernel, CbmWriter *writer)
 {
-        if (!manager || !kernel) {
+        if (!manager || !kernel || !writer) {
                 return false;
         }
-        autofree(char) *conf_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
         const char *os_name = NULL;
-        autofree(char) *old_conf = NULL;
-        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
+        const char *cmdline = NULL;
 
-        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
-
-        if (!cbm_writer_open(writer)) {
-                DECLARE_OOM();
-                abort();
+        cmdline = boot_manager_get_kernel_cmdline((BootManager *)manager, kernel);
+        if (!cmdline) {
+                LOG_FATAL("Unable to load cmdline for: %s", kernel->source.path);
+                return false;
         }
 
         /* Build the options for the entry */
@@ -271,7 +374,31 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
         }
 
         /* Finish it off with the command line options */
-        cbm_writer_append_printf(writer, "%s\n", kernel->meta.cmdline);
+        cbm_writer_append_printf(writer, "%s\n", cmdline);
+
+        return true;
+}
+
+/* Write the loader entry for kernel, setting *changed when the file was touched */
+static bool sd_class_write_entry(const BootManager *manager, const Kernel *kernel, bool *changed)
+{
+        if (!manager || !kernel) {
+                return false;
+        }
+        autofree(char) *conf_path = NULL;
+        autofree(char) *old_conf = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!sd_class_render_entry(manager, kernel, writer)) {
+                return false;
+        }
         cbm_writer_close(writer);
 
         if (cbm_writer_error(writer) != 0) {
@@ -293,12 +420,42 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
                 return false;
         }
 
-        cbm_sync();
+        *changed = true;
 
         return true;
 }
 
-bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
+bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+{
+        bool changed = false;
+
+        if (!sd_class_write_entry(manager, kernel, &changed)) {
+                return false;
+        }
+        if (changed) {
+                cbm_sync();
+        }
+
+        return true;
+}
+
+bool sd_class_install_kernels(const BootManager *manager, KernelArray *kernels)
+{
+        if (!manager || !kernels) {
+                return false;
+        }
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                if (!sd_class_write_entry(manager, nc_array_get(kernels, i), &sd_class_dirty)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/* Remove the loader entry for kernel, setting *changed when the file was unlinked */
+static bool sd_class_unlink_entry(const BootManager *manager, const Kernel *kernel, bool *changed)
 {
         if (!manager || !kernel) {
                 return false;
@@ -310,19 +467,65 @@ bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
         OOM_CHECK_RET(conf_path, false);
 
         /* We must take a non-fatal approach in a remove operation */
-        if (nc_file_exists(conf_path)) {
-                if (unlink(conf_path) < 0) {
+        if (cbm_fs_exists(conf_path)) {
+                if (cbm_fs_unlink(conf_path) < 0) {
                         LOG_ERROR("sd_class_remove_kernel: Failed to remove %s: %s",
                                   conf_path,
                                   strerror(errno));
                 } else {
-                        cbm_sync();
+                        *changed = true;
                 }
         }
 
         return true;
 }
 
+bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
+{
+        bool changed = false;
+
+        if (!sd_class_unlink_entry(manager, kernel, &changed)) {
+                return false;
+        }
+        if (changed) {
+                cbm_sync();
+        }
+
+        return true;
+}
+
+bool sd_class_remove_kernels(const BootManager *manager, KernelArray *kernels)
+{
+        if (!manager || !kernels) {
+                return false;
+        }
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                if (!sd_class_unlink_entry(manager, nc_array_get(kernels, i), &sd_class_dirty)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+bool sd_class_begin_transaction(__cbm_unused__ const BootManager *manager)
+{
+        sd_class_dirty = false;
+        return true;
+}
+
+bool sd_class_commit(__cbm_unused__ const BootManager *manager)
+{
+        /* One sync covers every entry written or removed by the batch hooks */
+        if (sd_class_dirty) {
+                cbm_sync();
+                sd_class_dirty = false;
+        }
+
+        return true;
+}
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel)
 {
         if (!manager) {
@@ -333,6 +536,7 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
         int timeout = 0;
         const char *prefix = NULL;
         autofree(char) *old_conf = NULL;
+        bool use_variable = false;
 
         prefix = boot_manager_get_vendor_prefix((BootManager *)manager);
 
@@ -349,7 +553,11 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
 
         timeout = boot_manager_get_timeout_value((BootManager *)manager);
 
-        if (timeout > 0) {
+        use_variable = !sd_class_config.entry_one_shot && sd_class_set_entry_variable(manager, kernel);
+        if (use_variable) {
+                /* The variable takes precedence, loader.conf only keeps the timeout */
+                item_name = string_printf("timeout %d\n", timeout > 0 ? timeout : 0);
+        } else if (timeout > 0) {
                 /* Set the timeout as configured by the user */
                 item_name = string_printf("timeout %d\ndefault %s-%s-%s-%d.conf\n",
                                           timeout,
@@ -366,25 +574,61 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
         }
 
 write_config:
-        if (file_get_text(sd_class_config.loader_config, &old_conf)) {
-                if (streq(old_conf, item_name)) {
-                        return true;
-                }
-        }
-
-        if (!file_set_text(sd_class_config.loader_config, item_name)) {
+        /* Check if the config changed, only loader.conf then needs syncing */
+        if ((!file_get_text(sd_class_config.loader_config, &old_conf) ||
+             !streq(old_conf, item_name)) &&
+            !file_set_text_durable(sd_class_config.loader_config, item_name)) {
                 LOG_FATAL("sd_class_set_default_kernel: Failed to write %s: %s",
                           sd_class_config.loader_config,
                           strerror(errno));
                 return false;
         }
 
-        cbm_sync();
+        if (!use_variable) {
+                sd_class_clear_entry_variable();
+        }
 
         return true;
 }
 
-static char *parse_kernel_from_loader(char *conf, const BootManager *manager)
+int sd_class_set_default_installed(const BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *conf_path = NULL;
+        autofree(char) *conf = NULL;
+        autofree(char) *kernel_path = NULL;
+        const char *line = NULL;
+        size_t len;
+
+        if (!manager || !kernel) {
+                return -1;
+        }
+
+        /* The entry must exist and point at a kernel blob that's in place */
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+        if (!conf_path || !file_get_text(conf_path, &conf)) {
+                return 0;
+        }
+        line = strstr(conf, "\nlinux ");
+        if (!line) {
+                return 0;
+        }
+        line += strlen("\nlinux ");
+        len = strcspn(line, "\n");
+        kernel_path = string_printf("%s%.*s", sd_class_config.base_path, (int)len, line);
+        if (!cbm_fs_exists(kernel_path)) {
+                LOG_DEBUG("Entry %s refers to missing %s", conf_path, kernel_path);
+                return 0;
+        }
+
+        /* Only the next boot changes, loader.conf stays as update left it */
+        if (sd_class_config.entry_one_shot && sd_class_set_entry_variable(manager, kernel)) {
+                return 1;
+        }
+
+        return sd_class_set_default_kernel(manager, kernel) ? 1 : -1;
+}
+
+char *sd_class_parse_default_kernel(char *conf, const BootManager *manager)
 {
         char ktype[32] = { 0 };
         char version[16] = { 0 };
@@ -490,6 +734,29 @@ static char *parse_kernel_from_loader(char *conf, const BootManager *manager)
 
 }
 
+/**
+ * Return the kernel the configured loader variable points at, if any
+ */
+static char *sd_class_get_entry_variable(const BootManager *manager)
+{
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        autofree(char) *entry = NULL;
+        autofree(char) *conf = NULL;
+
+        if (!sd_class_config.entry_variable ||
+            bootvar_get_loader_entry(sd_class_config.entry_variable, &entry) != 0) {
+                return NULL;
+        }
+
+        /* Same form as the loader.conf line */
+        conf = string_printf("default %s", entry);
+        return sd_class_parse_default_kernel(conf, manager);
+#else
+        (void)manager;
+        return NULL;
+#endif
+}
+
 char *sd_class_get_default_kernel(const BootManager *manager)
 {
         if (!manager) {
@@ -499,8 +766,14 @@ char *sd_class_get_default_kernel(const BootManager *manager)
         autofree(char) *conf = NULL;
         char *kernel = NULL;
 
+        /* The variable wins over loader.conf at boot, so look there first */
+        kernel = sd_class_get_entry_variable(manager);
+        if (kernel) {
+                return kernel;
+        }
+
         if (file_get_text(sd_class_config.loader_config, &conf)) {
-                kernel = parse_kernel_from_loader(conf, manager);
+                kernel = sd_class_parse_default_kernel(conf, manager);
         }
 
         if (!kernel) {
@@ -520,7 +793,7 @@ bool sd_class_needs_install(const BootManager *manager)
         const char *source_path = sd_class_config.efi_blob_source;
 
         /* Catch this in the install */
-        if (!nc_file_exists(source_path)) {
+        if (!cbm_fs_exists(source_path)) {
                 return true;
         }
 
@@ -528,7 +801,7 @@ bool sd_class_needs_install(const BootManager *manager)
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (!nc_file_exists(check_p)) {
+                if (!cbm_fs_exists(check_p)) {
                         return true;
                 }
         }
@@ -549,7 +822,7 @@ bool sd_class_needs_update(const BootManager *manager)
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (nc_file_exists(check_p) && !cbm_files_match(source_path, check_p)) {
+                if (cbm_fs_exists(check_p) && !cbm_files_match(source_path, check_p)) {
                         return true;
                 }
         }
@@ -639,14 +912,15 @@ bool sd_class_remove(const BootManager *manager)
 
         /* We call multiple syncs in case something goes wrong in removal, where we could be seeing
          * an ESP umount after */
-        if (nc_file_exists(sd_class_config.vendor_dir) && !nc_rm_rf(sd_class_config.vendor_dir)) {
+        if (cbm_fs_exists(sd_class_config.vendor_dir) &&
+            !cbm_fs_rm_rf(sd_class_config.vendor_dir)) {
                 LOG_FATAL("Failed to remove vendor dir: %s", strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (nc_file_exists(sd_class_config.default_path_efi_blob) &&
-            unlink(sd_class_config.default_path_efi_blob) < 0) {
+        if (cbm_fs_exists(sd_class_config.default_path_efi_blob) &&
+            cbm_fs_unlink(sd_class_config.default_path_efi_blob) < 0) {
                 LOG_FATAL("Failed to remove %s: %s",
                           sd_class_config.default_path_efi_blob,
                           strerror(errno));
@@ -654,8 +928,8 @@ bool sd_class_remove(const BootManager *manager)
         }
         cbm_sync();
 
-        if (nc_file_exists(sd_class_config.loader_config) &&
-            unlink(sd_class_config.loader_config) < 0) {
+        if (cbm_fs_exists(sd_class_config.loader_config) &&
+            cbm_fs_unlink(sd_class_config.loader_config) < 0) {
                 LOG_FATAL("Failed to remove %s: %s",
                           sd_class_config.loader_config,
                           strerror(errno));
@@ -13,6 +13,7 @@
 
 #include "bootloader.h"
 #include "bootman.h"
+#include "writer.h"
 
 #pragma once
 
@@ -35,8 +36,29 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel);
 
 bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel);
 
+bool sd_class_begin_transaction(const BootManager *manager);
+
+bool sd_class_install_kernels(const BootManager *manager, KernelArray *kernels);
+
+bool sd_class_remove_kernels(const BootManager *manager, KernelArray *kernels);
+
+bool sd_class_commit(const BootManager *manager);
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel);
 
+/**
+ * Append the loader entry for @kernel to the open @writer
+ */
+bool sd_class_render_entry(const BootManager *manager, const Kernel *kernel, CbmWriter *writer);
+
+/**
+ * Find the kernel named by the 'default' line of a loader.conf, mangling
+ * @conf in the process
+ */
+char *sd_class_parse_default_kernel(char *conf, const BootManager *manager);
+
+int sd_class_set_default_installed(const BootManager *manager, const Kernel *kernel);
+
 char *sd_class_get_default_kernel(const BootManager *manager);
 
 bool sd_class_needs_install(const BootManager *manager);
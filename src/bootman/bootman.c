@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/statvfs.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -24,9 +25,13 @@
 #include "bootman_private.h"
 #include "cmdline.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
+#include "metrics.h"
 #include "nica/files.h"
+#include "stats.h"
 #include "system_stub.h"
+#include "trace.h"
 
 #include "config.h"
 
@@ -43,6 +48,9 @@ extern const BootLoader shim_systemd_bootloader;
 extern const BootLoader systemd_bootloader;
 extern const BootLoader extlinux_bootloader;
 extern const BootLoader syslinux_bootloader;
+#if defined(NULL_BACKEND_ENABLED)
+extern const BootLoader null_bootloader;
+#endif
 
 struct InitrdEntry {
         char *name;
@@ -99,10 +107,26 @@ BootManager *boot_manager_new()
                                                      nc_string_compare, free, free_initrd_entry);
         OOM_CHECK(r->initrd_freestanding);
 
+        r->esp_lease_fd = -1;
+
 
         return r;
 }
 
+/**
+ * Drop a queue along with its index, the kernels aren't ours
+ */
+static void boot_manager_free_queue(KernelArray **queue, NcHashmap **queued)
+{
+        if (*queue) {
+                nc_array_free(queue, NULL);
+        }
+        if (*queued) {
+                nc_hashmap_free(*queued);
+                *queued = NULL;
+        }
+}
+
 void boot_manager_free(BootManager *self)
 {
         if (!self) {
@@ -122,19 +146,54 @@ void boot_manager_free(BootManager *self)
         free(self->initrd_freestanding_dir);
         free(self->user_initrd_freestanding_dir);
         nc_hashmap_free(self->initrd_freestanding);
+        boot_manager_free_queue(&self->pending_installs, &self->queued_installs);
+        boot_manager_free_queue(&self->pending_removals, &self->queued_removals);
         free(self->abs_bootdir);
         free(self->cmdline);
+        boot_manager_release_esp_lease(self);
+        free(self->esp_lease_dir);
         free(self);
 }
 
+/**
+ * Find the bootloader forced via CBM_BOOTLOADER, if any
+ */
+static const BootLoader *boot_manager_forced_bootloader(void)
+{
+        const char *forced = getenv("CBM_BOOTLOADER");
+
+        if (!forced || !*forced) {
+                return NULL;
+        }
+
+#if defined(NULL_BACKEND_ENABLED)
+        /* Never auto-selected, as it would win every capability check */
+        if (streq(forced, null_bootloader.name)) {
+                return &null_bootloader;
+        }
+#endif
+
+        for (size_t i = 0; i < ARRAY_SIZE(bootman_known_loaders); i++) {
+                if (streq(forced, bootman_known_loaders[i]->name)) {
+                        return bootman_known_loaders[i];
+                }
+        }
+
+        LOG_ERROR("Unknown bootloader requested via CBM_BOOTLOADER: %s", forced);
+        return NULL;
+}
+
 static bool boot_manager_select_bootloader(BootManager *self)
 {
+        CBM_TRACE_SCOPE("select_bootloader");
         const BootLoader *selected = NULL;
         int selected_boot_mask = 0;
-        int wanted_boot_mask = self->sysconfig->wanted_boot_mask;
+        int wanted_boot_mask = boot_manager_get_wanted_boot_mask(self);
+
+        selected = boot_manager_forced_bootloader();
 
         /* Select a bootloader based on the capabilities */
-        for (size_t i = 0; i < ARRAY_SIZE(bootman_known_loaders); i++) {
+        for (size_t i = 0; !selected && i < ARRAY_SIZE(bootman_known_loaders); i++) {
                 const BootLoader *l = bootman_known_loaders[i];
                 selected_boot_mask = l->get_capabilities(self);
                 LOG_DEBUG("%s caps: 0x%02x, wanted: 0x%02x",
@@ -161,12 +220,40 @@ static bool boot_manager_select_bootloader(BootManager *self)
         if (!self->bootloader->init(self)) {
                 self->bootloader->destroy(self);
                 LOG_FATAL("Cannot initialise bootloader %s", self->bootloader->name);
+                self->bootloader = NULL;
                 return false;
         }
 
         return true;
 }
 
+const BootLoader *boot_manager_get_bootloader(BootManager *self)
+{
+        assert(self != NULL);
+        assert(self->sysconfig != NULL);
+
+        /* Selected on first use, and only ever attempted once per prefix */
+        if (!self->bootloader_checked) {
+                self->bootloader_checked = true;
+                boot_manager_select_bootloader(self);
+        }
+
+        return self->bootloader;
+}
+
+/**
+ * Discover the root and boot devices on first use
+ */
+static SystemConfig *boot_manager_get_sysconfig(BootManager *self)
+{
+        if (!self->sysconfig_inspected) {
+                self->sysconfig_inspected = true;
+                cbm_inspect_root_devices(self->sysconfig, self->image_mode);
+        }
+
+        return self->sysconfig;
+}
+
 bool boot_manager_set_prefix(BootManager *self, char *prefix)
 {
         assert(self != NULL);
@@ -181,10 +268,12 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
         cbm_free_sysconfig(self->sysconfig);
         self->sysconfig = NULL;
 
-        config = cbm_inspect_root(prefix, self->image_mode);
+        /* Devices, os-release and the bootloader are all looked up lazily */
+        config = cbm_new_sysconfig(prefix);
         CHECK_DBG_RET_VAL(!config, false, "Could not inspect root");
 
         self->sysconfig = config;
+        self->sysconfig_inspected = false;
 
         if (self->kernel_dir) {
                 free(self->kernel_dir);
@@ -222,22 +311,9 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
                 self->os_release = NULL;
         }
 
-        self->os_release = cbm_os_release_new_for_root(prefix);
-        if (!self->os_release) {
-                DECLARE_OOM();
-                abort();
-        }
-
-        /* Load cmdline */
-        if (self->cmdline) {
-                free(self->cmdline);
-                self->cmdline = NULL;
-        }
-        self->cmdline = cbm_parse_cmdline_files(config->prefix);
-
-        if (!boot_manager_select_bootloader(self)) {
-                return false;
-        }
+        /* The cmdline is only built when an entry is rendered */
+        self->cmdline_checked = false;
+        self->bootloader_checked = false;
 
         return true;
 }
@@ -246,7 +322,7 @@ int boot_manager_get_wanted_boot_mask(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->sysconfig->wanted_boot_mask;
+        return boot_manager_get_sysconfig(self)->wanted_boot_mask;
 }
 
 const char *boot_manager_get_prefix(BootManager *self)
@@ -268,20 +344,64 @@ const char *boot_manager_get_vendor_prefix(__cbm_unused__ BootManager *self)
         return VENDOR_PREFIX;
 }
 
+/**
+ * Parse os-release on first use
+ */
+static CbmOsRelease *boot_manager_get_os_release(BootManager *self)
+{
+        assert(self->sysconfig != NULL);
+
+        if (!self->os_release) {
+                self->os_release = cbm_os_release_new_for_root(self->sysconfig->prefix);
+                if (!self->os_release) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        return self->os_release;
+}
+
 const char *boot_manager_get_os_name(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
 
-        return cbm_os_release_get_value(self->os_release, OS_RELEASE_PRETTY_NAME);
+        return cbm_os_release_get_value(boot_manager_get_os_release(self),
+                                        OS_RELEASE_PRETTY_NAME);
+}
+
+const char *boot_manager_get_cmdline(BootManager *self)
+{
+        assert(self != NULL);
+        assert(self->sysconfig != NULL);
+
+        uint64_t stamp;
+
+        /* Sources are only stat'ed once per set_prefix */
+        if (self->cmdline_checked) {
+                return self->cmdline;
+        }
+
+        /* Only a manager reused across requests, as by serve, gets to keep it */
+        stamp = cbm_cmdline_sources_stamp(self->sysconfig->prefix);
+        if (self->cmdline && stamp == self->cmdline_stamp) {
+                self->cmdline_checked = true;
+                return self->cmdline;
+        }
+
+        free(self->cmdline);
+        self->cmdline = cbm_parse_cmdline_files(self->sysconfig->prefix);
+        self->cmdline_stamp = stamp;
+        self->cmdline_checked = true;
+
+        return self->cmdline;
 }
 
 const char *boot_manager_get_os_id(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
 
-        return cbm_os_release_get_value(self->os_release, OS_RELEASE_ID);
+        return cbm_os_release_get_value(boot_manager_get_os_release(self), OS_RELEASE_ID);
 }
 
 const CbmDeviceProbe *boot_manager_get_root_device(BootManager *self)
@@ -289,17 +409,121 @@ const CbmDeviceProbe *boot_manager_get_root_device(BootManager *self)
         assert(self != NULL);
         assert(self->sysconfig != NULL);
 
-        return (const CbmDeviceProbe *)self->sysconfig->root_device;
+        return (const CbmDeviceProbe *)boot_manager_get_sysconfig(self)->root_device;
+}
+
+/**
+ * Queue a kernel for the bootloader's batch hooks, ignoring duplicates.
+ * @queued indexes the queue by source path, so that large batches don't
+ * rescan it for every kernel.
+ */
+static bool boot_manager_queue_kernel(KernelArray **queue, NcHashmap **queued,
+                                      const Kernel *kernel)
+{
+        if (!*queue) {
+                *queue = nc_array_new();
+                OOM_CHECK_RET(*queue, false);
+        }
+        if (!*queued) {
+                *queued = nc_hashmap_new(nc_string_hash, nc_string_compare);
+                OOM_CHECK_RET(*queued, false);
+        }
+
+        if (nc_hashmap_contains(*queued, kernel->source.path)) {
+                return true;
+        }
+        if (!nc_hashmap_put(*queued, kernel->source.path, (void *)kernel)) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        return nc_array_add(*queue, (void *)kernel);
+}
+
+/**
+ * Hand queued kernels over to the bootloader
+ */
+static bool boot_manager_flush_transaction(BootManager *self)
+{
+        bool ret = true;
+
+        if (self->pending_installs) {
+                if (!self->bootloader->install_kernels(self, self->pending_installs)) {
+                        LOG_ERROR("Failed to install %d kernels", self->pending_installs->len);
+                        ret = false;
+                }
+                boot_manager_free_queue(&self->pending_installs, &self->queued_installs);
+        }
+
+        if (self->pending_removals) {
+                /* Blobs only go once no entry can point at them. If the bootloader
+                 * gave up part way we can't tell which entries remain, so keep them all. */
+                if (!self->bootloader->remove_kernels(self, self->pending_removals)) {
+                        LOG_ERROR("Failed to remove %d kernels", self->pending_removals->len);
+                        ret = false;
+                } else {
+                        for (uint16_t i = 0; i < self->pending_removals->len; i++) {
+                                const Kernel *k = nc_array_get(self->pending_removals, i);
+                                if (!boot_manager_remove_kernel_internal(self, k)) {
+                                        LOG_ERROR("Failed to remove kernel blob: %s",
+                                                  k->source.path);
+                                        ret = false;
+                                }
+                        }
+                }
+                boot_manager_free_queue(&self->pending_removals, &self->queued_removals);
+        }
+
+        return ret;
+}
+
+bool boot_manager_begin_transaction(BootManager *self)
+{
+        assert(self != NULL);
+
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
+
+        if (self->in_transaction) {
+                return true;
+        }
+
+        if (self->bootloader->begin_transaction && !self->bootloader->begin_transaction(self)) {
+                LOG_ERROR("Failed to begin %s transaction", self->bootloader->name);
+                return false;
+        }
+
+        self->in_transaction = true;
+        return true;
+}
+
+bool boot_manager_commit_transaction(BootManager *self)
+{
+        assert(self != NULL);
+        bool ret = true;
+
+        if (!self->in_transaction) {
+                return true;
+        }
+
+        ret = boot_manager_flush_transaction(self);
+        self->in_transaction = false;
+
+        if (self->bootloader->commit && !self->bootloader->commit(self)) {
+                LOG_ERROR("Failed to commit %s transaction", self->bootloader->name);
+                ret = false;
+        }
+
+        return ret;
 }
 
 bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_get_bootloader(self)) {
                 return false;
         }
-        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+        if (!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self))) {
                 return false;
         }
 
@@ -307,6 +531,11 @@ bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
         if (!boot_manager_install_kernel_internal(self, kernel)) {
                 return false;
         }
+        /* Let the bootloader handle it with the rest of the batch */
+        if (self->in_transaction && self->bootloader->install_kernels) {
+                return boot_manager_queue_kernel(&self->pending_installs, &self->queued_installs,
+                                                 kernel);
+        }
         /* Hand over to the bootloader to finish it up */
         return self->bootloader->install_kernel(self, kernel);
 }
@@ -315,12 +544,18 @@ bool boot_manager_remove_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_get_bootloader(self)) {
                 return false;
         }
-        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+        if (!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self))) {
                 return false;
         }
+        /* Let the bootloader handle it with the rest of the batch, the blob
+         * follows at commit once its entry is gone */
+        if (self->in_transaction && self->bootloader->remove_kernels) {
+                return boot_manager_queue_kernel(&self->pending_removals, &self->queued_removals,
+                                                 kernel);
+        }
         /* Remove the kernel blob first */
         if (!boot_manager_remove_kernel_internal(self, kernel)) {
                 return false;
@@ -334,7 +569,7 @@ int detect_and_mount_boot(BootManager *self, char **boot_dir) {
         const char *prefix;
         int wanted_boot_mask;
 
-        wanted_boot_mask = self->sysconfig->wanted_boot_mask;
+        wanted_boot_mask = boot_manager_get_wanted_boot_mask(self);
         if ((wanted_boot_mask & BOOTLOADER_CAP_LEGACY) != BOOTLOADER_CAP_LEGACY) {
                 return mount_boot(self, boot_dir);
         }
@@ -351,8 +586,14 @@ int detect_and_mount_boot(BootManager *self, char **boot_dir) {
         return mount_boot(self, boot_dir);
 }
 
-bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
+/**
+ * Set the default among the kernels found in the kernel directory, recording
+ * the one chosen in the saved state if @save is set
+ */
+static bool boot_manager_set_default_kernel_full(BootManager *self, const Kernel *kernel,
+                                                 bool save)
 {
+        CBM_TRACE_SCOPE("set_default_kernel");
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
         autofree(char) *boot_dir = NULL;
@@ -360,11 +601,17 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
         bool matched = false;
         bool default_set = false;
 
-        CHECK_DBG_RET_VAL(!self->bootloader, false, "Invalid boot loader: null");
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
 
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
                           "Sysconfig is not sane");
 
+        /* The default must be chosen among the kernels already installed */
+        if (self->in_transaction && !boot_manager_flush_transaction(self)) {
+                LOG_ERROR("Failed to install queued kernels");
+                return false;
+        }
+
         /* Grab the available kernels */
         kernels = boot_manager_get_kernels(self);
         CHECK_ERR_RET_VAL(!kernels || kernels->len == 0, false,
@@ -380,9 +627,15 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
                     kernel->meta.release == k->meta.release) {
                         matched = true;
                         default_set = self->bootloader->set_default_kernel(self, kernel);
+                        if (default_set && save) {
+                                (void)boot_manager_update_saved_state(self,
+                                                                      "default",
+                                                                      k->meta.bpath);
+                        }
                         break;
                 }
         }
+        boot_manager_record_boot_space(self);
         if (did_mount > 0) {
                 umount_boot(boot_dir);
         }
@@ -392,12 +645,79 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
         return default_set;
 }
 
+bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
+{
+        return boot_manager_set_default_kernel_full(self, kernel, false);
+}
+
+bool boot_manager_select_default_kernel(BootManager *self, const Kernel *kernel)
+{
+        assert(self != NULL);
+        autofree(char) *bpath = NULL;
+        autofree(char) *source = NULL;
+        autofree(char) *target = NULL;
+        autofree(char) *boot_dir = NULL;
+        Kernel installed = { 0 };
+        int did_mount = -1;
+        int ret;
+
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
+
+        if (!self->bootloader->set_default_installed || self->in_transaction) {
+                return boot_manager_set_default_kernel(self, kernel);
+        }
+
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
+                          "Sysconfig is not sane");
+
+        /* Look for the one kernel in the index rather than parsing all of them */
+        bpath = string_printf("%s.%s.%s-%d",
+                              KERNEL_NAMESPACE,
+                              kernel->meta.ktype,
+                              kernel->meta.version,
+                              kernel->meta.release);
+        source = string_printf("%s/%s", self->kernel_dir, bpath);
+        CHECK_ERR_RET_VAL(!cbm_fs_exists(source), false,
+                          "No matching kernel in %s, bailing", self->kernel_dir);
+        target = string_printf("kernel-%s", bpath);
+
+        installed.meta = kernel->meta;
+        installed.meta.bpath = bpath;
+        installed.source.path = source;
+        installed.target.path = target;
+        installed.target.legacy_path = bpath;
+
+        did_mount = detect_and_mount_boot(self, &boot_dir);
+        CHECK_DBG_RET_VAL(did_mount < 0, false, "Boot was not mounted");
+
+        ret = self->bootloader->set_default_installed(self, &installed);
+        if (ret == 0) {
+                /* No entry to point at yet, take the long way. It mounts boot
+                 * itself and records the kernel it settled on. */
+                LOG_INFO("No boot entry for %s, reconciling", bpath);
+                if (did_mount > 0) {
+                        umount_boot(boot_dir);
+                }
+                return boot_manager_set_default_kernel_full(self, kernel, true);
+        }
+        if (ret > 0) {
+                (void)boot_manager_update_saved_state(self, "default", bpath);
+        }
+        boot_manager_record_boot_space(self);
+
+        if (did_mount > 0) {
+                umount_boot(boot_dir);
+        }
+
+        return ret > 0;
+}
+
 char *boot_manager_get_default_kernel(BootManager *self)
 {
         assert(self != NULL);
 
-        CHECK_DBG_RET_VAL(!self->bootloader, NULL, "Invalid bootloader value: null");
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), NULL,
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), NULL, "Invalid bootloader value: null");
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), NULL,
                             "Sysconfig is not sane");
         return self->bootloader->get_default_kernel(self);
 }
@@ -438,8 +758,11 @@ void umount_boot(char *boot_dir)
  */
 int mount_boot(BootManager *self, char **boot_directory)
 {
+        CBM_TRACE_SCOPE("mount_boot");
         autofree(char) *abs_bootdir = NULL;
         autofree(char) *boot_dir = NULL;
+        autofree(char) *lease_dir = NULL;
+        char *mount_dir = NULL;
         int ret = -1;
         char *root_base = NULL;
         const char *fs_name = NULL;
@@ -473,11 +796,17 @@ int mount_boot(BootManager *self, char **boot_directory)
         }
 
         /* Determine root device */
-        root_base = self->sysconfig->boot_device;
+        root_base = boot_manager_get_sysconfig(self)->boot_device;
         CHECK_FATAL_GOTO(!root_base, out, "Cannot determine boot device");
 
         abs_bootdir = cbm_system_get_mountpoint_for_device(root_base);
 
+        /* An ESP left mounted by an earlier lease may just have been released */
+        if (abs_bootdir && !boot_manager_renew_esp_lease(self, abs_bootdir)) {
+                free(abs_bootdir);
+                abs_bootdir = NULL;
+        }
+
         if (abs_bootdir) {
                 /*
                  * skip if abs_bootdir is equal prefix, in that case we don't want to change
@@ -503,39 +832,69 @@ int mount_boot(BootManager *self, char **boot_directory)
                 goto out;
         }
 
+        /* With a lease, mount it where it can stay mounted after we're done */
+        if (boot_manager_get_esp_lease_timeout(self) > 0) {
+                lease_dir = boot_manager_get_esp_lease_mountpoint(self);
+                if (cbm_system_is_mounted(lease_dir)) {
+                        /* Not our device, or we'd have found it above */
+                        LOG_WARNING("%s holds another device, not leasing the ESP", lease_dir);
+                        free(lease_dir);
+                        lease_dir = NULL;
+                } else if (!cbm_fs_mkdir_p(lease_dir, 00755)) {
+                        LOG_WARNING("Cannot create %s, not leasing the ESP: %s",
+                                    lease_dir,
+                                    strerror(errno));
+                        free(lease_dir);
+                        lease_dir = NULL;
+                }
+        }
+        mount_dir = lease_dir ? lease_dir : boot_dir;
+
         /* The boot directory isn't mounted, so we'll mount it now */
-        if (!nc_file_exists(boot_dir)) {
+        if (!cbm_fs_exists(mount_dir)) {
                 LOG_INFO("Creating boot dir");
-                nc_mkdir_p(boot_dir, 0755);
+                cbm_fs_mkdir_p(mount_dir, 0755);
         }
 
-        LOG_INFO("Mounting boot device %s at %s", root_base, boot_dir);
+        LOG_INFO("Mounting boot device %s at %s", root_base, mount_dir);
 
         fs_name = cbm_get_fstype_name(root_base);
         CHECK_FATAL_GOTO(!fs_name, out, "Could not determine fstype of: %s",
                          root_base);
 
-        if (cbm_system_mount(root_base, boot_dir, fs_name, MS_MGC_VAL, "") < 0) {
+        if (cbm_system_mount(root_base, mount_dir, fs_name, MS_MGC_VAL, "") < 0) {
                 LOG_FATAL("FATAL: Cannot mount boot device %s on %s: %s",
                           root_base,
-                          boot_dir,
+                          mount_dir,
                           strerror(errno));
                 goto out;
         }
-        LOG_SUCCESS("%s successfully mounted at %s", root_base, boot_dir);
+        LOG_SUCCESS("%s successfully mounted at %s", root_base, mount_dir);
 
         /* Reinit bootloader for non-image mode with newly mounted boot partition
          * as it may have paths that already exist, and we must adjust for case
          * sensitivity (ignorant) issues
          */
-        CHECK_FATAL_GOTO(!boot_manager_set_boot_dir(self, boot_dir), out,
-                         "Cannot initialize with newly mounted ESP");
+        if (!boot_manager_set_boot_dir(self, mount_dir)) {
+                LOG_FATAL("Cannot initialize with newly mounted ESP");
+                umount_boot(mount_dir);
+                goto out;
+        }
 
-        *boot_directory = strdup(boot_dir);
+        /* Leased mounts are left for the reaper to unmount */
+        if (lease_dir && boot_manager_take_esp_lease(self, root_base)) {
+                *boot_directory = strdup(mount_dir);
+                if (*boot_directory) {
+                        ret = 0;
+                }
+                goto out;
+        }
+
+        *boot_directory = strdup(mount_dir);
         if (*boot_directory) {
                 ret = 1;
         } else {
-                umount_boot(boot_dir);
+                umount_boot(mount_dir);
         }
 
 out:
@@ -592,6 +951,23 @@ char **boot_manager_list_kernels(BootManager *self)
         return results;
 }
 
+void boot_manager_record_boot_space(BootManager *self)
+{
+        autofree(char) *boot_dir = NULL;
+        struct statvfs st = { 0 };
+
+        if (!cbm_metrics_enabled()) {
+                return;
+        }
+
+        boot_dir = boot_manager_get_boot_dir(self);
+        if (!boot_dir || statvfs(boot_dir, &st) != 0) {
+                return;
+        }
+        cbm_metrics_set_boot_space((uint64_t)st.f_bavail * st.f_frsize,
+                                   (uint64_t)st.f_blocks * st.f_frsize);
+}
+
 char *boot_manager_get_boot_dir(BootManager *self)
 {
         assert(self != NULL);
@@ -607,7 +983,7 @@ char *boot_manager_get_boot_dir(BootManager *self)
         ret = string_printf("%s%s", self->sysconfig->prefix, BOOT_DIRECTORY);
 
         /* Attempt to resolve it first, removing double slashes */
-        realp = realpath(ret, NULL);
+        realp = cbm_fs_realpath(ret);
         if (realp) {
                 free(ret);
                 return realp;
@@ -660,12 +1036,13 @@ void boot_manager_set_data(BootManager *manager, void *data)
 
 bool boot_manager_modify_bootloader(BootManager *self, int flags)
 {
+        CBM_TRACE_SCOPE("modify_bootloader");
         assert(self != NULL);
         autofree(char) *boot_dir = NULL;
 
-        CHECK_DBG_RET_VAL(!self->bootloader, false, "invalid self->bootloader, null.");
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "invalid self->bootloader, null.");
 
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
                           "The sysconfig values are not sane");
 
         /* Ensure we're up to date here on the bootloader */
@@ -717,14 +1094,18 @@ bool boot_manager_needs_install(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->bootloader->needs_install(self);
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+
+        return bootloader && bootloader->needs_install(self);
 }
 
 bool boot_manager_needs_update(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->bootloader->needs_update(self);
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+
+        return bootloader && bootloader->needs_update(self);
 }
 
 bool boot_manager_set_uname(BootManager *self, const char *uname)
@@ -750,7 +1131,7 @@ bool boot_manager_set_uname(BootManager *self, const char *uname)
 
 static bool _boot_manager_enumerate_initrds_freestanding(BootManager *self, const char *dir)
 {
-        autofree(DIR) *initrd_dir = NULL;
+        autofree(CbmFsDir) *initrd_dir = NULL;
         struct dirent *ent = NULL;
         struct stat st = { 0 };
 
@@ -758,7 +1139,8 @@ static bool _boot_manager_enumerate_initrds_freestanding(BootManager *self, cons
                 return false;
         }
 
-        initrd_dir = opendir(dir);
+        CBM_STATS_ADD(dir_scans, 1);
+        initrd_dir = cbm_fs_opendir(dir);
         if (!initrd_dir) {
                 if (errno == ENOENT) {
                         LOG_INFO("path %s does not exist", dir);
@@ -769,7 +1151,7 @@ static bool _boot_manager_enumerate_initrds_freestanding(BootManager *self, cons
                 }
         }
 
-        while ((ent = readdir(initrd_dir)) != NULL) {
+        while ((ent = cbm_fs_readdir(initrd_dir)) != NULL) {
                 char *initrd_name_key = NULL;
                 char *initrd_name_val = NULL;
                 autofree(char) *path = NULL;
@@ -778,7 +1160,9 @@ static bool _boot_manager_enumerate_initrds_freestanding(BootManager *self, cons
                 path = string_printf("%s/%s", dir, ent->d_name);
 
                 /* Some kind of broken link */
-                CHECK_DBG_CONTINUE(lstat(path, &st) != 0, "Broken link: %s, skipping.", path);
+                CHECK_DBG_CONTINUE(cbm_fs_lstat(path, &st) != 0,
+                                   "Broken link: %s, skipping.",
+                                   path);
 
                 /* Regular only */
                 CHECK_DBG_CONTINUE(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode),
@@ -801,7 +1185,7 @@ static bool _boot_manager_enumerate_initrds_freestanding(BootManager *self, cons
                         buf = alloca(bufsiz);
                         OOM_CHECK(buf);
 
-                        nbytes = readlink(path, buf, bufsiz);
+                        nbytes = cbm_fs_readlink(path, buf, bufsiz);
                         if (nbytes == -1) {
                                 DECLARE_OOM();
                         }
@@ -865,19 +1249,25 @@ bool boot_manager_enumerate_initrds_freestanding(BootManager *self)
 bool boot_manager_copy_initrd_freestanding(BootManager *self)
 {
         autofree(char) *base_path = NULL;
+        const BootLoader *bootloader = NULL;
         NcHashmapIter iter = { 0 };
         void *key = NULL;
         void *val = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
-        base_path = boot_manager_get_boot_dir((BootManager *)self);
+        bool is_uefi = false;
+        const char *efi_boot_dir = NULL;
 
         if (!self || !self->initrd_freestanding) {
                 return false;
         }
 
+        bootloader = boot_manager_get_bootloader(self);
+        CHECK_DBG_RET_VAL(!bootloader, false, "Invalid boot loader: null");
+
+        is_uefi = ((bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(self) : NULL;
+        base_path = boot_manager_get_boot_dir(self);
+
         /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
         if (is_uefi && !efi_boot_dir) {
                 return false;
@@ -917,15 +1307,23 @@ bool boot_manager_remove_initrd_freestanding(BootManager * self)
 {
         autofree(char) *base_path = NULL;
         autofree(char) *initrd_efi_path = NULL;
-        autofree(DIR) *initrd_dir = NULL;
+        autofree(CbmFsDir) *initrd_dir = NULL;
         struct dirent *ent = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
+        const BootLoader *bootloader = NULL;
+        bool is_uefi = false;
+        const char *efi_boot_dir = NULL;
+
         if (!self || (!self->user_initrd_freestanding_dir && !self->initrd_freestanding_dir)) {
                 return false;
         }
+
+        bootloader = boot_manager_get_bootloader(self);
+        CHECK_DBG_RET_VAL(!bootloader, false, "Invalid boot loader: null");
+
+        is_uefi = ((bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(self) : NULL;
+
         /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
         if (is_uefi && !efi_boot_dir) {
                 return false;
@@ -937,13 +1335,14 @@ bool boot_manager_remove_initrd_freestanding(BootManager * self)
                                         base_path,
                                         (is_uefi ? efi_boot_dir : ""));
 
-        initrd_dir = opendir(initrd_efi_path);
+        CBM_STATS_ADD(dir_scans, 1);
+        initrd_dir = cbm_fs_opendir(initrd_efi_path);
         if (!initrd_dir) {
                 LOG_ERROR("Error opening %s: %s", initrd_efi_path, strerror(errno));
                 return false;
         }
 
-        while ((ent = readdir(initrd_dir)) != NULL) {
+        while ((ent = cbm_fs_readdir(initrd_dir)) != NULL) {
                 autofree(char) *initrd_target = NULL;
 
                 if (strstr(ent->d_name, "freestanding-") != ent->d_name) {
@@ -955,8 +1354,8 @@ bool boot_manager_remove_initrd_freestanding(BootManager * self)
                                                       initrd_efi_path,
                                                       ent->d_name);
                         /* Remove old initrd */
-                        if (nc_file_exists(initrd_target)) {
-                                if (unlink(initrd_target) < 0) {
+                        if (cbm_fs_exists(initrd_target)) {
+                                if (cbm_fs_unlink(initrd_target) < 0) {
                                         LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
                                                   initrd_target,
                                                   strerror(errno));
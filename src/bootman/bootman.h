@@ -60,7 +60,7 @@ typedef struct Kernel {
                 char *version; /**<Version of this kernel */
                 int release;   /**<Release number of this kernel */
                 char *ktype;   /**<Type of this kernel */
-                char *cmdline; /**<Contents of the cmdline file */
+                char *cmdline; /**<Full cmdline, see boot_manager_get_kernel_cmdline */
                 bool boots;    /**<Is this known to boot? */
         } meta;
 
@@ -90,7 +90,8 @@ typedef NcArray KernelArray;
 
 /**
  * Represenative of the system configuration of a given target prefix.
- * This is populated upon examination by @boot_manager_set_prefix.
+ * The prefix is set by @boot_manager_set_prefix, the devices are only
+ * inspected once something needs them.
  */
 typedef struct SystemConfig {
         char *prefix;                /**<Prefix for all operations */
@@ -125,6 +126,22 @@ void boot_manager_free(BootManager *manager);
  */
 char **boot_manager_list_kernels(BootManager *manager);
 
+/**
+ * Display the kernels recorded as installed by the last successful change,
+ * in the same form as boot_manager_list_kernels, without mounting anything.
+ *
+ * @return NULL terminated array of allocated strings, or NULL if no state
+ * has been recorded yet.
+ */
+char **boot_manager_list_kernels_saved(BootManager *manager);
+
+/**
+ * Return a value from the recorded installed state, such as "default",
+ * "timeout", "backend" or "boot_device", or NULL if it wasn't recorded.
+ * The caller should free the returned string.
+ */
+char *boot_manager_get_saved_state(BootManager *manager, const char *key);
+
 /**
  * Main actor of the operation, apply all relevant update and GC operations
  *
@@ -146,6 +163,21 @@ bool boot_manager_update(BootManager *manager);
  */
 bool boot_manager_set_uname(BootManager *manager, const char *uname);
 
+/**
+ * Override the directory holding the ESP lease and its mountpoint, which
+ * is otherwise ESP_LEASE_DIR
+ */
+void boot_manager_set_esp_lease_dir(BootManager *manager, const char *dir);
+
+/**
+ * Unmount the ESP leased in @lease_dir if it has been idle for @timeout
+ * seconds, otherwise arm the timer again for when it next could be.
+ * Run by the timer armed along with the lease.
+ *
+ * @return False if the lease is still held and no timer could be armed
+ */
+bool boot_manager_expire_esp_lease(const char *lease_dir, unsigned int timeout);
+
 /**
  * Set the prefix to apply to all filesystem paths
  *
@@ -202,6 +234,15 @@ const char *boot_manager_get_vendor_prefix(BootManager *manager);
  */
 void boot_manager_set_os_name(BootManager *manager, char *os_name);
 
+/**
+ * Return the full command line for @kernel: its own cmdline file, followed by
+ * the global command line, with cmdline-removal.d applied. This is built on
+ * first use only, as most operations never render a boot entry.
+ *
+ * @note This string is owned by the Kernel, do not modify or free
+ */
+const char *boot_manager_get_kernel_cmdline(BootManager *manager, const Kernel *kernel);
+
 /**
  * Return the OS name
  *
@@ -282,6 +323,15 @@ bool boot_manager_remove_kernel(BootManager *manager, const Kernel *kernel);
  */
 bool boot_manager_set_default_kernel(BootManager *manager, const Kernel *kernel);
 
+/**
+ * Make @kernel, identified by its meta fields, the default for the next boot.
+ *
+ * When the bootloader already has an entry for it only the default is
+ * rewritten, without scanning the other kernels. Otherwise this falls back to
+ * boot_manager_set_default_kernel.
+ */
+bool boot_manager_select_default_kernel(BootManager *manager, const Kernel *kernel);
+
 /**
  * Attempt to get the default kernel entry
  */
@@ -391,6 +441,17 @@ bool cbm_parse_system_kernel(const char *inp, SystemKernel *kernel);
  */
 void cbm_free_sysconfig(SystemConfig *config);
 
+/**
+ * Return a new SystemConfig for the given root path, without inspecting
+ * any devices yet
+ */
+SystemConfig *cbm_new_sysconfig(const char *path);
+
+/**
+ * Discover the root and boot devices of an existing SystemConfig
+ */
+void cbm_inspect_root_devices(SystemConfig *config, bool image_mode);
+
 /**
  * Inspect a given root path and return a new SystemConfig for it
  */
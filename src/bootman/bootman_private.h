@@ -19,6 +19,7 @@
 #endif
 
 #include <stdbool.h>
+#include <time.h>
 
 #include "bootloader.h"
 #include "bootman.h"
@@ -34,11 +35,22 @@ struct BootManager {
         bool image_mode;               /**<Are we in image mode? */
         bool update_efi_vars;          /**<Should we update efi variables? */
         SystemConfig *sysconfig;       /**<System configuration */
+        bool sysconfig_inspected;      /**<Root and boot devices discovered */
+        bool bootloader_checked;       /**<Bootloader selection attempted */
         char *cmdline;                 /**<Additional cmdline to append */
+        uint64_t cmdline_stamp;        /**<Sources stamp cmdline was built from */
+        bool cmdline_checked;          /**<cmdline_stamp verified since set_prefix */
         char *initrd_freestanding_dir; /**<Initrd without kernel deps directory */
         char *user_initrd_freestanding_dir; /**<User's initrd without kernel deps directory */
         NcHashmap *initrd_freestanding;/**<Array of initrds without kernel deps */
         void *data; /**<Bootloaders private data */
+        bool in_transaction;           /**<Batching bootloader changes */
+        KernelArray *pending_installs; /**<Kernels queued for install_kernels */
+        KernelArray *pending_removals; /**<Kernels queued for remove_kernels */
+        NcHashmap *queued_installs;    /**<Source paths in pending_installs */
+        NcHashmap *queued_removals;    /**<Source paths in pending_removals */
+        char *esp_lease_dir;           /**<Overrides ESP_LEASE_DIR */
+        int esp_lease_fd;              /**<Held ESP lease, or -1 */
 };
 
 /**
@@ -51,6 +63,32 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
  */
 bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel);
 
+/**
+ * Internal function to return the bootloader, selecting and initialising it
+ * on first use after boot_manager_set_prefix.
+ */
+const BootLoader *boot_manager_get_bootloader(BootManager *self);
+
+/**
+ * Internal function to return the merged global command line, reusing the
+ * previous result while its sources are unchanged.
+ */
+const char *boot_manager_get_cmdline(BootManager *self);
+
+/**
+ * Internal function to start batching bootloader changes. While a transaction
+ * is open, kernels are queued for the bootloader's install_kernels and
+ * remove_kernels hooks rather than handed over one at a time. Blobs of removed
+ * kernels are kept until remove_kernels has dropped their entries.
+ */
+bool boot_manager_begin_transaction(BootManager *self);
+
+/**
+ * Internal function to hand any queued kernels over to the bootloader and
+ * close the transaction.
+ */
+bool boot_manager_commit_transaction(BootManager *self);
+
 /**
  * Internal function to unmount boot directory
  */
@@ -64,6 +102,12 @@ void umount_boot(char *boot_dir);
  */
 int mount_boot(BootManager *self, char **boot_directory);
 
+/**
+ * Note the space left on the boot directory for the metrics file, if one
+ * was asked for. Only meaningful while the boot partition is mounted.
+ */
+void boot_manager_record_boot_space(BootManager *self);
+
 /**
  * Detect if legacy, if so make sure there's a boot partition, in that case mount. For
  * other cases always try to mount.
@@ -72,6 +116,59 @@ int mount_boot(BootManager *self, char **boot_directory);
  */
 int detect_and_mount_boot(BootManager *self, char **boot_dir);
 
+/**
+ * Internal function returning the number of idle seconds the ESP stays
+ * mounted after use, or 0 if it shouldn't be leased.
+ */
+int boot_manager_get_esp_lease_timeout(BootManager *self);
+
+/**
+ * Internal function returning where leased ESP mounts live, to be freed
+ * by the caller.
+ */
+char *boot_manager_get_esp_lease_mountpoint(BootManager *self);
+
+/**
+ * Internal function to hold on to the lease if @mountpoint is a leased ESP
+ * mount. Returns false if it is one that has since been released.
+ */
+bool boot_manager_renew_esp_lease(BootManager *self, const char *mountpoint);
+
+/**
+ * Internal function to lease @device, freshly mounted at the lease
+ * mountpoint, and arm the timer that unmounts it once idle. Returns false,
+ * leaving nothing leased, if the timer can't be armed.
+ */
+bool boot_manager_take_esp_lease(BootManager *self, const char *device);
+
+/**
+ * Internal function to let go of the held ESP lease, if any
+ */
+void boot_manager_release_esp_lease(BootManager *self);
+
+/**
+ * Internal function making a single pass of the reaper at time @now: once
+ * @lease_file has been idle for @timeout seconds, unmount @mountpoint and
+ * drop the lease.
+ *
+ * Returns 0 once the lease is gone, otherwise the seconds to wait before
+ * the next pass.
+ */
+unsigned int boot_manager_reap_esp_lease(const char *lease_file, const char *mountpoint,
+                                         unsigned int timeout, time_t now);
+
+/**
+ * Internal function to record the installed state once the boot partition
+ * has been brought up to date. Must be called with boot mounted.
+ */
+bool boot_manager_save_state(BootManager *self);
+
+/**
+ * Internal function to change a single value of the recorded state, if any
+ * has been recorded.
+ */
+bool boot_manager_update_saved_state(BootManager *self, const char *key, const char *value);
+
 /**
  * Internal function to sort by Kernel structs by release number (highest first)
  */
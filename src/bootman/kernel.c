@@ -22,8 +22,12 @@
 #include "bootman_private.h"
 #include "cmdline.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
+#include "metrics.h"
 #include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "config.h"
 
@@ -48,7 +52,7 @@ bool boot_manager_detect_kernel_dir(char *path)
 
         kernel_dir = path ? string_printf("%s/%s", path, KERNEL_DIRECTORY) :
                 string_printf("/%s", KERNEL_DIRECTORY);
-        if (!nc_file_exists(kernel_dir)) {
+        if (!cbm_fs_exists(kernel_dir)) {
                 return false;
         }
 
@@ -115,7 +119,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
         /* TODO: We may actually be uninstalling a partially flopped kernel,
          * so validity of existing kernels may be questionable
          * Thus, flag it, and return kernel */
-        CHECK_ERR_RET_VAL(!nc_file_exists(cmdline), NULL,
+        CHECK_ERR_RET_VAL(!cbm_fs_exists(cmdline), NULL,
                           "Valid kernel found with no cmdline: %s (expected %s)",
                           path, cmdline);
 
@@ -128,7 +132,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                                    type);
 
         /* Fallback to an older namespace */
-        if (!nc_file_exists(module_dir)) {
+        if (!cbm_fs_exists(module_dir)) {
                 free(module_dir);
                 module_dir = string_printf("%s/%s/%s-%d",
                                            self->sysconfig->prefix,
@@ -136,7 +140,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                                            version,
                                            release);
 
-                if (!nc_file_exists(module_dir)) {
+                if (!cbm_fs_exists(module_dir)) {
                         LOG_WARNING("Found kernel with no modules: %s %s", path, module_dir);
                         free(module_dir);
                         module_dir = NULL;
@@ -170,7 +174,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
          * a kernel- prefix */
         kern->target.path = string_printf("kernel-%s", kern->target.legacy_path);
 
-        if (nc_file_exists(kconfig_file)) {
+        if (cbm_fs_exists(kconfig_file)) {
                 kern->source.kconfig_file = strdup(kconfig_file);
                 if (!kern->source.kconfig_file) {
                         DECLARE_OOM();
@@ -178,7 +182,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 }
         }
 
-        if (nc_file_exists(sysmap_file)) {
+        if (cbm_fs_exists(sysmap_file)) {
                 kern->source.sysmap_file = strdup(sysmap_file);
                 if (!kern->source.sysmap_file) {
                         DECLARE_OOM();
@@ -186,7 +190,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 }
         }
 
-        if (nc_file_exists(vmlinux_file)) {
+        if (cbm_fs_exists(vmlinux_file)) {
                 kern->source.vmlinux_file = strdup(vmlinux_file);
                 if (!kern->source.vmlinux_file) {
                         DECLARE_OOM();
@@ -194,7 +198,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 }
         }
 
-        if (nc_file_exists(headers_dir)) {
+        if (cbm_fs_exists(headers_dir)) {
                 kern->source.headers_dir = strdup(headers_dir);
                 if (!kern->source.headers_dir) {
                         DECLARE_OOM();
@@ -202,7 +206,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 }
         }
 
-        if (nc_file_exists(initrd_file)) {
+        if (cbm_fs_exists(initrd_file)) {
                 kern->source.initrd_file = strdup(initrd_file);
                 if (!kern->source.initrd_file) {
                         DECLARE_OOM();
@@ -210,7 +214,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 }
         }
 
-        if (nc_file_exists(user_initrd_file)) {
+        if (cbm_fs_exists(user_initrd_file)) {
                 kern->source.user_initrd_file = strdup(user_initrd_file);
                 if (!kern->source.user_initrd_file) {
                         DECLARE_OOM();
@@ -227,37 +231,58 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
 
         kern->meta.release = (int16_t)release;
 
-        /* cmdline */
-        kern->meta.cmdline = cbm_parse_cmdline_file(cmdline);
-        if (!kern->meta.cmdline) {
-                LOG_ERROR("Unable to load cmdline %s: %s", cmdline, strerror(errno));
-                free_kernel(kern);
-                return NULL;
-        }
-
-        /* Merge global cmdline if we have one */
-        if (self->cmdline) {
-                char *cm = string_printf("%s %s", kern->meta.cmdline, self->cmdline);
-                free(kern->meta.cmdline);
-                kern->meta.cmdline = cm;
-        }
-
-        cbm_parse_cmdline_removal_files_directory(self->sysconfig->prefix, kern->meta.cmdline);
-
+        /* cmdline is loaded on demand by boot_manager_get_kernel_cmdline */
         kern->source.cmdline_file = strdup(cmdline);
 
         /** Determine if the kernel boots */
         kern->source.kboot_file = boot_manager_get_kboot_file(self, kern);
-        if (kern->source.kboot_file && nc_file_exists(kern->source.kboot_file)) {
+        if (kern->source.kboot_file && cbm_fs_exists(kern->source.kboot_file)) {
                 kern->meta.boots = true;
         }
         return kern;
 }
 
+const char *boot_manager_get_kernel_cmdline(BootManager *self, const Kernel *kernel)
+{
+        assert(self != NULL);
+        assert(kernel != NULL);
+
+        /* Kernels are owned by their KernelArray, the cache lives with them */
+        Kernel *kern = (Kernel *)kernel;
+        const char *global = NULL;
+        char *cmdline = NULL;
+
+        if (kern->meta.cmdline) {
+                return kern->meta.cmdline;
+        }
+
+        cmdline = cbm_parse_cmdline_file(kern->source.cmdline_file);
+        if (!cmdline) {
+                LOG_ERROR("Unable to load cmdline %s: %s",
+                          kern->source.cmdline_file,
+                          strerror(errno));
+                return NULL;
+        }
+
+        /* Merge global cmdline if we have one */
+        global = boot_manager_get_cmdline(self);
+        if (global) {
+                char *cm = string_printf("%s %s", cmdline, global);
+                free(cmdline);
+                cmdline = cm;
+        }
+
+        cbm_parse_cmdline_removal_files_directory(self->sysconfig->prefix, cmdline);
+
+        kern->meta.cmdline = cmdline;
+        return kern->meta.cmdline;
+}
+
 KernelArray *boot_manager_get_kernels(BootManager *self)
 {
+        CBM_TRACE_SCOPE("get_kernels");
         KernelArray *ret = NULL;
-        DIR *dir = NULL;
+        CbmFsDir *dir = NULL;
         struct dirent *ent = NULL;
         struct stat st = { 0 };
         if (!self || !self->kernel_dir) {
@@ -267,21 +292,22 @@ KernelArray *boot_manager_get_kernels(BootManager *self)
         ret = nc_array_new();
         OOM_CHECK_RET(ret, NULL);
 
-        dir = opendir(self->kernel_dir);
+        CBM_STATS_ADD(dir_scans, 1);
+        dir = cbm_fs_opendir(self->kernel_dir);
         if (!dir) {
                 LOG_ERROR("Error opening %s: %s", self->kernel_dir, strerror(errno));
                 nc_array_free(&ret, NULL);
                 return NULL;
         }
 
-        while ((ent = readdir(dir)) != NULL) {
+        while ((ent = cbm_fs_readdir(dir)) != NULL) {
                 autofree(char) *path = NULL;
                 Kernel *kern = NULL;
 
                 path = string_printf("%s/%s", self->kernel_dir, ent->d_name);
 
                 /* Some kind of broken link */
-                if (lstat(path, &st) != 0) {
+                if (cbm_fs_lstat(path, &st) != 0) {
                         continue;
                 }
 
@@ -305,7 +331,15 @@ KernelArray *boot_manager_get_kernels(BootManager *self)
                         abort();
                 }
         }
-        closedir(dir);
+        cbm_fs_closedir(dir);
+
+        if (cbm_metrics_enabled()) {
+                cbm_metrics_reset_kernels();
+                for (uint16_t i = 0; i < ret->len; i++) {
+                        const Kernel *k = nc_array_get(ret, i);
+                        cbm_metrics_count_kernel(k->meta.ktype);
+                }
+        }
         return ret;
 }
 
@@ -344,7 +378,7 @@ Kernel *boot_manager_get_default_for_type(BootManager *self, KernelArray *kernel
 
         default_file = string_printf("%s/default-%s", self->kernel_dir, type);
 
-        CHECK_DBG_RET_VAL(readlink(default_file, linkbuf, sizeof(linkbuf)) < 0,
+        CHECK_DBG_RET_VAL(cbm_fs_readlink(default_file, linkbuf, sizeof(linkbuf)) < 0,
                           NULL, "Could not resolve symlink");
 
         for (uint16_t i = 0; i < kernels->len; i++) {
@@ -576,8 +610,8 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         initrd_target = string_printf("%s/%s", base_path, kernel->target.initrd_path);
 
         /* Remove old kernel */
-        if (nc_file_exists(kfile_target)) {
-                if (unlink(kfile_target) < 0) {
+        if (cbm_fs_exists(kfile_target)) {
+                if (cbm_fs_unlink(kfile_target) < 0) {
                         LOG_ERROR("Failed to remove legacy-path UEFI kernel %s: %s",
                                   kfile_target,
                                   strerror(errno));
@@ -588,8 +622,8 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         }
 
         /* Remove old initrd */
-        if (nc_file_exists(initrd_target)) {
-                if (unlink(initrd_target) < 0) {
+        if (cbm_fs_exists(initrd_target)) {
+                if (cbm_fs_unlink(initrd_target) < 0) {
                         LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -613,18 +647,25 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
  */
 bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel)
 {
+        CBM_TRACE_SCOPE("install_kernel");
         autofree(char) *kfile_target = NULL;
         autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
         const char *initrd_source = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
+        const BootLoader *bootloader = NULL;
+        bool is_uefi = false;
+        const char *efi_boot_dir = NULL;
 
         assert(manager != NULL);
         assert(kernel != NULL);
 
+        bootloader = boot_manager_get_bootloader((BootManager *)manager);
+        CHECK_DBG_RET_VAL(!bootloader, false, "Invalid boot loader: null");
+
+        is_uefi = ((bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(manager) : NULL;
+
         if (is_uefi && !efi_boot_dir) {
                 return false;
         }
@@ -689,17 +730,24 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
  */
 bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel)
 {
+        CBM_TRACE_SCOPE("remove_kernel");
         autofree(char) *kfile_target = NULL;
         autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
+        const BootLoader *bootloader = NULL;
+        bool is_uefi = false;
+        const char *efi_boot_dir = NULL;
 
         assert(manager != NULL);
         assert(kernel != NULL);
 
+        bootloader = boot_manager_get_bootloader((BootManager *)manager);
+        CHECK_DBG_RET_VAL(!bootloader, false, "Invalid boot loader: null");
+
+        is_uefi = ((bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(manager) : NULL;
+
         /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
         if (is_uefi && !efi_boot_dir) {
                 return false;
@@ -723,15 +771,15 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         /* Remove the kernel from the ESP */
-        if (nc_file_exists(kfile_target) && unlink(kfile_target) < 0) {
+        if (cbm_fs_exists(kfile_target) && cbm_fs_unlink(kfile_target) < 0) {
                 LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
         } else {
                 cbm_sync();
         }
 
         /* Purge the kernel modules from disk */
-        if (kernel->source.module_dir && nc_file_exists(kernel->source.module_dir)) {
-                if (!nc_rm_rf(kernel->source.module_dir)) {
+        if (kernel->source.module_dir && cbm_fs_exists(kernel->source.module_dir)) {
+                if (!cbm_fs_rm_rf(kernel->source.module_dir)) {
                         LOG_ERROR("Failed to remove module dir (-rf) %s: %s",
                                   kernel->source.module_dir,
                                   strerror(errno));
@@ -741,8 +789,8 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         /* Purge the kernel headers from disk */
-        if (kernel->source.headers_dir && nc_file_exists(kernel->source.headers_dir)) {
-                if (!nc_rm_rf(kernel->source.headers_dir)) {
+        if (kernel->source.headers_dir && cbm_fs_exists(kernel->source.headers_dir)) {
+                if (!cbm_fs_rm_rf(kernel->source.headers_dir)) {
                         LOG_ERROR("Failed to remove headers dir (-rf) %s: %s",
                                   kernel->source.module_dir,
                                   strerror(errno));
@@ -751,36 +799,36 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
                 }
         }
 
-        if (kernel->source.cmdline_file && nc_file_exists(kernel->source.cmdline_file)) {
-                if (unlink(kernel->source.cmdline_file) < 0) {
+        if (kernel->source.cmdline_file && cbm_fs_exists(kernel->source.cmdline_file)) {
+                if (cbm_fs_unlink(kernel->source.cmdline_file) < 0) {
                         LOG_ERROR("Failed to remove cmdline file %s: %s",
                                   kernel->source.cmdline_file,
                                   strerror(errno));
                 }
         }
-        if (kernel->source.kconfig_file && nc_file_exists(kernel->source.kconfig_file)) {
-                if (unlink(kernel->source.kconfig_file) < 0) {
+        if (kernel->source.kconfig_file && cbm_fs_exists(kernel->source.kconfig_file)) {
+                if (cbm_fs_unlink(kernel->source.kconfig_file) < 0) {
                         LOG_ERROR("Failed to remove kconfig file %s: %s",
                                   kernel->source.kconfig_file,
                                   strerror(errno));
                 }
         }
-        if (kernel->source.sysmap_file && nc_file_exists(kernel->source.sysmap_file)) {
-                if (unlink(kernel->source.sysmap_file) < 0) {
+        if (kernel->source.sysmap_file && cbm_fs_exists(kernel->source.sysmap_file)) {
+                if (cbm_fs_unlink(kernel->source.sysmap_file) < 0) {
                         LOG_ERROR("Failed to remove System.map file %s: %s",
                                   kernel->source.sysmap_file,
                                   strerror(errno));
                 }
         }
-        if (kernel->source.vmlinux_file && nc_file_exists(kernel->source.vmlinux_file)) {
-                if (unlink(kernel->source.vmlinux_file) < 0) {
+        if (kernel->source.vmlinux_file && cbm_fs_exists(kernel->source.vmlinux_file)) {
+                if (cbm_fs_unlink(kernel->source.vmlinux_file) < 0) {
                         LOG_ERROR("Failed to remove vmlinux file %s: %s",
                                   kernel->source.vmlinux_file,
                                   strerror(errno));
                 }
         }
-        if (kernel->source.kboot_file && nc_file_exists(kernel->source.kboot_file)) {
-                if (unlink(kernel->source.kboot_file) < 0) {
+        if (kernel->source.kboot_file && cbm_fs_exists(kernel->source.kboot_file)) {
+                if (cbm_fs_unlink(kernel->source.kboot_file) < 0) {
                         LOG_ERROR("Failed to remove kboot file %s: %s",
                                   kernel->source.kboot_file,
                                   strerror(errno));
@@ -788,13 +836,13 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         if (kernel->source.initrd_file) {
-                if (nc_file_exists(kernel->source.initrd_file) &&
-                    unlink(kernel->source.initrd_file) < 0) {
+                if (cbm_fs_exists(kernel->source.initrd_file) &&
+                    cbm_fs_unlink(kernel->source.initrd_file) < 0) {
                         LOG_ERROR("Failed to remove initrd file %s: %s",
                                   kernel->source.initrd_file,
                                   strerror(errno));
                 }
-                if (nc_file_exists(initrd_target) && unlink(initrd_target) < 0) {
+                if (cbm_fs_exists(initrd_target) && cbm_fs_unlink(initrd_target) < 0) {
                         LOG_ERROR("Failed to remove initrd blob %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -802,7 +850,7 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         /* Lastly, remove the source */
-        if (unlink(kernel->source.path) < 0) {
+        if (cbm_fs_unlink(kernel->source.path) < 0) {
                 LOG_ERROR("Failed to remove kernel blob %s: %s",
                           kernel->source.path,
                           strerror(errno));
@@ -0,0 +1,274 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "config.h"
+#include "log.h"
+#include "nica/files.h"
+#include "system_stub.h"
+
+/**
+ * An ESP lease keeps the boot partition mounted under the lease directory
+ * once a command is done with it, so that the commands following it in a
+ * package transaction don't have to probe and mount it again.
+ *
+ * The lease file next to the mountpoint is held with a shared flock() by
+ * every BootManager using the mount, and its mtime records when the mount
+ * was last released. A transient systemd timer armed alongside the mount
+ * runs "clr-boot-manager reap-esp-lease", which unmounts it once the lease
+ * has been idle for the configured timeout or arms the timer again.
+ */
+
+static const char *boot_manager_get_esp_lease_dir(BootManager *self)
+{
+        return self->esp_lease_dir ? self->esp_lease_dir : ESP_LEASE_DIR;
+}
+
+void boot_manager_set_esp_lease_dir(BootManager *self, const char *dir)
+{
+        if (!self) {
+                return;
+        }
+        free(self->esp_lease_dir);
+        self->esp_lease_dir = dir ? strdup(dir) : NULL;
+}
+
+int boot_manager_get_esp_lease_timeout(BootManager *self)
+{
+        autofree(FILE) *fp = NULL;
+        autofree(char) *path = NULL;
+        int t_val;
+
+        if (!self || !self->sysconfig) {
+                return 0;
+        }
+
+        path = string_printf("%s%s/esp_lease", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY);
+
+        /* No lease by default, the ESP is unmounted straight after use */
+        if (!nc_file_exists(path)) {
+                return 0;
+        }
+
+        fp = fopen(path, "r");
+        if (!fp) {
+                LOG_ERROR("Unable to open %s for reading: %s", path, strerror(errno));
+                return 0;
+        }
+
+        if (fscanf(fp, "%d\n", &t_val) != 1 || t_val < 0) {
+                LOG_ERROR("Failed to parse %s, not leasing the ESP", path);
+                return 0;
+        }
+
+        return t_val;
+}
+
+char *boot_manager_get_esp_lease_mountpoint(BootManager *self)
+{
+        return string_printf("%s/mnt", boot_manager_get_esp_lease_dir(self));
+}
+
+static char *boot_manager_get_esp_lease_file(BootManager *self)
+{
+        return string_printf("%s/lease", boot_manager_get_esp_lease_dir(self));
+}
+
+unsigned int boot_manager_reap_esp_lease(const char *lease_file, const char *mountpoint,
+                                         unsigned int timeout, time_t now)
+{
+        struct stat st = { 0 };
+        time_t idle;
+        int fd;
+
+        fd = open(lease_file, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+                /* Released by someone else */
+                return 0;
+        }
+
+        /* Still in use, or used again since we last looked */
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0) {
+                close(fd);
+                return timeout;
+        }
+        idle = now - st.st_mtime;
+        if (idle >= 0 && idle < (time_t)timeout) {
+                close(fd);
+                return timeout - (unsigned int)idle;
+        }
+
+        if (cbm_system_umount(mountpoint) == 0 || !cbm_system_is_mounted(mountpoint)) {
+                (void)unlink(lease_file);
+                close(fd);
+                return 0;
+        }
+        close(fd);
+        return timeout;
+}
+
+/**
+ * Have systemd run the reaper on @lease_dir after @delay seconds. Nothing
+ * is left running in the meantime, and without systemd there is no lease.
+ */
+static bool esp_lease_arm_timer(const char *lease_dir, unsigned int delay, unsigned int timeout)
+{
+        autofree(char) *command = NULL;
+
+        command = string_printf("systemd-run --quiet --collect --on-active=%us "
+                                "--timer-property=AccuracySec=1s "
+                                "%s/%s reap-esp-lease '%s' %u",
+                                delay,
+                                BINDIR,
+                                PACKAGE_NAME,
+                                lease_dir,
+                                timeout);
+        if (cbm_system_system(command) != 0) {
+                LOG_WARNING("Cannot arm a timer for the ESP lease in %s", lease_dir);
+                return false;
+        }
+
+        return true;
+}
+
+bool boot_manager_expire_esp_lease(const char *lease_dir, unsigned int timeout)
+{
+        autofree(char) *lease_file = NULL;
+        autofree(char) *mountpoint = NULL;
+        unsigned int wait;
+
+        lease_file = string_printf("%s/lease", lease_dir);
+        mountpoint = string_printf("%s/mnt", lease_dir);
+
+        wait = boot_manager_reap_esp_lease(lease_file, mountpoint, timeout, time(NULL));
+        if (wait == 0) {
+                return true;
+        }
+
+        return esp_lease_arm_timer(lease_dir, wait, timeout);
+}
+
+/**
+ * Open the lease file and hold it shared. A fresh lease is created for a
+ * mount we just made, otherwise the existing lease must still be current.
+ */
+static bool boot_manager_hold_esp_lease(BootManager *self, const char *device, bool fresh)
+{
+        autofree(char) *lease_file = NULL;
+        autofree(char) *mountpoint = NULL;
+        struct stat held = { 0 };
+        struct stat current = { 0 };
+        unsigned int timeout;
+        int fd;
+
+        if (self->esp_lease_fd >= 0) {
+                return true;
+        }
+
+        lease_file = boot_manager_get_esp_lease_file(self);
+        mountpoint = boot_manager_get_esp_lease_mountpoint(self);
+
+        fd = open(lease_file, O_RDWR | O_CLOEXEC | (fresh ? O_CREAT | O_TRUNC : 0), 00600);
+        if (fd < 0) {
+                LOG_DEBUG("No ESP lease at %s: %s", lease_file, strerror(errno));
+                return false;
+        }
+        if (flock(fd, LOCK_SH) < 0) {
+                close(fd);
+                return false;
+        }
+
+        /* The reaper may have released it between open and lock, and another
+         * lease may already have taken its place */
+        if (fstat(fd, &held) < 0 || stat(lease_file, &current) < 0 ||
+            held.st_dev != current.st_dev || held.st_ino != current.st_ino ||
+            (!fresh && !cbm_system_is_mounted(mountpoint))) {
+                close(fd);
+                return false;
+        }
+
+        if (fresh) {
+                autofree(char) *text = string_printf("%s\n", device);
+
+                if (write(fd, text, strlen(text)) < 0) {
+                        LOG_WARNING("Failed to record ESP lease: %s", strerror(errno));
+                }
+                /* A lease nothing will ever expire is no lease at all */
+                timeout = (unsigned int)boot_manager_get_esp_lease_timeout(self);
+                if (!esp_lease_arm_timer(boot_manager_get_esp_lease_dir(self), timeout, timeout)) {
+                        (void)unlink(lease_file);
+                        close(fd);
+                        return false;
+                }
+        }
+
+        self->esp_lease_fd = fd;
+        return true;
+}
+
+bool boot_manager_renew_esp_lease(BootManager *self, const char *mountpoint)
+{
+        autofree(char) *lease_mountpoint = boot_manager_get_esp_lease_mountpoint(self);
+
+        if (!streq(mountpoint, lease_mountpoint)) {
+                return true;
+        }
+        if (!boot_manager_hold_esp_lease(self, NULL, false)) {
+                LOG_DEBUG("ESP lease on %s expired", mountpoint);
+                return false;
+        }
+
+        LOG_INFO("Reusing ESP leased at %s", mountpoint);
+        return true;
+}
+
+bool boot_manager_take_esp_lease(BootManager *self, const char *device)
+{
+        return boot_manager_hold_esp_lease(self, device, true);
+}
+
+void boot_manager_release_esp_lease(BootManager *self)
+{
+        if (self->esp_lease_fd < 0) {
+                return;
+        }
+
+        /* Idle time counts from here */
+        if (futimens(self->esp_lease_fd, NULL) < 0) {
+                LOG_WARNING("Failed to renew ESP lease: %s", strerror(errno));
+        }
+        close(self->esp_lease_fd);
+        self->esp_lease_fd = -1;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
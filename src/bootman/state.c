@@ -0,0 +1,296 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "trace.h"
+#include "writer.h"
+
+/**
+ * The installed state is recorded in /var/lib/kernel/boot-state once a
+ * change to the boot partition succeeds, so that read-only queries can be
+ * answered without root or mounting anything. It is a list of key=value
+ * lines, with one "kernel" line per installed entry, highest release first:
+ *
+ *      backend=systemd
+ *      boot_device=/dev/sda1
+ *      timeout=5
+ *      default=org.clearlinux.native.4.14.1-120
+ *      kernel=org.clearlinux.native.4.14.1-120
+ *      kernel=org.clearlinux.native.4.14.1-119
+ */
+
+#define BOOT_STATE_KERNEL "kernel"
+#define BOOT_STATE_DIR "/var/lib/kernel"
+
+static char *boot_manager_get_state_path(BootManager *self)
+{
+        return string_printf("%s%s/boot-state", self->sysconfig->prefix, BOOT_STATE_DIR);
+}
+
+static bool boot_manager_write_state(BootManager *self, const char *text)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *dir = NULL;
+
+        path = boot_manager_get_state_path(self);
+        dir = string_printf("%s%s", self->sysconfig->prefix, BOOT_STATE_DIR);
+
+        if (!nc_mkdir_p(dir, 00755)) {
+                LOG_ERROR("Failed to create directory %s: %s", dir, strerror(errno));
+                return false;
+        }
+        if (!file_set_text_durable(path, text)) {
+                LOG_ERROR("Failed to record boot state in %s: %s", path, strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Return the text of the saved state, or NULL if there is none
+ */
+static char *boot_manager_read_state(BootManager *self)
+{
+        autofree(char) *path = NULL;
+        char *text = NULL;
+
+        path = boot_manager_get_state_path(self);
+        if (!nc_file_exists(path)) {
+                LOG_DEBUG("No saved boot state in %s", path);
+                return NULL;
+        }
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                return NULL;
+        }
+        if (text[0] == '\0') {
+                /* Cut short by a crash, as good as never saved */
+                LOG_DEBUG("Saved boot state in %s is empty", path);
+                free(text);
+                return NULL;
+        }
+
+        return text;
+}
+
+/**
+ * Split a state line in place, returning the value or NULL if malformed
+ */
+static char *boot_manager_state_value(char *line)
+{
+        char *sep = strchr(line, '=');
+
+        if (!sep) {
+                return NULL;
+        }
+        *sep = '\0';
+        return sep + 1;
+}
+
+bool boot_manager_save_state(BootManager *self)
+{
+        CBM_TRACE_SCOPE("save_state");
+        autofree(KernelArray) *kernels = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *default_kernel = NULL;
+        const BootLoader *bootloader = NULL;
+
+        bootloader = boot_manager_get_bootloader(self);
+        CHECK_DBG_RET_VAL(!bootloader, false, "Invalid boot loader: null");
+
+        kernels = boot_manager_get_kernels(self);
+        if (!kernels) {
+                return false;
+        }
+        nc_array_qsort(kernels, kernel_compare_reverse);
+
+        default_kernel = boot_manager_get_default_kernel(self);
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        cbm_writer_append_printf(writer, "backend=%s\n", bootloader->name);
+        cbm_writer_append_printf(writer,
+                                 "boot_device=%s\n",
+                                 self->sysconfig->boot_device ? self->sysconfig->boot_device
+                                                              : "");
+        cbm_writer_append_printf(writer, "timeout=%d\n", boot_manager_get_timeout_value(self));
+        cbm_writer_append_printf(writer, "default=%s\n", default_kernel ? default_kernel : "");
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+                cbm_writer_append_printf(writer, BOOT_STATE_KERNEL "=%s\n", k->meta.bpath);
+        }
+
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        return boot_manager_write_state(self, writer->buffer);
+}
+
+bool boot_manager_update_saved_state(BootManager *self, const char *key, const char *value)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *text = NULL;
+        char *saveptr = NULL;
+        bool found = false;
+
+        text = boot_manager_read_state(self);
+        if (!text) {
+                /* Nothing recorded yet, the next full save takes care of it */
+                return true;
+        }
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        for (char *line = strtok_r(text, "\n", &saveptr); line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                char *v = boot_manager_state_value(line);
+
+                if (!v) {
+                        continue;
+                }
+                if (streq(line, key)) {
+                        cbm_writer_append_printf(writer, "%s=%s\n", key, value);
+                        found = true;
+                        continue;
+                }
+                cbm_writer_append_printf(writer, "%s=%s\n", line, v);
+        }
+        if (!found) {
+                cbm_writer_append_printf(writer, "%s=%s\n", key, value);
+        }
+
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        return boot_manager_write_state(self, writer->buffer);
+}
+
+char *boot_manager_get_saved_state(BootManager *self, const char *key)
+{
+        autofree(char) *text = NULL;
+        char *saveptr = NULL;
+
+        assert(self != NULL);
+
+        text = boot_manager_read_state(self);
+        if (!text) {
+                return NULL;
+        }
+
+        for (char *line = strtok_r(text, "\n", &saveptr); line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                char *v = boot_manager_state_value(line);
+
+                if (v && streq(line, key)) {
+                        return strdup(v);
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Free the first @n entries of @results along with it
+ */
+static void boot_manager_free_results(char **results, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                free(results[i]);
+        }
+        free(results);
+}
+
+char **boot_manager_list_kernels_saved(BootManager *self)
+{
+        autofree(char) *text = NULL;
+        autofree(char) *default_kernel = NULL;
+        char *saveptr = NULL;
+        char **results = NULL;
+        size_t n_alloc = 0;
+        size_t i = 0;
+
+        assert(self != NULL);
+
+        text = boot_manager_read_state(self);
+        if (!text) {
+                return NULL;
+        }
+
+        default_kernel = boot_manager_get_saved_state(self, "default");
+
+        /* Sized as we go, so only what the line parser accepts is counted */
+        for (char *line = strtok_r(text, "\n", &saveptr);; line = strtok_r(NULL, "\n", &saveptr)) {
+                char *v = NULL;
+
+                if (i + 1 >= n_alloc) {
+                        size_t n = n_alloc ? n_alloc * 2 : 8;
+                        char **r = realloc(results, n * sizeof(char *));
+
+                        if (!r) {
+                                boot_manager_free_results(results, i);
+                                DECLARE_OOM();
+                                return NULL;
+                        }
+                        results = r;
+                        n_alloc = n;
+                }
+
+                if (!line) {
+                        break;
+                }
+
+                v = boot_manager_state_value(line);
+                if (!v || !streq(line, BOOT_STATE_KERNEL)) {
+                        continue;
+                }
+                results[i++] = string_printf("%s %s", streq(default_kernel, v) ? "*" : " ", v);
+        }
+        results[i] = NULL;
+
+        return results;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -14,17 +14,19 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <blkid/blkid.h>
-
+#include "blkid_stub.h"
 #include "bootman.h"
 #include "bootman_private.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
+#include "topology.h"
+#include "trace.h"
 
 #define CBM_BOOTVAR_TEST_MODE_VAR "CBM_BOOTVAR_TEST_MODE"
 
@@ -82,31 +84,41 @@ static const struct FilesystemMap *cbm_get_fstype(const char *boot_device)
 {
         autofree(char) *fsname = NULL;
         const struct FilesystemMap *fs;
+        const CbmTopologyDevice *device = NULL;
+        struct stat st = { 0 };
 
         /* Test suite will set the CBM_TEST_FSTYPE env var and inform the wanted fstype */
         fsname = getenv("CBM_TEST_FSTYPE");
         if (fsname) {
                 fsname = strdup(fsname);
+        } else if (stat(boot_device, &st) == 0 && S_ISBLK(st.st_mode) &&
+                   (device = cbm_topology_probe(st.st_rdev)) && device->fstype) {
+                /* Already known from probing the ESP */
+                fsname = strdup(device->fstype);
+                if (fsname == NULL) {
+                        DECLARE_OOM();
+                        exit(EXIT_FAILURE);
+                }
         } else {
                 int rc;
                 blkid_probe pr;
                 const char *tmp;
 
-                pr = blkid_new_probe_from_filename(boot_device);
+                pr = cbm_blkid_new_probe_from_filename(boot_device);
                 if (!pr) {
                         LOG_ERROR("%s: failed to create a new libblkid probe",
                                   boot_device);
                         exit(EXIT_FAILURE);
                 }
 
-                blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE);
-                rc = blkid_do_safeprobe(pr);
+                cbm_blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE);
+                rc = cbm_blkid_do_safeprobe(pr);
                 if (rc != 0) {
                         LOG_ERROR("%s: blkid_do_safeprobe() failed", boot_device);
                         exit(EXIT_FAILURE);
                 }
 
-                rc = blkid_probe_lookup_value(pr, "TYPE", &tmp, NULL);
+                rc = cbm_blkid_probe_lookup_value(pr, "TYPE", &tmp, NULL);
                 if (rc != 0 || tmp == NULL || strlen(tmp) == 0) {
                         LOG_ERROR("%s: blkid_probe_lookup_value() failed", boot_device);
                         exit(EXIT_FAILURE);
@@ -118,7 +130,7 @@ static const struct FilesystemMap *cbm_get_fstype(const char *boot_device)
                         exit(EXIT_FAILURE);
                 }
 
-                blkid_free_probe(pr);
+                cbm_blkid_free_probe(pr);
         }
 
         fs = cbm_find_fstype(fsname);
@@ -220,11 +232,10 @@ static void cmb_inspect_root_image(SystemConfig *c, char *realp) {
         c->wanted_boot_mask = mask;
 }
 
-SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
+SystemConfig *cbm_new_sysconfig(const char *path)
 {
         SystemConfig *c = NULL;
         char *realp = NULL;
-        char *rel = NULL;
 
         CHECK_ERR_RET_VAL(!path, NULL, "invalid \"path\" value: null");
 
@@ -237,10 +248,23 @@ SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
         c->prefix = realp;
         c->wanted_boot_mask = 0;
 
+        return c;
+
+ error:
+        DECLARE_OOM();
+        free(realp);
+        return NULL;
+}
+
+void cbm_inspect_root_devices(SystemConfig *c, bool image_mode)
+{
+        CBM_TRACE_SCOPE("inspect_root_devices");
+        char *rel = NULL;
+
         if (image_mode) {
-                cmb_inspect_root_image(c, realp);
+                cmb_inspect_root_image(c, c->prefix);
         } else {
-                cmb_inspect_root_native(c, realp);
+                cmb_inspect_root_native(c, c->prefix);
         }
 
         /* Our probe methods are GPT only. If we found one, it's definitely GPT */
@@ -261,14 +285,17 @@ SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
                 c->wanted_boot_mask |= cbm_get_filesystem_cap(c->boot_device);
         }
 
-        c->root_device = cbm_probe_path(realp);
+        c->root_device = cbm_probe_path(c->prefix);
+}
 
-        return c;
+SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
+{
+        SystemConfig *c = cbm_new_sysconfig(path);
 
- error:
-        DECLARE_OOM();
-        free(realp);
-        return NULL;
+        if (c) {
+                cbm_inspect_root_devices(c, image_mode);
+        }
+        return c;
 }
 
 bool cbm_is_sysconfig_sane(SystemConfig *config)
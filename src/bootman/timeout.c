@@ -26,6 +26,7 @@ bool boot_manager_set_timeout_value(BootManager *self, int timeout)
         autofree(FILE) *fp = NULL;
         autofree(char) *path = NULL;
         autofree(char) *dir = NULL;
+        autofree(char) *timeout_str = NULL;
 
         if (!self || !self->sysconfig) {
                 return false;
@@ -49,7 +50,8 @@ bool boot_manager_set_timeout_value(BootManager *self, int timeout)
                         LOG_ERROR("Unable to remove %s: %s", path, strerror(errno));
                         return false;
                 }
-                return true;
+                timeout_str = strdup("-1");
+                goto save_state;
         }
 
         fp = fopen(path, "w");
@@ -62,6 +64,13 @@ bool boot_manager_set_timeout_value(BootManager *self, int timeout)
                 LOG_FATAL("Unable to set new timeout: %s", strerror(errno));
                 return false;
         }
+        timeout_str = string_printf("%d", timeout);
+
+save_state:
+        /* The timeout is already in place, the saved state only mirrors it */
+        if (!timeout_str || !boot_manager_update_saved_state(self, "timeout", timeout_str)) {
+                LOG_WARNING("Failed to record the new timeout in the saved boot state");
+        }
         return true;
 }
 
@@ -23,6 +23,7 @@
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
+#include "trace.h"
 
 static bool boot_manager_update_image(BootManager *self);
 static bool boot_manager_update_native(BootManager *self);
@@ -30,21 +31,38 @@ static bool boot_manager_update_bootloader(BootManager *self);
 
 bool boot_manager_update(BootManager *self)
 {
+        CBM_TRACE_SCOPE("update");
         assert(self != NULL);
         bool ret = false;
         autofree(char) *boot_dir = NULL;
         int did_mount = -1;
 
+        /* Selection is lazy, don't get as far as mounting without a bootloader */
+        if (!boot_manager_get_bootloader(self)) {
+                LOG_FATAL("No usable bootloader for this system");
+                return false;
+        }
+
         /* Image mode is very simple, no prep/cleanup */
         if (boot_manager_is_image_mode(self)) {
                 LOG_DEBUG("Skipping to image-update");
-                return boot_manager_update_image(self);
+                ret = boot_manager_update_image(self);
+                if (ret) {
+                        (void)boot_manager_save_state(self);
+                }
+                boot_manager_record_boot_space(self);
+                return ret;
         }
 
         did_mount = detect_and_mount_boot(self, &boot_dir);
         if (did_mount >= 0) {
                 /* Do a native update */
                 ret = boot_manager_update_native(self);
+                if (ret) {
+                        /* Let queries answer without mounting again */
+                        (void)boot_manager_save_state(self);
+                }
+                boot_manager_record_boot_space(self);
                 if (did_mount > 0) {
                         umount_boot(boot_dir);
                 }
@@ -67,6 +85,7 @@ bool boot_manager_update(BootManager *self)
  */
 static bool boot_manager_update_image(BootManager *self)
 {
+        CBM_TRACE_SCOPE("update_image");
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
         autofree(char) *boot_dir = NULL;
@@ -119,13 +138,19 @@ static bool boot_manager_update_image(BootManager *self)
                 return false;
         }
 
+        /* Let the bootloader handle all kernels in one go */
+        if (!boot_manager_begin_transaction(self)) {
+                return false;
+        }
+
         /* Go ahead and install the kernels */
         for (uint16_t i = 0; i < kernels->len; i++) {
                 const Kernel *k = nc_array_get(kernels, i);
                 LOG_DEBUG("update_image: Attempting install of %s", k->source.path);
                 if (!boot_manager_install_kernel(self, k)) {
                         LOG_FATAL("Cannot install kernel %s", k->source.path);
-                        return false;
+                        ret = false;
+                        goto cleanup;
                 }
                 LOG_SUCCESS("update_image: Successfully installed %s", k->source.path);
         }
@@ -135,10 +160,18 @@ static bool boot_manager_update_image(BootManager *self)
         LOG_DEBUG("update_image: Setting default_kernel to %s", default_kernel->source.path);
         if (!boot_manager_set_default_kernel(self, default_kernel)) {
                 LOG_FATAL("Failed to set the default kernel to: %s", default_kernel->source.path);
-                return false;
+                ret = false;
+                goto cleanup;
         }
         LOG_SUCCESS("update_image: Default kernel is now %s", default_kernel->source.path);
 
+cleanup:
+        /* Queued kernels reference our array, so always finish the batch here */
+        if (!boot_manager_commit_transaction(self)) {
+                LOG_FATAL("Failed to commit bootloader changes");
+                ret = false;
+        }
+
         /* The kernel parts worked, return status from bootloader update */
         return ret;
 }
@@ -148,6 +181,7 @@ static bool boot_manager_update_image(BootManager *self)
  */
 static bool boot_manager_update_native(BootManager *self)
 {
+        CBM_TRACE_SCOPE("update_native");
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
         autofree(NcHashmap) *mapped_kernels = NULL;
@@ -211,6 +245,11 @@ static bool boot_manager_update_native(BootManager *self)
                 return false;
         }
 
+        /* Let the bootloader handle all kernel changes in one go */
+        if (!boot_manager_begin_transaction(self)) {
+                return false;
+        }
+
         /* This is mostly to allow a repair-situation */
         if (running) {
                 /* Not necessarily fatal. */
@@ -366,6 +405,11 @@ static bool boot_manager_update_native(BootManager *self)
         }
 
 cleanup:
+        /* Queued kernels reference our array, so always finish the batch here */
+        if (!boot_manager_commit_transaction(self)) {
+                ret = false;
+                LOG_ERROR("Failed to commit bootloader changes");
+        }
         if (!boot_manager_remove_initrd_freestanding(self)) {
                 ret = false;
                 LOG_ERROR("Failed to remove old freestanding initrd");
@@ -382,6 +426,7 @@ cleanup:
  */
 static bool boot_manager_update_bootloader(BootManager *self)
 {
+        CBM_TRACE_SCOPE("update_bootloader");
         if (boot_manager_needs_install(self)) {
                 /* Attempt install of the bootloader */
                 int flags = BOOTLOADER_OPERATION_INSTALL | BOOTLOADER_OPERATION_NO_CHECK;
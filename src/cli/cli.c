@@ -18,8 +18,12 @@
 
 #include "cli.h"
 #include "config.h"
+#include "files.h"
 #include "log.h"
+#include "metrics.h"
 #include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 struct cli_option {
@@ -35,6 +39,12 @@ static struct cli_option cli_opts[] = {
         OPTION("image", no_argument, 0, 'i', "Force clr-boot-manager to run in image mode."),
         OPTION("no-efi-update", no_argument, 0, 'n',
                "Don't update efi vars when using shim-systemd backend."),
+        OPTION("live", no_argument, 0, 'l',
+               "Inspect the boot partition rather than the saved boot state."),
+        OPTION("timings", no_argument, 0, 't', "Print the time spent in each phase on exit."),
+        OPTION("stats", no_argument, 0, 's', "Print the I/O and system calls made on exit."),
+        OPTION("metrics", required_argument, 0, 'm',
+               "Write Prometheus metrics for the run to the given file."),
         OPTION(0, 0, 0, 0, NULL),
 };
 
@@ -51,6 +61,9 @@ void cli_print_default_args_help(void)
                 char tmp[60] = {0};
                 int len;
 
+                if (curr.opt.val == 'l') {
+                        continue;
+                }
                 len = sprintf(tmp, flags_mask, curr.opt.val, curr.opt.name);
                 if (len > larger) {
                         larger = len;
@@ -62,37 +75,43 @@ void cli_print_default_args_help(void)
                 char tmp[60] = {0};
                 int len;
 
+                /* Only list-kernels takes --live, its usage shows it */
+                if (curr.opt.val == 'l') {
+                        continue;
+                }
                 len = sprintf(tmp, flags_mask, curr.opt.val, curr.opt.name);
                 fprintf(stdout, "%s%*s%s\n", tmp, (larger - len) + 2, "", curr.desc);
         }
 }
 
-bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image,
-                           bool *update_efi_vars)
+bool cli_parse_args(int *argc, char ***argv, CliArgs *args, bool allow_live)
 {
         int o_in = 0;
         int c;
-        char *_root = NULL;
         int opt_len = sizeof(cli_opts) / sizeof(struct cli_option);
         struct option *default_opts;
+        int n_opts = 0;
 
         default_opts = alloca(sizeof(struct option) * (long unsigned int)opt_len);
 
+        /* --live is only accepted by the commands that ask for it */
         for (int i = 0; i < opt_len; i++) {
-                default_opts[i] = cli_opts[i].opt;
+                if (!allow_live && cli_opts[i].opt.val == 'l') {
+                        continue;
+                }
+                default_opts[n_opts++] = cli_opts[i].opt;
         }
 
         /* We actually want to use getopt, so rewind one for getopt */;
         --(*argv);
         ++(*argc);
 
-        if (!root) {
-                return false;
-        }
+        /* Start over, "serve" parses one command line after another */
+        optind = 0;
 
-        /* Allow setting the root */
         while (true) {
-                c = getopt_long(*argc, *argv, "nip:", default_opts, &o_in);
+                c = getopt_long(*argc, *argv, allow_live ? "nilm:stp:" : "nim:stp:", default_opts,
+                                &o_in);
                 if (c == -1) {
                         break;
                 }
@@ -100,22 +119,27 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                 case 0:
                 case 'p':
                         if (optarg) {
-                                if (_root) {
-                                        free(_root);
-                                        _root = NULL;
-                                }
-                                _root = strdup(optarg);
+                                free(args->root);
+                                args->root = strdup(optarg);
                         }
                         break;
                 case 'i':
-                        if (forced_image) {
-                                *forced_image = true;
-                        }
+                        args->forced_image = true;
                         break;
                 case 'n':
-                        if (update_efi_vars) {
-                                *update_efi_vars = false;
-                        }
+                        args->no_efi_update = true;
+                        break;
+                case 'l':
+                        args->live = true;
+                        break;
+                case 'm':
+                        args->metrics = optarg;
+                        break;
+                case 's':
+                        args->stats = true;
+                        break;
+                case 't':
+                        args->timings = true;
                         break;
                 case '?':
                         goto bail;
@@ -126,39 +150,82 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
         }
         *argc -= optind;
 
-        if (_root) {
-                *root = _root;
-        }
+        return true;
+bail:
+        free(args->root);
+        args->root = NULL;
+        return false;
+}
 
-        if (update_efi_vars && *update_efi_vars) {
-                autofree(FILE) *f = NULL;
-                autofree(char) *cfg_path = NULL;
-                char *buf = NULL;
-                size_t sn;
-                ssize_t r = 0;
-
-                cfg_path = string_printf("%s/%s/update_efi_vars", (*root != NULL) ? *root : "",
-                                         KERNEL_CONF_DIRECTORY);
-                CHECK_DBG_GOTO(!nc_file_exists(cfg_path), success, "No such file: %s", cfg_path);
-
-                f = fopen(cfg_path, "r");
-                CHECK_ERR_RET_VAL(!f, false, "Could not open file: %s", cfg_path);
-
-                while ((r = getline(&buf, &sn, f)) > 0) {
-                        if (!strncmp(buf, "no", 2) || !strncmp(buf, "false", 5)) {
-                                *update_efi_vars = false;
-                                break;
-                        }
+bool cli_read_update_efi_vars(const char *root, bool *update_efi_vars)
+{
+        autofree(FILE) *f = NULL;
+        autofree(char) *cfg_path = NULL;
+        char *buf = NULL;
+        size_t sn;
+        ssize_t r = 0;
+
+        cfg_path = string_printf("%s/%s/update_efi_vars", root ? root : "", KERNEL_CONF_DIRECTORY);
+        CHECK_DBG_RET_VAL(!nc_file_exists(cfg_path), true, "No such file: %s", cfg_path);
+
+        f = fopen(cfg_path, "r");
+        CHECK_ERR_RET_VAL(!f, false, "Could not open file: %s", cfg_path);
+
+        while ((r = getline(&buf, &sn, f)) > 0) {
+                if (!strncmp(buf, "no", 2) || !strncmp(buf, "false", 5)) {
+                        *update_efi_vars = false;
+                        break;
                 }
         }
+        free(buf);
 
- success:
         return true;
-bail:
-        if (_root) {
-                free(_root);
+}
+
+bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image,
+                           bool *update_efi_vars, bool *live)
+{
+        CliArgs args = { 0 };
+
+        if (!root) {
+                return false;
         }
-        return false;
+
+        /* Allow setting the root */
+        if (!cli_parse_args(argc, argv, &args, live != NULL)) {
+                return false;
+        }
+
+        if (args.root) {
+                *root = args.root;
+        }
+        if (forced_image && args.forced_image) {
+                *forced_image = true;
+        }
+        if (update_efi_vars && args.no_efi_update) {
+                *update_efi_vars = false;
+        }
+        if (live && args.live) {
+                *live = true;
+        }
+        if (args.metrics) {
+                cbm_metrics_set_output(args.metrics);
+        }
+        if (args.stats) {
+                cbm_stats_enable_report();
+        }
+        if (args.timings) {
+                cbm_trace_enable_report();
+        }
+
+        /* Without --metrics, look for the metrics file in the configuration */
+        cbm_metrics_load_config(*root);
+
+        if (update_efi_vars && *update_efi_vars) {
+                return cli_read_update_efi_vars(*root, update_efi_vars);
+        }
+
+        return true;
 }
 
 /*
@@ -22,10 +22,41 @@ typedef struct SubCommand {
         const char *help;
         subcommand_callback callback;
         bool requires_root;
+        bool served; /**<May be handed to a running "serve" instance */
+        bool mutating; /**<Runs under the update lock */
+        bool coalesce; /**<Identical requests already queued are shared */
+        bool metrics; /**<Writes the metrics file, see --metrics */
 } SubCommand;
 
+/**
+ * The options every command takes, as found on its command line
+ */
+typedef struct CliArgs {
+        char *root;          /**<--path, NULL for the running system */
+        const char *metrics; /**<--metrics, pointing into argv */
+        bool forced_image;   /**<--image */
+        bool no_efi_update;  /**<--no-efi-update */
+        bool live;           /**<--live */
+        bool stats;          /**<--stats */
+        bool timings;        /**<--timings */
+} CliArgs;
+
+/**
+ * Parse the options in @argv into @args without acting on any of them,
+ * taking --live only when @allow_live is set. As with cli_default_args_init
+ * the remaining *argc arguments start at (*argv)[optind], and args->root
+ * belongs to the caller.
+ */
+bool cli_parse_args(int *argc, char ***argv, CliArgs *args, bool allow_live);
+
+/**
+ * Clear @update_efi_vars when the configuration under @root asks not to
+ * touch the EFI variables. Returns false if the configuration is unreadable.
+ */
+bool cli_read_update_efi_vars(const char *root, bool *update_efi_vars);
+
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image,
-                           bool *update_efi_vars);
+                           bool *update_efi_vars, bool *live);
 void cli_print_default_args_help(void);
 
 /*
@@ -9,16 +9,26 @@
  * of the License, or (at your option) any later version.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "cli.h"
 #include "config.h"
+#include "lock.h"
+#include "log.h"
+#include "metrics.h"
 #include "nica/hashmap.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
+#include "ops/lease.h"
 #include "ops/report_booted.h"
+#include "ops/serve.h"
 #include "ops/timeout.h"
 #include "ops/update.h"
 #include "ops/kernels.h"
@@ -31,6 +41,8 @@ static SubCommand cmd_get_timeout;
 static SubCommand cmd_report_booted;
 static SubCommand cmd_list_kernels;
 static SubCommand cmd_set_kernel;
+static SubCommand cmd_serve;
+static SubCommand cmd_reap_esp_lease;
 static char *binary_name = NULL;
 static NcHashmap *g_commands = NULL;
 static bool explicit_help = false;
@@ -76,6 +88,71 @@ static bool print_usage(int argc, char **argv)
         return true;
 }
 
+typedef struct CommandRun {
+        const SubCommand *command;
+        int argc;
+        char **argv;
+} CommandRun;
+
+static bool run_command(void *userdata)
+{
+        CommandRun *run = userdata;
+
+        /* Invoke with discarded subcommand */
+        return run->command->callback(run->argc - 1, run->argv + 1);
+}
+
+/**
+ * Whether @arg, or the value of the option it sets, could be a relative path
+ */
+static bool command_arg_is_relative(const char *arg)
+{
+        const char *value = arg;
+
+        if (arg[0] == '-' && arg[1] != '-' && arg[1] != '\0') {
+                /* Grouped short options look like "-pvalue" too, which is harmless */
+                value = arg + 2;
+        } else if (arg[0] == '-') {
+                value = strchr(arg, '=');
+                if (!value) {
+                        return false;
+                }
+                value++;
+        }
+        return value[0] != '\0' && value[0] != '/';
+}
+
+/**
+ * Requests are shared with others given the same arguments. Relative paths
+ * are resolved against the working directory, so only when one may have been
+ * passed does the directory become part of the key.
+ */
+static char *command_key(int argc, char **argv)
+{
+        autofree(char) *cwd = NULL;
+        char *key = NULL;
+
+        for (int i = 1; i < argc; i++) {
+                if (command_arg_is_relative(argv[i])) {
+                        cwd = getcwd(NULL, 0);
+                        if (!cwd) {
+                                return NULL;
+                        }
+                        break;
+                }
+        }
+
+        key = strdup(cwd ? cwd : "");
+        for (int i = 0; i < argc && key; i++) {
+                char *next = string_printf("%s\x1f%s", key, argv[i]);
+
+                free(key);
+                key = next;
+        }
+
+        return key;
+}
+
 static bool print_version(__cbm_unused__ int argc, __cbm_unused__ char **argv)
 {
         fprintf(stdout,
@@ -95,6 +172,8 @@ int main(int argc, char **argv)
         autofree(NcHashmap) *commands = NULL;
         const char *command = NULL;
         SubCommand *s_command = NULL;
+        bool ok = false;
+        bool ran = true;
 
         binary_name = argv[0];
 
@@ -119,7 +198,11 @@ If necessary, the bootloader will be updated and/or installed during this\n\
 time.",
                 .callback = cbm_command_update,
                 .usage = " [--path=/path/to/filesystem/root]",
-                .requires_root = true
+                .requires_root = true,
+                .served = true,
+                .mutating = true,
+                .coalesce = true,
+                .metrics = true
         };
 
         if (!nc_hashmap_put(commands, cmd_update.name, &cmd_update)) {
@@ -139,6 +222,8 @@ to forcibly delay the system boot for a specified number of seconds.",
                 .callback = cbm_command_set_timeout,
                 .usage = " [--path=/path/to/filesystem/root]",
                 .requires_root = true,
+                .served = true,
+                .mutating = true,
         };
 
         if (!nc_hashmap_put(commands, cmd_set_timeout.name, &cmd_set_timeout)) {
@@ -158,6 +243,7 @@ to forcibly delay the system boot for a specified number of seconds.",
                 .callback = cbm_command_get_timeout,
                 .usage = " [--path=/path/to/filesystem/root]",
                 .requires_root = false,
+                .served = true,
         };
 
         if (!nc_hashmap_put(commands, cmd_get_timeout.name, &cmd_get_timeout)) {
@@ -171,7 +257,9 @@ to forcibly delay the system boot for a specified number of seconds.",
                          .blurb = "Report the current kernel as successfully booted",
                          .help = "This command is invoked at boot to track boot success",
                          .callback = cbm_command_report_booted,
-                         .requires_root = true };
+                         .requires_root = true,
+                         .mutating = true,
+                         .metrics = true };
         if (!nc_hashmap_put(commands, cmd_report_booted.name, &cmd_report_booted)) {
                 DECLARE_OOM();
                 return EXIT_FAILURE;
@@ -182,10 +270,14 @@ to forcibly delay the system boot for a specified number of seconds.",
                 .name = "list-kernels",
                 .blurb = "Display currently selectable kernels to boot",
                 .help = "This command will show available kernels that can be used\n\
-as the argument to select-kernel with a * marking the currently selected kernel.",
+as the argument to select-kernel with a * marking the currently selected kernel.\n\
+The list is read from the state saved by the last successful change, which\n\
+needs neither root nor the boot partition. Use --live to inspect the boot\n\
+partition instead.",
                 .callback = cbm_command_list_kernels,
-                .usage = " [--path=/path/to/filesystem/root]",
-                .requires_root = true
+                .usage = " [--path=/path/to/filesystem/root] [--live]",
+                .requires_root = false,
+                .served = true
         };
 
         if (!nc_hashmap_put(commands, cmd_list_kernels.name, &cmd_list_kernels)) {
@@ -201,7 +293,10 @@ as the argument to select-kernel with a * marking the currently selected kernel.
 kernel for the next time the system boots.",
                 .callback = cbm_command_set_kernel,
                 .usage = " [--path=/path/to/filesystem/root]",
-                .requires_root = true
+                .requires_root = true,
+                .served = true,
+                .mutating = true,
+                .metrics = true
         };
 
         if (!nc_hashmap_put(commands, cmd_set_kernel.name, &cmd_set_kernel)) {
@@ -209,6 +304,44 @@ kernel for the next time the system boots.",
                 return EXIT_FAILURE;
         }
 
+        /* Keep boot state warm for other invocations */
+        cmd_serve = (SubCommand){
+                .name = "serve",
+                .blurb = "Serve commands from a long-running process",
+                .help = "Keep the system inspection, kernel configuration and boot state\n\
+in memory and handle update, set-timeout, get-timeout, list-kernels and\n\
+set-kernel for other invocations over a local socket. Cached state is\n\
+discarded whenever the kernel or configuration directories change.\n\
+\n\
+With \"status\", report on the running service instead.",
+                .callback = cbm_command_serve,
+                .usage = " [--path=/path/to/filesystem/root] [status]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_serve.name, &cmd_serve)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Run by the timer armed along with an ESP lease */
+        cmd_reap_esp_lease = (SubCommand){
+                .name = "reap-esp-lease",
+                .blurb = "Unmount a leased boot partition once idle",
+                .help = "Unmount the boot partition leased in the given directory once the lease\n\
+has been idle for the given number of seconds, or schedule another check for\n\
+when it could be. This is run by the systemd timer armed along with the\n\
+lease and isn't normally needed by hand.",
+                .callback = cbm_command_reap_esp_lease,
+                .usage = " <lease-directory> <timeout>",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_reap_esp_lease.name, &cmd_reap_esp_lease)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Version */
         cmd_version = (SubCommand){
                 .name = "version",
@@ -276,8 +409,38 @@ kernel for the next time the system boots.",
                 return false;
         }
 
-        /* Invoke with discarded subcommand */
-        if (!s_command->callback(--argc, ++argv)) {
+        /* Prefer a running service, which already has the system inspected */
+        if (s_command->served) {
+                bool result = false;
+
+                if (cbm_serve_forward(argc, argv, &result)) {
+                        return result ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+        }
+
+        /* Report on this invocation, see --stats, --timings and CBM_TRACE */
+        cbm_trace_init();
+        atexit(cbm_trace_finish);
+        atexit(cbm_stats_finish);
+
+        /* Don't interleave changes with other invocations */
+        if (s_command->mutating) {
+                CommandRun run = { .command = s_command, .argc = argc, .argv = argv };
+                autofree(char) *key = s_command->coalesce ? command_key(argc, argv) : NULL;
+
+                ok = cbm_update_lock_run(cbm_update_lock_path(), key, run_command, &run, &ran);
+        } else {
+                /* Invoke with discarded subcommand */
+                ok = s_command->callback(--argc, ++argv);
+        }
+
+        /* An attached request did no work of its own to report */
+        if (s_command->metrics && ran) {
+                cbm_metrics_finish(s_command->name, ok);
+        }
+        if (!ok) {
+                /* Show what led up to the failure */
+                cbm_log_dump_held();
                 return EXIT_FAILURE;
         }
         return EXIT_SUCCESS;
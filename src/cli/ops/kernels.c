@@ -19,6 +19,7 @@
 #include "bootman.h"
 #include "cli.h"
 #include "config.h"
+#include "kernels.h"
 #include "log.h"
 
 bool cbm_command_list_kernels(int argc, char **argv)
@@ -26,10 +27,15 @@ bool cbm_command_list_kernels(int argc, char **argv)
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
         bool forced_image = false;
-        char **kernels = NULL;
         bool update_efi_vars = true;
+        bool live = false;
+
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, &live)) {
+                return false;
+        }
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (live && geteuid() != 0) {
+                fprintf(stderr, "list-kernels --live requires root permissions to execute\n");
                 return false;
         }
 
@@ -69,8 +75,28 @@ bool cbm_command_list_kernels(int argc, char **argv)
                 }
         }
 
+        return cbm_command_list_kernels_do(manager, live);
+}
+
+bool cbm_command_list_kernels_do(BootManager *manager, bool live)
+{
+        char **kernels = NULL;
+
+        /* Answer from what the last change recorded when we can */
+        if (!live) {
+                kernels = boot_manager_list_kernels_saved(manager);
+                if (!kernels && geteuid() != 0) {
+                        fprintf(stderr,
+                                "No saved boot state, run list-kernels as root to inspect "
+                                "the boot partition\n");
+                        return false;
+                }
+        }
+
         /* Let CBM take care of the rest */
-        kernels = boot_manager_list_kernels(manager);
+        if (!kernels) {
+                kernels = boot_manager_list_kernels(manager);
+        }
         if (!kernels) {
                 return false;
         }
@@ -87,13 +113,9 @@ bool cbm_command_set_kernel(int argc, char **argv)
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
         bool forced_image = false;
-        char type[32] = { 0 };
-        char version[16] = { 0 };
-        int release = 0;
-        Kernel kern = { 0 };
         bool update_efi_vars = true;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -140,7 +162,17 @@ bool cbm_command_set_kernel(int argc, char **argv)
                 return false;
         }
 
-        if (sscanf(argv[optind], KERNEL_NAMESPACE ".%31[^.].%15[^-]-%d", type, version, &release) != 3) {
+        return cbm_command_set_kernel_do(manager, argv[optind]);
+}
+
+bool cbm_command_set_kernel_do(BootManager *manager, const char *id)
+{
+        char type[32] = { 0 };
+        char version[16] = { 0 };
+        int release = 0;
+        Kernel kern = { 0 };
+
+        if (sscanf(id, KERNEL_NAMESPACE ".%31[^.].%15[^-]-%d", type, version, &release) != 3) {
                 fprintf(stderr,
                         "set-kernel takes a kernel ID of the form %s.TYPE.VERSION-RELEASE\n",
                         KERNEL_NAMESPACE);
@@ -152,7 +184,7 @@ bool cbm_command_set_kernel(int argc, char **argv)
         kern.meta.release = release;
 
         /* Let CBM take care of the rest */
-        if (!boot_manager_set_default_kernel(manager, &kern)) {
+        if (!boot_manager_select_default_kernel(manager, &kern)) {
                 return false;
         }
         return true;
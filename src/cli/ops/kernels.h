@@ -11,10 +11,13 @@
 
 #pragma once
 
+#include "bootman.h"
 #include "cli.h"
 
 bool cbm_command_list_kernels(int argc, char **argv);
+bool cbm_command_list_kernels_do(BootManager *manager, bool live);
 bool cbm_command_set_kernel(int argc, char **argv);
+bool cbm_command_set_kernel_do(BootManager *manager, const char *id);
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
@@ -0,0 +1,53 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "lease.h"
+
+bool cbm_command_reap_esp_lease(int argc, char **argv)
+{
+        unsigned long timeout;
+        char *end = NULL;
+
+        if (argc != 2) {
+                fprintf(stderr, "reap-esp-lease takes the lease directory and its timeout\n");
+                return false;
+        }
+
+        errno = 0;
+        timeout = strtoul(argv[1], &end, 10);
+        if (errno != 0 || end == argv[1] || *end != '\0' || timeout > 86400) {
+                fprintf(stderr, "Invalid lease timeout: %s\n", argv[1]);
+                return false;
+        }
+
+        return boot_manager_expire_esp_lease(argv[0], (unsigned int)timeout);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
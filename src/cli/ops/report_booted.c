@@ -27,13 +27,20 @@
 #include "nica/util.h"
 #include "report_booted.h"
 
-bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **argv)
+bool cbm_command_report_booted(int argc, char **argv)
 {
+        autofree(char) *root = NULL;
         SystemKernel sys = { 0 };
         struct utsname uts = { 0 };
         const char *lib_dir = "/var/lib/kernel";
         autofree(char) *boot_rep_path = NULL;
 
+        /* Only for the options, this is always about the running system.
+         * Anything else on the command line has always been ignored here */
+        opterr = 0;
+        (void)cli_default_args_init(&argc, &argv, &root, NULL, NULL, NULL);
+        opterr = 1;
+
         /* Try to parse the currently running kernel */
         if (uname(&uts) < 0) {
                 fprintf(stderr, "uname() broken: %s\n", strerror(errno));
@@ -0,0 +1,1098 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "config.h"
+#include "kernels.h"
+#include "lock.h"
+#include "log.h"
+#include "metrics.h"
+#include "nica/files.h"
+#include "serve.h"
+#include "stats.h"
+#include "timeout.h"
+#include "topology.h"
+#include "trace.h"
+
+/**
+ * Every message is a frame: a 32-bit length in network byte order followed
+ * by that many bytes of payload. A request carries the command line as a
+ * sequence of NUL terminated strings, with the client's stdout and stderr
+ * passed along as SCM_RIGHTS so the command writes straight to them. The
+ * reply is a single byte holding a CbmServeStatus.
+ */
+#define SERVE_MAX_FRAME (64 * 1024)
+
+/**
+ * How long a client has to deliver its whole request before it is dropped,
+ * so that a stalled client can't hold up everyone else
+ */
+#define SERVE_REQUEST_TIMEOUT_MS 5000
+
+/**
+ * Commands run in a child process each, so that a long update doesn't hold
+ * up anyone else. Beyond this many, requests wait for one to finish.
+ */
+#define SERVE_MAX_RUNNING 16
+
+typedef struct ServeChild {
+        pid_t pid;
+        bool mutating; /**<May have changed what the warm state was built from */
+} ServeChild;
+
+struct CbmServer {
+        char *root;              /**<Root as given with --path, or NULL for "/" */
+        char *realp;             /**<Resolved root, compared against requests */
+        bool image_mode;         /**<Whether root is served in image mode */
+        BootManager *manager;    /**<Warm manager, rebuilt once stale */
+        bool stale;              /**<Inputs changed since the manager was built */
+        bool changed;            /**<Our own commands changed the system since */
+        int inotify_fd;          /**<Watches on the manager's inputs */
+        time_t started;          /**<When the service started */
+        unsigned long requests;  /**<Number of requests handled */
+        unsigned long rebuilds;  /**<Number of times the manager was rebuilt */
+        ServeChild running[SERVE_MAX_RUNNING]; /**<Commands still running */
+        size_t n_running;
+};
+
+typedef struct ServeCommand ServeCommand;
+
+/**
+ * A request with its options parsed, but not acted upon
+ */
+typedef struct ServeRequest {
+        const ServeCommand *command;
+        CliArgs args;
+        int argc;    /**<Arguments left after the options */
+        char **argv;
+        bool fresh;  /**<Rebuild the manager once holding the update lock */
+} ServeRequest;
+
+typedef bool (*serve_callback)(CbmServer *server, const ServeRequest *request);
+
+struct ServeCommand {
+        const char *name;
+        serve_callback callback;
+        bool update_efi_vars; /**<Default before update_efi_vars is consulted */
+        bool requires_root;
+        bool any_root; /**<Doesn't depend on the root being served */
+        bool mutating; /**<Runs under the update lock */
+        bool metrics; /**<Writes the metrics file, see --metrics */
+};
+
+static volatile sig_atomic_t serve_quit = 0;
+
+static const char *serve_socket_path(void)
+{
+        const char *path = getenv("CBM_SERVE_SOCKET");
+
+        return path ? path : SERVE_SOCKET_PATH;
+}
+
+static bool serve_write_all(int fd, const void *data, size_t len)
+{
+        const char *p = data;
+
+        while (len > 0) {
+                ssize_t r = write(fd, p, len);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                p += r;
+                len -= (size_t)r;
+        }
+        return true;
+}
+
+static int64_t serve_now_ms(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait until @fd is readable, giving up at @deadline (in serve_now_ms time).
+ * A @deadline of 0 waits forever.
+ */
+static bool serve_wait_readable(int fd, int64_t deadline)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (!deadline) {
+                return true;
+        }
+
+        for (;;) {
+                int64_t left = deadline - serve_now_ms();
+                int r;
+
+                if (left <= 0) {
+                        errno = ETIMEDOUT;
+                        return false;
+                }
+                r = poll(&pfd, 1, (int)left);
+                if (r > 0) {
+                        return true;
+                }
+                if (r < 0 && errno != EINTR) {
+                        return false;
+                }
+        }
+}
+
+static bool serve_read_all(int fd, void *data, size_t len, int64_t deadline)
+{
+        char *p = data;
+
+        while (len > 0) {
+                ssize_t r;
+
+                if (!serve_wait_readable(fd, deadline)) {
+                        return false;
+                }
+                r = read(fd, p, len);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                if (r == 0) {
+                        errno = ECONNRESET;
+                        return false;
+                }
+                p += r;
+                len -= (size_t)r;
+        }
+        return true;
+}
+
+static bool serve_write_frame(int fd, const void *data, uint32_t len)
+{
+        uint32_t header = htonl(len);
+
+        return serve_write_all(fd, &header, sizeof(header)) && serve_write_all(fd, data, len);
+}
+
+/**
+ * Read a frame, returning a NUL terminated copy of the payload
+ */
+static char *serve_read_frame(int fd, uint32_t *len)
+{
+        uint32_t header = 0;
+        char *data = NULL;
+
+        if (!serve_read_all(fd, &header, sizeof(header), 0)) {
+                return NULL;
+        }
+        *len = ntohl(header);
+        if (*len > SERVE_MAX_FRAME) {
+                return NULL;
+        }
+        data = calloc(1, *len + 1);
+        if (!data) {
+                return NULL;
+        }
+        if (!serve_read_all(fd, data, *len, 0)) {
+                free(data);
+                return NULL;
+        }
+        return data;
+}
+
+/**
+ * Send the request header along with the command's stdout and stderr
+ */
+static bool serve_send_header(int fd, uint32_t len, const int fds[2])
+{
+        uint32_t header = htonl(len);
+        char control[CMSG_SPACE(sizeof(int) * 2)] = { 0 };
+        struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 2);
+
+        return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(header);
+}
+
+/**
+ * Receive the request header and the client's stdout and stderr, by @deadline
+ */
+static bool serve_recv_header(int fd, uint32_t *len, int fds[2], int64_t deadline)
+{
+        uint32_t header = 0;
+        char control[CMSG_SPACE(sizeof(int) * 2)] = { 0 };
+        struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg = NULL;
+        ssize_t r;
+
+        fds[0] = fds[1] = -1;
+
+        if (!serve_wait_readable(fd, deadline)) {
+                return false;
+        }
+        r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r == 0) {
+                errno = ECONNRESET;
+        }
+        if (r <= 0) {
+                return false;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 2)) {
+                        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+                }
+        }
+
+        /* The rest of the header may trail behind the descriptors */
+        if (r < (ssize_t)sizeof(header) &&
+            !serve_read_all(fd, (char *)&header + r, sizeof(header) - (size_t)r, deadline)) {
+                goto fail;
+        }
+        if (fds[0] < 0 || fds[1] < 0) {
+                errno = EBADF;
+                goto fail;
+        }
+
+        *len = ntohl(header);
+        if (*len > SERVE_MAX_FRAME) {
+                errno = EMSGSIZE;
+                goto fail;
+        }
+        return true;
+
+fail:
+        if (fds[0] >= 0) {
+                close(fds[0]);
+        }
+        if (fds[1] >= 0) {
+                close(fds[1]);
+        }
+        fds[0] = fds[1] = -1;
+        return false;
+}
+
+bool cbm_serve_send_request(int fd, int argc, char **argv, const int fds[2])
+{
+        autofree(char) *payload = NULL;
+        size_t len = 0;
+
+        for (int i = 0; i < argc; i++) {
+                len += strlen(argv[i]) + 1;
+        }
+        if (len > SERVE_MAX_FRAME) {
+                return false;
+        }
+        payload = calloc(1, len ? len : 1);
+        if (!payload) {
+                DECLARE_OOM();
+                return false;
+        }
+        len = 0;
+        for (int i = 0; i < argc; i++) {
+                size_t n = strlen(argv[i]) + 1;
+                memcpy(payload + len, argv[i], n);
+                len += n;
+        }
+
+        return serve_send_header(fd, (uint32_t)len, fds) && serve_write_all(fd, payload, len);
+}
+
+int cbm_serve_read_reply(int fd)
+{
+        autofree(char) *reply = NULL;
+        uint32_t reply_len = 0;
+
+        reply = serve_read_frame(fd, &reply_len);
+        if (!reply || reply_len != 1) {
+                return -1;
+        }
+        return reply[0];
+}
+
+bool cbm_serve_forward(int argc, char **argv, bool *result)
+{
+        const char *path = serve_socket_path();
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        const int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+        int fd = -1;
+        int reply;
+        bool handled = false;
+
+        if (!path[0] || strlen(path) >= sizeof(addr.sun_path)) {
+                return false;
+        }
+        strcpy(addr.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return false;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                LOG_DEBUG("No service listening on %s: %s", path, strerror(errno));
+                goto done;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        if (!cbm_serve_send_request(fd, argc, argv, fds)) {
+                LOG_DEBUG("Failed to send request to %s: %s", path, strerror(errno));
+                goto done;
+        }
+
+        /* From here on the command may have run, so never retry it locally */
+        handled = true;
+        reply = cbm_serve_read_reply(fd);
+        if (reply < 0) {
+                LOG_ERROR("Lost connection to service on %s", path);
+                *result = false;
+                goto done;
+        }
+
+        if (reply == CBM_SERVE_DECLINED) {
+                handled = false;
+        } else {
+                *result = reply == CBM_SERVE_OK;
+        }
+
+done:
+        close(fd);
+        return handled;
+}
+
+/**
+ * Watch the inputs the warm state was built from
+ */
+static void serve_watch(CbmServer *server)
+{
+        const char *prefix = boot_manager_get_prefix(server->manager);
+        const char *dirs[] = {
+                KERNEL_DIRECTORY,
+                KERNEL_CONF_DIRECTORY,
+                KERNEL_CONF_DIRECTORY "/cmdline.d",
+                KERNEL_CONF_DIRECTORY "/cmdline-removal.d",
+                VENDOR_KERNEL_CONF_DIRECTORY "/cmdline.d",
+                INITRD_DIRECTORY,
+                USER_INITRD_DIRECTORY,
+        };
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                        IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+        for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+                autofree(char) *path = string_printf("%s/%s", prefix, dirs[i]);
+
+                if (inotify_add_watch(server->inotify_fd, path, mask) < 0) {
+                        LOG_DEBUG("Not watching %s: %s", path, strerror(errno));
+                }
+        }
+}
+
+/**
+ * Throw away the manager and start again from the current root
+ */
+static bool serve_build(CbmServer *server)
+{
+        if (server->manager) {
+                boot_manager_free(server->manager);
+                server->manager = NULL;
+        }
+
+        server->manager = boot_manager_new();
+        if (!server->manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        boot_manager_set_image_mode(server->manager, server->image_mode);
+        if (!boot_manager_set_prefix(server->manager, server->root ? server->root : "/")) {
+                boot_manager_free(server->manager);
+                server->manager = NULL;
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Rebuild the warm state, inspecting the devices up front so that every
+ * command forked from it starts with them known
+ */
+static bool serve_rebuild(CbmServer *server)
+{
+        /* Our own changes leave the devices as they were */
+        if (server->stale) {
+                cbm_topology_reset();
+        }
+        if (!serve_build(server)) {
+                return false;
+        }
+        (void)boot_manager_get_wanted_boot_mask(server->manager);
+
+        serve_watch(server);
+        server->stale = false;
+        server->changed = false;
+        server->rebuilds++;
+        return true;
+}
+
+static void serve_drain_events(CbmServer *server)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        while (read(server->inotify_fd, buf, sizeof(buf)) > 0) {
+                server->stale = true;
+        }
+}
+
+static bool serve_update(CbmServer *server, __cbm_unused__ const ServeRequest *request)
+{
+        bool ret = false;
+
+        if (!boot_manager_detect_kernel_dir(server->root)) {
+                fprintf(stderr, "No kernels detected on system to update\n");
+                return true;
+        }
+
+        /* Grab the available freestanding initrd */
+        if (!boot_manager_enumerate_initrds_freestanding(server->manager)) {
+                return false;
+        }
+
+        ret = boot_manager_update(server->manager);
+
+        /* Share what we probed with one-shot invocations on the live system */
+        if (streq(server->realp, "/")) {
+                cbm_topology_save();
+        }
+
+        return ret;
+}
+
+static bool serve_set_timeout(CbmServer *server, const ServeRequest *request)
+{
+        if (request->argc != 1) {
+                fprintf(stderr, "set-timeout takes one integer parameter\n");
+                return false;
+        }
+
+        if (!cbm_command_set_timeout_do(server->manager, request->argv[0])) {
+                return false;
+        }
+
+        return serve_update(server, request);
+}
+
+static bool serve_get_timeout(CbmServer *server, const ServeRequest *request)
+{
+        if (request->argc != 0) {
+                fprintf(stderr, "get-timeout does not take any parameters\n");
+                return false;
+        }
+
+        return cbm_command_get_timeout_do(server->manager);
+}
+
+static bool serve_list_kernels(CbmServer *server, const ServeRequest *request)
+{
+        return cbm_command_list_kernels_do(server->manager, request->args.live);
+}
+
+static bool serve_set_kernel(CbmServer *server, const ServeRequest *request)
+{
+        if (request->argc != 1) {
+                fprintf(stderr,
+                        "set-kernel takes a kernel ID of the form %s.TYPE.VERSION-RELEASE\n",
+                        KERNEL_NAMESPACE);
+                return false;
+        }
+
+        return cbm_command_set_kernel_do(server->manager, request->argv[0]);
+}
+
+static bool serve_status(CbmServer *server, __cbm_unused__ const ServeRequest *request)
+{
+        fprintf(stdout, "Serving: %s%s\n", server->realp, server->image_mode ? " (image mode)" : "");
+        fprintf(stdout, "Uptime: %ld seconds\n", (long)(time(NULL) - server->started));
+        fprintf(stdout, "Requests: %lu\n", server->requests);
+        fprintf(stdout, "State rebuilds: %lu\n", server->rebuilds);
+        fprintf(stdout, "State: %s\n", server->stale || server->changed ? "stale" : "warm");
+        fprintf(stdout, "Running: %zu\n", server->n_running);
+        return true;
+}
+
+static const ServeCommand serve_commands[] = {
+        { "update", serve_update, true, true, false, true, true },
+        { "set-timeout", serve_set_timeout, false, true, false, true, false },
+        { "get-timeout", serve_get_timeout, false, false, false, false, false },
+        { "list-kernels", serve_list_kernels, true, true, false, false, false },
+        { "set-kernel", serve_set_kernel, true, true, false, true, true },
+        { "status", serve_status, false, false, true, false, false },
+};
+
+static const ServeCommand *serve_find_command(const char *name)
+{
+        for (size_t i = 0; i < sizeof(serve_commands) / sizeof(serve_commands[0]); i++) {
+                if (streq(serve_commands[i].name, name)) {
+                        return &serve_commands[i];
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Run @request against the warm state. Everything about the request comes
+ * from @request, and nothing it asked for is left behind in @server.
+ */
+static bool serve_dispatch(CbmServer *server, const ServeRequest *request)
+{
+        const ServeCommand *command = request->command;
+        bool update_efi_vars = command->update_efi_vars && !request->args.no_efi_update;
+        bool ret = false;
+        int lock_fd = -1;
+
+        if (command->any_root) {
+                return command->callback(server, request);
+        }
+
+        if (update_efi_vars && !cli_read_update_efi_vars(server->root, &update_efi_vars)) {
+                return false;
+        }
+
+        /* Changes still wait their turn behind direct invocations */
+        if (command->mutating) {
+                lock_fd = cbm_update_lock_acquire(cbm_update_lock_path());
+        }
+
+        /* Another change was under way when this copy of the state was made */
+        if (request->fresh && !serve_build(server)) {
+                goto done;
+        }
+
+        boot_manager_set_update_efi_vars(server->manager, update_efi_vars);
+        ret = command->callback(server, request);
+
+done:
+        cbm_update_lock_release(lock_fd);
+        return ret;
+}
+
+/**
+ * Run @request in the child, reporting on it the way a direct invocation
+ * would, and reply to @client. The trace, stats and metrics set up here
+ * are the child's own, so they never reach another request.
+ */
+static void serve_child(CbmServer *server, const ServeRequest *request, int client,
+                        const int fds[2])
+{
+        const ServeCommand *command = request->command;
+        char status = CBM_SERVE_FAILED;
+        bool ret = false;
+
+        if (dup2(fds[0], STDOUT_FILENO) < 0 || dup2(fds[1], STDERR_FILENO) < 0) {
+                _exit(EXIT_FAILURE);
+        }
+
+        /* Whatever the service itself was collecting isn't ours to report */
+        cbm_log_discard_held();
+        cbm_trace_discard();
+        cbm_stats_discard();
+        cbm_metrics_discard();
+
+        cbm_trace_init();
+        if (request->args.metrics) {
+                cbm_metrics_set_output(request->args.metrics);
+        } else {
+                cbm_metrics_load_config(server->root);
+        }
+        if (request->args.stats) {
+                cbm_stats_enable_report();
+        }
+        if (request->args.timings) {
+                cbm_trace_enable_report();
+        }
+
+        ret = serve_dispatch(server, request);
+        if (!ret) {
+                cbm_log_dump_held();
+        }
+        if (command->metrics) {
+                cbm_metrics_finish(command->name, ret);
+        }
+        cbm_stats_finish();
+        cbm_trace_finish();
+
+        fflush(stdout);
+        fflush(stderr);
+        status = ret ? CBM_SERVE_OK : CBM_SERVE_FAILED;
+        if (!serve_write_frame(client, &status, 1)) {
+                LOG_DEBUG("Client went away before the reply: %s", strerror(errno));
+        }
+        _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Parse the options of a request and check it is ours to run, without
+ * acting on any of them
+ */
+static CbmServeStatus serve_prepare(CbmServer *server, ServeRequest *request, int argc,
+                                    char **argv)
+{
+        autofree(char) *realp = NULL;
+        bool image_mode;
+        int opterr_saved = opterr;
+        bool parsed;
+
+        request->argc = argc - 1;
+        request->argv = argv + 1;
+
+        /* Let the client report bad options the usual way */
+        opterr = 0;
+        parsed = cli_parse_args(&request->argc, &request->argv, &request->args, true);
+        opterr = opterr_saved;
+        if (!parsed) {
+                return CBM_SERVE_DECLINED;
+        }
+        request->argv += optind;
+
+        if (request->command->any_root) {
+                return CBM_SERVE_OK;
+        }
+
+        /* Requests for any other root are left to the client */
+        realp = realpath(request->args.root ? request->args.root : "/", NULL);
+        if (!realp || !streq(realp, server->realp)) {
+                return CBM_SERVE_DECLINED;
+        }
+        image_mode = streq(realp, "/") ? request->args.forced_image : true;
+        if (image_mode != server->image_mode) {
+                return CBM_SERVE_DECLINED;
+        }
+
+        if ((server->stale || server->changed || !server->manager) && !serve_rebuild(server)) {
+                return CBM_SERVE_DECLINED;
+        }
+
+        server->requests++;
+        return CBM_SERVE_OK;
+}
+
+void cbm_server_reap(CbmServer *server, bool wait)
+{
+        while (server->n_running > 0) {
+                pid_t pid = waitpid(-1, NULL, wait ? 0 : WNOHANG);
+
+                if (pid < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (pid <= 0) {
+                        break;
+                }
+                for (size_t i = 0; i < server->n_running; i++) {
+                        if (server->running[i].pid != pid) {
+                                continue;
+                        }
+                        /* The next request starts from what it left behind */
+                        if (server->running[i].mutating) {
+                                server->changed = true;
+                        }
+                        server->running[i] = server->running[--server->n_running];
+                        break;
+                }
+        }
+}
+
+/**
+ * Whether a command that may change the system is still running
+ */
+static bool serve_mutating(CbmServer *server)
+{
+        for (size_t i = 0; i < server->n_running; i++) {
+                if (server->running[i].mutating) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+void cbm_server_handle(CbmServer *server, int client)
+{
+        autofree(char) *payload = NULL;
+        char *argv[64] = { NULL };
+        ServeRequest request = { 0 };
+        int argc = 0;
+        int fds[2] = { -1, -1 };
+        uint32_t len = 0;
+        struct ucred cred = { 0 };
+        socklen_t cred_len = sizeof(cred);
+        char status = CBM_SERVE_DECLINED;
+        int64_t deadline = serve_now_ms() + SERVE_REQUEST_TIMEOUT_MS;
+        pid_t pid;
+
+        if (!serve_recv_header(client, &len, fds, deadline)) {
+                LOG_DEBUG("Dropping malformed request: %s", strerror(errno));
+                return;
+        }
+
+        payload = calloc(1, len + 1);
+        if (!payload || !serve_read_all(client, payload, len, deadline)) {
+                LOG_DEBUG("Dropping incomplete request: %s", strerror(errno));
+                goto done;
+        }
+
+        if (len == 0 || payload[len - 1] != '\0') {
+                goto reply;
+        }
+        for (uint32_t i = 0; i < len; i += (uint32_t)strlen(payload + i) + 1) {
+                /* Leave unusually long command lines to the client */
+                if (argc == (int)(sizeof(argv) / sizeof(argv[0])) - 1) {
+                        goto reply;
+                }
+                argv[argc++] = payload + i;
+        }
+
+        request.command = serve_find_command(argv[0]);
+        if (!request.command) {
+                goto reply;
+        }
+        if (request.command->requires_root &&
+            (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != 0)) {
+                goto reply;
+        }
+
+        status = (char)serve_prepare(server, &request, argc, argv);
+        if (status != CBM_SERVE_OK) {
+                goto reply;
+        }
+
+        /* Make room, and don't let the child print what we haven't yet */
+        while (server->n_running == SERVE_MAX_RUNNING) {
+                cbm_server_reap(server, true);
+        }
+        request.fresh = request.command->mutating && serve_mutating(server);
+        fflush(stdout);
+        fflush(stderr);
+
+        pid = fork();
+        if (pid == 0) {
+                serve_child(server, &request, client, fds);
+        }
+        if (pid < 0) {
+                LOG_ERROR("Failed to fork for %s: %s", request.command->name, strerror(errno));
+                status = CBM_SERVE_DECLINED;
+                goto reply;
+        }
+        server->running[server->n_running++] =
+            (ServeChild){ .pid = pid, .mutating = request.command->mutating };
+        goto done;
+
+reply:
+        if (!serve_write_frame(client, &status, 1)) {
+                LOG_DEBUG("Client went away before the reply: %s", strerror(errno));
+        }
+
+done:
+        free(request.args.root);
+        if (fds[0] >= 0) {
+                close(fds[0]);
+        }
+        if (fds[1] >= 0) {
+                close(fds[1]);
+        }
+}
+
+static void serve_signal(__cbm_unused__ int sig)
+{
+        serve_quit = 1;
+}
+
+static void serve_child_exited(__cbm_unused__ int sig)
+{
+}
+
+/**
+ * Bind the listening socket, refusing to take over from a live service
+ */
+static int serve_listen(const char *path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        autofree(char) *copy = NULL;
+        autofree(char) *dir = NULL;
+        mode_t mask;
+        int fd = -1;
+        int r;
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                LOG_FATAL("Socket path is too long: %s", path);
+                return -1;
+        }
+        strcpy(addr.sun_path, path);
+
+        /* dirname() may modify its argument, work from a copy */
+        copy = strdup(path);
+        if (!copy) {
+                DECLARE_OOM();
+                return -1;
+        }
+        dir = strdup(dirname(copy));
+        if (!dir) {
+                DECLARE_OOM();
+                return -1;
+        }
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", dir, strerror(errno));
+                return -1;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                LOG_FATAL("Failed to create socket: %s", strerror(errno));
+                return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+                LOG_FATAL("Another service is already listening on %s", path);
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        (void)unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                LOG_FATAL("Failed to create socket: %s", strerror(errno));
+                return -1;
+        }
+
+        mask = umask(0077);
+        r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        umask(mask);
+        if (r < 0 || listen(fd, SOMAXCONN) < 0) {
+                LOG_FATAL("Failed to listen on %s: %s", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+CbmServer *cbm_server_new(const char *root, bool forced_image)
+{
+        CbmServer *server = NULL;
+
+        server = calloc(1, sizeof(CbmServer));
+        if (!server) {
+                DECLARE_OOM();
+                return NULL;
+        }
+        server->inotify_fd = -1;
+
+        if (root) {
+                server->root = strdup(root);
+                if (!server->root) {
+                        DECLARE_OOM();
+                        goto fail;
+                }
+        }
+        server->realp = realpath(root ? root : "/", NULL);
+        if (!server->realp) {
+                LOG_FATAL("Path specified does not exist: %s", root);
+                goto fail;
+        }
+        /* Anything not / is image mode */
+        server->image_mode = streq(server->realp, "/") ? forced_image : true;
+        server->started = time(NULL);
+
+        server->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (server->inotify_fd < 0) {
+                LOG_FATAL("Failed to initialise inotify: %s", strerror(errno));
+                goto fail;
+        }
+
+        server->stale = true;
+        if (!serve_rebuild(server)) {
+                goto fail;
+        }
+
+        return server;
+
+fail:
+        cbm_server_free(server);
+        return NULL;
+}
+
+void cbm_server_free(CbmServer *server)
+{
+        if (!server) {
+                return;
+        }
+        if (server->inotify_fd >= 0) {
+                close(server->inotify_fd);
+        }
+        if (server->manager) {
+                boot_manager_free(server->manager);
+        }
+        free(server->root);
+        free(server->realp);
+        free(server);
+}
+
+bool cbm_command_serve(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        const char *path = serve_socket_path();
+        CbmServer *server = NULL;
+        struct sigaction sa = { .sa_handler = serve_signal };
+        struct sigaction sa_child = { .sa_handler = serve_child_exited };
+        struct pollfd pfds[2];
+        bool forced_image = false;
+        bool ret = false;
+        int listen_fd = -1;
+
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, NULL, NULL)) {
+                return false;
+        }
+
+        if (argc == 1 && streq(argv[optind], "status")) {
+                char *status_argv[] = { "status" };
+                bool result = false;
+
+                if (!cbm_serve_forward(1, status_argv, &result)) {
+                        fprintf(stderr, "No service is listening on %s\n", path);
+                        return false;
+                }
+                return result;
+        } else if (argc != 0) {
+                fprintf(stderr, "serve takes no parameters other than \"status\"\n");
+                return false;
+        }
+
+        if (!path[0]) {
+                fprintf(stderr, "No socket path configured, set CBM_SERVE_SOCKET\n");
+                return false;
+        }
+
+        server = cbm_server_new(root, forced_image);
+        if (!server) {
+                return false;
+        }
+
+        listen_fd = serve_listen(path);
+        if (listen_fd < 0) {
+                goto cleanup;
+        }
+
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        /* Without SA_RESTART, so that finished commands wake up poll() */
+        sigaction(SIGCHLD, &sa_child, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        LOG_INFO("Serving %s on %s", server->realp, path);
+
+        pfds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        pfds[1] = (struct pollfd){ .fd = server->inotify_fd, .events = POLLIN };
+
+        while (!serve_quit) {
+                cbm_server_reap(server, false);
+
+                if (poll(pfds, 2, -1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        LOG_FATAL("poll() failed: %s", strerror(errno));
+                        goto cleanup;
+                }
+
+                if (pfds[1].revents & POLLIN) {
+                        serve_drain_events(server);
+                }
+
+                if (pfds[0].revents & POLLIN) {
+                        int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+                        if (client < 0) {
+                                continue;
+                        }
+                        /* Pick up changes made just before this request */
+                        serve_drain_events(server);
+                        cbm_server_reap(server, false);
+                        cbm_server_handle(server, client);
+                        close(client);
+                }
+        }
+
+        ret = true;
+
+cleanup:
+        if (listen_fd >= 0) {
+                close(listen_fd);
+                (void)unlink(path);
+        }
+        cbm_server_free(server);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
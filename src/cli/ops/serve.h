@@ -0,0 +1,86 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "cli.h"
+
+/**
+ * Outcome of a served command, as sent back to the client
+ */
+typedef enum {
+        CBM_SERVE_OK = 0,
+        CBM_SERVE_FAILED,
+        CBM_SERVE_DECLINED, /**<Not handled, the client should run it itself */
+} CbmServeStatus;
+
+/**
+ * The warm state kept by "serve" and the commands running from it
+ */
+typedef struct CbmServer CbmServer;
+
+bool cbm_command_serve(int argc, char **argv);
+
+/**
+ * Build the warm state for @root, or the running system if NULL
+ */
+CbmServer *cbm_server_new(const char *root, bool forced_image);
+
+/**
+ * Free @server. Commands still running finish on their own.
+ */
+void cbm_server_free(CbmServer *server);
+
+/**
+ * Read a request from @client and run it in a child process, which works on
+ * a copy of the warm state and replies on @client itself. Requests that
+ * can't be run are answered straight away.
+ */
+void cbm_server_handle(CbmServer *server, int client);
+
+/**
+ * Collect the commands that have finished, or with @wait all of them
+ */
+void cbm_server_reap(CbmServer *server, bool wait);
+
+/**
+ * Send the command line @argv, starting with the command name, as a request
+ * on @fd, with @fds as the stdout and stderr of the command
+ */
+bool cbm_serve_send_request(int fd, int argc, char **argv, const int fds[2]);
+
+/**
+ * Wait for the reply to the request sent on @fd, returning a CbmServeStatus
+ * or -1 if the connection was lost first
+ */
+int cbm_serve_read_reply(int fd);
+
+/**
+ * Hand the command line @argv, starting with the command name, to a running
+ * service. Returns false when no service took the command, in which case it
+ * must be run locally, otherwise @result holds the outcome of the command.
+ */
+bool cbm_serve_forward(int argc, char **argv, bool *result);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -15,6 +15,7 @@
 
 #include "bootman.h"
 #include "cli.h"
+#include "timeout.h"
 #include "update.h"
 
 static inline bool is_numeric(const char *str)
@@ -32,12 +33,11 @@ static inline bool is_numeric(const char *str)
 
 bool cbm_command_set_timeout(int argc, char **argv)
 {
-        int n_val = -1;
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
         bool update_efi_vars = false;
 
-        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -66,12 +66,23 @@ bool cbm_command_set_timeout(int argc, char **argv)
                 return false;
         }
 
-        if (sscanf(argv[optind], "%d", &n_val) < 0) {
+        if (!cbm_command_set_timeout_do(manager, argv[optind])) {
+                return false;
+        }
+
+        return cbm_command_update_do(manager, root, false);
+}
+
+bool cbm_command_set_timeout_do(BootManager *manager, const char *value)
+{
+        int n_val = -1;
+
+        if (sscanf(value, "%d", &n_val) < 0) {
                 fprintf(stderr, "Erroneous input. Please provide an integer value.\n");
                 return false;
         }
 
-        if (!is_numeric(argv[optind])) {
+        if (!is_numeric(value)) {
                 fprintf(stderr, "Please provide a valid numeric value.\n");
                 return false;
         }
@@ -93,7 +104,7 @@ bool cbm_command_set_timeout(int argc, char **argv)
                 fprintf(stdout, "New timeout value is: %d\n", n_val);
         }
 
-        return cbm_command_update_do(manager, root, false);
+        return true;
 }
 
 bool cbm_command_get_timeout(int argc, char **argv)
@@ -102,7 +113,7 @@ bool cbm_command_get_timeout(int argc, char **argv)
         autofree(BootManager) *manager = NULL;
         bool update_efi_vars = false;
 
-        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars);
+        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL);
 
         manager = boot_manager_new();
         if (!manager) {
@@ -129,6 +140,11 @@ bool cbm_command_get_timeout(int argc, char **argv)
                 return false;
         }
 
+        return cbm_command_get_timeout_do(manager);
+}
+
+bool cbm_command_get_timeout_do(BootManager *manager)
+{
         int tval = boot_manager_get_timeout_value(manager);
         if (tval <= 0) {
                 fprintf(stdout, "No timeout is currently configured\n");
@@ -11,10 +11,13 @@
 
 #pragma once
 
+#include "bootman.h"
 #include "cli.h"
 
 bool cbm_command_set_timeout(int argc, char **argv);
+bool cbm_command_set_timeout_do(BootManager *manager, const char *value);
 bool cbm_command_get_timeout(int argc, char **argv);
+bool cbm_command_get_timeout_do(BootManager *manager);
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
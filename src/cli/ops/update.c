@@ -20,6 +20,7 @@
 #include "cli.h"
 #include "log.h"
 #include "nica/files.h"
+#include "topology.h"
 #include "update.h"
 
 bool cbm_command_update(int argc, char **argv)
@@ -29,7 +30,7 @@ bool cbm_command_update(int argc, char **argv)
         bool forced_image = false;
         bool update_efi_vars = true;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -46,6 +47,9 @@ bool cbm_command_update(int argc, char **argv)
 
 bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image)
 {
+        bool live = true;
+        bool ret = false;
+
         if (!boot_manager_detect_kernel_dir(root)) {
                 fprintf(stderr, "No kernels detected on system to update\n");
                 return true;
@@ -60,7 +64,8 @@ bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image)
                         return false;
                 }
                 /* Anything not / is image mode */
-                if (!streq(realp, "/")) {
+                live = streq(realp, "/");
+                if (!live) {
                         boot_manager_set_image_mode(manager, true);
                 } else {
                         boot_manager_set_image_mode(manager, forced_image);
@@ -84,7 +89,15 @@ bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image)
         }
 
         /* Let CBM take care of the rest */
-        return boot_manager_update(manager);
+        ret = boot_manager_update(manager);
+
+        /* Let the next invocation skip probing the same devices. Those of
+         * an image root say nothing about the running system. */
+        if (live) {
+                cbm_topology_save();
+        }
+
+        return ret;
 }
 
 /*
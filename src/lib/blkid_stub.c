@@ -16,6 +16,55 @@
 #include <stdlib.h>
 #include <sys/sysmacros.h>
 
+#include "library.h"
+#include "stats.h"
+#include "topology.h"
+
+/**
+ * libblkid is only loaded on first use, so each default op resolves its
+ * symbol the first time it is called and fails gracefully when the library
+ * cannot be loaded.
+ */
+#define CBM_BLKID_LAZY(ret, fn, fail, args, ...)                                                   \
+        static ret lazy_##fn args                                                                  \
+        {                                                                                          \
+                static __typeof__(fn) *fn##_ptr = NULL;                                            \
+                if (!CBM_LIBRARY_BIND(&cbm_libblkid, fn##_ptr, #fn)) {                             \
+                        return fail;                                                               \
+                }                                                                                  \
+                return fn##_ptr(__VA_ARGS__);                                                      \
+        }
+
+CBM_BLKID_LAZY(blkid_probe, blkid_new_probe_from_filename, NULL, (const char *filename), filename)
+CBM_BLKID_LAZY(int, blkid_probe_enable_superblocks, -1, (blkid_probe pr, int enable), pr, enable)
+CBM_BLKID_LAZY(int, blkid_probe_set_superblocks_flags, -1, (blkid_probe pr, int flags), pr, flags)
+CBM_BLKID_LAZY(int, blkid_probe_enable_partitions, -1, (blkid_probe pr, int enable), pr, enable)
+CBM_BLKID_LAZY(int, blkid_probe_set_partitions_flags, -1, (blkid_probe pr, int flags), pr, flags)
+CBM_BLKID_LAZY(int, blkid_probe_lookup_value, -1,
+               (blkid_probe pr, const char *name, const char **data, size_t *len),
+               pr, name, data, len)
+CBM_BLKID_LAZY(int, blkid_do_safeprobe, -1, (blkid_probe pr), pr)
+CBM_BLKID_LAZY(blkid_partlist, blkid_probe_get_partitions, NULL, (blkid_probe pr), pr)
+CBM_BLKID_LAZY(int, blkid_partlist_numof_partitions, -1, (blkid_partlist ls), ls)
+CBM_BLKID_LAZY(blkid_partition, blkid_partlist_get_partition, NULL,
+               (blkid_partlist ls, int n), ls, n)
+CBM_BLKID_LAZY(unsigned long long, blkid_partition_get_flags, 0, (blkid_partition par), par)
+CBM_BLKID_LAZY(const char *, blkid_partition_get_uuid, NULL, (blkid_partition par), par)
+CBM_BLKID_LAZY(blkid_parttable, blkid_partlist_get_table, NULL, (blkid_partlist ls), ls)
+CBM_BLKID_LAZY(const char *, blkid_parttable_get_type, NULL, (blkid_parttable tab), tab)
+CBM_BLKID_LAZY(int, blkid_devno_to_wholedisk, -1,
+               (dev_t dev, char *diskname, size_t len, dev_t *diskdevno),
+               dev, diskname, len, diskdevno)
+
+static void lazy_blkid_free_probe(blkid_probe pr)
+{
+        static __typeof__(blkid_free_probe) *blkid_free_probe_ptr = NULL;
+
+        if (CBM_LIBRARY_BIND(&cbm_libblkid, blkid_free_probe_ptr, "blkid_free_probe")) {
+                blkid_free_probe_ptr(pr);
+        }
+}
+
 /**
  * Ensure we check here for the blkid device being correct.
  */
@@ -25,32 +74,32 @@ static int cbm_blkid_devno_to_wholedisk_wrapped(dev_t dev, char *diskname, size_
         if (major(dev) == 0) {
                 return -1;
         }
-        return blkid_devno_to_wholedisk(dev, diskname, len, diskdevno);
+        return lazy_blkid_devno_to_wholedisk(dev, diskname, len, diskdevno);
 }
 
 /**
  * Default blkid ops vtable passes through to libblkid itself
  */
 static CbmBlkidOps default_blkid_ops = {
-        .probe_new_from_filename = blkid_new_probe_from_filename,
-        .probe_enable_superblocks = blkid_probe_enable_superblocks,
-        .probe_set_superblocks_flags = blkid_probe_set_superblocks_flags,
-        .probe_enable_partitions = blkid_probe_enable_partitions,
-        .probe_set_partitions_flags = blkid_probe_set_partitions_flags,
-        .probe_lookup_value = blkid_probe_lookup_value,
-        .do_safeprobe = blkid_do_safeprobe,
-        .free_probe = blkid_free_probe,
+        .probe_new_from_filename = lazy_blkid_new_probe_from_filename,
+        .probe_enable_superblocks = lazy_blkid_probe_enable_superblocks,
+        .probe_set_superblocks_flags = lazy_blkid_probe_set_superblocks_flags,
+        .probe_enable_partitions = lazy_blkid_probe_enable_partitions,
+        .probe_set_partitions_flags = lazy_blkid_probe_set_partitions_flags,
+        .probe_lookup_value = lazy_blkid_probe_lookup_value,
+        .do_safeprobe = lazy_blkid_do_safeprobe,
+        .free_probe = lazy_blkid_free_probe,
 
         /* Partition functions */
-        .probe_get_partitions = blkid_probe_get_partitions,
-        .partlist_numof_partitions = blkid_partlist_numof_partitions,
-        .partlist_get_partition = blkid_partlist_get_partition,
-        .partition_get_flags = blkid_partition_get_flags,
-        .partition_get_uuid = blkid_partition_get_uuid,
+        .probe_get_partitions = lazy_blkid_probe_get_partitions,
+        .partlist_numof_partitions = lazy_blkid_partlist_numof_partitions,
+        .partlist_get_partition = lazy_blkid_partlist_get_partition,
+        .partition_get_flags = lazy_blkid_partition_get_flags,
+        .partition_get_uuid = lazy_blkid_partition_get_uuid,
 
         /* Partition table functions */
-        .partlist_get_table = blkid_partlist_get_table,
-        .parttable_get_type = blkid_parttable_get_type,
+        .partlist_get_table = lazy_blkid_partlist_get_table,
+        .parttable_get_type = lazy_blkid_parttable_get_type,
 
         /* Misc */
         .devno_to_wholedisk = cbm_blkid_devno_to_wholedisk_wrapped,
@@ -64,6 +113,12 @@ static CbmBlkidOps *blkid_ops = &default_blkid_ops;
 void cbm_blkid_reset_vtable(void)
 {
         blkid_ops = &default_blkid_ops;
+        cbm_topology_reset();
+}
+
+bool cbm_blkid_is_default_vtable(void)
+{
+        return blkid_ops == &default_blkid_ops;
 }
 
 void cbm_blkid_set_vtable(CbmBlkidOps *ops)
@@ -72,6 +127,7 @@ void cbm_blkid_set_vtable(CbmBlkidOps *ops)
                 cbm_blkid_reset_vtable();
         } else {
                 blkid_ops = ops;
+                cbm_topology_reset();
         }
         /* Ensure the vtable is valid at this point. */
         assert(blkid_ops->probe_new_from_filename != NULL);
@@ -103,6 +159,7 @@ void cbm_blkid_set_vtable(CbmBlkidOps *ops)
  */
 blkid_probe cbm_blkid_new_probe_from_filename(const char *filename)
 {
+        CBM_STATS_ADD(probes, 1);
         return blkid_ops->probe_new_from_filename(filename);
 }
 
@@ -13,6 +13,7 @@
 
 #define _GNU_SOURCE
 #include <blkid.h>
+#include <stdbool.h>
 
 /**
  * Defines the vtable used for all blkid operations within clr-boot-manager.
@@ -98,6 +99,11 @@ void cbm_blkid_reset_vtable(void);
  */
 void cbm_blkid_set_vtable(CbmBlkidOps *ops);
 
+/**
+ * Returns true if the default passthrough vtable is in use
+ */
+bool cbm_blkid_is_default_vtable(void);
+
 /**
  * Probe related wrappers
  */
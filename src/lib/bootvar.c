@@ -12,28 +12,18 @@
 #define _GNU_SOURCE
 
 #include "bootvar.h"
+#include "efivar_stub.h"
+#include "stats.h"
+#include "trace.h"
 
-#include <endian.h>
-/* Workaround for using --std=c11 in CBM. Provide "relaxed" defines which efivar
- * expects. */
-#define BYTE_ORDER __BYTE_ORDER
-#define LITTLE_ENDIAN __LITTLE_ENDIAN
-#define BIG_ENDIAN __BIG_ENDIAN
-
-#include <alloca.h>
-#include <blkid.h>
 #include <ctype.h>
-#include <config.h>
 #include <efi.h>
-#include <efiboot.h>
 #include <efilib.h>
-#include <efivar.h>
 #include <errno.h>
 #include <log.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/sysmacros.h>
 
 /* 1K is the limit for boot var storage that efivar defines. it should be
  * enough. actual space occupied is normally >2 times less. */
@@ -44,61 +34,187 @@
  * side effects. */
 #define CBM_BOOTVAR_TEST_MODE_VAR "CBM_BOOTVAR_TEST_MODE"
 
-typedef struct boot_rec boot_rec_t;
+/* vendor GUID of the variables shared with systemd-boot. */
+#define LOADER_GUID EFI_GUID(0x4a67b082, 0x0a4c, 0x41cf, 0xb6c7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f)
+
+/* loader entry ids are file names, this is plenty. */
+#define LOADER_ENTRY_MAX 512
 
-struct boot_rec {
-        char *name;
+/* a cached Boot#### variable. the payload is read once, when the snapshot is
+ * taken, and kept up to date after every write. */
+typedef struct boot_rec {
+        char name[9]; /* variable name, e.g. "BootXXXX". */
         int num;
-        unsigned char *data;
-        boot_rec_t *next;
-};
+        uint8_t *data;
+        size_t data_size;
+        uint32_t attrs;
+        uint32_t hash; /* FNV-1a hash of data. */
+} boot_rec_t;
 
+/* snapshot of the boot records, sorted by number. */
 static boot_rec_t *boot_recs;
 static int boot_recs_cnt;
+static int boot_recs_alloc;
+
+/* indices into boot_recs, sorted by payload hash. */
+static int *boot_recs_by_hash;
+
+/* snapshot of the BootOrder variable. */
+static uint16_t *boot_order;
+static size_t boot_order_cnt;
+static uint32_t boot_order_attrs;
 
 static int test_mode = 0;
 
+static int bootvar_get_variable(const char *name, uint8_t **data, size_t *size, uint32_t *attrs)
+{
+        CBM_STATS_ADD(efivar_reads, 1);
+        return cbm_efivar_get_variable(EFI_GLOBAL_GUID, name, data, size, attrs);
+}
+
+/* writes the variable unless current already holds exactly the same payload,
+ * since firmware writes are slow and wear the NVRAM. */
+static int bootvar_set_variable(const char *name, uint8_t *data, size_t size, uint32_t attrs,
+                                const uint8_t *current, size_t current_size)
+{
+        if (current && current_size == size && !memcmp(current, data, size)) {
+                CBM_STATS_ADD(efivar_writes_skipped, 1);
+                return 0;
+        }
+        CBM_STATS_ADD(efivar_writes, 1);
+        return cbm_efivar_set_variable(EFI_GLOBAL_GUID, name, data, size, attrs, 0644);
+}
+
+static uint32_t bootvar_hash(const uint8_t *data, size_t size)
+{
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < size; i++) {
+                hash ^= data[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
 static void bootvar_free_boot_recs(void)
 {
-        boot_rec_t *p, *c;
-        c = boot_recs;
-        if (!c) {
-                return;
+        for (int i = 0; i < boot_recs_cnt; i++) {
+                free(boot_recs[i].data);
         }
+        free(boot_recs);
+        free(boot_recs_by_hash);
+        free(boot_order);
         boot_recs = NULL;
-        do {
-                p = c;
-                c = c->next;
-                free(p);
-        } while (c);
+        boot_recs_by_hash = NULL;
+        boot_order = NULL;
+        boot_recs_cnt = 0;
+        boot_recs_alloc = 0;
+        boot_order_cnt = 0;
+        boot_order_attrs = 0;
 }
 
-static void bootvar_print_boot_recs(void) __attribute__((unused));
-static void bootvar_print_boot_recs(void)
+static int cmp_num(const void *a, const void *b)
 {
-        boot_rec_t *c = boot_recs;
-        if (!c) {
-                return;
+        return ((const boot_rec_t *)a)->num - ((const boot_rec_t *)b)->num;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+        uint32_t ha = boot_recs[*(const int *)a].hash;
+        uint32_t hb = boot_recs[*(const int *)b].hash;
+
+        return (ha > hb) - (ha < hb);
+}
+
+/* rebuilds the hash index, must be called whenever boot_recs changes. */
+static int bootvar_index_boot_recs(void)
+{
+        int *index = NULL;
+
+        if (boot_recs_cnt) {
+                index = (int *)realloc(boot_recs_by_hash, sizeof(int) * (size_t)boot_recs_cnt);
+                if (!index) {
+                        return -EBOOT_VAR_ERR;
+                }
+                for (int i = 0; i < boot_recs_cnt; i++) {
+                        index[i] = i;
+                }
+                boot_recs_by_hash = index;
+                qsort(boot_recs_by_hash, (size_t)boot_recs_cnt, sizeof(int), cmp_hash);
         }
-        do {
-                fprintf(stderr, "Boot record #%d: %s\n", c->num, c->name);
-        } while ((c = c->next));
+        return 0;
 }
 
-/* enumerates boot recs and initializes boot_recs and boot_recs_cnt. */
+/* appends a record to the snapshot, taking ownership of data. the caller is
+ * responsible for restoring the sort order and index. */
+static boot_rec_t *bootvar_append_boot_rec(int num, uint8_t *data, size_t size, uint32_t attrs)
+{
+        boot_rec_t *c;
+
+        if (boot_recs_cnt == boot_recs_alloc) {
+                int alloc = boot_recs_alloc ? boot_recs_alloc * 2 : 16;
+                c = (boot_rec_t *)realloc(boot_recs, sizeof(boot_rec_t) * (size_t)alloc);
+                if (!c) {
+                        return NULL;
+                }
+                boot_recs = c;
+                boot_recs_alloc = alloc;
+        }
+
+        c = &boot_recs[boot_recs_cnt++];
+        memset(c, 0, sizeof(boot_rec_t));
+        snprintf(c->name, sizeof(c->name), "Boot%04X", num);
+        c->num = num;
+        c->data = data;
+        c->data_size = size;
+        c->attrs = attrs;
+        c->hash = bootvar_hash(data, size);
+        return c;
+}
+
+/* reads BootOrder into the snapshot. a missing BootOrder is an empty one. */
+static int bootvar_read_boot_order(void)
+{
+        uint8_t *data = NULL;
+        size_t size = 0;
+        uint32_t attrs = 0;
+
+        if (bootvar_get_variable("BootOrder", &data, &size, &attrs)) {
+                if (errno != ENOENT) {
+                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+                        return -EBOOT_VAR_ERR;
+                }
+                data = NULL;
+                size = 0;
+                attrs = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                        EFI_VARIABLE_RUNTIME_ACCESS;
+        }
+
+        boot_order = (uint16_t *)data;
+        /* read as uint16_t, hence twice less the returned size */
+        boot_order_cnt = size >> 1;
+        boot_order_attrs = attrs;
+        return 0;
+}
+
+/* takes one snapshot of BootOrder and all the Boot#### variables, including
+ * their payloads. all further lookups are served from it. */
 static int bootvar_read_boot_recs(void)
 {
         int res;
+        const efi_guid_t global_guid = EFI_GLOBAL_GUID;
         efi_guid_t *guid = NULL;
         char *name = NULL;
-        boot_rec_t *p = NULL, *c;
-        int i = 0;
 
         bootvar_free_boot_recs();
 
-        while ((res = efi_get_next_variable_name(&guid, &name)) > 0) {
+        while ((res = cbm_efivar_get_next_variable_name(&guid, &name)) > 0) {
                 char *num_end;
                 int num;
+                uint8_t *data = NULL;
+                size_t size = 0;
+                uint32_t attrs = 0;
+
                 if (strncmp(name, "Boot", 4)) {
                         continue;
                 }
@@ -110,242 +226,134 @@ static int bootvar_read_boot_recs(void)
                     !isxdigit(name[7])) {
                         continue;
                 }
-                if (memcmp(guid, &efi_guid_global, sizeof(efi_guid_t))) {
+                if (memcmp(guid, &global_guid, sizeof(efi_guid_t))) {
                         continue;
                 }
-
-                c = (boot_rec_t *)malloc(sizeof(boot_rec_t));
-                memset(c, 0, sizeof(boot_rec_t));
-                c->name = strdup(name);
-                c->num = num;
-                if (!boot_recs) {
-                        boot_recs = p = c;
-                } else {
-                        p->next = c;
-                        p = c;
+                if (bootvar_get_variable(name, &data, &size, &attrs) < 0) {
+                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+                        continue;
+                }
+                if (!bootvar_append_boot_rec(num, data, size, attrs)) {
+                        free(data);
+                        return -EBOOT_VAR_ERR;
                 }
-                i++;
         }
         if (res < 0) {
                 LOG_ERROR("efi_get_next_variable_name() failed: %s", strerror(errno));
                 return -EBOOT_VAR_ERR;
         }
-        boot_recs_cnt = i;
-        return 0;
+
+        if (boot_recs_cnt) {
+                qsort(boot_recs, (size_t)boot_recs_cnt, sizeof(boot_rec_t), cmp_num);
+        }
+        if (bootvar_index_boot_recs() < 0) {
+                return -EBOOT_VAR_ERR;
+        }
+
+        return bootvar_read_boot_order();
 }
 
 /* given the record, puts it first in the boot order (via BootOrder EFI
  * variable). */
-static int bootvar_push_to_boot_order(boot_rec_t *rec)
+static int bootvar_push_to_boot_order(const boot_rec_t *rec)
 {
         uint16_t number;
-        uint16_t *boot_order;
         uint16_t *new_boot_order;
-        size_t boot_order_size;
-        size_t new_boot_order_size;
-        uint32_t boot_order_attrs;
-        unsigned int i;
-        int found = 0;
-
-        if (!rec || !rec->name) {
-                return -EBOOT_VAR_ERR;
-        }
+        size_t new_boot_order_cnt;
+        uint16_t *c;
 
-        if (efi_get_variable(EFI_GLOBAL_GUID,
-                             "BootOrder",
-                             (uint8_t **)&boot_order,
-                             &boot_order_size,
-                             &boot_order_attrs)) {
-                LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+        if (!rec) {
                 return -EBOOT_VAR_ERR;
         }
 
-        sscanf(rec->name, "Boot%04hX", &number);
+        number = (uint16_t)rec->num;
 
-        /* read as uint16_t, hence twice less the returned size */
-        boot_order_size >>= 1;
-
-        for (i = 0; i < boot_order_size; i++) {
-                if (boot_order[i] == number) {
-                        found = 1;
-                        break;
-                }
+        /* room for the record even if it's not in the boot order yet. */
+        new_boot_order = (uint16_t *)malloc((boot_order_cnt + 1) * sizeof(uint16_t));
+        if (!new_boot_order) {
+                return -EBOOT_VAR_ERR;
         }
-
-        if (!found) {
-                new_boot_order_size = boot_order_size + 1;
-                new_boot_order = (uint16_t *)malloc(new_boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                memcpy(new_boot_order + 1, boot_order, boot_order_size * sizeof(uint16_t));
-        } else {
-                uint16_t *c;
-                new_boot_order = (uint16_t *)malloc(boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                c = new_boot_order + 1;
-                for (i = 0; i < boot_order_size; i++) {
-                        if (boot_order[i] != number) {
-                                *c = boot_order[i];
-                                c++;
-                        }
+        new_boot_order[0] = number;
+        c = new_boot_order + 1;
+        for (size_t i = 0; i < boot_order_cnt; i++) {
+                if (boot_order[i] != number) {
+                        *c = boot_order[i];
+                        c++;
                 }
-                new_boot_order_size = (size_t)(c - new_boot_order);
         }
+        new_boot_order_cnt = (size_t)(c - new_boot_order);
 
-        new_boot_order_size <<= 1;
-        if (efi_set_variable(EFI_GLOBAL_GUID,
-                             "BootOrder",
-                             (uint8_t *)new_boot_order,
-                             new_boot_order_size,
-                             boot_order_attrs,
-                             0644)) {
+        /* a no-op when the record is already first. */
+        if (bootvar_set_variable("BootOrder",
+                                 (uint8_t *)new_boot_order,
+                                 new_boot_order_cnt << 1,
+                                 boot_order_attrs,
+                                 (uint8_t *)boot_order,
+                                 boot_order_cnt << 1)) {
                 LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+                free(new_boot_order);
                 return -EBOOT_VAR_ERR;
         }
 
-        return 0;
-}
+        /* keep the snapshot in sync with the firmware. */
+        free(boot_order);
+        boot_order = new_boot_order;
+        boot_order_cnt = new_boot_order_cnt;
 
-static int cmp(const void *a, const void *b)
-{
-        return *((int *)a) - *((int *)b);
+        return 0;
 }
 
 /* finds the first available free number for a boot var. */
 static int bootvar_find_free_no(void)
 {
-        int *nums;
-        int res;
-        int i = 0;
-        boot_rec_t *c = boot_recs;
-        size_t cnt;
-
-        if (!boot_recs) {
-                return -1;
-        }
-        if (!boot_recs_cnt) {
-                return 0; /* no records. */
-        }
-
-        cnt = (size_t)boot_recs_cnt;
-
-        nums = (int *)alloca(sizeof(int) * cnt);
-        memset(nums, 0, sizeof(int) * cnt);
-
-        do {
-                nums[i] = c->num;
-                i++;
-        } while ((c = c->next));
+        int res = 0;
 
-        qsort(nums, cnt, sizeof(int), cmp);
-
-        for (i = 0, res = 0; i < boot_recs_cnt; i++, res++) {
-                if (res < nums[i]) {
+        /* records are sorted by number, the first gap is free. */
+        for (int i = 0; i < boot_recs_cnt; i++, res++) {
+                if (res < boot_recs[i].num) {
                         break;
                 }
         }
-        if (res == nums[boot_recs_cnt - 1]) {
-                res++; /* no gap. */
+        if (res > 0xFFFF) {
+                return -1;
         }
         return res;
 }
 
 /* finds and returns boot rec whose value is data of size. NULL if not found. */
-static boot_rec_t *bootvar_find_boot_rec(uint8_t *data, size_t size)
+static boot_rec_t *bootvar_find_boot_rec(const uint8_t *data, size_t size)
 {
-        boot_rec_t *c = boot_recs;
-        boot_rec_t *res = NULL;
-
-        uint8_t *cdata;
-        size_t csize;
-        uint32_t cattr;
+        uint32_t hash;
+        int lo = 0;
+        int hi = boot_recs_cnt;
 
-        if (!boot_recs || !boot_recs_cnt) {
+        if (!boot_recs_cnt) {
                 return NULL;
         }
 
-        do {
-                if (efi_get_variable(EFI_GLOBAL_GUID, c->name, &cdata, &csize, &cattr) < 0) {
-                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
-                        continue;
-                }
-                if (csize == size && !memcmp(cdata, data, csize)) {
-                        res = c;
-                        break;
-                }
-        } while ((c = c->next));
-
-        return res;
-}
-
-typedef struct part_info {
-        char disk_path[PATH_MAX];
-        int part_no;
-        char part_type[36 + 1]; /* GUID string, hyphen notation */
-} part_info_t;
-
-/* given the location of the ESP mount point, returns the partition information
- * needed to create boot variable which points to that bootloader. */
-static int bootvar_get_part_info(const char *path, part_info_t *pi)
-{
-        blkid_probe probe;
-        blkid_partition part;
-        blkid_partlist parts;
-        struct stat st;
-        dev_t disk_dev;
-        char disk_path[PATH_MAX];
-        const char *part_type;
-
-        if (stat(path, &st)) {
-                LOG_ERROR("stat() failed on %s: %s", path, strerror(errno));
-                return -EBOOT_VAR_ERR;
-        }
-
-        strcpy(disk_path, "/dev/");
-        if (blkid_devno_to_wholedisk(st.st_dev, disk_path + 5, PATH_MAX - 5, &disk_dev)) {
-                LOG_ERROR("blkid_devno_to_wholedisk() error");
-                return -EBOOT_VAR_ERR;
-        }
+        hash = bootvar_hash(data, size);
 
-        if (!(probe = blkid_new_probe_from_filename(disk_path))) {
-                LOG_ERROR("blkid_new_probe_from_filename() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (blkid_probe_enable_partitions(probe, 1)) {
-                LOG_ERROR("blkid_probe_enable_partitions() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (!(parts = blkid_probe_get_partitions(probe))) {
-                LOG_ERROR("blkid_probe_get_partitions() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (!(part = blkid_partlist_devno_to_partition(parts, st.st_dev))) {
-                LOG_ERROR("blkid_partlist_devno_to_partition() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if ((pi->part_no = blkid_partition_get_partno(part)) < 0) {
-                LOG_ERROR("blkid_partition_get_partno() error");
-                return -EBOOT_VAR_ERR;
+        /* lower bound of hash in the index. */
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (boot_recs[boot_recs_by_hash[mid]].hash < hash) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
         }
 
-        part_type = blkid_partition_get_type_string(part);
-        if (!part_type) {
-                LOG_ERROR("blkid_partition_get_type_string() returned NULL");
-                return -EBOOT_VAR_ERR;
-        } else if (strlen(part_type) != 36) {
-                LOG_ERROR("partition type does not seem to be a GUID: %s", part_type);
-                return -EBOOT_VAR_ERR;
+        for (; lo < boot_recs_cnt; lo++) {
+                boot_rec_t *c = &boot_recs[boot_recs_by_hash[lo]];
+                if (c->hash != hash) {
+                        break;
+                }
+                if (c->data_size == size && !memcmp(c->data, data, size)) {
+                        return c;
+                }
         }
 
-        snprintf(pi->disk_path, strlen(disk_path) + 1, "%s", disk_path);
-        snprintf(pi->part_type, 36 + 1, "%s", part_type);
-
-        blkid_free_probe(probe);
-
-        return 0;
+        return NULL;
 }
 
 /* attempts to look up existing record, otherwise creates a new one. */
@@ -355,7 +363,8 @@ static boot_rec_t *bootvar_add_boot_rec(uint8_t *data, size_t len)
         int slot;
         uint32_t attr = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
                         EFI_VARIABLE_RUNTIME_ACCESS;
-        boot_rec_t *c, *res = bootvar_find_boot_rec(data, len);
+        uint8_t *copy = NULL;
+        boot_rec_t *res = bootvar_find_boot_rec(data, len);
 
         if (res) {
                 return res;
@@ -368,79 +377,41 @@ static boot_rec_t *bootvar_add_boot_rec(uint8_t *data, size_t len)
         if (snprintf(name, 9, "Boot%04X", slot) > 8) {
                 return NULL;
         }
-        if (efi_set_variable(EFI_GLOBAL_GUID, name, data, len, attr, 0644) < 0) {
-                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+        copy = (uint8_t *)malloc(len);
+        if (!copy) {
                 return NULL;
         }
-        /* re-read the records and find the variable that was just created. */
-        if (bootvar_read_boot_recs() < 0) {
+        memcpy(copy, data, len);
+        if (bootvar_set_variable(name, data, len, attr, NULL, 0) < 0) {
+                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+                free(copy);
                 return NULL;
         }
-        if (!boot_recs) {
-                return NULL; /* something went terribly wrong. */
-        }
-        c = boot_recs;
-        do {
-                if (!strcmp(c->name, name)) {
-                        res = c;
-                        break;
-                }
-        } while ((c = c->next));
-
-        return res;
-}
-
-/* fills out data based on the partition data (pointed to by esp_mount_path) and
- * the bootloader to use (bootloader_esp_path). data must be pre-allocated. */
-static int bootvar_make_boot_rec_data(const char *esp_mount_path, const char *bootloader_esp_path,
-                                      uint8_t *data, ssize_t *size)
-{
-        part_info_t pi;
-        uint8_t fdev_path[PATH_MAX];
-        long int len;
-
-        if (bootvar_get_part_info(esp_mount_path, &pi)) {
-                return -1;
-        }
-
-        len = efi_generate_file_device_path_from_esp(fdev_path,
-                                                     PATH_MAX,
-                                                     pi.disk_path,
-                                                     pi.part_no,
-                                                     bootloader_esp_path,
-                                                     EFIBOOT_ABBREV_HD);
-        if (len < 0) {
-                LOG_ERROR("efi_generate_file_device_path_from_esp() failed: %s", strerror(errno));
-                return -EBOOT_VAR_ERR;
+        /* update the snapshot in place rather than re-reading all variables. */
+        if (!bootvar_append_boot_rec(slot, copy, len, attr)) {
+                free(copy);
+                return NULL;
         }
-
-        len = efi_loadopt_create(data,
-                                 *size,
-                                 LOAD_OPTION_ACTIVE,
-                                 (void *)fdev_path,
-                                 len,
-                                 (unsigned char *)UEFI_ENTRY_LABEL,
-                                 NULL,
-                                 0);
-        if (len < 0) {
-                LOG_ERROR("efi_loadopt_create() failed: %s", strerror(errno));
-                return -EBOOT_VAR_ERR;
+        qsort(boot_recs, (size_t)boot_recs_cnt, sizeof(boot_rec_t), cmp_num);
+        if (bootvar_index_boot_recs() < 0) {
+                return NULL;
         }
 
-        *size = len;
-        return 0;
+        return bootvar_find_boot_rec(data, len);
 }
 
 int bootvar_has_boot_rec(const char *esp_mount_path, const char *bootloader_esp_path)
 {
         uint8_t data[BOOT_VAR_MAX];
-        ssize_t data_size = BOOT_VAR_MAX;
+        ssize_t data_size;
 
         if (test_mode) {
                 return 1;
         }
 
-        if (bootvar_make_boot_rec_data(esp_mount_path, bootloader_esp_path, data, &data_size)) {
+        data_size = cbm_efivar_make_load_option(esp_mount_path, bootloader_esp_path, data,
+                                                BOOT_VAR_MAX);
+        if (data_size < 0) {
                 return 0;
         }
 
@@ -450,16 +421,19 @@ int bootvar_has_boot_rec(const char *esp_mount_path, const char *bootloader_esp_
 int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path, char *varname,
                    size_t size)
 {
+        CBM_TRACE_SCOPE("bootvar_create");
         uint8_t data[BOOT_VAR_MAX]; /* this is what efivar supports and it should be
                                        enough. */
-        ssize_t data_size = BOOT_VAR_MAX;
-        boot_rec_t *rec;
+        ssize_t data_size;
+        const boot_rec_t *rec;
 
         if (test_mode) {
                 return 0;
         }
 
-        if (bootvar_make_boot_rec_data(esp_mount_path, bootloader_esp_path, data, &data_size)) {
+        data_size = cbm_efivar_make_load_option(esp_mount_path, bootloader_esp_path, data,
+                                                BOOT_VAR_MAX);
+        if (data_size < 0) {
                 return -EBOOT_VAR_ERR;
         }
 
@@ -484,17 +458,151 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
         return 0;
 }
 
-int bootvar_init(void)
+/* the loader variables are only reachable when EFI variables are, or when
+ * something stands in for the firmware. */
+static int bootvar_loader_supported(void)
 {
-        char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
+        const char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
+
+        if (!cbm_efivar_is_default_vtable()) {
+                return 0;
+        }
         if (test_mode_env && !strncmp(test_mode_env, "yes", 4)) {
-                LOG_INFO("EFI variables support is disabled: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
-                test_mode = 1;
+                return -EBOOT_VAR_NOSUP;
+        }
+        if (cbm_efivar_variables_supported() < 0) {
+                return -EBOOT_VAR_NOSUP;
+        }
+        return 0;
+}
+
+int bootvar_get_loader_entry(const char *name, char **entry)
+{
+        uint8_t *data = NULL;
+        size_t size = 0;
+        uint32_t attrs = 0;
+        char *ret = NULL;
+        size_t len = 0;
+        int r;
+
+        r = bootvar_loader_supported();
+        if (r) {
+                return r;
+        }
+
+        CBM_STATS_ADD(efivar_reads, 1);
+        if (cbm_efivar_get_variable(LOADER_GUID, name, &data, &size, &attrs) < 0) {
+                return errno == ENOENT ? -ENOENT : -EBOOT_VAR_ERR;
+        }
+
+        /* UCS-2, NUL terminated. entry ids are plain ASCII file names. */
+        ret = calloc(size / 2 + 1, 1);
+        if (!ret) {
+                r = -EBOOT_VAR_ERR;
+                goto out;
+        }
+        for (size_t i = 0; i + 1 < size; i += 2, len++) {
+                if (data[i + 1] != 0 || data[i] > 0x7f) {
+                        LOG_ERROR("%s holds a non-ASCII entry", name);
+                        free(ret);
+                        ret = NULL;
+                        r = -EBOOT_VAR_ERR;
+                        goto out;
+                }
+                if (data[i] == 0) {
+                        break;
+                }
+                ret[len] = (char)data[i];
+        }
+        *entry = ret;
+
+out:
+        free(data);
+        return r;
+}
+
+int bootvar_set_loader_entry(const char *name, const char *entry)
+{
+        uint8_t data[LOADER_ENTRY_MAX * 2];
+        size_t size = 0;
+        uint32_t attrs = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                         EFI_VARIABLE_RUNTIME_ACCESS;
+        char *current = NULL;
+        int r;
+
+        if (strlen(entry) >= LOADER_ENTRY_MAX) {
+                return -EBOOT_VAR_ERR;
+        }
+
+        r = bootvar_loader_supported();
+        if (r) {
+                return r;
+        }
+
+        if (bootvar_get_loader_entry(name, &current) == 0) {
+                int same = !strcmp(current, entry);
+
+                free(current);
+                if (same) {
+                        CBM_STATS_ADD(efivar_writes_skipped, 1);
+                        return 0;
+                }
         }
+
+        for (const char *c = entry;; c++) {
+                data[size++] = (uint8_t)*c;
+                data[size++] = 0;
+                if (*c == '\0') {
+                        break;
+                }
+        }
+
+        CBM_STATS_ADD(efivar_writes, 1);
+        if (cbm_efivar_set_variable(LOADER_GUID, name, data, size, attrs, 0644) < 0) {
+                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+                return -EBOOT_VAR_ERR;
+        }
+        return 0;
+}
+
+int bootvar_del_loader_entry(const char *name)
+{
+        uint32_t attrs = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                         EFI_VARIABLE_RUNTIME_ACCESS;
+        uint8_t data = 0;
+        char *current = NULL;
+        int r;
+
+        r = bootvar_get_loader_entry(name, &current);
+        if (r == -ENOENT) {
+                return 0;
+        } else if (r) {
+                return r;
+        }
+        free(current);
+
+        /* writing no data deletes the variable, as with SetVariable() */
+        CBM_STATS_ADD(efivar_writes, 1);
+        if (cbm_efivar_set_variable(LOADER_GUID, name, &data, 0, attrs, 0644) < 0 &&
+            errno != ENOENT) {
+                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+                return -EBOOT_VAR_ERR;
+        }
+        return 0;
+}
+
+int bootvar_init(void)
+{
+        CBM_TRACE_SCOPE("bootvar_init");
+        char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
+        /* a stand-in for the firmware is side-effect free already. */
+        test_mode = test_mode_env && !strncmp(test_mode_env, "yes", 4) &&
+                    cbm_efivar_is_default_vtable();
         if (test_mode) {
+                LOG_INFO("EFI variables support is disabled: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
                 return 0;
         }
-        if (efi_variables_supported() < 0) {
+        if (cbm_efivar_variables_supported() < 0) {
                 return -EBOOT_VAR_NOSUP;
         }
         if (bootvar_read_boot_recs() < 0) {
@@ -508,6 +616,10 @@ void bootvar_destroy(void)
         if (test_mode) {
                 return;
         }
+        LOG_DEBUG("EFI variables: %lu reads, %lu writes, %lu writes skipped",
+                  cbm_stats.efivar_reads,
+                  cbm_stats.efivar_writes,
+                  cbm_stats.efivar_writes_skipped);
         bootvar_free_boot_recs();
 }
 
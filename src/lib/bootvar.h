@@ -19,4 +19,13 @@ void bootvar_destroy(void);
 int bootvar_create(const char *, const char *, char *, size_t);
 int bootvar_has_boot_rec(const char *, const char *);
 
+/* read and write the systemd-boot loader variables, such as
+ * LoaderEntryDefault and LoaderEntryOneShot, holding a loader entry id.
+ * these don't need bootvar_init(). returns -ENOENT when the variable isn't
+ * set, and the string returned through entry should be freed. deleting a
+ * variable that isn't set succeeds. */
+int bootvar_get_loader_entry(const char *, char **);
+int bootvar_set_loader_entry(const char *, const char *);
+int bootvar_del_loader_entry(const char *);
+
 /* vim: set nosi noai cin ts=8 sw=8 et tw=80: */
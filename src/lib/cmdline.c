@@ -14,418 +14,785 @@
 #include "cmdline.h"
 #include "config.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
+#include "nica/array.h"
 #include "nica/files.h"
+#include "nica/hashmap.h"
+#include "stats.h"
 #include "util.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
-#include <glob.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
- * Attempt to parse the command line file and add it to the given output file.
- *
- * @Returns negative code if parsing failed, otherwise the number of bytes (>0)
+ * A single kernel parameter within a parsed buffer. Parameters are split on
+ * whitespace outside of double quotes, so 'foo="a b"' is one parameter.
  */
-static int cbm_parse_cmdline_file_internal(const char *path, FILE *out)
+typedef struct CmdlineToken {
+        char *start;  /**<Start of the parameter, not NUL terminated */
+        size_t len;   /**<Length of the parameter */
+        size_t sep;   /**<Whitespace following the parameter in the buffer */
+        bool removed; /**<Dropped by a removal file */
+        bool eol;     /**<Last parameter of its line, joined to the next by one space */
+} CmdlineToken;
+
+typedef struct CmdlineTokens {
+        CmdlineToken *items;
+        size_t len;
+        size_t alloc;
+} CmdlineTokens;
+
+static void cmdline_tokens_free(CmdlineTokens *tokens)
 {
-        autofree(FILE) *f = NULL;
-        size_t sn;
-        ssize_t r = 0;
-        char *buf = NULL;
-        bool ret = true;
-        bool hadcontent = false;
-        int nbytes = 0;
+        free(tokens->items);
+        memset(tokens, 0, sizeof(*tokens));
+}
 
-        f = fopen(path, "r");
-        if (!f) {
-                if (errno != ENOENT) {
-                        LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
+DEF_AUTOFREE(CmdlineTokens, cmdline_tokens_free)
+
+#define CMDLINE_TOKENS_INIT &(CmdlineTokens){ 0 }
+
+static bool cmdline_tokens_add(CmdlineTokens *tokens, char *start, size_t len, size_t sep)
+{
+        if (tokens->len == tokens->alloc) {
+                size_t alloc = tokens->alloc ? tokens->alloc * 2 : 32;
+                CmdlineToken *items = realloc(tokens->items, alloc * sizeof(CmdlineToken));
+                if (!items) {
+                        return false;
                 }
-                return false;
+                tokens->items = items;
+                tokens->alloc = alloc;
         }
 
-        while ((r = getline(&buf, &sn, f)) > 0) {
-                ssize_t cur = 0;
+        tokens->items[tokens->len++] = (CmdlineToken){ start, len, sep, false, false };
+        return true;
+}
 
-                /* Strip newlines */
-                if (r >= 1 && buf[r - 1] == '\n') {
-                        buf[r - 1] = '\0';
-                        --r;
-                }
-                char *l = buf;
+/**
+ * Split the first @len bytes of @s into parameters, appending them to @tokens.
+ * The tokens point into @s, which must outlive them.
+ */
+static bool cmdline_tokenize(char *s, size_t len, CmdlineTokens *tokens)
+{
+        size_t i = 0;
+
+        while (i < len) {
+                size_t start;
+                bool quoted = false;
 
-                /* Skip empty lines */
-                if (r < 1) {
-                        goto next_line;
+                while (i < len && isspace(s[i])) {
+                        ++i;
+                }
+                if (i >= len) {
+                        break;
                 }
 
-                /* Skip the starting whitespace */
-                while (isspace(*l)) {
-                        ++l;
-                        if (!*l) {
-                                break;
+                start = i;
+                while (i < len && (quoted || !isspace(s[i]))) {
+                        if (s[i] == '"') {
+                                quoted = !quoted;
                         }
+                        ++i;
+                }
+
+                size_t end = i;
+                while (i < len && isspace(s[i])) {
+                        ++i;
                 }
 
-                /* Skip a comment */
-                if (l[0] == '#') {
-                        goto next_line;
+                if (!cmdline_tokens_add(tokens, s + start, end - start, i - end)) {
+                        return false;
                 }
+        }
 
-                /* Reset length */
-                cur = (l - buf);
-                r -= cur;
+        /* Trailing whitespace never belongs to the command line */
+        if (tokens->len > 0) {
+                tokens->items[tokens->len - 1].sep = 0;
+        }
 
-                /* Strip trailing whitespace */
-                l = rstrip(l, (size_t *)&r);
+        return true;
+}
 
-                /* May now be an empty line */
-                if (r < 1) {
-                        goto next_line;
+/**
+ * Tokenize configuration file content, skipping lines starting with '#'
+ */
+static bool cmdline_tokenize_text(char *text, CmdlineTokens *tokens)
+{
+        char *line = text;
+
+        while (*line) {
+                char *l = line;
+                char *eol = strchrnul(line, '\n');
+
+                while (l < eol && isspace(*l)) {
+                        ++l;
                 }
 
-                /* For successive new lines, add a space before writing anything. */
-                if (hadcontent) {
-                        if (fwrite(" ", 1, 1, out) != 1) {
-                                ret = false;
-                                break;
+                if (l < eol && *l != '#') {
+                        size_t before = tokens->len;
+
+                        if (!cmdline_tokenize(l, (size_t)(eol - l), tokens)) {
+                                return false;
+                        }
+                        /* Parameters on successive lines are space separated */
+                        if (tokens->len > before) {
+                                tokens->items[tokens->len - 1].eol = true;
                         }
-                        ++nbytes;
                 }
 
-                if (fwrite(l, (size_t)r, 1, out) != 1) {
-                        ret = false;
+                if (!*eol) {
                         break;
                 }
-                nbytes += (int)r;
-
-                hadcontent = true;
-        next_line:
-                free(buf);
-                buf = NULL;
+                line = eol + 1;
         }
 
-        if (buf) {
-                free(buf);
-                buf = NULL;
+        return true;
+}
+
+/**
+ * Join every live token into a new string. Parameters on the same line keep
+ * the whitespace between them as written, lines and files are joined with a
+ * single space.
+ */
+static char *cmdline_tokens_serialize(CmdlineTokens *tokens)
+{
+        CmdlineToken *prev = NULL;
+        size_t total = 0;
+        char *ret = NULL;
+        char *c = NULL;
+
+        for (size_t i = 0; i < tokens->len; i++) {
+                if (!tokens->items[i].removed) {
+                        total += tokens->items[i].len + tokens->items[i].sep + 1;
+                }
         }
 
+        ret = malloc(total + 1);
         if (!ret) {
-                return -1;
+                return NULL;
+        }
+
+        c = ret;
+        for (size_t i = 0; i < tokens->len; i++) {
+                CmdlineToken *t = &tokens->items[i];
+                if (t->removed) {
+                        continue;
+                }
+                if (prev && (prev->eol || prev->sep == 0)) {
+                        *c++ = ' ';
+                } else if (prev) {
+                        memcpy(c, prev->start + prev->len, prev->sep);
+                        c += prev->sep;
+                }
+                memcpy(c, t->start, t->len);
+                c += t->len;
+                prev = t;
         }
-        return nbytes;
+        *c = '\0';
+
+        return ret;
 }
 
 /**
- * Attempt to parse a command line file and remove its content from the out buffer.
+ * Read the whole of @path into a NUL terminated buffer.
  *
- * @Returns negative code if parsing failed, otherwise the new buffer size.
+ * @Returns false if the file could not be read. A missing file is reported
+ * through errno as ENOENT without logging.
  */
-static int cbm_parse_cmdline_file_removal_internal(const char *path, char *out, size_t buflen)
+static bool cmdline_read_file(const char *path, char **out)
 {
-        autofree(FILE) *f = NULL;
-        size_t sn = 0;
-        ssize_t r = 0;
-        size_t sz = 0;
+        struct stat st = { 0 };
         char *buf = NULL;
-        size_t nbytes = buflen;
+        size_t done = 0;
+        int fd = -1;
 
-        /* Cleanup trailing whitespace of out buf */
-        out = rstrip(out, &nbytes);
-
-        f = fopen(path, "r");
-        if (!f) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
                 if (errno != ENOENT) {
                         LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
                 }
-                return -1;
+                return false;
         }
 
-        while ((r = getline(&buf, &sn, f)) > 0) {
-                sz = (size_t)r;
-                char *m = NULL;
+        if (fstat(fd, &st) != 0) {
+                LOG_ERROR("Unable to stat %s: %s", path, strerror(errno));
+                close(fd);
+                return false;
+        }
 
-                /* Strip newlines */
-                if (sz >= 1 && buf[sz - 1] == '\n') {
-                        buf[sz - 1] = '\0';
-                        --sz;
-                }
-                char *l = buf;
+        buf = malloc((size_t)st.st_size + 1);
+        if (!buf) {
+                close(fd);
+                return false;
+        }
 
-                /* Skip empty lines */
-                if (sz < 1) {
-                        goto next_line;
+        while (done < (size_t)st.st_size) {
+                ssize_t r = read(fd, buf + done, (size_t)st.st_size - done);
+                if (r < 0 && errno == EINTR) {
+                        continue;
                 }
-
-                /* Skip the starting whitespace */
-                while (isspace(*l)) {
-                        ++l;
-                        if (!*l) {
-                                break;
-                        }
+                if (r < 0) {
+                        LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                        free(buf);
+                        close(fd);
+                        return false;
                 }
-
-                /* Skip a comment */
-                if (l[0] == '#') {
-                        goto next_line;
+                if (r == 0) {
+                        break;
                 }
+                done += (size_t)r;
+        }
+        buf[done] = '\0';
 
-                /* Reset length */
-                sz = sz - (size_t)(l - buf);
-
-                /* Strip trailing whitespace */
-                l = rstrip(l, &sz);
+        close(fd);
+        *out = buf;
+        return true;
+}
 
-                /* May now be an empty line */
-                if (sz < 1) {
-                        goto next_line;
-                }
+/**
+ * Read and tokenize @path, keeping the buffer alive in @texts.
+ *
+ * @Returns negative code if parsing failed, otherwise the number of parameters
+ */
+static int cmdline_parse_into(const char *path, NcArray *texts, CmdlineTokens *tokens)
+{
+        char *text = NULL;
+        size_t before = tokens->len;
 
-                m = memmem(out, nbytes, l, sz);
-                if (!m) {
-                        goto next_line;
-                }
+        if (!cmdline_read_file(path, &text)) {
+                /* Unreadable files contribute nothing, as before */
+                return 0;
+        }
 
-                /* check match wasn't a substring */
-                if (m[sz] != '\0' && m[sz] != ' ') {
-                        goto next_line;
-                }
+        if (!nc_array_add(texts, text)) {
+                free(text);
+                return -1;
+        }
 
-                /* Given memem matched, check if it matched the entire line */
-                if (sz == nbytes) {
-                        m[0] = '\0';
-                } else {
-                        /* Kill spaces in between options */
-                        if (m[sz] == ' ') {
-                                sz += 1;
-                        }
+        if (!cmdline_tokenize_text(text, tokens)) {
+                return -1;
+        }
 
-                        /* a bit of casting but given memem results we assume:
-                           out <= m && nbytes > sz
-                           this means m - out is the distance from the start
-                           of the string to the start of the match and
-                           nbytes - sz is the length of the characters not
-                           in the match
-                           this leaves rest_len to be the number of characters
-                           that were not in the match minus the characters
-                           before the match as the number of characters needed
-                           to be copied */
-
-                        /* Example:
-                           out = "test cmdline options"
-                           m = "cmdline options"
-                           sz = 8 -> strlen("cmdline ")
-                           nbytes = 20 -> strlen("test cmdline options")
-                           nbytes - sz = 12 -> strlen("test ")
-                           + strlen("options")
-                           m - out = 5 -> 0x5 - 0x0
-                           12 - 5 = 7 -> strlen("options") == rest_len
-                           0x5 + 8 = 13 -> out[13] = 'o'
-                           (next character position in out after m) */
-                        size_t rest_len = (nbytes - sz) - (size_t)(m - out);
-                        (void)memmove(m, m + sz, rest_len);
-                        m[rest_len] = '\0';
-                }
-                nbytes -= sz;
-
-        next_line:
-                free(buf);
-                buf = NULL;
-        }
-
-        if (buf) {
-                free(buf);
-                buf = NULL;
-        }
-
-        return (int)nbytes;
+        return (int)(tokens->len - before);
 }
 
 char *cbm_parse_cmdline_file(const char *file)
 {
-        FILE *memstr = NULL;
-        autofree(char) *buf = NULL;
-        size_t sz = 0;
+        autofree(CmdlineTokens) *tokens = CMDLINE_TOKENS_INIT;
+        autofree(char) *text = NULL;
 
-        memstr = open_memstream(&buf, &sz);
-        if (!memstr) {
-                return NULL;
+        if (!cmdline_read_file(file, &text)) {
+                return strdup("");
         }
-        if (cbm_parse_cmdline_file_internal(file, memstr) < 0) {
-                fclose(memstr);
+        if (!cmdline_tokenize_text(text, tokens)) {
                 return NULL;
         }
-        fclose(memstr);
-        return strdup(buf);
+
+        return cmdline_tokens_serialize(tokens);
 }
 
 /**
- * Determine if there is a version of this file within the /etc/ tree that
- * is "masking" the vendor file (i.e. it has the same name)
+ * A directory listing, read once and sorted by name in the same collation
+ * order glob() would use
  */
-static bool cbm_cmdline_disabled_by_mask(const char *root, char *path)
+typedef struct CmdlineDir {
+        struct dirent **entries;
+        int n_entries;
+} CmdlineDir;
+
+static void cmdline_dir_free(CmdlineDir *dir)
 {
-        autofree(char) *cmp = NULL;
-        autofree(char) *alt_path = NULL;
-        char *bcp = NULL;
+        for (int i = 0; i < dir->n_entries; i++) {
+                free(dir->entries[i]);
+        }
+        free(dir->entries);
+        memset(dir, 0, sizeof(*dir));
+}
 
-        cmp = strdup(path);
-        if (!cmp) {
-                return false;
+DEF_AUTOFREE(CmdlineDir, cmdline_dir_free)
+
+#define CMDLINE_DIR_INIT &(CmdlineDir){ 0 }
+
+/**
+ * Like a "*.conf" glob, hidden entries are never considered
+ */
+static int cmdline_dir_filter(const struct dirent *ent)
+{
+        return ent->d_name[0] != '.';
+}
+
+/**
+ * Read @path once, a missing directory is simply empty
+ */
+static bool cmdline_dir_read(const char *path, CmdlineDir *dir)
+{
+        dir->n_entries = scandir(path, &dir->entries, cmdline_dir_filter, alphasort);
+        if (dir->n_entries < 0) {
+                dir->entries = NULL;
+                dir->n_entries = 0;
+                if (errno != ENOENT && errno != ENOTDIR) {
+                        LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                        return false;
+                }
         }
-        bcp = basename(cmp);
-        if (!bcp) {
-                return false;
+        return true;
+}
+
+/**
+ * Determine if there is an entry of the same name within the /etc/ tree that
+ * is "masking" the vendor file
+ */
+static bool cmdline_dir_contains(CmdlineDir *dir, const char *name)
+{
+        int lo = 0;
+        int hi = dir->n_entries - 1;
+
+        while (lo <= hi) {
+                int mid = lo + (hi - lo) / 2;
+                int c = strcoll(dir->entries[mid]->d_name, name);
+                if (c == 0) {
+                        return streq(dir->entries[mid]->d_name, name);
+                } else if (c < 0) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid - 1;
+                }
         }
 
-        /* Find this path within /etc/ tree */
-        alt_path = string_printf("%s/%s/cmdline.d/%s", root, KERNEL_CONF_DIRECTORY, bcp);
-        return nc_file_exists(alt_path);
+        return false;
 }
 
 /**
- * Glob *.conf files within the given glob, and merge the resulting command
- * line into the final stream
+ * Merge the *.conf files of @dir, in name order, into @tokens.
+ *
+ * Vendor files are masked by an identically named entry in @masks, files
+ * without @masks are disabled by linking them to /dev/null.
  *
  * @Returns negative code if the call failed, or the number of files processed.
  */
-static int cbm_parse_cmdline_files_directory(const char *root, bool bump_start, bool check_masked,
-                                             char *globfile, FILE *memstr)
+static int cbm_parse_cmdline_files_directory(const char *path, CmdlineDir *dir, CmdlineDir *masks,
+                                             NcArray *texts, CmdlineTokens *tokens)
 {
-        glob_t glo = { 0 };
-        glo.gl_offs = 0;
-        glob(globfile, GLOB_DOOFFS, NULL, &glo);
-        int ret = -1;
         size_t true_index = 0;
 
-        for (size_t i = 0; i < glo.gl_pathc; i++) {
-                char *argv = glo.gl_pathv[i];
+        for (int i = 0; i < dir->n_entries; i++) {
+                const struct dirent *ent = dir->entries[i];
+                autofree(char) *argv = NULL;
+                size_t len = strlen(ent->d_name);
                 int r = 0;
 
+                if (len < 5 || !streq(ent->d_name + len - 5, ".conf")) {
+                        continue;
+                }
+
+                argv = string_printf("%s/%s", path, ent->d_name);
+
                 /* If we're in a maskable directory, check if it's masked. */
-                if (check_masked && cbm_cmdline_disabled_by_mask(root, argv)) {
+                if (masks && cmdline_dir_contains(masks, ent->d_name)) {
                         LOG_DEBUG("Skipping masked file: %s", argv);
                         continue;
                 }
 
                 /* If we're not in a maskable, check if it links to /dev/null */
-                if (!check_masked && cbm_path_check(argv, "/dev/null")) {
+                if (!masks && (ent->d_type == DT_LNK || ent->d_type == DT_CHR ||
+                               ent->d_type == DT_UNKNOWN) &&
+                    cbm_path_check(argv, "/dev/null")) {
                         LOG_DEBUG("Skipping disabled cmdline: %s", argv);
                         continue;
                 }
 
-                if (true_index > 0 || bump_start) {
-                        /* add a space between all files, after the first file. */
-                        if (fwrite(" ", 1, 1, memstr) != 1) {
-                                goto clean;
-                        }
-                        if (bump_start) {
-                                bump_start = false;
-                        }
-                }
-
-                r = cbm_parse_cmdline_file_internal(argv, memstr);
+                r = cmdline_parse_into(argv, texts, tokens);
                 if (r < 0) {
-                        goto clean;
+                        return -1;
                 } else if (r > 0) {
-                        /* Prevent accidental spaces for masked or empty files */
                         ++true_index;
                 }
         }
 
         // 0 or more
-        ret = (int)true_index;
+        return (int)true_index;
+}
 
-clean:
-        globfree(&glo);
-        return ret;
+/**
+ * A single removal line. Like the literal match it replaces, each line only
+ * removes the first occurrence of its parameters.
+ */
+typedef struct CmdlineRemoval {
+        bool used;       /**<Already removed its occurrence */
+        char params[];   /**<Parameters joined by newlines */
+} CmdlineRemoval;
+
+static void cmdline_free_candidates(void *v)
+{
+        NcArray *candidates = v;
+        nc_array_free(&candidates, free);
+}
+
+/**
+ * Add every removal line of @path to @removals, keyed by its first parameter.
+ * Each candidate stores its parameters joined by newlines, which can never
+ * appear inside a parameter.
+ */
+static bool cmdline_load_removals(const char *path, NcHashmap *removals)
+{
+        autofree(char) *text = NULL;
+        char *line = NULL;
+
+        if (!cmdline_read_file(path, &text)) {
+                /* Skip files we cannot read, the rest still apply */
+                return true;
+        }
+
+        line = text;
+        while (*line) {
+                autofree(CmdlineTokens) *tokens = CMDLINE_TOKENS_INIT;
+                char *eol = strchrnul(line, '\n');
+                char *l = line;
+
+                while (l < eol && isspace(*l)) {
+                        ++l;
+                }
+
+                if (l < eol && *l != '#') {
+                        NcArray *candidates = NULL;
+                        char *key = NULL;
+                        CmdlineRemoval *candidate = NULL;
+                        char *c = NULL;
+                        size_t total = 0;
+
+                        if (!cmdline_tokenize(l, (size_t)(eol - l), tokens)) {
+                                return false;
+                        }
+
+                        for (size_t i = 0; i < tokens->len; i++) {
+                                total += tokens->items[i].len + 1;
+                        }
+
+                        candidate = malloc(sizeof(CmdlineRemoval) + total);
+                        if (!candidate) {
+                                return false;
+                        }
+                        candidate->used = false;
+                        c = candidate->params;
+                        for (size_t i = 0; i < tokens->len; i++) {
+                                memcpy(c, tokens->items[i].start, tokens->items[i].len);
+                                c += tokens->items[i].len;
+                                *c++ = '\n';
+                        }
+                        *(c - 1) = '\0';
+
+                        key = strndup(tokens->items[0].start, tokens->items[0].len);
+                        if (!key) {
+                                free(candidate);
+                                return false;
+                        }
+
+                        candidates = nc_hashmap_get(removals, key);
+                        if (candidates) {
+                                free(key);
+                        } else {
+                                candidates = nc_array_new();
+                                if (!candidates || !nc_hashmap_put(removals, key, candidates)) {
+                                        free(key);
+                                        free(candidate);
+                                        return false;
+                                }
+                        }
+
+                        if (!nc_array_add(candidates, candidate)) {
+                                free(candidate);
+                                return false;
+                        }
+                }
+
+                if (!*eol) {
+                        break;
+                }
+                line = eol + 1;
+        }
+
+        return true;
+}
+
+/**
+ * Match the newline separated @candidate against the live tokens starting at
+ * @index, returning the index of the last matched token or -1.
+ */
+static ssize_t cmdline_match_candidate(CmdlineTokens *tokens, size_t index, const char *candidate)
+{
+        const char *p = candidate;
+        size_t i = index;
+
+        for (;;) {
+                const char *end = strchrnul(p, '\n');
+                size_t len = (size_t)(end - p);
+
+                while (i < tokens->len && tokens->items[i].removed) {
+                        ++i;
+                }
+                if (i >= tokens->len) {
+                        return -1;
+                }
+                if (tokens->items[i].len != len || memcmp(tokens->items[i].start, p, len) != 0) {
+                        return -1;
+                }
+                if (!*end) {
+                        return (ssize_t)i;
+                }
+
+                p = end + 1;
+                ++i;
+        }
 }
 
 void cbm_parse_cmdline_removal_files_directory(const char *root, char *buffer)
 {
-        glob_t glo = { 0 };
-        autofree(char) *globfile = NULL;
+        autofree(char) *removal_dir = NULL;
+        autofree(CmdlineDir) *dir = CMDLINE_DIR_INIT;
+        autofree(NcHashmap) *removals = NULL;
+        autofree(CmdlineTokens) *tokens = CMDLINE_TOKENS_INIT;
+        char *out = buffer;
+        char *end = buffer;
+
+        removal_dir = string_printf("%s/%s/cmdline-removal.d", root, KERNEL_CONF_DIRECTORY);
+        if (!cmdline_dir_read(removal_dir, dir) || dir->n_entries == 0) {
+                return;
+        }
 
-        glo.gl_offs = 0;
-        size_t sz = strlen(buffer);
-        globfile = string_printf("%s/%s/cmdline-removal.d/*.conf", root, KERNEL_CONF_DIRECTORY);
-        glob(globfile, GLOB_DOOFFS, NULL, &glo);
+        removals =
+            nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, cmdline_free_candidates);
+        if (!removals) {
+                DECLARE_OOM();
+                return;
+        }
 
-        for (size_t i = 0; i < glo.gl_pathc; i++) {
-                char *argv = glo.gl_pathv[i];
-                int r = 0;
+        for (int i = 0; i < dir->n_entries; i++) {
+                const char *name = dir->entries[i]->d_name;
+                autofree(char) *path = NULL;
+                size_t len = strlen(name);
 
-                LOG_DEBUG("Removing cmdline using file: %s", argv);
-                r = cbm_parse_cmdline_file_removal_internal(argv, buffer, sz);
-                if (r < 0) {
+                if (len < 5 || !streq(name + len - 5, ".conf")) {
                         continue;
                 }
-                sz = (size_t)r;
+
+                path = string_printf("%s/%s", removal_dir, name);
+                LOG_DEBUG("Removing cmdline using file: %s", path);
+                if (!cmdline_load_removals(path, removals)) {
+                        DECLARE_OOM();
+                        return;
+                }
+        }
+
+        if (!cmdline_tokenize(buffer, strlen(buffer), tokens)) {
+                DECLARE_OOM();
+                return;
         }
 
-        globfree(&glo);
+        /* One lookup per parameter, whatever the number of removal lines */
+        for (size_t i = 0; i < tokens->len; i++) {
+                CmdlineToken *t = &tokens->items[i];
+                autofree(char) *key = NULL;
+                NcArray *candidates = NULL;
+
+                if (t->removed) {
+                        continue;
+                }
+
+                key = strndup(t->start, t->len);
+                if (!key) {
+                        DECLARE_OOM();
+                        return;
+                }
+
+                candidates = nc_hashmap_get(removals, key);
+                if (!candidates) {
+                        continue;
+                }
+
+                for (int j = 0; j < candidates->len; j++) {
+                        CmdlineRemoval *candidate = nc_array_get(candidates, j);
+                        ssize_t last;
+
+                        if (candidate->used) {
+                                continue;
+                        }
+                        last = cmdline_match_candidate(tokens, i, candidate->params);
+                        if (last < 0) {
+                                continue;
+                        }
+                        for (size_t k = i; k <= (size_t)last; k++) {
+                                tokens->items[k].removed = true;
+                        }
+                        candidate->used = true;
+                        break;
+                }
+        }
+
+        /* Compact in place. A removed parameter takes its trailing space with it,
+         * and nothing is kept after the last parameter left. */
+        for (size_t i = 0; i < tokens->len; i++) {
+                CmdlineToken *t = &tokens->items[i];
+                size_t len = t->len + t->sep;
+
+                if (t->removed) {
+                        continue;
+                }
+                memmove(out, t->start, len);
+                end = out + t->len;
+                out += len;
+        }
+        *end = '\0';
 }
 
 char *cbm_parse_cmdline_files(const char *root)
 {
         autofree(char) *cmdline = NULL;
-        autofree(char) *globfile = NULL;
-        autofree(char) *vendor_glob = NULL;
-        FILE *memstr = NULL;
-        autofree(char) *buf = NULL;
-        bool bump_start = false;
-        int ret = 0;
-        size_t sz = 0;
-
-        bool success = false;
+        autofree(char) *local_dir = NULL;
+        autofree(char) *vendor_dir = NULL;
+        autofree(CmdlineDir) *local = CMDLINE_DIR_INIT;
+        autofree(CmdlineDir) *vendor = CMDLINE_DIR_INIT;
+        autofree(CmdlineTokens) *tokens = CMDLINE_TOKENS_INIT;
+        NcArray *texts = NULL;
+        char *ret = NULL;
 
         /* global cmdline */
         cmdline = string_printf("%s/%s/cmdline", root, KERNEL_CONF_DIRECTORY);
-        globfile = string_printf("%s/%s/cmdline.d/*.conf", root, KERNEL_CONF_DIRECTORY);
-        vendor_glob = string_printf("%s/%s/cmdline.d/*.conf", root, VENDOR_KERNEL_CONF_DIRECTORY);
+        local_dir = string_printf("%s/%s/cmdline.d", root, KERNEL_CONF_DIRECTORY);
+        vendor_dir = string_printf("%s/%s/cmdline.d", root, VENDOR_KERNEL_CONF_DIRECTORY);
+
+        /* Each directory is listed once, /etc doubles as the mask set */
+        if (!cmdline_dir_read(local_dir, local) || !cmdline_dir_read(vendor_dir, vendor)) {
+                return NULL;
+        }
 
-        memstr = open_memstream(&buf, &sz);
-        if (!memstr) {
+        texts = nc_array_new();
+        if (!texts) {
                 return NULL;
         }
 
         /* Merge vendor cmdline.d files if present */
-        ret = cbm_parse_cmdline_files_directory(root, bump_start, true, vendor_glob, memstr);
-        bump_start = ret >= 1;
-        if (ret < 0) {
+        if (cbm_parse_cmdline_files_directory(vendor_dir, vendor, local, texts, tokens) < 0) {
                 goto clean;
         }
 
         /* If the local system cmdline exists, merge it it */
-        if (nc_file_exists(cmdline)) {
-                /* Add a space after the vendor files */
-                if (bump_start && fwrite(" ", 1, 1, memstr) != 1) {
-                        goto clean;
-                }
-                ret = cbm_parse_cmdline_file_internal(cmdline, memstr);
-                if (ret < 0) {
-                        goto clean;
-                } else if (ret > 0) {
-                        /* Might not have had vendor files */
-                        bump_start = true;
-                }
+        if (cmdline_parse_into(cmdline, texts, tokens) < 0) {
+                goto clean;
         }
 
         /* Merge system cmdline.d files if present */
-        if (cbm_parse_cmdline_files_directory(root, bump_start, false, globfile, memstr) < 0) {
+        if (cbm_parse_cmdline_files_directory(local_dir, local, NULL, texts, tokens) < 0) {
                 goto clean;
         }
-        success = true;
+
+        ret = cmdline_tokens_serialize(tokens);
 
 clean:
-        fclose(memstr);
-        if (success) {
-                return strdup(buf);
+        nc_array_free(&texts, free);
+        return ret;
+}
+
+/**
+ * FNV-1a over @len bytes of @data, continuing from @hash
+ */
+static uint64_t cmdline_stamp_mix(uint64_t hash, const void *data, size_t len)
+{
+        const unsigned char *c = data;
+
+        for (size_t i = 0; i < len; i++) {
+                hash ^= c[i];
+                hash *= 1099511628211ULL;
         }
-        return NULL;
+
+        return hash;
+}
+
+static uint64_t cmdline_stamp_stat(uint64_t hash, const struct stat *st)
+{
+        hash = cmdline_stamp_mix(hash, &st->st_dev, sizeof(st->st_dev));
+        hash = cmdline_stamp_mix(hash, &st->st_ino, sizeof(st->st_ino));
+        hash = cmdline_stamp_mix(hash, &st->st_size, sizeof(st->st_size));
+        hash = cmdline_stamp_mix(hash, &st->st_mtim, sizeof(st->st_mtim));
+        return cmdline_stamp_mix(hash, &st->st_ctim, sizeof(st->st_ctim));
+}
+
+static uint64_t cmdline_stamp_path(uint64_t hash, const char *path)
+{
+        struct stat st = { 0 };
+
+        hash = cmdline_stamp_mix(hash, path, strlen(path) + 1);
+        if (cbm_fs_stat(path, &st) != 0) {
+                /* Absence is part of the stamp too */
+                return cmdline_stamp_mix(hash, "-", 1);
+        }
+        return cmdline_stamp_stat(hash, &st);
+}
+
+/**
+ * Stamp a directory and every entry within it. Editing a file in place does
+ * not touch the directory, so each entry is stat'ed too. Entries are summed
+ * so that readdir order does not matter.
+ */
+static uint64_t cmdline_stamp_dir(uint64_t hash, const char *path)
+{
+        CbmFsDir *dir = NULL;
+        struct dirent *ent = NULL;
+        uint64_t entries = 0;
+
+        hash = cmdline_stamp_path(hash, path);
+
+        CBM_STATS_ADD(dir_scans, 1);
+        dir = cbm_fs_opendir(path);
+        if (!dir) {
+                return hash;
+        }
+
+        while ((ent = cbm_fs_readdir(dir)) != NULL) {
+                autofree(char) *entry = NULL;
+                struct stat st = { 0 };
+                uint64_t h = 14695981039346656037ULL;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+
+                h = cmdline_stamp_mix(h, ent->d_name, strlen(ent->d_name) + 1);
+                /* Follow links, the target content is what gets parsed */
+                entry = string_printf("%s/%s", path, ent->d_name);
+                if (cbm_fs_stat(entry, &st) == 0) {
+                        h = cmdline_stamp_stat(h, &st);
+                }
+                entries += h;
+        }
+
+        cbm_fs_closedir(dir);
+        return cmdline_stamp_mix(hash, &entries, sizeof(entries));
+}
+
+uint64_t cbm_cmdline_sources_stamp(const char *root)
+{
+        autofree(char) *cmdline = NULL;
+        autofree(char) *local_dir = NULL;
+        autofree(char) *vendor_dir = NULL;
+        autofree(char) *removal_dir = NULL;
+        uint64_t hash = 14695981039346656037ULL;
+
+        cmdline = string_printf("%s/%s/cmdline", root, KERNEL_CONF_DIRECTORY);
+        local_dir = string_printf("%s/%s/cmdline.d", root, KERNEL_CONF_DIRECTORY);
+        vendor_dir = string_printf("%s/%s/cmdline.d", root, VENDOR_KERNEL_CONF_DIRECTORY);
+        removal_dir = string_printf("%s/%s/cmdline-removal.d", root, KERNEL_CONF_DIRECTORY);
+
+        hash = cmdline_stamp_path(hash, cmdline);
+        hash = cmdline_stamp_dir(hash, local_dir);
+        hash = cmdline_stamp_dir(hash, vendor_dir);
+        return cmdline_stamp_dir(hash, removal_dir);
 }
 
 /*
@@ -14,6 +14,7 @@
 #define _GNU_SOURCE
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * Parse all user & cmdline files within the root prefix, and merge them
@@ -36,6 +37,13 @@ char *cbm_parse_cmdline_file(const char *file);
  */
 void cbm_parse_cmdline_removal_files_directory(const char *root, char *buffer);
 
+/**
+ * Compute a stamp over every source of the merged command line within root,
+ * i.e. the global cmdline file and the cmdline.d and cmdline-removal.d trees.
+ * Any change to their names, sizes or timestamps yields a different stamp.
+ */
+uint64_t cbm_cmdline_sources_stamp(const char *root);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
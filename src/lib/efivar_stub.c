@@ -0,0 +1,296 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#include "efivar_stub.h"
+
+#include <assert.h>
+#include <blkid.h>
+#include <config.h>
+#include <efiboot.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "library.h"
+#include "log.h"
+#include "stats.h"
+
+static CbmLibrary libefivar = CBM_LIBRARY_INIT("libefivar.so.1");
+static CbmLibrary libefiboot = CBM_LIBRARY_INIT("libefiboot.so.1");
+
+/**
+ * libefivar is only loaded on first use, so each default op resolves its
+ * symbol the first time it is called and fails gracefully when the library
+ * cannot be loaded.
+ */
+#define CBM_EFIVAR_LAZY(ret, fn, args, ...)                                                        \
+        static ret lazy_##fn args                                                                  \
+        {                                                                                          \
+                static __typeof__(fn) *fn##_ptr = NULL;                                            \
+                if (!CBM_LIBRARY_BIND(&libefivar, fn##_ptr, #fn)) {                                \
+                        errno = ENOSYS;                                                            \
+                        return -1;                                                                 \
+                }                                                                                  \
+                return fn##_ptr(__VA_ARGS__);                                                      \
+        }
+
+CBM_EFIVAR_LAZY(int, efi_get_variable,
+                (efi_guid_t guid, const char *name, uint8_t **data, size_t *size, uint32_t *attrs),
+                guid, name, data, size, attrs)
+CBM_EFIVAR_LAZY(int, efi_set_variable,
+                (efi_guid_t guid, const char *name, uint8_t *data, size_t size, uint32_t attrs,
+                 mode_t mode),
+                guid, name, data, size, attrs, mode)
+CBM_EFIVAR_LAZY(int, efi_get_next_variable_name, (efi_guid_t * *guid, char **name), guid, name)
+
+static int lazy_efi_variables_supported(void)
+{
+        static __typeof__(efi_variables_supported) *efi_variables_supported_ptr = NULL;
+
+        if (!CBM_LIBRARY_BIND(&libefivar, efi_variables_supported_ptr, "efi_variables_supported")) {
+                return -1;
+        }
+        return efi_variables_supported_ptr();
+}
+
+/**
+ * Partition and disk functions needed for building a load option, resolved
+ * together on first use.
+ */
+static struct {
+        __typeof__(efi_generate_file_device_path_from_esp) *efi_generate_file_device_path_from_esp;
+        __typeof__(efi_loadopt_create) *efi_loadopt_create;
+        __typeof__(blkid_devno_to_wholedisk) *blkid_devno_to_wholedisk;
+        __typeof__(blkid_new_probe_from_filename) *blkid_new_probe_from_filename;
+        __typeof__(blkid_probe_enable_partitions) *blkid_probe_enable_partitions;
+        __typeof__(blkid_probe_get_partitions) *blkid_probe_get_partitions;
+        __typeof__(blkid_partlist_devno_to_partition) *blkid_partlist_devno_to_partition;
+        __typeof__(blkid_partition_get_partno) *blkid_partition_get_partno;
+        __typeof__(blkid_partition_get_type_string) *blkid_partition_get_type_string;
+        __typeof__(blkid_free_probe) *blkid_free_probe;
+} lib;
+
+#define EFIVAR_BIND(l, f) CBM_LIBRARY_BIND((l), lib.f, #f)
+
+static bool efivar_load_libraries(void)
+{
+        return EFIVAR_BIND(&libefiboot, efi_generate_file_device_path_from_esp) &&
+               EFIVAR_BIND(&libefiboot, efi_loadopt_create) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_devno_to_wholedisk) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_new_probe_from_filename) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_probe_enable_partitions) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_probe_get_partitions) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_partlist_devno_to_partition) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_partition_get_partno) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_partition_get_type_string) &&
+               EFIVAR_BIND(&cbm_libblkid, blkid_free_probe);
+}
+
+typedef struct part_info {
+        char disk_path[PATH_MAX];
+        int part_no;
+        char part_type[36 + 1]; /* GUID string, hyphen notation */
+} part_info_t;
+
+/* given the location of the ESP mount point, returns the partition information
+ * needed to create boot variable which points to that bootloader. */
+static int efivar_get_part_info(const char *path, part_info_t *pi)
+{
+        blkid_probe probe;
+        blkid_partition part;
+        blkid_partlist parts;
+        struct stat st;
+        dev_t disk_dev;
+        char disk_path[PATH_MAX];
+        const char *part_type;
+
+        if (stat(path, &st)) {
+                LOG_ERROR("stat() failed on %s: %s", path, strerror(errno));
+                return -1;
+        }
+
+        strcpy(disk_path, "/dev/");
+        if (lib.blkid_devno_to_wholedisk(st.st_dev, disk_path + 5, PATH_MAX - 5, &disk_dev)) {
+                LOG_ERROR("blkid_devno_to_wholedisk() error");
+                return -1;
+        }
+
+        CBM_STATS_ADD(probes, 1);
+        if (!(probe = lib.blkid_new_probe_from_filename(disk_path))) {
+                LOG_ERROR("blkid_new_probe_from_filename() error");
+                return -1;
+        }
+
+        if (lib.blkid_probe_enable_partitions(probe, 1)) {
+                LOG_ERROR("blkid_probe_enable_partitions() error");
+                return -1;
+        }
+
+        if (!(parts = lib.blkid_probe_get_partitions(probe))) {
+                LOG_ERROR("blkid_probe_get_partitions() error");
+                return -1;
+        }
+
+        if (!(part = lib.blkid_partlist_devno_to_partition(parts, st.st_dev))) {
+                LOG_ERROR("blkid_partlist_devno_to_partition() error");
+                return -1;
+        }
+
+        if ((pi->part_no = lib.blkid_partition_get_partno(part)) < 0) {
+                LOG_ERROR("blkid_partition_get_partno() error");
+                return -1;
+        }
+
+        part_type = lib.blkid_partition_get_type_string(part);
+        if (!part_type) {
+                LOG_ERROR("blkid_partition_get_type_string() returned NULL");
+                return -1;
+        } else if (strlen(part_type) != 36) {
+                LOG_ERROR("partition type does not seem to be a GUID: %s", part_type);
+                return -1;
+        }
+
+        snprintf(pi->disk_path, strlen(disk_path) + 1, "%s", disk_path);
+        snprintf(pi->part_type, 36 + 1, "%s", part_type);
+
+        lib.blkid_free_probe(probe);
+
+        return 0;
+}
+
+/* fills out data based on the partition data (pointed to by esp_mount_path) and
+ * the bootloader to use (bootloader_esp_path). */
+static ssize_t efivar_make_load_option(const char *esp_mount_path,
+                                       const char *bootloader_esp_path, uint8_t *data,
+                                       size_t size)
+{
+        part_info_t pi;
+        uint8_t fdev_path[PATH_MAX];
+        ssize_t len;
+
+        if (!efivar_load_libraries()) {
+                return -1;
+        }
+
+        if (efivar_get_part_info(esp_mount_path, &pi)) {
+                return -1;
+        }
+
+        len = lib.efi_generate_file_device_path_from_esp(fdev_path,
+                                                         PATH_MAX,
+                                                         pi.disk_path,
+                                                         pi.part_no,
+                                                         bootloader_esp_path,
+                                                         EFIBOOT_ABBREV_HD);
+        if (len < 0) {
+                LOG_ERROR("efi_generate_file_device_path_from_esp() failed: %s", strerror(errno));
+                return -1;
+        }
+
+        len = lib.efi_loadopt_create(data,
+                                     (ssize_t)size,
+                                     LOAD_OPTION_ACTIVE,
+                                     (void *)fdev_path,
+                                     len,
+                                     (unsigned char *)UEFI_ENTRY_LABEL,
+                                     NULL,
+                                     0);
+        if (len < 0) {
+                LOG_ERROR("efi_loadopt_create() failed: %s", strerror(errno));
+                return -1;
+        }
+
+        return len;
+}
+
+/**
+ * Default vtable passes through to libefivar and libefiboot
+ */
+static CbmEfivarOps default_efivar_ops = {
+        .variables_supported = lazy_efi_variables_supported,
+        .get_variable = lazy_efi_get_variable,
+        .set_variable = lazy_efi_set_variable,
+        .get_next_variable_name = lazy_efi_get_next_variable_name,
+        .make_load_option = efivar_make_load_option,
+};
+
+/**
+ * Pointer to the currently active vtable
+ */
+static CbmEfivarOps *efivar_ops = &default_efivar_ops;
+
+void cbm_efivar_reset_vtable(void)
+{
+        efivar_ops = &default_efivar_ops;
+}
+
+bool cbm_efivar_is_default_vtable(void)
+{
+        return efivar_ops == &default_efivar_ops;
+}
+
+void cbm_efivar_set_vtable(CbmEfivarOps *ops)
+{
+        if (!ops) {
+                cbm_efivar_reset_vtable();
+        } else {
+                efivar_ops = ops;
+        }
+        /* Ensure the vtable is valid at this point. */
+        assert(efivar_ops->variables_supported != NULL);
+        assert(efivar_ops->get_variable != NULL);
+        assert(efivar_ops->set_variable != NULL);
+        assert(efivar_ops->get_next_variable_name != NULL);
+        assert(efivar_ops->make_load_option != NULL);
+}
+
+int cbm_efivar_variables_supported(void)
+{
+        return efivar_ops->variables_supported();
+}
+
+int cbm_efivar_get_variable(efi_guid_t guid, const char *name, uint8_t **data, size_t *size,
+                            uint32_t *attrs)
+{
+        return efivar_ops->get_variable(guid, name, data, size, attrs);
+}
+
+int cbm_efivar_set_variable(efi_guid_t guid, const char *name, uint8_t *data, size_t size,
+                            uint32_t attrs, mode_t mode)
+{
+        return efivar_ops->set_variable(guid, name, data, size, attrs, mode);
+}
+
+int cbm_efivar_get_next_variable_name(efi_guid_t **guid, char **name)
+{
+        return efivar_ops->get_next_variable_name(guid, name);
+}
+
+ssize_t cbm_efivar_make_load_option(const char *esp_mount_path, const char *bootloader_esp_path,
+                                    uint8_t *data, size_t size)
+{
+        return efivar_ops->make_load_option(esp_mount_path, bootloader_esp_path, data, size);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,98 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+/* Workaround for using --std=c11 in CBM. Provide "relaxed" defines which efivar
+ * expects. */
+#define BYTE_ORDER __BYTE_ORDER
+#define LITTLE_ENDIAN __LITTLE_ENDIAN
+#define BIG_ENDIAN __BIG_ENDIAN
+
+#include <efivar.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Defines the vtable used for all EFI variable operations within
+ * clr-boot-manager, so that the firmware can be stood in for. The default
+ * internal vtable will pass through all operations to libefivar and
+ * libefiboot, loading them on first use.
+ *
+ * The variable functions behave as their libefivar namesakes, returning a
+ * negative value and setting errno on failure.
+ */
+typedef struct CbmEfivarOps {
+        /* Variable store */
+        int (*variables_supported)(void);
+        int (*get_variable)(efi_guid_t guid, const char *name, uint8_t **data, size_t *size,
+                            uint32_t *attrs);
+        int (*set_variable)(efi_guid_t guid, const char *name, uint8_t *data, size_t size,
+                            uint32_t attrs, mode_t mode);
+        int (*get_next_variable_name)(efi_guid_t **guid, char **name);
+
+        /**
+         * Build the EFI_LOAD_OPTION payload of a Boot#### variable starting
+         * @bootloader_esp_path on the ESP mounted at @esp_mount_path into
+         * @data. Returns its length, or a negative value on failure.
+         */
+        ssize_t (*make_load_option)(const char *esp_mount_path, const char *bootloader_esp_path,
+                                    uint8_t *data, size_t size);
+} CbmEfivarOps;
+
+/**
+ * Reset the EFI variable vtable
+ */
+void cbm_efivar_reset_vtable(void);
+
+/**
+ * Set the vfunc table used for all EFI variable operations within
+ * clr-boot-manager
+ *
+ * @note Passing null has the same effect as calling cbm_efivar_reset_vtable
+ * The vtable will be checked to ensure that it is valid at this point, so
+ * only call this when the vtable is fully populated.
+ */
+void cbm_efivar_set_vtable(CbmEfivarOps *ops);
+
+/**
+ * Returns true if the default libefivar vtable is in use
+ */
+bool cbm_efivar_is_default_vtable(void);
+
+/**
+ * Wrappers for the vtable functions
+ */
+int cbm_efivar_variables_supported(void);
+int cbm_efivar_get_variable(efi_guid_t guid, const char *name, uint8_t **data, size_t *size,
+                            uint32_t *attrs);
+int cbm_efivar_set_variable(efi_guid_t guid, const char *name, uint8_t *data, size_t size,
+                            uint32_t attrs, mode_t mode);
+int cbm_efivar_get_next_variable_name(efi_guid_t **guid, char **name);
+ssize_t cbm_efivar_make_load_option(const char *esp_mount_path, const char *bootloader_esp_path,
+                                    uint8_t *data, size_t size);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
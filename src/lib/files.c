@@ -23,17 +23,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
 
-#include "blkid_stub.h"
 #include "files.h"
+#include "fs_stub.h"
 #include "log.h"
 #include "nica/files.h"
+#include "stats.h"
 #include "system_stub.h"
+#include "topology.h"
+#include "trace.h"
 #include "util.h"
 
 /**
@@ -49,13 +50,16 @@ static bool cbm_should_sync = true;
 
 void cbm_sync(void)
 {
+        CBM_TRACE_SCOPE("sync");
+        CBM_STATS_ADD(syncs, 1);
         if (cbm_should_sync) {
-                sync();
+                cbm_fs_sync();
         }
 }
 
 bool cbm_files_match(const char *p1, const char *p2)
 {
+        CBM_TRACE_SCOPE("files_match");
         autofree(CbmMappedFile) *m1 = CBM_MAPPED_FILE_INIT;
         autofree(CbmMappedFile) *m2 = CBM_MAPPED_FILE_INIT;
 
@@ -73,7 +77,9 @@ bool cbm_files_match(const char *p1, const char *p2)
         }
 
         /* Compare both buffers */
+        CBM_STATS_ADD(bytes_compared, m1->length * 2);
         if (memcmp(m1->buffer, m2->buffer, m1->length) == 0) {
+                CBM_STATS_ADD(files_skipped, 1);
                 return true;
         }
         return false;
@@ -149,24 +155,25 @@ next:
 }
 
 /**
- * Use libblkid to determine the parent disk for the given path,
- * in order to facilitate partition enumeration
+ * Determine the parent disk for the given path through the topology cache,
+ * optionally with its partition table, to facilitate partition enumeration
  */
-static bool get_parent_disk_devno(char *path, dev_t *diskdevno)
+static const CbmTopologyDevice *get_parent_disk_topology(const char *path, bool table)
 {
         struct stat st = { 0 };
-        dev_t ret;
+        const CbmTopologyDevice *disk = NULL;
 
         if (stat(path, &st) != 0) {
-                return false;
+                return NULL;
         }
 
-        if (cbm_blkid_devno_to_wholedisk(st.st_dev, NULL, 0, &ret) < 0) {
+        disk = cbm_topology_get_parent(st.st_dev);
+        if (!disk) {
                 LOG_ERROR("Invalid block device: %s", path);
-                return false;
+                return NULL;
         }
-        *diskdevno = ret;
-        return true;
+
+        return table ? cbm_topology_get_table(st.st_dev) : disk;
 }
 
 bool cbm_file_has_content(char *path)
@@ -175,76 +182,50 @@ bool cbm_file_has_content(char *path)
         struct stat st = { 0 };
         ssize_t length = -1;
 
-        if (!nc_file_exists(path)) {
+        if (!cbm_fs_exists(path)) {
                 return false;
         }
 
-        fd = open(path, O_RDONLY);
+        fd = cbm_fs_open(path, O_RDONLY, 0);
         if (fd < 0) {
                 return false;
         }
 
-        if (fstat(fd, &st) != 0) {
-                close(fd);
+        if (cbm_fs_fstat(fd, &st) != 0) {
+                cbm_fs_close(fd);
                 return false;
         }
 
         length = st.st_size;
-        close(fd);
+        cbm_fs_close(fd);
 
         return length != 0;
 }
 
 char *get_parent_disk(char *path)
 {
-        dev_t devt;
-        autofree(char) *node = NULL;
-        const char *devfs = cbm_system_get_devfs_path();
-
-        if (!get_parent_disk_devno(path, &devt)) {
-                return NULL;
-        }
+        const CbmTopologyDevice *disk = get_parent_disk_topology(path, false);
 
-        node = string_printf("%s/block/%u:%u", devfs, major(devt), minor(devt));
-        return realpath(node, NULL);
+        return disk ? strdup(disk->devpath) : NULL;
 }
 
 int get_partition_index(const char *path, const char *devnode)
 {
-        autofree(char) *parent_disk = NULL;
+        const CbmTopologyDevice *disk = NULL;
         autofree(char) *devnode_rpath = NULL;
-        blkid_partlist parts = NULL;
-        blkid_probe probe = NULL;
         const char *devfs = NULL;
-        int part_count = 0;
-        int ret = -1;
 
-        parent_disk = get_parent_disk((char *)path);
-        if (!parent_disk) {
-                LOG_ERROR("Failed to get parent disk");
-                return ret;
-        }
-
-        probe = cbm_blkid_new_probe_from_filename(parent_disk);
-        if (!probe) {
-                LOG_ERROR("Unable to blkid probe %s", parent_disk);
-                return ret;
-        }
-
-        parts = cbm_blkid_probe_get_partitions(probe);
-
-        part_count = cbm_blkid_partlist_numof_partitions(parts);
-        if (part_count <= 0) {
+        disk = get_parent_disk_topology(path, true);
+        if (!disk) {
                 LOG_ERROR("Invalid partition list");
-                goto clean;
+                return -1;
         }
 
         devfs = cbm_system_get_devfs_path();
         devnode_rpath = realpath(devnode, NULL);
 
-        for (int i = 0; i < part_count; i++) {
-                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
-                const char *part_id = cbm_blkid_partition_get_uuid(part);
+        for (int i = 0; i < disk->n_partitions; i++) {
+                const char *part_id = disk->partitions[i].part_uuid;
                 autofree(char) *pt_path = NULL;
                 autofree(char) *rpath = NULL;
 
@@ -257,82 +238,60 @@ int get_partition_index(const char *path, const char *devnode)
                 rpath = realpath(pt_path, NULL);
 
                 if (strncmp(devnode_rpath, rpath, strlen(devnode)) == 0) {
-                        ret = i;
-                        break;
+                        return i;
                 }
         }
 
- clean:
-        cbm_blkid_free_probe(probe);
-        return ret;
+        return -1;
 }
 
 char *get_legacy_boot_device(char *path)
 {
-        blkid_probe probe = NULL;
-        blkid_partlist parts = NULL;
-        int part_count = 0;
-        char *ret = NULL;
-        autofree(char) *parent_disk = NULL;
+        const CbmTopologyDevice *disk = NULL;
         const char *devfs = cbm_system_get_devfs_path();
 
-        parent_disk = get_parent_disk(path);
-        if (!parent_disk) {
+        disk = get_parent_disk_topology(path, true);
+        if (!disk || !disk->table_safe) {
                 return NULL;
         }
 
-        probe = cbm_blkid_new_probe_from_filename(parent_disk);
-        if (!probe) {
-                LOG_ERROR("Unable to blkid probe %s", parent_disk);
-                return NULL;
-        }
-
-        cbm_blkid_probe_enable_superblocks(probe, 1);
-        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
-        cbm_blkid_probe_enable_partitions(probe, 1);
-        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
-
-        if (cbm_blkid_do_safeprobe(probe) != 0) {
-                LOG_ERROR("Error probing filesystem of %s: %s", parent_disk, strerror(errno));
-                goto clean;
-        }
-
-        parts = cbm_blkid_probe_get_partitions(probe);
-
-        part_count = cbm_blkid_partlist_numof_partitions(parts);
-        if (part_count <= 0) {
-                /* No partitions */
-                goto clean;
-        }
-
-        for (int i = 0; i < part_count; i++) {
-                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
+        for (int i = 0; i < disk->n_partitions; i++) {
                 const char *part_id = NULL;
-                unsigned long long flags;
                 autofree(char) *pt_path = NULL;
 
-                flags = cbm_blkid_partition_get_flags(part);
-                if (flags & CBM_MBR_BOOT_FLAG) {
-                        part_id = cbm_blkid_partition_get_uuid(part);
+                if (disk->partitions[i].flags & CBM_MBR_BOOT_FLAG) {
+                        part_id = disk->partitions[i].part_uuid;
                         if (!part_id) {
                                 LOG_ERROR("Not a valid GPT disk");
-                                goto clean;
+                                return NULL;
                         }
                         pt_path = string_printf("%s/disk/by-partuuid/%s", devfs, part_id);
-                        ret = realpath(pt_path, NULL);
-                        break;
+                        return realpath(pt_path, NULL);
                 }
         }
 
-clean:
-        cbm_blkid_free_probe(probe);
-        errno = 0;
-        return ret;
+        return NULL;
+}
+
+bool get_partition_legacy_boot(const char *path, int index)
+{
+        const CbmTopologyDevice *disk = NULL;
+
+        disk = get_parent_disk_topology(path, true);
+        if (!disk || !disk->table_safe) {
+                return false;
+        }
+
+        if (index < 0 || index >= disk->n_partitions) {
+                return false;
+        }
+
+        return (disk->partitions[index].flags & CBM_MBR_BOOT_FLAG) == CBM_MBR_BOOT_FLAG;
 }
 
 char *cbm_get_file_parent(const char *p)
 {
-        char *r = realpath(p, NULL);
+        char *r = cbm_fs_realpath(p);
         if (!r) {
                 return NULL;
         }
@@ -344,12 +303,12 @@ bool file_set_text(const char *path, char *text)
         FILE *fp = NULL;
         bool ret = false;
 
-        if (nc_file_exists(path) && unlink(path) < 0) {
+        if (cbm_fs_exists(path) && cbm_fs_unlink(path) < 0) {
                 return false;
         }
         cbm_sync();
 
-        fp = fopen(path, "w");
+        fp = cbm_fs_fopen(path, "w");
 
         if (!fp) {
                 goto end;
@@ -358,6 +317,7 @@ bool file_set_text(const char *path, char *text)
         if (fprintf(fp, "%s", text) < 0) {
                 goto end;
         }
+        CBM_STATS_ADD(bytes_written, strlen(text));
         ret = true;
 end:
         if (fp) {
@@ -368,6 +328,58 @@ end:
         return ret;
 }
 
+/**
+ * Flush @fd to disk, unless syncing has been turned off
+ */
+static bool cbm_fsync(int fd)
+{
+        CBM_STATS_ADD(syncs, 1);
+        if (!cbm_should_sync) {
+                return true;
+        }
+        return cbm_fs_fsync(fd) == 0;
+}
+
+bool file_set_text_durable(const char *path, const char *text)
+{
+        CBM_TRACE_SCOPE("set_text_durable");
+        autofree(char) *new_name = NULL;
+        autofree(char) *parent = NULL;
+        size_t len = strlen(text);
+        ssize_t written;
+        int fd;
+
+        new_name = string_printf("%s.TmpWrite", path);
+
+        fd = cbm_fs_open(new_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        written = cbm_fs_write(fd, text, len);
+        if (written < 0 || (size_t)written != len || !cbm_fsync(fd)) {
+                cbm_fs_close(fd);
+                (void)cbm_fs_unlink(new_name);
+                return false;
+        }
+        cbm_fs_close(fd);
+        CBM_STATS_ADD(bytes_written, len);
+
+        if (cbm_fs_rename(new_name, path) != 0) {
+                (void)cbm_fs_unlink(new_name);
+                return false;
+        }
+
+        /* Make the rename itself stick */
+        parent = cbm_get_file_parent(path);
+        fd = parent ? cbm_fs_open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0) : -1;
+        if (fd >= 0) {
+                (void)cbm_fsync(fd);
+                cbm_fs_close(fd);
+        }
+
+        return true;
+}
+
 bool file_get_text(const char *path, char **out_buf)
 {
         autofree(CbmMappedFile) *mapped_file = CBM_MAPPED_FILE_INIT;
@@ -382,7 +394,8 @@ bool file_get_text(const char *path, char **out_buf)
                 return false;
         }
 
-        *out_buf = strdup(mapped_file->buffer);
+        /* The mapping isn't NUL terminated */
+        *out_buf = strndup(mapped_file->buffer, mapped_file->length);
         if (!*out_buf) {
                 return false;
         }
@@ -391,6 +404,7 @@ bool file_get_text(const char *path, char **out_buf)
 
 bool copy_file(const char *src, const char *target, mode_t mode)
 {
+        CBM_TRACE_SCOPE("copy_file");
         struct stat sst = { 0 };
         ssize_t sz;
         int sfd = -1;
@@ -398,21 +412,21 @@ bool copy_file(const char *src, const char *target, mode_t mode)
         bool ret = false;
         ssize_t written;
 
-        sfd = open(src, O_RDONLY);
+        sfd = cbm_fs_open(src, O_RDONLY, 0);
         if (sfd < 0) {
                 return false;
         }
-        dfd = open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
+        dfd = cbm_fs_open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
         if (dfd < 0) {
                 goto end;
         }
-        if (fstat(sfd, &sst) != 0) {
+        if (cbm_fs_fstat(sfd, &sst) != 0) {
                 goto end;
         }
 
         sz = sst.st_size;
         for (;;) {
-                written = sendfile(dfd, sfd, NULL, (size_t)sz);
+                written = cbm_fs_sendfile(dfd, sfd, (size_t)sz);
                 if (written == sz) {
                         break;
                 } else if (written < 0) {
@@ -420,14 +434,16 @@ bool copy_file(const char *src, const char *target, mode_t mode)
                 }
                 sz -= written;
         }
+        CBM_STATS_ADD(bytes_written, sst.st_size);
+        CBM_STATS_ADD(files_copied, 1);
         ret = true;
 
 end:
         if (sfd > 0) {
-                close(sfd);
+                cbm_fs_close(sfd);
         }
         if (dfd > 0) {
-                close(dfd);
+                cbm_fs_close(dfd);
         }
         return ret;
 }
@@ -440,14 +456,14 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
         new_name = string_printf("%s.TmpWrite", target);
 
         if (!copy_file(src, new_name, mode)) {
-                (void)unlink(new_name);
+                (void)cbm_fs_unlink(new_name);
                 return false;
         }
         cbm_sync();
 
         /* Delete target if needed  */
-        if (stat(target, &st) == 0) {
-                if (!S_ISDIR(st.st_mode) && unlink(target) != 0) {
+        if (cbm_fs_stat(target, &st) == 0) {
+                if (!S_ISDIR(st.st_mode) && cbm_fs_unlink(target) != 0) {
                         return false;
                 }
                 cbm_sync();
@@ -455,7 +471,7 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
                 errno = 0;
         }
 
-        if (rename(new_name, target) != 0) {
+        if (cbm_fs_rename(new_name, target) != 0) {
                 return false;
         }
         /* vfat protect */
@@ -541,19 +557,28 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
         ssize_t length = -1;
         char *buffer = NULL;
 
-        fd = open(path, O_RDONLY);
+        fd = cbm_fs_open(path, O_RDONLY, 0);
         if (fd < 0) {
                 return false;
         }
-        if (fstat(fd, &st) != 0) {
-                close(fd);
+        if (cbm_fs_fstat(fd, &st) != 0) {
+                cbm_fs_close(fd);
                 return false;
         }
         length = st.st_size;
 
-        buffer = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
+        /* Nothing to map, mmap() refuses a zero length */
+        if (length == 0) {
+                cbm_fs_close(fd);
+                file->length = 0;
+                file->buffer = "";
+                file->fd = -1;
+                return true;
+        }
+
+        buffer = cbm_fs_mmap(fd, (size_t)length);
         if (!buffer) {
-                close(fd);
+                cbm_fs_close(fd);
                 return false;
         }
         file->length = (size_t)length;
@@ -564,11 +589,15 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
 
 void cbm_mapped_file_close(CbmMappedFile *file)
 {
-        if (!file) {
+        /* Never opened or failed to map, fd is still 0 from CBM_MAPPED_FILE_INIT */
+        if (!file || !file->buffer) {
                 return;
         }
-        munmap(file->buffer, file->length);
-        close(file->fd);
+        /* Empty files aren't mapped and have no descriptor held */
+        if (file->length > 0) {
+                cbm_fs_munmap(file->buffer, file->length);
+                cbm_fs_close(file->fd);
+        }
         memset(file, 0, sizeof(CbmMappedFile));
 }
 
@@ -579,7 +608,7 @@ bool cbm_path_check(const char *path, const char *resolved)
         /* GCC incorrectly complains about us freeing the return from realpath()
          * which is allocated, however GCC believes it is heap storage.
          */
-        p = realpath(path, NULL);
+        p = cbm_fs_realpath(path);
         if (!p) {
                 return false;
         }
@@ -588,14 +617,15 @@ bool cbm_path_check(const char *path, const char *resolved)
 
 bool cbm_is_dir_empty(const char *path)
 {
-        DIR *dir = NULL;
+        CbmFsDir *dir = NULL;
         struct dirent *entry;
         bool ret = true;
 
-        dir = opendir(path);
+        CBM_STATS_ADD(dir_scans, 1);
+        dir = cbm_fs_opendir(path);
         CHECK_DBG_GOTO(!dir, out, "No such directory: %s", path);
 
-        while ((entry = readdir(dir)) != NULL) {
+        while ((entry = cbm_fs_readdir(dir)) != NULL) {
                 if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
                         continue;
                 }
@@ -606,7 +636,7 @@ bool cbm_is_dir_empty(const char *path)
         }
 
  out:
-        closedir(dir);
+        cbm_fs_closedir(dir);
         return ret;
 }
 
@@ -65,6 +65,12 @@ int get_partition_index(const char *path, const char *devnode);
  */
 char *get_legacy_boot_device(char *path);
 
+/**
+ * Determine whether the partition at @index on the disk backing @path
+ * already carries the GPT legacy_boot attribute
+ */
+bool get_partition_legacy_boot(const char *path, int index);
+
 /**
  * Determine if the files match in content by comparing
  * their checksums
@@ -92,6 +98,17 @@ char *cbm_get_file_parent(const char *p);
  */
 bool file_set_text(const char *path, char *text);
 
+/**
+ * Replace a small text file through a rename, flushing only that file and
+ * its directory instead of syncing every filesystem
+ *
+ * @param path Path of the file to be written
+ * @param text Contents of the new file
+ *
+ * @return True if this succeeded
+ */
+bool file_set_text_durable(const char *path, const char *text);
+
 /**
  * Quick utility for reading very small files into a string
  *
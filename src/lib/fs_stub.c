@@ -0,0 +1,413 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include "fs_stub.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+static int cbm_fs_default_open(const char *path, int flags, mode_t mode)
+{
+        return open(path, flags, mode);
+}
+
+static ssize_t cbm_fs_default_sendfile(int out_fd, int in_fd, size_t count)
+{
+        return sendfile(out_fd, in_fd, NULL, count);
+}
+
+static void *cbm_fs_default_mmap(int fd, size_t length)
+{
+        void *addr = NULL;
+
+        /* mmap() rejects it anyway, but be explicit about it */
+        if (length == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+        addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void *cbm_fs_default_opendir(const char *path)
+{
+        return opendir(path);
+}
+
+static struct dirent *cbm_fs_default_readdir(void *dir)
+{
+        return readdir(dir);
+}
+
+static int cbm_fs_default_closedir(void *dir)
+{
+        return closedir(dir);
+}
+
+/**
+ * Default vtable for file operation passthrough
+ */
+static CbmFsOps default_fs_ops = {
+        .access = access,
+        .stat = stat,
+        .lstat = lstat,
+        .realpath = realpath,
+        .readlink = readlink,
+        .mkdir = mkdir,
+        .rmdir = rmdir,
+        .unlink = unlink,
+        .rename = rename,
+        .symlink = symlink,
+        .chmod = chmod,
+        .open = cbm_fs_default_open,
+        .close = close,
+        .read = read,
+        .write = write,
+        .fstat = fstat,
+        .fsync = fsync,
+        .sendfile = cbm_fs_default_sendfile,
+        .mmap = cbm_fs_default_mmap,
+        .munmap = munmap,
+        .opendir = cbm_fs_default_opendir,
+        .readdir = cbm_fs_default_readdir,
+        .closedir = cbm_fs_default_closedir,
+        .sync = sync,
+};
+
+/**
+ * Pointer to the currently active vtable
+ */
+static CbmFsOps *fs_ops = &default_fs_ops;
+
+void cbm_fs_reset_vtable(void)
+{
+        fs_ops = &default_fs_ops;
+}
+
+bool cbm_fs_is_default_vtable(void)
+{
+        return fs_ops == &default_fs_ops;
+}
+
+void cbm_fs_set_vtable(CbmFsOps *ops)
+{
+        if (!ops) {
+                cbm_fs_reset_vtable();
+        } else {
+                fs_ops = ops;
+        }
+        /* Ensure the vtable is valid at this point. */
+        assert(fs_ops->access != NULL);
+        assert(fs_ops->stat != NULL);
+        assert(fs_ops->lstat != NULL);
+        assert(fs_ops->realpath != NULL);
+        assert(fs_ops->readlink != NULL);
+        assert(fs_ops->mkdir != NULL);
+        assert(fs_ops->rmdir != NULL);
+        assert(fs_ops->unlink != NULL);
+        assert(fs_ops->rename != NULL);
+        assert(fs_ops->symlink != NULL);
+        assert(fs_ops->chmod != NULL);
+        assert(fs_ops->open != NULL);
+        assert(fs_ops->close != NULL);
+        assert(fs_ops->read != NULL);
+        assert(fs_ops->write != NULL);
+        assert(fs_ops->fstat != NULL);
+        assert(fs_ops->fsync != NULL);
+        assert(fs_ops->sendfile != NULL);
+        assert(fs_ops->mmap != NULL);
+        assert(fs_ops->munmap != NULL);
+        assert(fs_ops->opendir != NULL);
+        assert(fs_ops->readdir != NULL);
+        assert(fs_ops->closedir != NULL);
+        assert(fs_ops->sync != NULL);
+}
+
+int cbm_fs_access(const char *path, int mode)
+{
+        return fs_ops->access(path, mode);
+}
+
+int cbm_fs_stat(const char *path, struct stat *st)
+{
+        return fs_ops->stat(path, st);
+}
+
+int cbm_fs_lstat(const char *path, struct stat *st)
+{
+        return fs_ops->lstat(path, st);
+}
+
+char *cbm_fs_realpath(const char *path)
+{
+        return fs_ops->realpath(path, NULL);
+}
+
+ssize_t cbm_fs_readlink(const char *path, char *buf, size_t size)
+{
+        return fs_ops->readlink(path, buf, size);
+}
+
+int cbm_fs_mkdir(const char *path, mode_t mode)
+{
+        return fs_ops->mkdir(path, mode);
+}
+
+int cbm_fs_rmdir(const char *path)
+{
+        return fs_ops->rmdir(path);
+}
+
+int cbm_fs_unlink(const char *path)
+{
+        return fs_ops->unlink(path);
+}
+
+int cbm_fs_rename(const char *oldpath, const char *newpath)
+{
+        return fs_ops->rename(oldpath, newpath);
+}
+
+int cbm_fs_symlink(const char *target, const char *linkpath)
+{
+        return fs_ops->symlink(target, linkpath);
+}
+
+int cbm_fs_chmod(const char *path, mode_t mode)
+{
+        return fs_ops->chmod(path, mode);
+}
+
+int cbm_fs_open(const char *path, int flags, mode_t mode)
+{
+        return fs_ops->open(path, flags, mode);
+}
+
+int cbm_fs_close(int fd)
+{
+        return fs_ops->close(fd);
+}
+
+ssize_t cbm_fs_read(int fd, void *buf, size_t count)
+{
+        return fs_ops->read(fd, buf, count);
+}
+
+ssize_t cbm_fs_write(int fd, const void *buf, size_t count)
+{
+        return fs_ops->write(fd, buf, count);
+}
+
+int cbm_fs_fstat(int fd, struct stat *st)
+{
+        return fs_ops->fstat(fd, st);
+}
+
+int cbm_fs_fsync(int fd)
+{
+        return fs_ops->fsync(fd);
+}
+
+ssize_t cbm_fs_sendfile(int out_fd, int in_fd, size_t count)
+{
+        return fs_ops->sendfile(out_fd, in_fd, count);
+}
+
+void *cbm_fs_mmap(int fd, size_t length)
+{
+        return fs_ops->mmap(fd, length);
+}
+
+int cbm_fs_munmap(void *addr, size_t length)
+{
+        return fs_ops->munmap(addr, length);
+}
+
+CbmFsDir *cbm_fs_opendir(const char *path)
+{
+        return fs_ops->opendir(path);
+}
+
+struct dirent *cbm_fs_readdir(CbmFsDir *dir)
+{
+        return fs_ops->readdir(dir);
+}
+
+void cbm_fs_closedir(CbmFsDir *dir)
+{
+        if (!dir) {
+                return;
+        }
+        (void)fs_ops->closedir(dir);
+}
+
+void cbm_fs_sync(void)
+{
+        fs_ops->sync();
+}
+
+bool cbm_fs_exists(const char *path)
+{
+        struct stat st = { 0 };
+
+        return path && cbm_fs_lstat(path, &st) == 0;
+}
+
+bool cbm_fs_mkdir_p(const char *path, mode_t mode)
+{
+        autofree(char) *dup = NULL;
+
+        if (!path) {
+                return false;
+        }
+        dup = strdup(path);
+        if (!dup) {
+                return false;
+        }
+
+        for (char *s = dup + 1; *s; s++) {
+                if (*s != '/') {
+                        continue;
+                }
+                *s = '\0';
+                if (cbm_fs_mkdir(dup, mode) < 0 && errno != EEXIST) {
+                        return false;
+                }
+                *s = '/';
+        }
+
+        return cbm_fs_mkdir(dup, mode) == 0 || errno == EEXIST;
+}
+
+bool cbm_fs_rm_rf(const char *path)
+{
+        autofree(CbmFsDir) *dir = NULL;
+        struct dirent *ent = NULL;
+        struct stat st = { 0 };
+
+        if (cbm_fs_lstat(path, &st) != 0) {
+                return false;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+                return cbm_fs_unlink(path) == 0;
+        }
+
+        dir = cbm_fs_opendir(path);
+        if (!dir) {
+                return false;
+        }
+        while ((ent = cbm_fs_readdir(dir)) != NULL) {
+                autofree(char) *child = NULL;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                child = string_printf("%s/%s", path, ent->d_name);
+                if (!cbm_fs_rm_rf(child)) {
+                        return false;
+                }
+        }
+
+        return cbm_fs_rmdir(path) == 0;
+}
+
+static ssize_t cbm_fs_cookie_read(void *cookie, char *buf, size_t size)
+{
+        return cbm_fs_read(*(int *)cookie, buf, size);
+}
+
+static ssize_t cbm_fs_cookie_write(void *cookie, const char *buf, size_t size)
+{
+        ssize_t ret = cbm_fs_write(*(int *)cookie, buf, size);
+
+        /* stdio treats 0 as an error anyway, -1 would confuse the accounting */
+        return ret < 0 ? 0 : ret;
+}
+
+static int cbm_fs_cookie_close(void *cookie)
+{
+        int ret = cbm_fs_close(*(int *)cookie);
+
+        free(cookie);
+        return ret;
+}
+
+FILE *cbm_fs_fopen(const char *path, const char *mode)
+{
+        cookie_io_functions_t funcs = {
+                .read = cbm_fs_cookie_read,
+                .write = cbm_fs_cookie_write,
+                .close = cbm_fs_cookie_close,
+        };
+        int flags = 0;
+        int *cookie = NULL;
+        FILE *fp = NULL;
+
+        if (cbm_fs_is_default_vtable()) {
+                return fopen(path, mode);
+        }
+
+        switch (mode[0]) {
+        case 'r':
+                flags = strchr(mode, '+') ? O_RDWR : O_RDONLY;
+                break;
+        case 'w':
+                flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+                break;
+        case 'a':
+                flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+                break;
+        default:
+                errno = EINVAL;
+                return NULL;
+        }
+        if (strchr(mode, 'e')) {
+                flags |= O_CLOEXEC;
+        }
+
+        cookie = malloc(sizeof(int));
+        if (!cookie) {
+                return NULL;
+        }
+        *cookie = cbm_fs_open(path, flags, 00666);
+        if (*cookie < 0) {
+                free(cookie);
+                return NULL;
+        }
+
+        fp = fopencookie(cookie, mode, funcs);
+        if (!fp) {
+                cbm_fs_close(*cookie);
+                free(cookie);
+        }
+        return fp;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
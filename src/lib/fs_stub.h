@@ -0,0 +1,151 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+/**
+ * Defines the vtable used for the file operations within clr-boot-manager,
+ * so that the boot partition can be swapped out for something other than
+ * the disk. The default internal vtable will pass through all operations
+ * to the standard library.
+ *
+ * All functions behave as their libc namesakes, setting errno on failure.
+ */
+typedef struct CbmFsOps {
+        /* path functions */
+        int (*access)(const char *path, int mode);
+        int (*stat)(const char *path, struct stat *st);
+        int (*lstat)(const char *path, struct stat *st);
+        char *(*realpath)(const char *path, char *resolved);
+        ssize_t (*readlink)(const char *path, char *buf, size_t size);
+        int (*mkdir)(const char *path, mode_t mode);
+        int (*rmdir)(const char *path);
+        int (*unlink)(const char *path);
+        int (*rename)(const char *oldpath, const char *newpath);
+        int (*symlink)(const char *target, const char *linkpath);
+        int (*chmod)(const char *path, mode_t mode);
+
+        /* file descriptor functions */
+        int (*open)(const char *path, int flags, mode_t mode);
+        int (*close)(int fd);
+        ssize_t (*read)(int fd, void *buf, size_t count);
+        ssize_t (*write)(int fd, const void *buf, size_t count);
+        int (*fstat)(int fd, struct stat *st);
+        int (*fsync)(int fd);
+        ssize_t (*sendfile)(int out_fd, int in_fd, size_t count); /**<From the current offsets */
+        void *(*mmap)(int fd, size_t length); /**<Private read-only map, NULL and errno on error */
+        int (*munmap)(void *addr, size_t length);
+
+        /* directory functions, the handle is opaque to callers */
+        void *(*opendir)(const char *path);
+        struct dirent *(*readdir)(void *dir);
+        int (*closedir)(void *dir);
+
+        /* whole system */
+        void (*sync)(void);
+} CbmFsOps;
+
+/**
+ * Open directory handle, as returned by cbm_fs_opendir
+ */
+typedef struct CbmFsDir CbmFsDir;
+
+/**
+ * Reset the file operations vtable
+ */
+void cbm_fs_reset_vtable(void);
+
+/**
+ * Set the vfunc table used for all file operations within clr-boot-manager
+ *
+ * @note Passing null has the same effect as calling cbm_fs_reset_vtable
+ * The vtable will be checked to ensure that it is valid at this point, so
+ * only call this when the vtable is fully populated.
+ */
+void cbm_fs_set_vtable(CbmFsOps *ops);
+
+/**
+ * Returns true if the default passthrough vtable is in use
+ */
+bool cbm_fs_is_default_vtable(void);
+
+/**
+ * Wrappers for the vtable functions
+ */
+int cbm_fs_access(const char *path, int mode);
+int cbm_fs_stat(const char *path, struct stat *st);
+int cbm_fs_lstat(const char *path, struct stat *st);
+char *cbm_fs_realpath(const char *path);
+ssize_t cbm_fs_readlink(const char *path, char *buf, size_t size);
+int cbm_fs_mkdir(const char *path, mode_t mode);
+int cbm_fs_rmdir(const char *path);
+int cbm_fs_unlink(const char *path);
+int cbm_fs_rename(const char *oldpath, const char *newpath);
+int cbm_fs_symlink(const char *target, const char *linkpath);
+int cbm_fs_chmod(const char *path, mode_t mode);
+int cbm_fs_open(const char *path, int flags, mode_t mode);
+int cbm_fs_close(int fd);
+ssize_t cbm_fs_read(int fd, void *buf, size_t count);
+ssize_t cbm_fs_write(int fd, const void *buf, size_t count);
+int cbm_fs_fstat(int fd, struct stat *st);
+int cbm_fs_fsync(int fd);
+ssize_t cbm_fs_sendfile(int out_fd, int in_fd, size_t count);
+void *cbm_fs_mmap(int fd, size_t length);
+int cbm_fs_munmap(void *addr, size_t length);
+CbmFsDir *cbm_fs_opendir(const char *path);
+struct dirent *cbm_fs_readdir(CbmFsDir *dir);
+void cbm_fs_closedir(CbmFsDir *dir);
+void cbm_fs_sync(void);
+
+/**
+ * Whether anything exists at @path, without following a final symlink
+ */
+bool cbm_fs_exists(const char *path);
+
+/**
+ * Create @path along with any missing parents
+ */
+bool cbm_fs_mkdir_p(const char *path, mode_t mode);
+
+/**
+ * Remove @path and everything below it, without following symlinks
+ */
+bool cbm_fs_rm_rf(const char *path);
+
+/**
+ * fopen() through the vtable, for the stdio based readers and writers
+ */
+FILE *cbm_fs_fopen(const char *path, const char *mode);
+
+DEF_AUTOFREE(CbmFsDir, cbm_fs_closedir)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,337 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gpt.h"
+#include "log.h"
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN_SIZE 92
+#define GPT_ENTRY_MIN_SIZE 128
+#define GPT_MAX_ENTRIES 4096
+#define MBR_SIZE 512
+#define MBR_PART_OFFSET 446
+#define MBR_PART_TYPE_PROTECTIVE 0xEE
+
+static uint32_t gpt_crc32_table[256];
+
+static void cbm_gpt_crc32_init(void)
+{
+        for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                        c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+                }
+                gpt_crc32_table[i] = c;
+        }
+}
+
+/**
+ * The CRC32 used by UEFI, as in zlib
+ */
+static uint32_t cbm_gpt_crc32(const uint8_t *buf, size_t len)
+{
+        uint32_t crc = 0xFFFFFFFFU;
+
+        if (!gpt_crc32_table[1]) {
+                cbm_gpt_crc32_init();
+        }
+
+        for (size_t i = 0; i < len; i++) {
+                crc = gpt_crc32_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFU;
+}
+
+static uint32_t cbm_gpt_le32(const uint8_t *p)
+{
+        return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t cbm_gpt_le64(const uint8_t *p)
+{
+        return (uint64_t)cbm_gpt_le32(p) | (uint64_t)cbm_gpt_le32(p + 4) << 32;
+}
+
+/**
+ * GUIDs are stored mixed endian, the first three fields little endian
+ */
+static void cbm_gpt_guid_to_string(const uint8_t *g, char out[CBM_GPT_GUID_STRING_LEN])
+{
+        snprintf(out,
+                 CBM_GPT_GUID_STRING_LEN,
+                 "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                 g[3], g[2], g[1], g[0],
+                 g[5], g[4],
+                 g[7], g[6],
+                 g[8], g[9],
+                 g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+static bool cbm_gpt_guid_is_null(const uint8_t *g)
+{
+        for (int i = 0; i < 16; i++) {
+                if (g[i]) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+static bool cbm_gpt_pread(int fd, void *buf, size_t len, uint64_t offset)
+{
+        size_t done = 0;
+
+        while (done < len) {
+                ssize_t r = pread(fd, (uint8_t *)buf + done, len - done, (off_t)(offset + done));
+                if (r <= 0) {
+                        return false;
+                }
+                done += (size_t)r;
+        }
+        return true;
+}
+
+/**
+ * A GPT disk must carry a protective (or hybrid) MBR
+ */
+static bool cbm_gpt_has_protective_mbr(int fd)
+{
+        uint8_t mbr[MBR_SIZE];
+
+        if (!cbm_gpt_pread(fd, mbr, sizeof(mbr), 0)) {
+                return false;
+        }
+        if (mbr[510] != 0x55 || mbr[511] != 0xAA) {
+                return false;
+        }
+        for (int i = 0; i < 4; i++) {
+                if (mbr[MBR_PART_OFFSET + i * 16 + 4] == MBR_PART_TYPE_PROTECTIVE) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Attempt to read the primary GPT assuming a logical sector size of @ss
+ */
+static CbmGptTable *cbm_gpt_read_sector_size(int fd, uint32_t ss)
+{
+        autofree(CbmGptTable) *table = NULL;
+        CbmGptTable *ret = NULL;
+        autofree(char) *header_buf = NULL;
+        autofree(char) *entries_buf = NULL;
+        uint8_t *header = NULL;
+        uint8_t *entries = NULL;
+        uint32_t header_size, header_crc, n_entries, entry_size, entries_crc = 0;
+        uint64_t entries_lba = 0;
+        size_t entries_len = 0;
+
+        header = (uint8_t *)(header_buf = calloc(1, ss));
+        if (!header) {
+                DECLARE_OOM();
+                return NULL;
+        }
+        if (!cbm_gpt_pread(fd, header, ss, ss)) {
+                return NULL;
+        }
+        if (memcmp(header, GPT_SIGNATURE, strlen(GPT_SIGNATURE)) != 0) {
+                return NULL;
+        }
+
+        header_size = cbm_gpt_le32(header + 12);
+        if (header_size < GPT_HEADER_MIN_SIZE || header_size > ss) {
+                LOG_DEBUG("Invalid GPT header size: %u", header_size);
+                return NULL;
+        }
+
+        /* The header CRC is computed with its own field zeroed */
+        header_crc = cbm_gpt_le32(header + 16);
+        memset(header + 16, 0, 4);
+        if (cbm_gpt_crc32(header, header_size) != header_crc) {
+                LOG_DEBUG("GPT header CRC mismatch");
+                return NULL;
+        }
+
+        if (cbm_gpt_le64(header + 24) != 1) {
+                LOG_DEBUG("Primary GPT header not at LBA 1");
+                return NULL;
+        }
+
+        entries_lba = cbm_gpt_le64(header + 72);
+        n_entries = cbm_gpt_le32(header + 80);
+        entry_size = cbm_gpt_le32(header + 84);
+        entries_crc = cbm_gpt_le32(header + 88);
+        if (entry_size < GPT_ENTRY_MIN_SIZE || entry_size % 8 != 0 || n_entries > GPT_MAX_ENTRIES ||
+            entries_lba < 2) {
+                LOG_DEBUG("Invalid GPT entry array: %u entries of %u bytes", n_entries, entry_size);
+                return NULL;
+        }
+
+        entries_len = (size_t)n_entries * entry_size;
+        entries = (uint8_t *)(entries_buf = calloc(1, entries_len ? entries_len : 1));
+        if (!entries) {
+                DECLARE_OOM();
+                return NULL;
+        }
+        if (!cbm_gpt_pread(fd, entries, entries_len, entries_lba * ss)) {
+                return NULL;
+        }
+        if (cbm_gpt_crc32(entries, entries_len) != entries_crc) {
+                LOG_DEBUG("GPT entry array CRC mismatch");
+                return NULL;
+        }
+
+        table = calloc(1, sizeof(CbmGptTable));
+        if (!table) {
+                DECLARE_OOM();
+                return NULL;
+        }
+        table->sector_size = ss;
+        cbm_gpt_guid_to_string(header + 56, table->disk_guid);
+
+        table->partitions = calloc(n_entries ? n_entries : 1, sizeof(CbmGptPartition));
+        if (!table->partitions) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        for (uint32_t i = 0; i < n_entries; i++) {
+                const uint8_t *entry = entries + (size_t)i * entry_size;
+                CbmGptPartition *part = NULL;
+
+                /* Unused entries have a null type GUID */
+                if (cbm_gpt_guid_is_null(entry)) {
+                        continue;
+                }
+
+                part = &table->partitions[table->n_partitions++];
+                part->slot = (int)i;
+                cbm_gpt_guid_to_string(entry, part->type_guid);
+                cbm_gpt_guid_to_string(entry + 16, part->unique_guid);
+                part->first_lba = cbm_gpt_le64(entry + 32);
+                part->last_lba = cbm_gpt_le64(entry + 40);
+                part->attributes = cbm_gpt_le64(entry + 48);
+        }
+
+        ret = table;
+        table = NULL;
+        return ret;
+}
+
+CbmGptTable *cbm_gpt_read(const char *path)
+{
+        CbmGptTable *table = NULL;
+        struct stat st = { 0 };
+        int ss = 0;
+        int fd = -1;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) {
+                return NULL;
+        }
+
+        if (fstat(fd, &st) != 0 || !cbm_gpt_has_protective_mbr(fd)) {
+                goto clean;
+        }
+
+        /* Block devices know their logical sector size, images have to guess */
+        if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &ss) == 0 && ss >= MBR_SIZE) {
+                table = cbm_gpt_read_sector_size(fd, (uint32_t)ss);
+        } else {
+                table = cbm_gpt_read_sector_size(fd, 512);
+                if (!table) {
+                        table = cbm_gpt_read_sector_size(fd, 4096);
+                }
+        }
+
+clean:
+        close(fd);
+        return table;
+}
+
+/**
+ * Read the stored CRC of the primary header assuming a logical sector size of @ss
+ */
+static bool cbm_gpt_read_header_crc_sector_size(int fd, uint32_t ss, uint32_t *crc)
+{
+        uint8_t header[GPT_HEADER_MIN_SIZE];
+
+        if (!cbm_gpt_pread(fd, header, sizeof(header), ss)) {
+                return false;
+        }
+        if (memcmp(header, GPT_SIGNATURE, strlen(GPT_SIGNATURE)) != 0) {
+                return false;
+        }
+        *crc = cbm_gpt_le32(header + 16);
+        return true;
+}
+
+bool cbm_gpt_read_header_crc(const char *path, uint32_t *crc)
+{
+        struct stat st = { 0 };
+        bool ret = false;
+        int ss = 0;
+        int fd = -1;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) {
+                return false;
+        }
+
+        if (fstat(fd, &st) != 0 || !cbm_gpt_has_protective_mbr(fd)) {
+                goto clean;
+        }
+
+        if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &ss) == 0 && ss >= MBR_SIZE) {
+                ret = cbm_gpt_read_header_crc_sector_size(fd, (uint32_t)ss, crc);
+        } else {
+                ret = cbm_gpt_read_header_crc_sector_size(fd, 512, crc) ||
+                      cbm_gpt_read_header_crc_sector_size(fd, 4096, crc);
+        }
+
+clean:
+        close(fd);
+        return ret;
+}
+
+void cbm_gpt_free(CbmGptTable *table)
+{
+        if (!table) {
+                return;
+        }
+        free(table->partitions);
+        free(table);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,88 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+
+#include "util.h"
+
+/**
+ * Length of a GUID in its canonical lower case string form, with nul
+ */
+#define CBM_GPT_GUID_STRING_LEN 37
+
+/**
+ * Legacy BIOS bootable, the GPT equivalent of the MBR boot flag
+ */
+#define CBM_GPT_ATTR_LEGACY_BOOT (1ULL << 2)
+
+/**
+ * A used entry of the GPT partition entry array
+ */
+typedef struct CbmGptPartition {
+        int slot;                                  /**<Position in the entry array */
+        char type_guid[CBM_GPT_GUID_STRING_LEN];   /**<Partition type GUID */
+        char unique_guid[CBM_GPT_GUID_STRING_LEN]; /**<PartUUID */
+        uint64_t first_lba;
+        uint64_t last_lba;
+        uint64_t attributes; /**<Attribute bits, i.e. CBM_GPT_ATTR_LEGACY_BOOT */
+} CbmGptPartition;
+
+/**
+ * A validated GPT partition table
+ */
+typedef struct CbmGptTable {
+        char disk_guid[CBM_GPT_GUID_STRING_LEN];
+        uint32_t sector_size;        /**<Logical sector size the table was found at */
+        int n_partitions;            /**<Number of used entries */
+        CbmGptPartition *partitions; /**<Used entries, in entry array order */
+} CbmGptTable;
+
+/**
+ * Read the primary GPT of the disk or disk image at @path, validating the
+ * protective MBR along with the header and entry array CRCs.
+ *
+ * Returns NULL if there is no valid primary GPT, in which case callers
+ * should fall back to libblkid.
+ */
+CbmGptTable *cbm_gpt_read(const char *path);
+
+/**
+ * Read only the CRC stored in the primary GPT header of @path. It covers the
+ * disk GUID and the CRC of the entry array, so it changes with any change to
+ * the table. Cheaper than cbm_gpt_read(), as the entries are not read.
+ *
+ * Returns false if there is no GPT.
+ */
+bool cbm_gpt_read_header_crc(const char *path, uint32_t *crc);
+
+/**
+ * Free a previously read table
+ */
+void cbm_gpt_free(CbmGptTable *table);
+
+DEF_AUTOFREE(CbmGptTable, cbm_gpt_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,60 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+
+#include "library.h"
+#include "log.h"
+
+CbmLibrary cbm_libblkid = CBM_LIBRARY_INIT("libblkid.so.1");
+
+bool cbm_library_resolve(CbmLibrary *lib, const char *name, void **symbol)
+{
+        if (!lib->handle && !lib->failed) {
+                lib->handle = dlopen(lib->soname, RTLD_NOW | RTLD_LOCAL);
+                if (!lib->handle) {
+                        LOG_ERROR("Unable to load %s: %s", lib->soname, dlerror());
+                        lib->failed = true;
+                }
+        }
+
+        if (!lib->handle) {
+                return false;
+        }
+
+        *symbol = dlsym(lib->handle, name);
+        if (!*symbol) {
+                LOG_ERROR("Unable to find %s in %s: %s", name, lib->soname, dlerror());
+                return false;
+        }
+
+        return true;
+}
+
+bool cbm_library_is_loaded(const CbmLibrary *lib)
+{
+        return lib->handle != NULL;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
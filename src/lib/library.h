@@ -0,0 +1,68 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+/**
+ * A shared library that is only mapped once one of its symbols is needed,
+ * so that commands never probing devices or touching EFI variables start
+ * with nothing but libc.
+ */
+typedef struct CbmLibrary {
+        const char *soname; /**<Name passed to dlopen */
+        void *handle;       /**<dlopen handle, once loaded */
+        bool failed;        /**<Loading failed, don't try again */
+} CbmLibrary;
+
+#define CBM_LIBRARY_INIT(n)                                                                        \
+        {                                                                                          \
+                .soname = (n), .handle = NULL, .failed = false                                     \
+        }
+
+/**
+ * libblkid, shared between the blkid stub and bootvar
+ */
+extern CbmLibrary cbm_libblkid;
+
+/**
+ * Resolve @name from @lib into @symbol, loading the library on first use.
+ * Returns false, having logged why, if either cannot be found.
+ */
+bool cbm_library_resolve(CbmLibrary *lib, const char *name, void **symbol);
+
+/**
+ * Resolve the function pointer @ptr, named after the library symbol @name,
+ * unless already resolved.
+ */
+#define CBM_LIBRARY_BIND(lib, ptr, name)                                                           \
+        ((ptr) != NULL || cbm_library_resolve((lib), (name), (void **)&(ptr)))
+
+/**
+ * Returns true if @lib has been loaded into the process
+ */
+bool cbm_library_is_loaded(const CbmLibrary *lib);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
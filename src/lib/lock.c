@@ -0,0 +1,374 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lock.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+/**
+ * Mutating commands are serialized with an exclusive flock() on the lock
+ * file. Two companion files make back to back requests coalesce:
+ *
+ *  - <lock>.queue is held by the one request waiting to run next. Anyone
+ *    finding it taken knows a run is pending that hasn't started yet.
+ *  - <lock>.state numbers the runs: the last one queued, started and
+ *    finished, along with the key of the queued run and the result of the
+ *    finished one.
+ *
+ * A request finding a pending run with its own key attaches to it and waits
+ * for that run to finish, so a burst of identical requests costs the run in
+ * progress plus a single queued one.
+ */
+
+#define UPDATE_LOCK_KEY_MAX 1024
+
+/* How long attached requests sleep while the queued run waits for the lock */
+#define UPDATE_LOCK_POLL_USEC 20000
+
+typedef struct UpdateLockState {
+        unsigned long queued;  /**<Last run queued */
+        unsigned long started; /**<Last run that took the lock */
+        unsigned long done;    /**<Last run that finished */
+        int result;            /**<Result of the run numbered done */
+        char key[UPDATE_LOCK_KEY_MAX]; /**<Key of the run numbered queued */
+} UpdateLockState;
+
+typedef struct UpdateLock {
+        int run_fd;
+        int queue_fd;
+        int state_fd;
+} UpdateLock;
+
+const char *cbm_update_lock_path(void)
+{
+        const char *path = getenv("CBM_UPDATE_LOCK");
+
+        if (!path) {
+                path = UPDATE_LOCK_PATH;
+        }
+        return path[0] != '\0' ? path : NULL;
+}
+
+static int update_lock_flock(int fd, int operation)
+{
+        int r;
+
+        do {
+                r = flock(fd, operation);
+        } while (r < 0 && errno == EINTR);
+
+        return r;
+}
+
+static int update_lock_open(const char *path)
+{
+        autofree(char) *dir = strdup(path);
+        char *slash = NULL;
+        int fd;
+
+        if (!dir) {
+                DECLARE_OOM();
+                return -1;
+        }
+        slash = strrchr(dir, '/');
+        if (slash && slash != dir) {
+                *slash = '\0';
+                if (!nc_mkdir_p(dir, 00755)) {
+                        LOG_WARNING("Cannot create %s: %s", dir, strerror(errno));
+                        return -1;
+                }
+        }
+
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOCTTY, 00600);
+        if (fd < 0) {
+                LOG_WARNING("Cannot open lock file %s: %s", path, strerror(errno));
+        }
+        return fd;
+}
+
+int cbm_update_lock_acquire(const char *path)
+{
+        int fd;
+
+        if (!path) {
+                return -1;
+        }
+
+        fd = update_lock_open(path);
+        if (fd < 0) {
+                return -1;
+        }
+        if (update_lock_flock(fd, LOCK_EX) < 0) {
+                LOG_WARNING("Cannot lock %s: %s", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+void cbm_update_lock_release(int fd)
+{
+        if (fd < 0) {
+                return;
+        }
+        (void)update_lock_flock(fd, LOCK_UN);
+        close(fd);
+}
+
+/**
+ * Read the run counters, with the state file locked by the caller. A missing
+ * or unreadable state starts counting from zero.
+ */
+static void update_lock_read_state(UpdateLock *lock, UpdateLockState *state)
+{
+        char buf[UPDATE_LOCK_KEY_MAX + 128] = { 0 };
+        ssize_t r;
+        int n;
+
+        memset(state, 0, sizeof(*state));
+
+        r = pread(lock->state_fd, buf, sizeof(buf) - 1, 0);
+        if (r <= 0) {
+                return;
+        }
+
+        n = sscanf(buf,
+                   "%lu %lu %lu %d %1023[^\n]",
+                   &state->queued,
+                   &state->started,
+                   &state->done,
+                   &state->result,
+                   state->key);
+        if (n < 4) {
+                memset(state, 0, sizeof(*state));
+        }
+}
+
+static void update_lock_write_state(UpdateLock *lock, const UpdateLockState *state)
+{
+        autofree(char) *text = NULL;
+
+        text = string_printf("%lu %lu %lu %d %s\n",
+                             state->queued,
+                             state->started,
+                             state->done,
+                             state->result,
+                             state->key);
+        if (ftruncate(lock->state_fd, 0) < 0 ||
+            pwrite(lock->state_fd, text, strlen(text), 0) != (ssize_t)strlen(text)) {
+                LOG_WARNING("Failed to record update lock state: %s", strerror(errno));
+        }
+}
+
+/**
+ * Take a consistent snapshot of the state
+ */
+static void update_lock_get_state(UpdateLock *lock, UpdateLockState *state)
+{
+        (void)update_lock_flock(lock->state_fd, LOCK_EX);
+        update_lock_read_state(lock, state);
+        (void)update_lock_flock(lock->state_fd, LOCK_UN);
+}
+
+/**
+ * We hold the queue: wait for the lock, then run on behalf of everyone who
+ * attached to us in the meantime.
+ */
+static bool update_lock_run_queued(UpdateLock *lock, const char *key, cbm_update_lock_func func,
+                                   void *userdata)
+{
+        UpdateLockState state;
+        unsigned long run;
+        bool ret;
+
+        (void)update_lock_flock(lock->state_fd, LOCK_EX);
+        update_lock_read_state(lock, &state);
+        run = state.started + 1;
+        state.queued = run;
+        snprintf(state.key, sizeof(state.key), "%s", key);
+        update_lock_write_state(lock, &state);
+        (void)update_lock_flock(lock->state_fd, LOCK_UN);
+
+        (void)update_lock_flock(lock->run_fd, LOCK_EX);
+
+        (void)update_lock_flock(lock->state_fd, LOCK_EX);
+        update_lock_read_state(lock, &state);
+        state.started = run;
+        update_lock_write_state(lock, &state);
+        (void)update_lock_flock(lock->state_fd, LOCK_UN);
+
+        /* Anything arriving from now on needs another run */
+        (void)update_lock_flock(lock->queue_fd, LOCK_UN);
+
+        ret = func(userdata);
+
+        (void)update_lock_flock(lock->state_fd, LOCK_EX);
+        update_lock_read_state(lock, &state);
+        state.done = run;
+        state.result = ret ? 1 : 0;
+        update_lock_write_state(lock, &state);
+        (void)update_lock_flock(lock->state_fd, LOCK_UN);
+
+        (void)update_lock_flock(lock->run_fd, LOCK_UN);
+
+        return ret;
+}
+
+/**
+ * Wait for the queued run numbered @run to finish, storing its result.
+ * Returns false if the queued request went away before starting.
+ */
+static bool update_lock_wait_for(UpdateLock *lock, unsigned long run, bool *result)
+{
+        UpdateLockState state;
+
+        for (;;) {
+                /* Blocks for as long as a run is in progress */
+                (void)update_lock_flock(lock->run_fd, LOCK_SH);
+                update_lock_get_state(lock, &state);
+                (void)update_lock_flock(lock->run_fd, LOCK_UN);
+
+                if (state.done >= run) {
+                        *result = state.result != 0;
+                        return true;
+                }
+                if (state.started >= run) {
+                        /* It let go of the lock without finishing */
+                        LOG_ERROR("Queued update exited before completing");
+                        *result = false;
+                        return true;
+                }
+
+                /* Not started yet, make sure it's still waiting */
+                if (update_lock_flock(lock->queue_fd, LOCK_EX | LOCK_NB) == 0) {
+                        (void)update_lock_flock(lock->queue_fd, LOCK_UN);
+                        return false;
+                }
+                usleep(UPDATE_LOCK_POLL_USEC);
+        }
+}
+
+/**
+ * Run @func once nobody else holds the lock, without coalescing
+ */
+static bool update_lock_run_serialized(int run_fd, cbm_update_lock_func func, void *userdata)
+{
+        bool ret;
+
+        if (run_fd < 0 || update_lock_flock(run_fd, LOCK_EX) < 0) {
+                return func(userdata);
+        }
+        ret = func(userdata);
+        (void)update_lock_flock(run_fd, LOCK_UN);
+
+        return ret;
+}
+
+bool cbm_update_lock_run(const char *path, const char *key, cbm_update_lock_func func,
+                         void *userdata, bool *ran)
+{
+        autofree(char) *queue_path = NULL;
+        autofree(char) *state_path = NULL;
+        UpdateLock lock = { .run_fd = -1, .queue_fd = -1, .state_fd = -1 };
+        UpdateLockState state;
+        bool ret = false;
+
+        if (ran) {
+                *ran = true;
+        }
+        if (!path) {
+                return func(userdata);
+        }
+
+        lock.run_fd = update_lock_open(path);
+        if (lock.run_fd < 0) {
+                LOG_WARNING("Running without the update lock");
+                return func(userdata);
+        }
+
+        if (!key || strlen(key) >= UPDATE_LOCK_KEY_MAX || strchr(key, '\n')) {
+                ret = update_lock_run_serialized(lock.run_fd, func, userdata);
+                goto out;
+        }
+
+        queue_path = string_printf("%s.queue", path);
+        state_path = string_printf("%s.state", path);
+        lock.queue_fd = update_lock_open(queue_path);
+        lock.state_fd = update_lock_open(state_path);
+        if (lock.queue_fd < 0 || lock.state_fd < 0) {
+                ret = update_lock_run_serialized(lock.run_fd, func, userdata);
+                goto out;
+        }
+
+        for (;;) {
+                unsigned long run = 0;
+
+                if (update_lock_flock(lock.queue_fd, LOCK_EX | LOCK_NB) == 0) {
+                        ret = update_lock_run_queued(&lock, key, func, userdata);
+                        goto out;
+                }
+
+                /* Another request is queued, share it if it's the same */
+                update_lock_get_state(&lock, &state);
+                if (state.queued > state.started && streq(state.key, key)) {
+                        run = state.queued;
+                }
+                if (run == 0) {
+                        ret = update_lock_run_serialized(lock.run_fd, func, userdata);
+                        goto out;
+                }
+
+                LOG_INFO("Identical request already queued, waiting for it");
+                if (update_lock_wait_for(&lock, run, &ret)) {
+                        if (ran) {
+                                *ran = false;
+                        }
+                        goto out;
+                }
+        }
+
+out:
+        if (lock.state_fd >= 0) {
+                close(lock.state_fd);
+        }
+        if (lock.queue_fd >= 0) {
+                close(lock.queue_fd);
+        }
+        close(lock.run_fd);
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
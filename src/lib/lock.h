@@ -0,0 +1,69 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+/**
+ * Work done while holding the update lock
+ */
+typedef bool (*cbm_update_lock_func)(void *userdata);
+
+/**
+ * Return the path of the lock serializing mutating commands, or NULL if
+ * locking is disabled. CBM_UPDATE_LOCK overrides the built in path, and
+ * an empty value disables the lock.
+ */
+const char *cbm_update_lock_path(void);
+
+/**
+ * Block until no other process holds the update lock at @path, then take it.
+ *
+ * Returns the descriptor to pass to cbm_update_lock_release, or -1 if the
+ * lock couldn't be set up, in which case the caller carries on without it.
+ */
+int cbm_update_lock_acquire(const char *path);
+
+/**
+ * Release a lock taken with cbm_update_lock_acquire
+ */
+void cbm_update_lock_release(int fd);
+
+/**
+ * Run @func with @userdata while holding the update lock at @path.
+ *
+ * With a @key the request may be coalesced: when a run with the same key is
+ * already queued behind the one in progress, wait for that run and return
+ * its result instead of calling @func. The queued run only starts once the
+ * current one is done, so it sees everything this request would have.
+ *
+ * @ran, if not NULL, is set to whether @func was called by this process.
+ *
+ * A NULL @path runs @func straight away.
+ */
+bool cbm_update_lock_run(const char *path, const char *key, cbm_update_lock_func func,
+                         void *userdata, bool *ran);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
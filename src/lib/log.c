@@ -23,6 +23,26 @@ static CbmLogLevel min_log_level;
 
 #define PACKAGE_NAME_SHORT "cbm"
 
+/**
+ * Messages below the log level are still kept, formatted into fixed slots
+ * without allocating, so that the lead up to an error can be shown once it
+ * happens. Only the most recent CBM_LOG_RING_SIZE survive.
+ */
+#define CBM_LOG_RING_SIZE 256
+#define CBM_LOG_RING_MESSAGE 192
+
+typedef struct CbmLogRecord {
+        CbmLogLevel level;
+        const char *filename; /**<Always __FILE__, so never copied */
+        int lineno;
+        char message[CBM_LOG_RING_MESSAGE];
+} CbmLogRecord;
+
+static struct {
+        CbmLogRecord records[CBM_LOG_RING_SIZE];
+        unsigned long count; /**<Messages held since the last dump */
+} log_ring;
+
 static const char *log_str_table[] = {[CBM_LOG_DEBUG] = "DEBUG",     [CBM_LOG_INFO] = "INFO",
                                       [CBM_LOG_SUCCESS] = "SUCCESS", [CBM_LOG_ERROR] = "ERROR",
                                       [CBM_LOG_WARNING] = "WARNING", [CBM_LOG_FATAL] = "FATAL" };
@@ -60,17 +80,89 @@ static inline const char *cbm_log_level_str(CbmLogLevel l)
         return "unknown";
 }
 
+static void cbm_log_hold(CbmLogLevel level, const char *filename, int lineno,
+                         const char *format, va_list vargs)
+{
+        CbmLogRecord *record = &log_ring.records[log_ring.count % CBM_LOG_RING_SIZE];
+
+        record->level = level;
+        record->filename = filename;
+        record->lineno = lineno;
+        (void)vsnprintf(record->message, sizeof(record->message), format, vargs);
+        log_ring.count++;
+}
+
+void cbm_log_dump_held(void)
+{
+        const char *dump_path = NULL;
+        unsigned long first = 0;
+        FILE *out = log_file;
+
+        if (log_ring.count == 0) {
+                return;
+        }
+
+        dump_path = getenv("CBM_LOG_DUMP");
+        if (dump_path && dump_path[0] != '\0') {
+                out = fopen(dump_path, "a");
+                if (!out) {
+                        out = log_file;
+                }
+        }
+
+        if (log_ring.count > CBM_LOG_RING_SIZE) {
+                first = log_ring.count - CBM_LOG_RING_SIZE;
+        }
+        fprintf(out,
+                "[%s] %s: Messages leading up to this point",
+                cbm_log_level_str(CBM_LOG_INFO),
+                PACKAGE_NAME_SHORT);
+        if (first > 0) {
+                fprintf(out, " (%lu older dropped)", first);
+        }
+        fputs(":\n", out);
+        for (unsigned long i = first; i < log_ring.count; i++) {
+                const CbmLogRecord *record = &log_ring.records[i % CBM_LOG_RING_SIZE];
+
+                fprintf(out,
+                        "  [%s] %s (%s:L%d): %s\n",
+                        cbm_log_level_str(record->level),
+                        PACKAGE_NAME_SHORT,
+                        record->filename,
+                        record->lineno,
+                        record->message);
+        }
+
+        if (out != log_file) {
+                fclose(out);
+        }
+        log_ring.count = 0;
+}
+
+void cbm_log_discard_held(void)
+{
+        log_ring.count = 0;
+}
+
 void cbm_log(CbmLogLevel level, const char *filename, int lineno, const char *format, ...)
 {
         const char *displ = NULL;
         va_list vargs;
         autofree(char) *rend = NULL;
 
-        /* Respect minimum log level */
+        /* Respect minimum log level, but keep the message around */
         if (level < min_log_level) {
+                va_start(vargs, format);
+                cbm_log_hold(level, filename, lineno, format, vargs);
+                va_end(vargs);
                 return;
         }
 
+        /* Give errors the context they happened in */
+        if (level == CBM_LOG_ERROR || level == CBM_LOG_FATAL) {
+                cbm_log_dump_held();
+        }
+
         displ = cbm_log_level_str(level);
 
         va_start(vargs, format);
@@ -40,6 +40,18 @@ void cbm_log_init(FILE *log);
 void cbm_log(CbmLogLevel level, const char *file, int line, const char *format, ...)
     __attribute__((format(printf, 4, 5)));
 
+/**
+ * Write out the messages held back for being below the log level, which
+ * happens by itself before any error is logged, to the log file or to the
+ * file named by $CBM_LOG_DUMP, then forget them
+ */
+void cbm_log_dump_held(void);
+
+/**
+ * Forget the messages held back for being below the log level
+ */
+void cbm_log_discard_held(void);
+
 /**
  * Log a simple debug message
  */
@@ -0,0 +1,473 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "metrics.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "writer.h"
+
+/**
+ * Several commands share one file, so each run only replaces the samples
+ * it owns: those labelled with its own command, plus the kernel counts and
+ * boot partition space when it learned them. Everything else is carried
+ * over from the previous file.
+ */
+
+#define METRICS_MAX_KTYPES 16
+
+typedef enum {
+        METRIC_SCOPE_COMMAND = 0, /**<Labelled with the command that wrote it */
+        METRIC_SCOPE_KERNELS,
+        METRIC_SCOPE_BOOT,
+} MetricScope;
+
+typedef enum {
+        METRIC_SUCCESS = 0,
+        METRIC_LAST_SUCCESS,
+        METRIC_LAST_FAILURE,
+        METRIC_DURATION,
+        METRIC_PHASE_DURATION,
+        METRIC_BYTES_WRITTEN,
+        METRIC_FILES_SKIPPED,
+        METRIC_SYNCS,
+        METRIC_KERNELS,
+        METRIC_BOOT_FREE,
+        METRIC_BOOT_SIZE,
+        METRIC_MAX,
+} Metric;
+
+static const struct {
+        const char *name;
+        const char *help;
+        MetricScope scope;
+} metrics_table[] = {
+        [METRIC_SUCCESS] = { "cbm_last_run_success",
+                             "Whether the last run of the command succeeded",
+                             METRIC_SCOPE_COMMAND },
+        [METRIC_LAST_SUCCESS] = { "cbm_last_success_timestamp_seconds",
+                                  "When the command last succeeded",
+                                  METRIC_SCOPE_COMMAND },
+        [METRIC_LAST_FAILURE] = { "cbm_last_failure_timestamp_seconds",
+                                  "When the command last failed",
+                                  METRIC_SCOPE_COMMAND },
+        [METRIC_DURATION] = { "cbm_last_run_duration_seconds",
+                              "Duration of the last run of the command",
+                              METRIC_SCOPE_COMMAND },
+        [METRIC_PHASE_DURATION] = { "cbm_last_run_phase_duration_seconds",
+                                    "Time spent in each phase of the last run of the command",
+                                    METRIC_SCOPE_COMMAND },
+        [METRIC_BYTES_WRITTEN] = { "cbm_last_run_bytes_written",
+                                   "Bytes written by the last run of the command",
+                                   METRIC_SCOPE_COMMAND },
+        [METRIC_FILES_SKIPPED] = { "cbm_last_run_files_skipped",
+                                   "Files already up to date in the last run of the command",
+                                   METRIC_SCOPE_COMMAND },
+        [METRIC_SYNCS] = { "cbm_last_run_syncs",
+                           "sync and fsync requests made by the last run of the command",
+                           METRIC_SCOPE_COMMAND },
+        [METRIC_KERNELS] = { "cbm_kernels", "Available kernels of each type", METRIC_SCOPE_KERNELS },
+        [METRIC_BOOT_FREE] = { "cbm_boot_free_bytes",
+                               "Space left on the boot partition",
+                               METRIC_SCOPE_BOOT },
+        [METRIC_BOOT_SIZE] = { "cbm_boot_size_bytes",
+                               "Size of the boot partition",
+                               METRIC_SCOPE_BOOT },
+};
+
+static struct {
+        char *output;
+        struct timespec start;
+        struct {
+                char *ktype;
+                unsigned long count;
+        } kernels[METRICS_MAX_KTYPES];
+        size_t n_kernels;
+        bool kernels_known;
+        uint64_t boot_free;
+        uint64_t boot_total;
+        bool boot_known;
+} metrics = { 0 };
+
+void cbm_metrics_set_output(const char *path)
+{
+        free(metrics.output);
+        metrics.output = NULL;
+        if (!path) {
+                return;
+        }
+        metrics.output = strdup(path);
+        if (!metrics.output) {
+                DECLARE_OOM();
+                return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+
+        /* Per phase durations come from the trace */
+        cbm_trace_enable();
+}
+
+void cbm_metrics_load_config(const char *root)
+{
+        autofree(char) *cfg_path = NULL;
+        autofree(char) *path = NULL;
+
+        if (cbm_metrics_enabled()) {
+                return;
+        }
+
+        cfg_path = string_printf("%s/%s/metrics_file", root ? root : "", KERNEL_CONF_DIRECTORY);
+        CHECK_DBG_RET(!nc_file_exists(cfg_path), "No such file: %s", cfg_path);
+        CHECK_ERR_RET(!file_get_text(cfg_path, &path) || !path,
+                      "Could not read file: %s",
+                      cfg_path);
+
+        path[strcspn(path, "\r\n")] = '\0';
+        if (path[0] != '\0') {
+                cbm_metrics_set_output(path);
+        }
+}
+
+bool cbm_metrics_enabled(void)
+{
+        return metrics.output != NULL;
+}
+
+void cbm_metrics_reset_kernels(void)
+{
+        for (size_t i = 0; i < metrics.n_kernels; i++) {
+                free(metrics.kernels[i].ktype);
+        }
+        metrics.n_kernels = 0;
+        metrics.kernels_known = true;
+}
+
+void cbm_metrics_count_kernel(const char *ktype)
+{
+        size_t i;
+
+        metrics.kernels_known = true;
+        for (i = 0; i < metrics.n_kernels; i++) {
+                if (streq(metrics.kernels[i].ktype, ktype)) {
+                        metrics.kernels[i].count++;
+                        return;
+                }
+        }
+        if (i == METRICS_MAX_KTYPES) {
+                return;
+        }
+        metrics.kernels[i].ktype = strdup(ktype);
+        if (!metrics.kernels[i].ktype) {
+                DECLARE_OOM();
+                return;
+        }
+        metrics.kernels[i].count = 1;
+        metrics.n_kernels++;
+}
+
+void cbm_metrics_set_boot_space(uint64_t free_bytes, uint64_t total_bytes)
+{
+        metrics.boot_free = free_bytes;
+        metrics.boot_total = total_bytes;
+        metrics.boot_known = true;
+}
+
+/**
+ * Return the metric a sample line belongs to, or METRIC_MAX
+ */
+static Metric metrics_line_metric(const char *line)
+{
+        size_t len = strcspn(line, "{ ");
+
+        for (int i = 0; i < METRIC_MAX; i++) {
+                if (strlen(metrics_table[i].name) == len &&
+                    strncmp(metrics_table[i].name, line, len) == 0) {
+                        return (Metric)i;
+                }
+        }
+        return METRIC_MAX;
+}
+
+/**
+ * Whether a sample line is labelled with @command
+ */
+static bool metrics_line_is_command(const char *line, const char *command)
+{
+        const char *label = strstr(line, "command=\"");
+        size_t len = strlen(command);
+
+        if (!label) {
+                return false;
+        }
+        label += strlen("command=\"");
+        return strncmp(label, command, len) == 0 && label[len] == '"';
+}
+
+/**
+ * Whether a sample from the previous file is carried over unchanged
+ */
+static bool metrics_keep_line(Metric metric, const char *line, const char *command)
+{
+        switch (metrics_table[metric].scope) {
+        case METRIC_SCOPE_KERNELS:
+                return !metrics.kernels_known;
+        case METRIC_SCOPE_BOOT:
+                return !metrics.boot_known;
+        default:
+                return !metrics_line_is_command(line, command);
+        }
+}
+
+typedef struct MetricsPhaseWriter {
+        CbmWriter *writer;
+        const char *command;
+} MetricsPhaseWriter;
+
+static void metrics_write_phase(const char *path, uint64_t total_ns,
+                                __cbm_unused__ unsigned long count, void *userdata)
+{
+        MetricsPhaseWriter *w = userdata;
+
+        cbm_writer_append_printf(w->writer,
+                                 "%s{command=\"%s\",phase=\"%s\"} %.6f\n",
+                                 metrics_table[METRIC_PHASE_DURATION].name,
+                                 w->command,
+                                 path,
+                                 (double)total_ns / 1e9);
+}
+
+/**
+ * Append the samples this run produced for @metric
+ */
+static void metrics_write_samples(CbmWriter *writer, Metric metric, const char *command,
+                                  bool success, double last_success, double last_failure)
+{
+        const char *name = metrics_table[metric].name;
+        struct timespec now = { 0 };
+        CbmStats stats = { 0 };
+
+        cbm_stats_get(&stats);
+
+        switch (metric) {
+        case METRIC_SUCCESS:
+                cbm_writer_append_printf(writer,
+                                         "%s{command=\"%s\"} %d\n",
+                                         name,
+                                         command,
+                                         success ? 1 : 0);
+                break;
+        case METRIC_LAST_SUCCESS:
+        case METRIC_LAST_FAILURE: {
+                double value = metric == METRIC_LAST_SUCCESS ? last_success : last_failure;
+
+                if ((metric == METRIC_LAST_SUCCESS) == success) {
+                        value = (double)time(NULL);
+                }
+                if (value > 0) {
+                        cbm_writer_append_printf(writer,
+                                                 "%s{command=\"%s\"} %.0f\n",
+                                                 name,
+                                                 command,
+                                                 value);
+                }
+                break;
+        }
+        case METRIC_DURATION:
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                cbm_writer_append_printf(writer,
+                                         "%s{command=\"%s\"} %.6f\n",
+                                         name,
+                                         command,
+                                         (double)(now.tv_sec - metrics.start.tv_sec) +
+                                             (double)(now.tv_nsec - metrics.start.tv_nsec) / 1e9);
+                break;
+        case METRIC_PHASE_DURATION: {
+                MetricsPhaseWriter w = { .writer = writer, .command = command };
+
+                cbm_trace_visit(metrics_write_phase, &w);
+                break;
+        }
+        case METRIC_BYTES_WRITTEN:
+                cbm_writer_append_printf(writer,
+                                         "%s{command=\"%s\"} %lu\n",
+                                         name,
+                                         command,
+                                         stats.bytes_written);
+                break;
+        case METRIC_FILES_SKIPPED:
+                cbm_writer_append_printf(writer,
+                                         "%s{command=\"%s\"} %lu\n",
+                                         name,
+                                         command,
+                                         stats.files_skipped);
+                break;
+        case METRIC_SYNCS:
+                cbm_writer_append_printf(writer,
+                                         "%s{command=\"%s\"} %lu\n",
+                                         name,
+                                         command,
+                                         stats.syncs);
+                break;
+        case METRIC_KERNELS:
+                for (size_t i = 0; i < metrics.n_kernels; i++) {
+                        cbm_writer_append_printf(writer,
+                                                 "%s{type=\"%s\"} %lu\n",
+                                                 name,
+                                                 metrics.kernels[i].ktype,
+                                                 metrics.kernels[i].count);
+                }
+                break;
+        case METRIC_BOOT_FREE:
+                if (metrics.boot_known) {
+                        cbm_writer_append_printf(writer,
+                                                 "%s %llu\n",
+                                                 name,
+                                                 (unsigned long long)metrics.boot_free);
+                }
+                break;
+        case METRIC_BOOT_SIZE:
+                if (metrics.boot_known) {
+                        cbm_writer_append_printf(writer,
+                                                 "%s %llu\n",
+                                                 name,
+                                                 (unsigned long long)metrics.boot_total);
+                }
+                break;
+        default:
+                break;
+        }
+}
+
+bool cbm_metrics_write(const char *path, const char *command, bool success)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *old = NULL;
+        char **lines = NULL;
+        size_t n_lines = 0;
+        char *saveptr = NULL;
+        double last_success = 0;
+        double last_failure = 0;
+        bool ret = false;
+
+        /* Pick up what the previous runs left behind */
+        if (nc_file_exists(path) && file_get_text(path, &old)) {
+                for (char *c = old; *c; c++) {
+                        n_lines += *c == '\n';
+                }
+                lines = calloc(n_lines + 1, sizeof(char *));
+                if (!lines) {
+                        DECLARE_OOM();
+                        return false;
+                }
+                n_lines = 0;
+                for (char *line = strtok_r(old, "\n", &saveptr); line;
+                     line = strtok_r(NULL, "\n", &saveptr)) {
+                        Metric metric = metrics_line_metric(line);
+                        const char *value = strrchr(line, ' ');
+
+                        if (line[0] == '#' || metric == METRIC_MAX) {
+                                continue;
+                        }
+                        if (value && metrics_line_is_command(line, command)) {
+                                if (metric == METRIC_LAST_SUCCESS) {
+                                        last_success = strtod(value + 1, NULL);
+                                } else if (metric == METRIC_LAST_FAILURE) {
+                                        last_failure = strtod(value + 1, NULL);
+                                }
+                        }
+                        lines[n_lines++] = line;
+                }
+        }
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                goto end;
+        }
+
+        for (int i = 0; i < METRIC_MAX; i++) {
+                Metric metric = (Metric)i;
+
+                cbm_writer_append_printf(writer,
+                                         "# HELP %s %s\n# TYPE %s gauge\n",
+                                         metrics_table[i].name,
+                                         metrics_table[i].help,
+                                         metrics_table[i].name);
+                for (size_t j = 0; j < n_lines; j++) {
+                        if (metrics_line_metric(lines[j]) == metric &&
+                            metrics_keep_line(metric, lines[j], command)) {
+                                cbm_writer_append_printf(writer, "%s\n", lines[j]);
+                        }
+                }
+                metrics_write_samples(writer,
+                                      metric,
+                                      command,
+                                      success,
+                                      last_success,
+                                      last_failure);
+        }
+
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                goto end;
+        }
+
+        if (!file_set_text_durable(path, writer->buffer)) {
+                LOG_ERROR("Failed to write metrics to %s: %s", path, strerror(errno));
+                goto end;
+        }
+        ret = true;
+
+end:
+        free(lines);
+        return ret;
+}
+
+void cbm_metrics_finish(const char *command, bool success)
+{
+        if (metrics.output) {
+                (void)cbm_metrics_write(metrics.output, command, success);
+        }
+        cbm_metrics_discard();
+}
+
+void cbm_metrics_discard(void)
+{
+        cbm_metrics_reset_kernels();
+        free(metrics.output);
+        metrics.output = NULL;
+        metrics.kernels_known = false;
+        metrics.boot_known = false;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
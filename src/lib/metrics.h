@@ -0,0 +1,82 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Export the outcome of a run to @path in the Prometheus text format, for
+ * node_exporter's textfile collector to pick up, or stop doing so with a
+ * NULL @path. Phase timings are recorded from here on.
+ */
+void cbm_metrics_set_output(const char *path);
+
+/**
+ * Unless already asked for, take the metrics file from the metrics_file
+ * configuration under @root, which may be NULL for "/". An empty or blank
+ * configuration leaves metrics off.
+ */
+void cbm_metrics_load_config(const char *root);
+
+/**
+ * Whether a metrics file has been asked for
+ */
+bool cbm_metrics_enabled(void);
+
+/**
+ * Forget the kernels counted so far
+ */
+void cbm_metrics_reset_kernels(void);
+
+/**
+ * Count one more available kernel of type @ktype
+ */
+void cbm_metrics_count_kernel(const char *ktype);
+
+/**
+ * Record the space left on the boot partition
+ */
+void cbm_metrics_set_boot_space(uint64_t free_bytes, uint64_t total_bytes);
+
+/**
+ * Write the metrics of the current run of @command to @path, keeping what
+ * other commands last recorded there, along with when this one last
+ * succeeded or failed. The file is replaced atomically.
+ */
+bool cbm_metrics_write(const char *path, const char *command, bool success);
+
+/**
+ * Write the requested metrics file for @command, then forget everything
+ * recorded along with the request
+ */
+void cbm_metrics_finish(const char *command, bool success);
+
+/**
+ * Forget everything recorded along with any requested metrics file
+ */
+void cbm_metrics_discard(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
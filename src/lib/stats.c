@@ -0,0 +1,98 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "stats.h"
+#include "util.h"
+
+CbmStats cbm_stats = { 0 };
+
+static bool cbm_stats_report = false;
+
+/**
+ * Printed names of each counter, in report order
+ */
+static const struct {
+        const char *name;
+        const unsigned long *value;
+} cbm_stats_fields[] = {
+        { "bytes compared", &cbm_stats.bytes_compared },
+        { "bytes written", &cbm_stats.bytes_written },
+        { "files copied", &cbm_stats.files_copied },
+        { "files skipped", &cbm_stats.files_skipped },
+        { "syncs", &cbm_stats.syncs },
+        { "directory scans", &cbm_stats.dir_scans },
+        { "blkid probes", &cbm_stats.probes },
+        { "EFI variable reads", &cbm_stats.efivar_reads },
+        { "EFI variable writes", &cbm_stats.efivar_writes },
+        { "EFI variable writes skipped", &cbm_stats.efivar_writes_skipped },
+        { "processes spawned", &cbm_stats.processes },
+        { "mounts", &cbm_stats.mounts },
+};
+
+void cbm_stats_get(CbmStats *stats)
+{
+        if (stats) {
+                *stats = cbm_stats;
+        }
+}
+
+void cbm_stats_reset(void)
+{
+        memset(&cbm_stats, 0, sizeof(cbm_stats));
+}
+
+void cbm_stats_print(FILE *out)
+{
+        fprintf(out, "I/O statistics:\n");
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_stats_fields); i++) {
+                fprintf(out,
+                        "  %-28s %12lu\n",
+                        cbm_stats_fields[i].name,
+                        *cbm_stats_fields[i].value);
+        }
+}
+
+void cbm_stats_enable_report(void)
+{
+        cbm_stats_report = true;
+}
+
+void cbm_stats_finish(void)
+{
+        if (cbm_stats_report) {
+                cbm_stats_print(stderr);
+        }
+        cbm_stats_discard();
+}
+
+void cbm_stats_discard(void)
+{
+        cbm_stats_report = false;
+        cbm_stats_reset();
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
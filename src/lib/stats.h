@@ -0,0 +1,88 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+/**
+ * I/O and system calls made since the last reset
+ */
+typedef struct CbmStats {
+        unsigned long bytes_compared; /**<Bytes read by cbm_files_match */
+        unsigned long bytes_written;  /**<Bytes written by copies and text writes */
+        unsigned long files_copied;
+        unsigned long files_skipped;  /**<Comparisons finding the target already up to date */
+        unsigned long syncs;          /**<sync() and fsync() requests, even if syncing is off */
+        unsigned long dir_scans;
+        unsigned long probes; /**<blkid probes opened */
+        unsigned long efivar_reads;
+        unsigned long efivar_writes;
+        unsigned long efivar_writes_skipped; /**<Writes that wouldn't have changed the value */
+        unsigned long processes; /**<Commands spawned through cbm_system_system */
+        unsigned long mounts;
+} CbmStats;
+
+/**
+ * Counters of the current run, only to be updated through CBM_STATS_ADD
+ */
+extern CbmStats cbm_stats;
+
+/**
+ * Add @n to the @field counter of the current run
+ */
+#define CBM_STATS_ADD(field, n) (cbm_stats.field += (unsigned long)(n))
+
+/**
+ * Copy the counters of the current run into @stats
+ */
+void cbm_stats_get(CbmStats *stats);
+
+/**
+ * Zero all counters
+ */
+void cbm_stats_reset(void);
+
+/**
+ * Print all counters to @out
+ */
+void cbm_stats_print(FILE *out);
+
+/**
+ * Have cbm_stats_finish print the counters to stderr
+ */
+void cbm_stats_enable_report(void);
+
+/**
+ * Produce the requested report, then zero the counters and forget the
+ * request
+ */
+void cbm_stats_finish(void);
+
+/**
+ * Zero the counters and forget any requested report
+ */
+void cbm_stats_discard(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
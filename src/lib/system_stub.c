@@ -18,6 +18,9 @@
 
 #include "files.h"
 #include "log.h"
+#include "stats.h"
+#include "topology.h"
+#include "trace.h"
 
 /**
  * Factory function to convert a dev_t to the full device path
@@ -68,6 +71,12 @@ static CbmSystemOps *system_ops = &default_system_ops;
 void cbm_system_reset_vtable(void)
 {
         system_ops = &default_system_ops;
+        cbm_topology_reset();
+}
+
+bool cbm_system_is_default_vtable(void)
+{
+        return system_ops == &default_system_ops;
 }
 
 void cbm_system_set_vtable(CbmSystemOps *ops)
@@ -76,6 +85,7 @@ void cbm_system_set_vtable(CbmSystemOps *ops)
                 cbm_system_reset_vtable();
         } else {
                 system_ops = ops;
+                cbm_topology_reset();
         }
         /* Ensure the vtable is valid at this point. */
         assert(system_ops->mount != NULL);
@@ -91,6 +101,7 @@ void cbm_system_set_vtable(CbmSystemOps *ops)
 int cbm_system_mount(const char *source, const char *target, const char *filesystemtype,
                      unsigned long mountflags, const void *data)
 {
+        CBM_STATS_ADD(mounts, 1);
         return system_ops->mount(source, target, filesystemtype, mountflags, data);
 }
 
@@ -101,6 +112,8 @@ int cbm_system_umount(const char *target)
 
 int cbm_system_system(const char *command)
 {
+        CBM_TRACE_SCOPE("system");
+        CBM_STATS_ADD(processes, 1);
         return system_ops->system(command);
 }
 
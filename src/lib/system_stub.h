@@ -54,6 +54,11 @@ void cbm_system_reset_vtable(void);
  */
 void cbm_system_set_vtable(CbmSystemOps *ops);
 
+/**
+ * Returns true if the default passthrough vtable is in use
+ */
+bool cbm_system_is_default_vtable(void);
+
 /**
  * Wrap the mount syscall
  */
@@ -0,0 +1,837 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "blkid_stub.h"
+#include "config.h"
+#include "gpt.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "system_stub.h"
+#include "topology.h"
+#include "util.h"
+
+#define TOPOLOGY_CACHE_FILE "topology"
+
+/**
+ * udev's record of each block device, holding the superblock it last saw
+ */
+#define TOPOLOGY_UDEV_DATA_DIR "/run/udev/data"
+
+/**
+ * Devices seen during this run. There are only ever a handful, so a flat
+ * array is plenty.
+ */
+static CbmTopologyDevice **topology_devices = NULL;
+static size_t topology_n_devices = 0;
+static bool topology_loaded = false;
+static bool topology_dirty = false;
+
+static void cbm_topology_load(void);
+
+/**
+ * Forget everything known about @d, keeping only the device itself
+ */
+static void cbm_topology_device_clear(CbmTopologyDevice *d)
+{
+        dev_t dev = d->dev;
+
+        free(d->uuid);
+        free(d->part_uuid);
+        free(d->fstype);
+        free(d->devpath);
+        free(d->luks_uuid);
+        free(d->table_type);
+        for (int i = 0; i < d->n_partitions; i++) {
+                free(d->partitions[i].part_uuid);
+        }
+        free(d->partitions);
+        memset(d, 0, sizeof(*d));
+        d->dev = dev;
+}
+
+static void cbm_topology_device_free(CbmTopologyDevice *d)
+{
+        cbm_topology_device_clear(d);
+        free(d);
+}
+
+void cbm_topology_reset(void)
+{
+        for (size_t i = 0; i < topology_n_devices; i++) {
+                cbm_topology_device_free(topology_devices[i]);
+        }
+        free(topology_devices);
+        topology_devices = NULL;
+        topology_n_devices = 0;
+        topology_loaded = false;
+        topology_dirty = false;
+}
+
+static CbmTopologyDevice *cbm_topology_lookup(dev_t dev)
+{
+        CbmTopologyDevice **devices = NULL;
+        CbmTopologyDevice *d = NULL;
+
+        if (!topology_loaded) {
+                topology_loaded = true;
+                cbm_topology_load();
+        }
+
+        for (size_t i = 0; i < topology_n_devices; i++) {
+                if (topology_devices[i]->dev == dev) {
+                        return topology_devices[i];
+                }
+        }
+
+        d = calloc(1, sizeof(CbmTopologyDevice));
+        if (!d) {
+                return NULL;
+        }
+        devices = realloc(topology_devices, (topology_n_devices + 1) * sizeof(*devices));
+        if (!devices) {
+                free(d);
+                return NULL;
+        }
+
+        d->dev = dev;
+        topology_devices = devices;
+        topology_devices[topology_n_devices++] = d;
+        return d;
+}
+
+static bool cbm_topology_dup(char **out, const char *value)
+{
+        if (!value) {
+                return true;
+        }
+        *out = strdup(value);
+        return *out != NULL;
+}
+
+const CbmTopologyDevice *cbm_topology_probe(dev_t dev)
+{
+        CbmTopologyDevice *d = NULL;
+        autofree(char) *devnode = NULL;
+        blkid_probe probe = NULL;
+        const char *value = NULL;
+
+        d = cbm_topology_lookup(dev);
+        if (!d) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        if (d->probed) {
+                return d->probe_ok ? d : NULL;
+        }
+        d->probed = true;
+
+        devnode = cbm_system_devnode_to_devpath(dev);
+        if (!devnode) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        probe = cbm_blkid_new_probe_from_filename(devnode);
+        if (!probe) {
+                LOG_ERROR("Unable to probe %u:%u", major(dev), minor(dev));
+                return NULL;
+        }
+
+        cbm_blkid_probe_enable_superblocks(probe, 1);
+        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_UUID);
+        cbm_blkid_probe_enable_partitions(probe, 1);
+        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+
+        if (cbm_blkid_do_safeprobe(probe) != 0) {
+                LOG_ERROR("Error probing filesystem of %s: %s", devnode, strerror(errno));
+                goto clean;
+        }
+
+        if (cbm_blkid_probe_lookup_value(probe, "PART_ENTRY_UUID", &value, NULL) == 0 &&
+            !cbm_topology_dup(&d->part_uuid, value)) {
+                DECLARE_OOM();
+                goto clean;
+        }
+        if (cbm_blkid_probe_lookup_value(probe, "UUID", &value, NULL) == 0 &&
+            !cbm_topology_dup(&d->uuid, value)) {
+                DECLARE_OOM();
+                goto clean;
+        }
+        if (cbm_blkid_probe_lookup_value(probe, "TYPE", &value, NULL) == 0 &&
+            !cbm_topology_dup(&d->fstype, value)) {
+                DECLARE_OOM();
+                goto clean;
+        }
+
+        d->probe_ok = true;
+        topology_dirty = true;
+
+clean:
+        cbm_blkid_free_probe(probe);
+        return d->probe_ok ? d : NULL;
+}
+
+const CbmTopologyDevice *cbm_topology_get_parent(dev_t dev)
+{
+        CbmTopologyDevice *d = NULL;
+        CbmTopologyDevice *disk = NULL;
+        autofree(char) *node = NULL;
+        dev_t whole = 0;
+
+        d = cbm_topology_lookup(dev);
+        if (!d) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        if (d->parent_state == 0) {
+                d->parent_state = -1;
+
+                if (cbm_blkid_devno_to_wholedisk(dev, NULL, 0, &whole) < 0) {
+                        return NULL;
+                }
+
+                node = string_printf("%s/block/%u:%u",
+                                     cbm_system_get_devfs_path(),
+                                     major(whole),
+                                     minor(whole));
+                disk = cbm_topology_lookup(whole);
+                if (!disk) {
+                        DECLARE_OOM();
+                        return NULL;
+                }
+                if (!disk->devpath) {
+                        disk->devpath = realpath(node, NULL);
+                        if (!disk->devpath) {
+                                /* Node not there (yet), look again next time */
+                                d->parent_state = 0;
+                                return NULL;
+                        }
+                }
+
+                d->parent = whole;
+                d->parent_state = 1;
+                topology_dirty = true;
+        }
+
+        if (d->parent_state < 0) {
+                return NULL;
+        }
+
+        disk = cbm_topology_lookup(d->parent);
+        return disk && disk->devpath ? disk : NULL;
+}
+
+/**
+ * Fill in the partition table of @disk from a single read of its primary GPT
+ */
+static bool cbm_topology_read_gpt(CbmTopologyDevice *disk)
+{
+        autofree(CbmGptTable) *gpt = NULL;
+
+        gpt = cbm_gpt_read(disk->devpath);
+        if (!gpt) {
+                return false;
+        }
+
+        disk->table_type = strdup("gpt");
+        if (!disk->table_type) {
+                goto oom;
+        }
+
+        if (gpt->n_partitions > 0) {
+                disk->partitions = calloc((size_t)gpt->n_partitions, sizeof(CbmTopologyPartition));
+                if (!disk->partitions) {
+                        goto oom;
+                }
+        }
+
+        for (int i = 0; i < gpt->n_partitions; i++) {
+                disk->partitions[i].flags = gpt->partitions[i].attributes;
+                disk->partitions[i].part_uuid = strdup(gpt->partitions[i].unique_guid);
+                if (!disk->partitions[i].part_uuid) {
+                        goto oom;
+                }
+                disk->n_partitions = i + 1;
+        }
+
+        /* Both CRCs matched, nothing for a safe probe to add */
+        disk->table_safe = true;
+        return true;
+
+oom:
+        DECLARE_OOM();
+        for (int i = 0; i < disk->n_partitions; i++) {
+                free(disk->partitions[i].part_uuid);
+        }
+        free(disk->partitions);
+        free(disk->table_type);
+        disk->partitions = NULL;
+        disk->table_type = NULL;
+        disk->n_partitions = 0;
+        return false;
+}
+
+const CbmTopologyDevice *cbm_topology_get_table(dev_t dev)
+{
+        CbmTopologyDevice *disk = NULL;
+        blkid_probe probe = NULL;
+        blkid_partlist parts = NULL;
+        blkid_parttable table = NULL;
+        const char *table_type = NULL;
+        int n = 0;
+
+        disk = (CbmTopologyDevice *)cbm_topology_get_parent(dev);
+        if (!disk) {
+                return NULL;
+        }
+
+        if (disk->table_probed) {
+                return disk->n_partitions > 0 ? disk : NULL;
+        }
+        disk->table_probed = true;
+
+        /* Native GPT first, with libblkid for everything else */
+        if (cbm_topology_read_gpt(disk)) {
+                topology_dirty = true;
+                return disk->n_partitions > 0 ? disk : NULL;
+        }
+
+        probe = cbm_blkid_new_probe_from_filename(disk->devpath);
+        if (!probe) {
+                LOG_ERROR("Unable to blkid probe %s", disk->devpath);
+                return NULL;
+        }
+
+        cbm_blkid_probe_enable_superblocks(probe, 1);
+        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
+        cbm_blkid_probe_enable_partitions(probe, 1);
+        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+
+        /* The partition list is still usable when a safe probe is ambivalent */
+        disk->table_safe = cbm_blkid_do_safeprobe(probe) == 0;
+        if (!disk->table_safe) {
+                LOG_ERROR("Error probing filesystem of %s: %s", disk->devpath, strerror(errno));
+        }
+
+        parts = cbm_blkid_probe_get_partitions(probe);
+        n = cbm_blkid_partlist_numof_partitions(parts);
+        if (n <= 0) {
+                /* No partitions */
+                goto clean;
+        }
+
+        disk->partitions = calloc((size_t)n, sizeof(CbmTopologyPartition));
+        if (!disk->partitions) {
+                DECLARE_OOM();
+                goto clean;
+        }
+
+        for (int i = 0; i < n; i++) {
+                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
+
+                disk->partitions[i].flags = cbm_blkid_partition_get_flags(part);
+                if (!cbm_topology_dup(&disk->partitions[i].part_uuid,
+                                      cbm_blkid_partition_get_uuid(part))) {
+                        DECLARE_OOM();
+                        goto clean;
+                }
+                disk->n_partitions = i + 1;
+        }
+
+        if (disk->table_safe) {
+                table = cbm_blkid_partlist_get_table(parts);
+                if (!table) {
+                        LOG_ERROR("Unable to discover partition table for %s: %s",
+                                  disk->devpath,
+                                  strerror(errno));
+                        goto clean;
+                }
+                table_type = cbm_blkid_parttable_get_type(table);
+                if (!cbm_topology_dup(&disk->table_type, table_type)) {
+                        DECLARE_OOM();
+                        goto clean;
+                }
+        }
+
+        topology_dirty = true;
+
+clean:
+        cbm_blkid_free_probe(probe);
+        errno = 0;
+        return disk->n_partitions > 0 ? disk : NULL;
+}
+
+/**
+ * Convert a sysfs dev file to its dev_t
+ */
+static bool cbm_topology_read_devfile(const char *devfile, dev_t *dev)
+{
+        int fd = 0;
+        unsigned int dev_major, dev_minor = 0;
+        char read_buf[64] = { 0 };
+        ssize_t size = -1;
+
+        fd = open(devfile, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+
+        size = read(fd, read_buf, sizeof(read_buf) - 1);
+        close(fd);
+        if (size < 1) {
+                return false;
+        }
+
+        if (sscanf(read_buf, "%u:%u", &dev_major, &dev_minor) != 2) {
+                return false;
+        }
+
+        *dev = makedev(dev_major, dev_minor);
+        return true;
+}
+
+const char *cbm_topology_get_luks_uuid(dev_t dev, const char *name)
+{
+        CbmTopologyDevice *d = NULL;
+        const CbmTopologyDevice *slave = NULL;
+        autofree(char) *npath = NULL;
+        glob_t glo = { 0 };
+        dev_t slave_dev = 0;
+        bool found = false;
+
+        d = cbm_topology_lookup(dev);
+        if (!d) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        if (d->luks_probed) {
+                return d->luks_uuid;
+        }
+        d->luks_probed = true;
+
+        /* i.e. /sys/block/dm-1/slaves/dm-0/slaves/sdb1/dev
+         * or /sys/block/dm-1/slaves/sdb1/dev
+         */
+        npath = string_printf("%s/block/%s/slaves/*{,/slaves/*}/dev",
+                              cbm_system_get_sysfs_path(),
+                              name);
+
+        glob(npath, GLOB_DOOFFS | GLOB_BRACE, NULL, &glo);
+        if (glo.gl_pathc > 0) {
+                found = cbm_topology_read_devfile(glo.gl_pathv[0], &slave_dev);
+        }
+        globfree(&glo);
+        if (!found) {
+                return NULL;
+        }
+
+        /* Ensure that this parent disk really is LUKS */
+        slave = cbm_topology_probe(slave_dev);
+        if (!slave || !slave->fstype || !streq(slave->fstype, "crypto_LUKS")) {
+                return NULL;
+        }
+
+        if (!cbm_topology_dup(&d->luks_uuid, slave->uuid)) {
+                DECLARE_OOM();
+        }
+        return d->luks_uuid;
+}
+
+#if defined(TOPOLOGY_CACHE_DIR)
+
+/**
+ * Persistent cache
+ *
+ * Only enabled with a cache directory configured and the real blkid and
+ * system implementations in use, as anything else would poison later runs.
+ */
+static bool cbm_topology_persistent(void)
+{
+        return cbm_blkid_is_default_vtable() && cbm_system_is_default_vtable();
+}
+
+static uint64_t cbm_topology_mix(uint64_t hash, const char *s)
+{
+        for (; *s; s++) {
+                hash ^= (unsigned char)*s;
+                hash *= 1099511628211ULL;
+        }
+        return hash;
+}
+
+static uint64_t cbm_topology_mix_file(uint64_t hash, const char *path)
+{
+        char buf[64] = { 0 };
+        ssize_t r = 0;
+        int fd = -1;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return hash;
+        }
+        r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (r > 0) {
+                hash = cbm_topology_mix(hash, buf);
+        }
+        return hash;
+}
+
+/**
+ * Compute the partition table generation of @disk: the disk size plus the
+ * name, start and size of every partition from sysfs, and the GPT header CRC
+ * which covers the disk GUID and every entry. Returns 0 if unknown.
+ */
+static uint64_t cbm_topology_generation(dev_t disk)
+{
+        autofree(char) *dir_path = NULL;
+        autofree(char) *size_path = NULL;
+        autofree(char) *node = NULL;
+        DIR *dir = NULL;
+        struct dirent *ent = NULL;
+        uint64_t hash = 14695981039346656037ULL;
+        uint64_t parts = 0;
+        uint32_t crc = 0;
+
+        dir_path = string_printf("%s/dev/block/%u:%u",
+                                 cbm_system_get_sysfs_path(),
+                                 major(disk),
+                                 minor(disk));
+        CBM_STATS_ADD(dir_scans, 1);
+        dir = opendir(dir_path);
+        if (!dir) {
+                return 0;
+        }
+
+        size_path = string_printf("%s/size", dir_path);
+        hash = cbm_topology_mix_file(hash, size_path);
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *part = NULL;
+                autofree(char) *start = NULL;
+                autofree(char) *size = NULL;
+                uint64_t h = 14695981039346656037ULL;
+
+                part = string_printf("%s/%s/partition", dir_path, ent->d_name);
+                if (ent->d_name[0] == '.' || access(part, F_OK) != 0) {
+                        continue;
+                }
+                start = string_printf("%s/%s/start", dir_path, ent->d_name);
+                size = string_printf("%s/%s/size", dir_path, ent->d_name);
+
+                h = cbm_topology_mix(h, ent->d_name);
+                h = cbm_topology_mix_file(h, start);
+                h = cbm_topology_mix_file(h, size);
+                /* Order independent */
+                parts += h;
+        }
+        closedir(dir);
+        hash ^= parts;
+
+        /* Two sectors, still far cheaper than the probes being skipped */
+        node = string_printf("%s/block/%u:%u", cbm_system_get_devfs_path(), major(disk), minor(disk));
+        if (cbm_gpt_read_header_crc(node, &crc)) {
+                hash ^= crc;
+                hash *= 1099511628211ULL;
+        }
+
+        return hash ? hash : 1;
+}
+
+/**
+ * Mix the superblock udev last saw on @dev into @hash, so that a filesystem
+ * recreated in place is probed again. Returns 0 if udev has no record.
+ */
+static uint64_t cbm_topology_mix_superblock(uint64_t hash, dev_t dev)
+{
+        autofree(char) *path = NULL;
+        autofree(FILE) *f = NULL;
+        char *line = NULL;
+        size_t sn = 0;
+
+        path = string_printf("%s/b%u:%u", TOPOLOGY_UDEV_DATA_DIR, major(dev), minor(dev));
+        f = fopen(path, "r");
+        if (!f) {
+                return 0;
+        }
+
+        while (getline(&line, &sn, f) > 0) {
+                if (strncmp(line, "E:ID_FS_UUID=", 13) == 0 ||
+                    strncmp(line, "E:ID_FS_TYPE=", 13) == 0) {
+                        hash = cbm_topology_mix(hash, line);
+                }
+        }
+        free(line);
+
+        return hash ? hash : 1;
+}
+
+/**
+ * Device-mapper devices can be remapped at any time, they are never persisted
+ */
+static bool cbm_topology_is_dm(dev_t dev)
+{
+        autofree(char) *path = NULL;
+
+        path = string_printf("%s/dev/block/%u:%u/dm",
+                             cbm_system_get_sysfs_path(),
+                             major(dev),
+                             minor(dev));
+        return access(path, F_OK) == 0;
+}
+
+/**
+ * The generation an entry is keyed on: that of its whole disk, plus its own
+ * superblock when one was probed. Returns 0 if the entry must not be kept.
+ */
+static uint64_t cbm_topology_entry_generation(CbmTopologyDevice *d)
+{
+        CbmTopologyDevice *disk = d;
+
+        if (cbm_topology_is_dm(d->dev)) {
+                return 0;
+        }
+
+        if (d->parent_state > 0) {
+                disk = cbm_topology_lookup(d->parent);
+        } else if (!d->devpath) {
+                /* Neither a partition nor a disk */
+                return 0;
+        }
+
+        if (!disk || cbm_topology_is_dm(disk->dev)) {
+                return 0;
+        }
+        if (!disk->generation) {
+                disk->generation = cbm_topology_generation(disk->dev);
+        }
+        if (!disk->generation || !(d->probed && d->probe_ok)) {
+                return disk->generation;
+        }
+        return cbm_topology_mix_superblock(disk->generation, d->dev);
+}
+
+static const char *cbm_topology_str(const char *s)
+{
+        return s ? s : "-";
+}
+
+static char *cbm_topology_unstr(const char *s)
+{
+        return streq(s, "-") ? NULL : strdup(s);
+}
+
+static bool cbm_topology_parse_dev(const char *s, dev_t *dev)
+{
+        unsigned int dev_major, dev_minor = 0;
+
+        if (sscanf(s, "%u:%u", &dev_major, &dev_minor) != 2) {
+                return false;
+        }
+        *dev = makedev(dev_major, dev_minor);
+        return true;
+}
+
+/**
+ * Restore a single line written by cbm_topology_save
+ */
+static void cbm_topology_load_line(char *line)
+{
+        CbmTopologyDevice *d = NULL;
+        char *saveptr = NULL;
+        char *tok = NULL;
+        dev_t dev = 0;
+        uint64_t generation = 0;
+        int part = 0;
+
+        tok = strtok_r(line, " \n", &saveptr);
+        if (!tok || !cbm_topology_parse_dev(tok, &dev)) {
+                return;
+        }
+        tok = strtok_r(NULL, " \n", &saveptr);
+        if (!tok || sscanf(tok, "%" SCNx64, &generation) != 1) {
+                return;
+        }
+
+        d = cbm_topology_lookup(dev);
+        if (!d || d->probed || d->parent_state || d->table_probed || d->devpath) {
+                return;
+        }
+
+        while ((tok = strtok_r(NULL, " \n", &saveptr)) != NULL) {
+                char *value = strchr(tok, '=');
+                if (!value) {
+                        continue;
+                }
+                *value++ = '\0';
+
+                if (streq(tok, "parent") && cbm_topology_parse_dev(value, &d->parent)) {
+                        d->parent_state = 1;
+                } else if (streq(tok, "path")) {
+                        d->devpath = cbm_topology_unstr(value);
+                } else if (streq(tok, "uuid")) {
+                        d->probed = d->probe_ok = true;
+                        d->uuid = cbm_topology_unstr(value);
+                } else if (streq(tok, "partuuid")) {
+                        d->part_uuid = cbm_topology_unstr(value);
+                } else if (streq(tok, "fstype")) {
+                        d->fstype = cbm_topology_unstr(value);
+                } else if (streq(tok, "table")) {
+                        d->table_probed = true;
+                        d->table_type = cbm_topology_unstr(value);
+                } else if (streq(tok, "safe")) {
+                        d->table_safe = streq(value, "1");
+                } else if (streq(tok, "parts")) {
+                        int n = atoi(value);
+                        if (n > 0 && !d->partitions) {
+                                d->partitions = calloc((size_t)n, sizeof(CbmTopologyPartition));
+                                d->n_partitions = d->partitions ? n : 0;
+                        }
+                } else if (streq(tok, "part") && part < d->n_partitions) {
+                        char *flags = strchr(value, ',');
+                        if (flags) {
+                                *flags++ = '\0';
+                                d->partitions[part].flags = strtoull(flags, NULL, 16);
+                        }
+                        d->partitions[part++].part_uuid = cbm_topology_unstr(value);
+                }
+        }
+
+        /* Stale if the partition table or superblock changed since it was written */
+        if (cbm_topology_entry_generation(d) != generation) {
+                cbm_topology_device_clear(d);
+        }
+}
+#endif
+
+static void cbm_topology_load(void)
+{
+#if defined(TOPOLOGY_CACHE_DIR)
+        autofree(FILE) *f = NULL;
+        char *line = NULL;
+        size_t sn = 0;
+
+        if (!cbm_topology_persistent()) {
+                return;
+        }
+
+        f = fopen(TOPOLOGY_CACHE_DIR "/" TOPOLOGY_CACHE_FILE, "r");
+        if (!f) {
+                return;
+        }
+
+        while (getline(&line, &sn, f) > 0) {
+                cbm_topology_load_line(line);
+        }
+        free(line);
+#endif
+}
+
+void cbm_topology_save(void)
+{
+#if defined(TOPOLOGY_CACHE_DIR)
+        autofree(char) *tmp = NULL;
+        FILE *f = NULL;
+
+        if (!topology_dirty || !cbm_topology_persistent()) {
+                return;
+        }
+
+        if (!nc_mkdir_p(TOPOLOGY_CACHE_DIR, 00755)) {
+                LOG_DEBUG("Not caching topology: %s", strerror(errno));
+                return;
+        }
+
+        tmp = string_printf("%s/.%s.%d", TOPOLOGY_CACHE_DIR, TOPOLOGY_CACHE_FILE, getpid());
+        f = fopen(tmp, "w");
+        if (!f) {
+                LOG_DEBUG("Not caching topology: %s", strerror(errno));
+                return;
+        }
+
+        for (size_t i = 0; i < topology_n_devices; i++) {
+                CbmTopologyDevice *d = topology_devices[i];
+                uint64_t generation = cbm_topology_entry_generation(d);
+
+                if (!generation) {
+                        continue;
+                }
+
+                fprintf(f, "%u:%u %" PRIx64, major(d->dev), minor(d->dev), generation);
+                if (d->parent_state > 0) {
+                        fprintf(f, " parent=%u:%u", major(d->parent), minor(d->parent));
+                }
+                if (d->devpath) {
+                        fprintf(f, " path=%s", d->devpath);
+                }
+                if (d->probed && d->probe_ok) {
+                        fprintf(f,
+                                " uuid=%s partuuid=%s fstype=%s",
+                                cbm_topology_str(d->uuid),
+                                cbm_topology_str(d->part_uuid),
+                                cbm_topology_str(d->fstype));
+                }
+                if (d->table_probed) {
+                        fprintf(f,
+                                " table=%s safe=%d parts=%d",
+                                cbm_topology_str(d->table_type),
+                                d->table_safe,
+                                d->n_partitions);
+                        for (int j = 0; j < d->n_partitions; j++) {
+                                fprintf(f,
+                                        " part=%s,%llx",
+                                        cbm_topology_str(d->partitions[j].part_uuid),
+                                        d->partitions[j].flags);
+                        }
+                }
+                fputc('\n', f);
+        }
+
+        if (fclose(f) != 0 || rename(tmp, TOPOLOGY_CACHE_DIR "/" TOPOLOGY_CACHE_FILE) != 0) {
+                LOG_DEBUG("Not caching topology: %s", strerror(errno));
+                unlink(tmp);
+                return;
+        }
+        topology_dirty = false;
+#endif
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,112 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * A partition as listed in the table of its whole disk
+ */
+typedef struct CbmTopologyPartition {
+        char *part_uuid;           /**<PartUUID, NULL for non GPT tables */
+        unsigned long long flags;  /**<Partition flags, i.e. the legacy boot flag */
+} CbmTopologyPartition;
+
+/**
+ * Everything clr-boot-manager learns about a single block device during a
+ * run. Each part is filled in on first use and never probed again.
+ */
+typedef struct CbmTopologyDevice {
+        dev_t dev; /**<The device itself */
+
+        /* Superblock probe of the device */
+        bool probed;     /**<Superblock values have been looked up */
+        bool probe_ok;   /**<The superblock probe succeeded */
+        char *uuid;      /**<Filesystem UUID */
+        char *part_uuid; /**<PartUUID of the partition entry */
+        char *fstype;    /**<Superblock TYPE, i.e. "vfat" */
+
+        /* Whole disk */
+        int parent_state;  /**<0 if unknown, 1 if found, -1 if there is none */
+        dev_t parent;      /**<Whole disk holding this device */
+        char *devpath;     /**<Resolved /dev path, for whole disks */
+
+        /* Parent LUKS device, for device-mapper devices */
+        bool luks_probed;
+        char *luks_uuid;
+
+        /* Partition table, for whole disks */
+        bool table_probed;
+        bool table_safe;   /**<The disk passed a safe probe */
+        char *table_type;  /**<i.e. "gpt" or "dos" */
+        int n_partitions;
+        CbmTopologyPartition *partitions;
+
+        uint64_t generation; /**<Partition table generation, for whole disks */
+} CbmTopologyDevice;
+
+/**
+ * Return the superblock details of @dev, probing it on first use.
+ * Returns NULL if the device cannot be probed.
+ *
+ * @note The device is owned by the topology cache, do not modify or free
+ */
+const CbmTopologyDevice *cbm_topology_probe(dev_t dev);
+
+/**
+ * Return the whole disk holding @dev, looking it up on first use.
+ * Returns NULL if @dev is not a partition of a block device.
+ */
+const CbmTopologyDevice *cbm_topology_get_parent(dev_t dev);
+
+/**
+ * Return the partition table of the disk holding @dev, probing it on first
+ * use. Returns NULL if there is no such disk or it has no partitions.
+ */
+const CbmTopologyDevice *cbm_topology_get_table(dev_t dev);
+
+/**
+ * Return the UUID of the LUKS device underneath the device-mapper device
+ * @dev, named @name within sysfs, or NULL if it is not backed by LUKS.
+ */
+const char *cbm_topology_get_luks_uuid(dev_t dev, const char *name);
+
+/**
+ * Write any newly probed devices to the persistent cache under /run, so that
+ * later invocations can skip probing entirely. Entries are keyed by device,
+ * the partition table generation of their disk and the superblock udev last
+ * saw on them. Device-mapper devices are never persisted.
+ */
+void cbm_topology_save(void);
+
+/**
+ * Forget everything probed so far. Called whenever the blkid or system
+ * vtables change.
+ */
+void cbm_topology_reset(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,357 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+#include "util.h"
+
+/**
+ * Spans are aggregated into a tree of nodes as they close, one node per
+ * distinct name under a given parent, which is all the summary needs. The
+ * individual spans are only kept around for the trace file, and only up to
+ * a fixed number of them.
+ *
+ * While nothing asked for a trace, opening a span is a single test.
+ */
+
+#define TRACE_MAX_DEPTH 32
+#define TRACE_MAX_EVENTS 65536
+
+typedef struct TraceNode {
+        const char *name;
+        int parent;             /**<Index of the parent node, or -1 */
+        uint64_t total_ns;      /**<Time spent in all spans of this node */
+        unsigned long count;    /**<Number of spans of this node */
+} TraceNode;
+
+typedef struct TraceEvent {
+        int node;
+        uint64_t start_ns;
+        uint64_t end_ns;
+} TraceEvent;
+
+typedef struct TraceFrame {
+        int node;
+        size_t event;           /**<Index in events, or TRACE_MAX_EVENTS if not kept */
+        uint64_t start_ns;
+} TraceFrame;
+
+static struct {
+        bool enabled;
+        bool report;
+        char *output;
+        uint64_t epoch_ns;
+        TraceNode *nodes;
+        int n_nodes;
+        int nodes_alloc;
+        TraceEvent *events;
+        size_t n_events;
+        size_t events_alloc;
+        TraceFrame stack[TRACE_MAX_DEPTH];
+        int depth;
+} trace = { 0 };
+
+static uint64_t trace_now(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_start(void)
+{
+        if (!trace.enabled) {
+                trace.enabled = true;
+                trace.epoch_ns = trace_now();
+        }
+}
+
+void cbm_trace_init(void)
+{
+        const char *path = getenv("CBM_TRACE");
+
+        if (path && path[0] != '\0') {
+                cbm_trace_set_output(path);
+        }
+}
+
+void cbm_trace_enable(void)
+{
+        trace_start();
+}
+
+void cbm_trace_enable_report(void)
+{
+        trace.report = true;
+        trace_start();
+}
+
+void cbm_trace_set_output(const char *path)
+{
+        free(trace.output);
+        trace.output = NULL;
+        if (!path) {
+                return;
+        }
+        trace.output = strdup(path);
+        if (!trace.output) {
+                DECLARE_OOM();
+                return;
+        }
+        trace_start();
+}
+
+bool cbm_trace_enabled(void)
+{
+        return trace.enabled;
+}
+
+static int trace_get_node(const char *name, int parent)
+{
+        TraceNode *node = NULL;
+
+        for (int i = trace.n_nodes - 1; i >= 0; i--) {
+                if (trace.nodes[i].parent == parent && streq(trace.nodes[i].name, name)) {
+                        return i;
+                }
+        }
+
+        if (trace.n_nodes == trace.nodes_alloc) {
+                int alloc = trace.nodes_alloc ? trace.nodes_alloc * 2 : 32;
+                TraceNode *nodes = realloc(trace.nodes, sizeof(TraceNode) * (size_t)alloc);
+
+                if (!nodes) {
+                        return -1;
+                }
+                trace.nodes = nodes;
+                trace.nodes_alloc = alloc;
+        }
+
+        node = &trace.nodes[trace.n_nodes];
+        *node = (TraceNode){ .name = name, .parent = parent };
+        return trace.n_nodes++;
+}
+
+static size_t trace_add_event(int node, uint64_t start_ns)
+{
+        if (!trace.output || trace.n_events == TRACE_MAX_EVENTS) {
+                return TRACE_MAX_EVENTS;
+        }
+
+        if (trace.n_events == trace.events_alloc) {
+                size_t alloc = trace.events_alloc ? trace.events_alloc * 2 : 256;
+                TraceEvent *events = realloc(trace.events, sizeof(TraceEvent) * alloc);
+
+                if (!events) {
+                        return TRACE_MAX_EVENTS;
+                }
+                trace.events = events;
+                trace.events_alloc = alloc;
+        }
+
+        trace.events[trace.n_events] = (TraceEvent){ .node = node, .start_ns = start_ns };
+        return trace.n_events++;
+}
+
+CbmTraceSpan cbm_trace_begin(const char *name)
+{
+        TraceFrame *frame = NULL;
+        int depth;
+
+        if (!trace.enabled) {
+                return -1;
+        }
+
+        depth = trace.depth++;
+        if (depth >= TRACE_MAX_DEPTH) {
+                /* Too deep to record, but still closed in order */
+                return depth;
+        }
+
+        frame = &trace.stack[depth];
+        frame->start_ns = trace_now();
+        frame->node = trace_get_node(name, depth > 0 ? trace.stack[depth - 1].node : -1);
+        frame->event = frame->node >= 0 ? trace_add_event(frame->node, frame->start_ns)
+                                        : TRACE_MAX_EVENTS;
+
+        return depth;
+}
+
+void cbm_trace_end(CbmTraceSpan span)
+{
+        uint64_t now;
+
+        if (span < 0 || span >= trace.depth) {
+                return;
+        }
+
+        now = trace_now();
+        while (trace.depth > span) {
+                int depth = --trace.depth;
+                TraceFrame *frame = NULL;
+
+                if (depth >= TRACE_MAX_DEPTH) {
+                        continue;
+                }
+                frame = &trace.stack[depth];
+                if (frame->node >= 0) {
+                        trace.nodes[frame->node].total_ns += now - frame->start_ns;
+                        trace.nodes[frame->node].count++;
+                }
+                if (frame->event < TRACE_MAX_EVENTS) {
+                        trace.events[frame->event].end_ns = now;
+                }
+        }
+}
+
+static void trace_report_node(FILE *out, int parent, int level)
+{
+        for (int i = 0; i < trace.n_nodes; i++) {
+                const TraceNode *node = &trace.nodes[i];
+                int width = 40 - level * 2;
+
+                if (node->parent != parent || node->count == 0) {
+                        continue;
+                }
+                fprintf(out,
+                        "  %*s%-*s %10.3f ms",
+                        level * 2,
+                        "",
+                        width > 0 ? width : 0,
+                        node->name,
+                        (double)node->total_ns / 1e6);
+                if (node->count > 1) {
+                        fprintf(out, "  (%lu calls)", node->count);
+                }
+                fputc('\n', out);
+                trace_report_node(out, i, level + 1);
+        }
+}
+
+void cbm_trace_report(FILE *out)
+{
+        fprintf(out, "Timings:\n");
+        trace_report_node(out, -1, 0);
+}
+
+static void trace_visit_node(cbm_trace_visit_func func, void *userdata, int parent, char *path,
+                             size_t offset)
+{
+        for (int i = 0; i < trace.n_nodes; i++) {
+                const TraceNode *node = &trace.nodes[i];
+                int len;
+
+                if (node->parent != parent || node->count == 0) {
+                        continue;
+                }
+                len = snprintf(path + offset,
+                               PATH_MAX - offset,
+                               "%s%s",
+                               offset ? "/" : "",
+                               node->name);
+                if (len < 0 || (size_t)len >= PATH_MAX - offset) {
+                        continue;
+                }
+                func(path, node->total_ns, node->count, userdata);
+                trace_visit_node(func, userdata, i, path, offset + (size_t)len);
+        }
+        path[offset] = '\0';
+}
+
+void cbm_trace_visit(cbm_trace_visit_func func, void *userdata)
+{
+        char path[PATH_MAX] = { 0 };
+
+        trace_visit_node(func, userdata, -1, path, 0);
+}
+
+bool cbm_trace_write(const char *path)
+{
+        autofree(FILE) *f = NULL;
+        pid_t pid = getpid();
+        const char *sep = "";
+
+        f = fopen(path, "w");
+        if (!f) {
+                LOG_ERROR("Unable to open trace file %s: %s", path, strerror(errno));
+                return false;
+        }
+
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < trace.n_events; i++) {
+                const TraceEvent *ev = &trace.events[i];
+
+                if (ev->end_ns == 0) {
+                        /* Still open */
+                        continue;
+                }
+                fprintf(f,
+                        "%s{\"name\":\"%s\",\"cat\":\"cbm\",\"ph\":\"X\",\"ts\":%.3f,"
+                        "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        sep,
+                        trace.nodes[ev->node].name,
+                        (double)(ev->start_ns - trace.epoch_ns) / 1e3,
+                        (double)(ev->end_ns - ev->start_ns) / 1e3,
+                        (int)pid,
+                        (int)pid);
+                sep = ",\n";
+        }
+        fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+        if (fflush(f) != 0 || ferror(f)) {
+                LOG_ERROR("Failed to write trace file %s: %s", path, strerror(errno));
+                return false;
+        }
+        return true;
+}
+
+void cbm_trace_finish(void)
+{
+        if (trace.report) {
+                cbm_trace_report(stderr);
+        }
+        if (trace.output) {
+                (void)cbm_trace_write(trace.output);
+        }
+        cbm_trace_discard();
+}
+
+void cbm_trace_discard(void)
+{
+        free(trace.nodes);
+        free(trace.events);
+        free(trace.output);
+        memset(&trace, 0, sizeof(trace));
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,126 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Handle for an open span, as returned by cbm_trace_begin
+ */
+typedef int CbmTraceSpan;
+
+/**
+ * Pick up CBM_TRACE from the environment: when set to a file name, spans
+ * are recorded and written there as Chrome trace events by cbm_trace_finish.
+ */
+void cbm_trace_init(void);
+
+/**
+ * Record spans and have cbm_trace_finish print a summary tree of the time
+ * spent in each phase to stderr
+ */
+void cbm_trace_enable_report(void);
+
+/**
+ * Record spans and have cbm_trace_finish write them to @path as Chrome
+ * trace events, or stop doing so with a NULL @path
+ */
+void cbm_trace_set_output(const char *path);
+
+/**
+ * Record spans for whoever wants to inspect them through cbm_trace_visit,
+ * without producing a report or trace file
+ */
+void cbm_trace_enable(void);
+
+/**
+ * Whether spans are currently being recorded
+ */
+bool cbm_trace_enabled(void);
+
+/**
+ * Open a span named @name, nested in the innermost open span. @name must
+ * outlive the trace, which string literals do.
+ */
+CbmTraceSpan cbm_trace_begin(const char *name);
+
+/**
+ * Close @span along with anything still open inside it
+ */
+void cbm_trace_end(CbmTraceSpan span);
+
+/**
+ * Print the summary tree of everything recorded so far to @out
+ */
+void cbm_trace_report(FILE *out);
+
+/**
+ * Called for every distinct phase, parents first. @path joins the names of
+ * the enclosing spans with '/'.
+ */
+typedef void (*cbm_trace_visit_func)(const char *path, uint64_t total_ns, unsigned long count,
+                                     void *userdata);
+
+/**
+ * Visit the summary tree of everything recorded so far
+ */
+void cbm_trace_visit(cbm_trace_visit_func func, void *userdata);
+
+/**
+ * Write everything recorded so far to @path as Chrome trace events, which
+ * Perfetto and chrome://tracing can load
+ */
+bool cbm_trace_write(const char *path);
+
+/**
+ * Produce the requested report and trace file, then discard the recorded
+ * spans and stop recording
+ */
+void cbm_trace_finish(void);
+
+/**
+ * Drop everything recorded so far, along with any pending report or trace
+ * file, so that cbm_trace_finish has nothing left to produce
+ */
+void cbm_trace_discard(void);
+
+static inline void cbm_trace_span_cleanup(CbmTraceSpan *span)
+{
+        cbm_trace_end(*span);
+}
+
+#define _CBM_TRACE_CAT(a, b) a##b
+#define _CBM_TRACE_NAME(line) _CBM_TRACE_CAT(_cbm_trace_span_, line)
+
+/**
+ * Trace the rest of the enclosing scope as a span named @name
+ */
+#define CBM_TRACE_SCOPE(name)                                                                      \
+        __attribute__((cleanup(cbm_trace_span_cleanup))) CbmTraceSpan _CBM_TRACE_NAME(__LINE__) =  \
+            cbm_trace_begin(name)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,167 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/*
+ * Measure the EFI variable traffic of finding or creating the boot entry on
+ * machines with more and more foreign Boot#### entries, with a directory
+ * standing in for the firmware.
+ *
+ * Usage: bench-bootvar [iterations]
+ *
+ * Firmware latency is accounted for rather than slept, see
+ * EFIVARFS_LATENCY_FIRMWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootvar.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+#include "efivarfs-harness.h"
+
+#define BENCH_ROOT TOP_BUILD_DIR "/bench-bootvar"
+#define BENCH_ESP BENCH_ROOT "/esp"
+#define BENCH_EFIVARS BENCH_ROOT "/efivars"
+#define BENCH_SHIM "/EFI/org.clearlinux/shimx64.efi"
+
+static const unsigned int bench_entries[] = { 8, 32, 64, 128 };
+
+static double bench_now(void)
+{
+        struct timespec ts = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * What shim-systemd does on install: snapshot the variables, look for its
+ * entry and create it when missing.
+ */
+static bool bench_install(void)
+{
+        char varname[9];
+        bool ret = true;
+
+        if (bootvar_init() != 0) {
+                return false;
+        }
+        if (!bootvar_has_boot_rec(BENCH_ESP, BENCH_SHIM)) {
+                ret = bootvar_create(BENCH_ESP, BENCH_SHIM, varname, sizeof(varname)) == 0;
+        }
+        bootvar_destroy();
+        return ret;
+}
+
+/**
+ * Run the install @iterations times on @entries foreign entries, starting
+ * over each time unless @steady, and print the traffic of one run.
+ */
+static bool bench_run(const char *name, unsigned int entries, int iterations, bool steady)
+{
+        EfivarfsLatency latency = EFIVARFS_LATENCY_FIRMWARE;
+        EfivarfsStats stats = { 0 };
+        double elapsed = 0;
+
+        for (int i = 0; i < iterations; i++) {
+                double start;
+
+                if (!steady || i == 0) {
+                        nc_rm_rf(BENCH_EFIVARS);
+                        if (!efivarfs_mount(BENCH_EFIVARS, &latency, false) ||
+                            !efivarfs_add_boot_entries(entries)) {
+                                return false;
+                        }
+                        /* the entry is already there, leave it out of the numbers */
+                        if (steady && !bench_install()) {
+                                return false;
+                        }
+                }
+
+                efivarfs_reset_stats();
+                start = bench_now();
+                if (!bench_install()) {
+                        return false;
+                }
+                elapsed += bench_now() - start;
+        }
+        efivarfs_get_stats(&stats);
+        efivarfs_unmount();
+
+        printf("%-10s %8u %8lu %8lu %10lu %14.1f %12.1f\n",
+               name,
+               entries,
+               stats.reads,
+               stats.writes,
+               stats.enumerated,
+               (double)stats.simulated_ns / 1e6,
+               elapsed * 1e6 / iterations);
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : 50;
+        autofree(FILE) *devnull = NULL;
+
+        if (iterations < 1) {
+                fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* Every iteration logs the same, keep the numbers readable */
+        devnull = fopen("/dev/null", "w");
+        cbm_log_init(devnull ? devnull : stderr);
+
+        nc_rm_rf(BENCH_ROOT);
+        if (!nc_mkdir_p(BENCH_ESP, 00755)) {
+                fprintf(stderr, "Failed to create %s\n", BENCH_ESP);
+                return EXIT_FAILURE;
+        }
+
+        printf("%-10s %8s %8s %8s %10s %14s %12s\n",
+               "run",
+               "entries",
+               "reads",
+               "writes",
+               "enumerated",
+               "simulated_ms",
+               "wall_us");
+        for (size_t i = 0; i < ARRAY_SIZE(bench_entries); i++) {
+                if (!bench_run("install", bench_entries[i], iterations, false) ||
+                    !bench_run("steady", bench_entries[i], iterations, true)) {
+                        fprintf(stderr, "Failed with %u entries\n", bench_entries[i]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        nc_rm_rf(BENCH_ROOT);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,148 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/*
+ * Benchmark the command line merge over large cmdline.d trees.
+ *
+ * Usage: bench-cmdline [files] [iterations]
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cmdline.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+#define BENCH_ROOT TOP_BUILD_DIR "/bench-cmdline"
+
+static double bench_now(void)
+{
+        struct timespec ts = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool bench_write(const char *dir, const char *name, const char *text)
+{
+        autofree(char) *path = string_printf("%s/%s", dir, name);
+        return file_set_text(path, (char *)text);
+}
+
+/**
+ * Populate vendor and local cmdline.d, masking every tenth vendor file, and
+ * remove every fifth parameter through cmdline-removal.d
+ */
+static bool bench_populate(int files)
+{
+        autofree(char) *vendor = string_printf("%s/%s/cmdline.d", BENCH_ROOT,
+                                               VENDOR_KERNEL_CONF_DIRECTORY);
+        autofree(char) *local = string_printf("%s/%s/cmdline.d", BENCH_ROOT,
+                                              KERNEL_CONF_DIRECTORY);
+        autofree(char) *removal = string_printf("%s/%s/cmdline-removal.d", BENCH_ROOT,
+                                                KERNEL_CONF_DIRECTORY);
+
+        nc_rm_rf(BENCH_ROOT);
+        if (!nc_mkdir_p(vendor, 00755) || !nc_mkdir_p(local, 00755) ||
+            !nc_mkdir_p(removal, 00755)) {
+                return false;
+        }
+
+        for (int i = 0; i < files; i++) {
+                autofree(char) *name = string_printf("%05d.conf", i);
+                autofree(char) *local_name = string_printf("%05d-local.conf", i);
+                autofree(char) *text = string_printf("# vendor %d\nvendor.p%d=%d\nvendor.q%d\n",
+                                                     i, i, i, i);
+                autofree(char) *local_text = string_printf("local.p%d=\"a b %d\"\n", i, i);
+
+                if (!bench_write(vendor, name, text) ||
+                    !bench_write(local, local_name, local_text)) {
+                        return false;
+                }
+                if (i % 10 == 0 && !bench_write(local, name, "masked\n")) {
+                        return false;
+                }
+                if (i % 5 == 0) {
+                        autofree(char) *rm_text = string_printf("vendor.q%d\n", i);
+                        if (!bench_write(removal, name, rm_text)) {
+                                return false;
+                        }
+                }
+        }
+
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        int files = argc > 1 ? atoi(argv[1]) : 2000;
+        int iterations = argc > 2 ? atoi(argv[2]) : 10;
+        double merge = 0.0;
+        double removal = 0.0;
+        size_t len = 0;
+
+        cbm_log_init(stderr);
+
+        if (files < 1 || iterations < 1) {
+                fprintf(stderr, "Usage: %s [files] [iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (!bench_populate(files)) {
+                fprintf(stderr, "Failed to populate %s\n", BENCH_ROOT);
+                return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < iterations; i++) {
+                autofree(char) *p = NULL;
+                double start = bench_now();
+
+                p = cbm_parse_cmdline_files(BENCH_ROOT);
+                if (!p) {
+                        fprintf(stderr, "Failed to merge cmdline\n");
+                        return EXIT_FAILURE;
+                }
+                double mid = bench_now();
+                cbm_parse_cmdline_removal_files_directory(BENCH_ROOT, p);
+                double end = bench_now();
+
+                merge += mid - start;
+                removal += end - mid;
+                len = strlen(p);
+        }
+
+        printf("cmdline: %d files, %zu bytes\n", files * 2, len);
+        printf("merge:   %.3f ms/iter\n", merge * 1000.0 / iterations);
+        printf("removal: %.3f ms/iter\n", removal * 1000.0 / iterations);
+
+        nc_rm_rf(BENCH_ROOT);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
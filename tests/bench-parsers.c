@@ -0,0 +1,461 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/*
+ * Microbenchmark the parsers that run on every invocation and the boot
+ * loader configuration renderers, on realistic and adversarial inputs.
+ *
+ * Usage: bench-parsers [iterations]
+ *
+ * Adversarial inputs run a fraction of the iterations, see BenchCase.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+#include "cmdline.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "os-release.h"
+#include "syslinux-common.h"
+#include "systemd-class.h"
+#include "util.h"
+#include "writer.h"
+#if defined(GRUB2_BACKEND_ENABLED)
+#include "grub2.h"
+#endif
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+#define BENCH_ROOT TOP_BUILD_DIR "/bench-parsers"
+
+/* Kernels in the playground, the realistic renders use the first few */
+#define BENCH_KERNELS 1000
+#define BENCH_FEW_KERNELS 4
+
+typedef bool (*bench_func)(void *data);
+
+typedef struct BenchCase {
+        const char *name;
+        const char *input;
+        int divisor;            /**<Run iterations / divisor times */
+        bench_func func;
+        void *data;
+} BenchCase;
+
+/* Keeps results alive so nothing is optimised away */
+static volatile size_t bench_sink = 0;
+
+static double bench_now(void)
+{
+        struct timespec ts = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool bench_write(const char *dir, const char *name, const char *text)
+{
+        autofree(char) *path = string_printf("%s/%s", dir, name);
+
+        return nc_mkdir_p(dir, 00755) && file_set_text(path, (char *)text);
+}
+
+/**
+ * A root with @files cmdline.d snippets of @params parameters each
+ */
+static char *bench_cmdline_root(const char *name, int files, int params)
+{
+        char *root = string_printf("%s/%s", BENCH_ROOT, name);
+        autofree(char) *dir = string_printf("%s/%s/cmdline.d", root, KERNEL_CONF_DIRECTORY);
+
+        for (int i = 0; i < files; i++) {
+                autofree(char) *file = string_printf("%05d.conf", i);
+                autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+                if (!cbm_writer_open(writer)) {
+                        abort();
+                }
+                cbm_writer_append_printf(writer, "# snippet %d\n", i);
+                for (int j = 0; j < params; j++) {
+                        cbm_writer_append_printf(writer, "bench.p%d_%d=\"v %d\"\n", i, j, j);
+                }
+                cbm_writer_close(writer);
+                if (cbm_writer_error(writer) != 0 || !bench_write(dir, file, writer->buffer)) {
+                        abort();
+                }
+        }
+        return root;
+}
+
+/**
+ * A root with an os-release of the usual keys plus @extra unknown ones,
+ * with values of @value_len characters
+ */
+static char *bench_os_release_root(const char *name, int extra, int value_len)
+{
+        char *root = string_printf("%s/%s", BENCH_ROOT, name);
+        autofree(char) *dir = string_printf("%s/etc", root);
+        autofree(char) *value = calloc(1, (size_t)value_len + 1);
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        if (!value || !cbm_writer_open(writer)) {
+                abort();
+        }
+        memset(value, 'x', (size_t)value_len);
+
+        cbm_writer_append(writer,
+                          "NAME=\"Clear Linux OS\"\n"
+                          "VERSION=1\n"
+                          "ID=clear-linux-os\n"
+                          "ID_LIKE=clear-linux-os\n"
+                          "VERSION_ID=31200\n"
+                          "PRETTY_NAME=\"Clear Linux OS\"\n"
+                          "ANSI_COLOR=\"1;35\"\n"
+                          "HOME_URL=\"https://clearlinux.org\"\n"
+                          "SUPPORT_URL=\"https://clearlinux.org\"\n"
+                          "BUG_REPORT_URL=\"mailto:dev@lists.clearlinux.org\"\n"
+                          "PRIVACY_POLICY_URL=\"http://www.intel.com/privacy\"\n");
+        for (int i = 0; i < extra; i++) {
+                cbm_writer_append_printf(writer, "# comment %d\nEXTRA_%d=\"%s\"\n", i, i, value);
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0 || !bench_write(dir, "os-release", writer->buffer)) {
+                abort();
+        }
+        return root;
+}
+
+static bool bench_cmdline_files(void *data)
+{
+        autofree(char) *cmdline = cbm_parse_cmdline_files(data);
+
+        if (!cmdline) {
+                return false;
+        }
+        bench_sink += strlen(cmdline);
+        return true;
+}
+
+static bool bench_os_release(void *data)
+{
+        CbmOsRelease *os_release = cbm_os_release_new_for_root(data);
+
+        if (!os_release) {
+                return false;
+        }
+        bench_sink += strlen(cbm_os_release_get_value(os_release, OS_RELEASE_PRETTY_NAME));
+        cbm_os_release_free(os_release);
+        return true;
+}
+
+typedef struct BenchLoaderConf {
+        BootManager *manager;
+        const char *conf;
+} BenchLoaderConf;
+
+static bool bench_loader_conf(void *data)
+{
+        BenchLoaderConf *ctx = data;
+        autofree(char) *conf = strdup(ctx->conf);
+        autofree(char) *kernel = NULL;
+
+        /* The parser mangles its input, so it gets a copy each time */
+        if (!conf) {
+                return false;
+        }
+        kernel = sd_class_parse_default_kernel(conf, ctx->manager);
+        bench_sink += kernel ? strlen(kernel) : 0;
+        return true;
+}
+
+static bool bench_system_kernel(void *data)
+{
+        SystemKernel kernel = { 0 };
+
+        bench_sink += cbm_parse_system_kernel(data, &kernel) ? (size_t)kernel.release : 0;
+        return true;
+}
+
+typedef struct BenchInspect {
+        BootManager *manager;
+        char *path;
+} BenchInspect;
+
+static bool bench_inspect_kernel(void *data)
+{
+        BenchInspect *ctx = data;
+        Kernel *kernel = boot_manager_inspect_kernel(ctx->manager, ctx->path);
+
+        if (kernel) {
+                bench_sink += (size_t)kernel->meta.release;
+                free_kernel(kernel);
+        }
+        return true;
+}
+
+typedef bool (*bench_render_func)(const BootManager *manager, KernelArray *kernels,
+                                  const Kernel *default_kernel, CbmWriter *writer);
+
+typedef struct BenchRender {
+        BootManager *manager;
+        KernelArray *kernels;
+        bench_render_func render;
+} BenchRender;
+
+static bool bench_render_sd_entries(const BootManager *manager, KernelArray *kernels,
+                                    __cbm_unused__ const Kernel *default_kernel,
+                                    CbmWriter *writer)
+{
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                if (!sd_class_render_entry(manager, nc_array_get(kernels, i), writer)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+static bool bench_render(void *data)
+{
+        BenchRender *ctx = data;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        if (!cbm_writer_open(writer) ||
+            !ctx->render(ctx->manager, ctx->kernels, nc_array_get(ctx->kernels, 0), writer)) {
+                return false;
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                return false;
+        }
+        bench_sink += writer->buffer_n;
+        return true;
+}
+
+static bool bench_run(const BenchCase *c, int iterations)
+{
+        int n = iterations / c->divisor > 0 ? iterations / c->divisor : 1;
+        double start;
+        double elapsed;
+
+        /* Warm up, and make sure it works at all */
+        if (!c->func(c->data)) {
+                fprintf(stderr, "%s (%s) failed\n", c->name, c->input);
+                return false;
+        }
+
+        start = bench_now();
+        for (int i = 0; i < n; i++) {
+                if (!c->func(c->data)) {
+                        fprintf(stderr, "%s (%s) failed\n", c->name, c->input);
+                        return false;
+                }
+        }
+        elapsed = bench_now() - start;
+
+        printf("%-24s %-28s %10d %14.1f\n", c->name, c->input, n, elapsed * 1e9 / n);
+        return true;
+}
+
+static BootManager *bench_prepare_manager(void)
+{
+        PlaygroundConfig config = { "5.0.0-100.native", NULL, 0, .uefi = true,
+                                    .disable_modules = true };
+        BootManager *m = prepare_playground(&config);
+
+        if (!m) {
+                return NULL;
+        }
+        for (int i = 0; i < BENCH_KERNELS; i++) {
+                PlaygroundKernel kernel = { "5.0.0", i % 2 ? "lts" : "native", 100 + i, false,
+                                            false };
+
+                if (!push_kernel_update(&config, &kernel)) {
+                        boot_manager_free(m);
+                        return NULL;
+                }
+        }
+
+        /* Sets up the systemd-class destination the entries point at */
+        if (!boot_manager_get_bootloader(m)) {
+                boot_manager_free(m);
+                return NULL;
+        }
+        return m;
+}
+
+int main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+        autofree(FILE) *devnull = NULL;
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        KernelArray *few = NULL;
+        autofree(char) *cmdline_small = NULL;
+        autofree(char) *cmdline_huge = NULL;
+        autofree(char) *os_small = NULL;
+        autofree(char) *os_huge = NULL;
+        autofree(char) *loader_huge = NULL;
+        autofree(char) *uname_huge = NULL;
+        autofree(char) *name_huge = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        bool ret = true;
+
+        if (iterations < 1) {
+                fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* Every iteration logs the same, keep the numbers readable */
+        devnull = fopen("/dev/null", "w");
+        cbm_set_sync_filesystems(false);
+        cbm_log_init(devnull ? devnull : stderr);
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        nc_rm_rf(BENCH_ROOT);
+        cmdline_small = bench_cmdline_root("cmdline-small", 4, 2);
+        cmdline_huge = bench_cmdline_root("cmdline-huge", 2000, 8);
+        os_small = bench_os_release_root("os-release-small", 0, 0);
+        os_huge = bench_os_release_root("os-release-huge", 4000, 512);
+
+        m = bench_prepare_manager();
+        if (!m) {
+                fprintf(stderr, "Failed to prepare the playground\n");
+                return EXIT_FAILURE;
+        }
+        kernels = boot_manager_get_kernels(m);
+        few = nc_array_new();
+        if (!kernels || kernels->len != BENCH_KERNELS || !few) {
+                fprintf(stderr, "Failed to load the playground kernels\n");
+                return EXIT_FAILURE;
+        }
+        for (uint16_t i = 0; i < BENCH_FEW_KERNELS; i++) {
+                if (!nc_array_add(few, nc_array_get(kernels, i))) {
+                        DECLARE_OOM();
+                        return EXIT_FAILURE;
+                }
+        }
+
+        /* Thousands of lines ahead of the default, which has plenty of dashes */
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+        cbm_writer_append(writer, "timeout 5\n");
+        for (int i = 0; i < 4000; i++) {
+                cbm_writer_append_printf(writer, "# console-mode keep %d\n", i);
+        }
+        cbm_writer_append_printf(writer,
+                                 "default %s-a-b-c-d-e-f-g-h-5.0.0-100\n",
+                                 boot_manager_get_vendor_prefix(m));
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+        loader_huge = strdup(writer->buffer);
+        uname_huge = calloc(1, 4097);
+        name_huge = calloc(1, 4097 + strlen(PLAYGROUND_ROOT "/" KERNEL_DIRECTORY "/"));
+        if (!loader_huge || !uname_huge || !name_huge) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+        memset(uname_huge, '4', 4096);
+        strcpy(name_huge, PLAYGROUND_ROOT "/" KERNEL_DIRECTORY "/" KERNEL_NAMESPACE ".");
+        memset(name_huge + strlen(name_huge), 'k', 4096 - strlen(name_huge));
+
+        {
+                autofree(char) *loader_small_text = string_printf(
+                    "timeout 5\ndefault %s-native-5.0.0-100\n", boot_manager_get_vendor_prefix(m));
+                BenchLoaderConf loader_small = { m, loader_small_text };
+                BenchLoaderConf loader_adversarial = { m, loader_huge };
+                BenchInspect inspect_valid = {
+                        m,
+                        PLAYGROUND_ROOT "/" KERNEL_DIRECTORY "/" KERNEL_NAMESPACE
+                                        ".native.5.0.0-100"
+                };
+                BenchInspect inspect_reject = { m, name_huge };
+                BenchRender sd_few = { m, few, bench_render_sd_entries };
+                BenchRender sd_many = { m, kernels, bench_render_sd_entries };
+                BenchRender syslinux_few = { m, few, syslinux_common_render_config };
+                BenchRender syslinux_many = { m, kernels, syslinux_common_render_config };
+#if defined(GRUB2_BACKEND_ENABLED)
+                BenchRender grub2_few = { m, few, grub2_render_config };
+                BenchRender grub2_many = { m, kernels, grub2_render_config };
+#endif
+                const BenchCase cases[] = {
+                        { "cmdline-files", "4 files", 1, bench_cmdline_files, cmdline_small },
+                        { "cmdline-files", "2000 files", 200, bench_cmdline_files,
+                          cmdline_huge },
+                        { "os-release", "stock", 1, bench_os_release, os_small },
+                        { "os-release", "4000 keys x 512 bytes", 200, bench_os_release,
+                          os_huge },
+                        { "loader-default", "stock", 1, bench_loader_conf, &loader_small },
+                        { "loader-default", "4000 lines, dashes", 20, bench_loader_conf,
+                          &loader_adversarial },
+                        { "system-kernel", "4.2.1-121.kvm", 1, bench_system_kernel,
+                          "4.2.1-121.kvm" },
+                        { "system-kernel", "4096 digits", 1, bench_system_kernel,
+                          uname_huge },
+                        { "inspect-kernel", "valid", 1, bench_inspect_kernel, &inspect_valid },
+                        { "inspect-kernel", "4096 byte name", 1, bench_inspect_kernel,
+                          &inspect_reject },
+                        { "render-systemd", "4 entries", 1, bench_render, &sd_few },
+                        { "render-systemd", "1000 entries", 200, bench_render, &sd_many },
+                        { "render-syslinux", "4 entries", 1, bench_render, &syslinux_few },
+                        { "render-syslinux", "1000 entries", 200, bench_render,
+                          &syslinux_many },
+#if defined(GRUB2_BACKEND_ENABLED)
+                        { "render-grub2", "4 entries", 1, bench_render, &grub2_few },
+                        { "render-grub2", "1000 entries", 200, bench_render, &grub2_many },
+#endif
+                };
+
+                printf("%-24s %-28s %10s %14s\n", "benchmark", "input", "iterations", "ns/op");
+                for (size_t i = 0; i < ARRAY_SIZE(cases) && ret; i++) {
+                        ret = bench_run(&cases[i], iterations);
+                }
+        }
+
+        nc_array_free(&few, NULL);
+        nc_rm_rf(BENCH_ROOT);
+        nc_rm_rf(PLAYGROUND_ROOT);
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
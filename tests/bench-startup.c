@@ -0,0 +1,244 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/*
+ * Benchmark BootManager startup for the read-only subcommands, comparing
+ * lazy facets against forcing every facet straight after set_prefix as
+ * was done previously.
+ *
+ * Usage: bench-startup [iterations]
+ *
+ * Each command is timed over several rounds, alternating which variant goes
+ * first, and the median round is reported so that warm-up and ordering do
+ * not favour either side. The blkid probes and directory scans of a single
+ * invocation are printed alongside, as they do not depend on timing.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "topology.h"
+#include "util.h"
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+#define BENCH_ROUNDS 7
+
+static PlaygroundKernel bench_kernels[] = { { "4.2.1", "kvm", 121, false, false },
+                                            { "4.2.3", "kvm", 124, true, false },
+                                            { "4.2.1", "native", 137, false, false },
+                                            { "4.2.3", "native", 138, true, false } };
+
+static PlaygroundConfig bench_config = { "4.2.1-121.kvm",
+                                         bench_kernels,
+                                         ARRAY_SIZE(bench_kernels),
+                                         .uefi = true };
+
+typedef bool (*bench_command)(BootManager *manager);
+
+static double bench_now(void)
+{
+        struct timespec ts = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool bench_get_timeout(BootManager *manager)
+{
+        return boot_manager_get_timeout_value(manager) != -2;
+}
+
+static bool bench_list_kernels(BootManager *manager)
+{
+        char **kernels = boot_manager_list_kernels(manager);
+
+        if (!kernels) {
+                return false;
+        }
+        for (char **k = kernels; *k; k++) {
+                free(*k);
+        }
+        free(kernels);
+        return true;
+}
+
+/**
+ * One simulated invocation, from a fresh process' point of view
+ */
+static bool bench_invoke(bench_command command, bool eager)
+{
+        autofree(BootManager) *manager = NULL;
+
+        cbm_topology_reset();
+
+        manager = boot_manager_new();
+        if (!manager || !boot_manager_set_prefix(manager, PLAYGROUND_ROOT)) {
+                return false;
+        }
+        boot_manager_set_boot_dir(manager, PLAYGROUND_ROOT "/" BOOT_DIRECTORY);
+
+        /* Everything set_prefix used to do up front */
+        if (eager && (!boot_manager_get_root_device(manager) || !boot_manager_get_os_name(manager) ||
+                      !boot_manager_get_bootloader(manager))) {
+                return false;
+        }
+
+        return command(manager);
+}
+
+static double bench_run(bench_command command, bool eager, int iterations)
+{
+        double start = bench_now();
+
+        for (int i = 0; i < iterations; i++) {
+                if (!bench_invoke(command, eager)) {
+                        fprintf(stderr, "Simulated invocation failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        return (bench_now() - start) * 1000.0 / iterations;
+}
+
+/**
+ * The I/O counters of a single invocation
+ */
+static CbmStats bench_count(bench_command command, bool eager)
+{
+        CbmStats stats = { 0 };
+
+        cbm_stats_reset();
+        if (!bench_invoke(command, eager)) {
+                fprintf(stderr, "Simulated invocation failed\n");
+                exit(EXIT_FAILURE);
+        }
+        cbm_stats_get(&stats);
+        return stats;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+/**
+ * Time both variants of @command, storing the median round of each
+ */
+static void bench_command_rounds(bench_command command, int iterations, double *eager,
+                                 double *lazy)
+{
+        double eager_rounds[BENCH_ROUNDS];
+        double lazy_rounds[BENCH_ROUNDS];
+
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+                if (r % 2 == 0) {
+                        eager_rounds[r] = bench_run(command, true, iterations);
+                        lazy_rounds[r] = bench_run(command, false, iterations);
+                } else {
+                        lazy_rounds[r] = bench_run(command, false, iterations);
+                        eager_rounds[r] = bench_run(command, true, iterations);
+                }
+        }
+
+        qsort(eager_rounds, BENCH_ROUNDS, sizeof(double), bench_compare);
+        qsort(lazy_rounds, BENCH_ROUNDS, sizeof(double), bench_compare);
+        *eager = eager_rounds[BENCH_ROUNDS / 2];
+        *lazy = lazy_rounds[BENCH_ROUNDS / 2];
+}
+
+int main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : 200;
+        autofree(FILE) *devnull = NULL;
+        static const struct {
+                const char *name;
+                bench_command command;
+        } commands[] = {
+                { "get-timeout", bench_get_timeout },
+                { "list-kernels", bench_list_kernels },
+        };
+
+        if (iterations < 1) {
+                fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* Every simulated invocation logs the same, keep the numbers readable */
+        devnull = fopen("/dev/null", "w");
+        cbm_set_sync_filesystems(false);
+        cbm_log_init(devnull ? devnull : stderr);
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        boot_manager_free(prepare_playground(&bench_config));
+
+        printf("%-14s %12s %12s %14s %14s\n",
+               "command",
+               "eager ms",
+               "lazy ms",
+               "eager prb/dir",
+               "lazy prb/dir");
+        for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+                CbmStats eager_stats = bench_count(commands[i].command, true);
+                CbmStats lazy_stats = bench_count(commands[i].command, false);
+                autofree(char) *eager_io = NULL;
+                autofree(char) *lazy_io = NULL;
+                double eager = 0;
+                double lazy = 0;
+
+                bench_command_rounds(commands[i].command, iterations, &eager, &lazy);
+                eager_io = string_printf("%lu/%lu", eager_stats.probes, eager_stats.dir_scans);
+                lazy_io = string_printf("%lu/%lu", lazy_stats.probes, lazy_stats.dir_scans);
+                printf("%-14s %12.3f %12.3f %14s %14s\n",
+                       commands[i].name,
+                       eager,
+                       lazy,
+                       eager_io,
+                       lazy_io);
+        }
+
+        nc_rm_rf(PLAYGROUND_ROOT);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
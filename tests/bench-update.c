@@ -0,0 +1,576 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/*
+ * Benchmark the mutating commands end to end on synthetic roots, for every
+ * backend, and print the results as JSON so they can be compared between
+ * runs.
+ *
+ * Each iteration starts from a fresh root and goes through a cold update,
+ * an update with nothing to do, an update adding a single kernel, both ways
+ * of listing kernels, set-kernel, and finally a native update garbage
+ * collecting all but the running and default kernels. Every step uses a new
+ * BootManager, as a separate invocation would.
+ *
+ * With -m the boot directory is held in memory, charged with the latencies
+ * of a slow FAT ESP and with syncing turned on, so that sync and copy
+ * strategies can be compared by their simulated time independently of the
+ * disk the benchmark happens to run on.
+ *
+ * Usage: bench-update [-k kernels] [-s initrd KiB] [-f freestanding initrds]
+ *                     [-c cmdline.d files] [-n iterations] [-m] [-o output]
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "topology.h"
+#include "util.h"
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "memfs-harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+
+typedef struct BenchParams {
+        int kernels;
+        int initrd_kib;
+        int freestanding;
+        int cmdline_files;
+        int iterations;
+        bool memfs;
+} BenchParams;
+
+/**
+ * How to make the harness look like a system wanting @name
+ */
+typedef struct BenchBackend {
+        const char *name;
+        bool uefi;
+        const char *forced;     /**<CBM_BOOTLOADER, or NULL to let it be detected */
+        const char *fstype;
+} BenchBackend;
+
+static const BenchBackend bench_backends[] = {
+        { "uefi", true, NULL, "vfat" },
+        { "extlinux", false, "extlinux", "ext4" },
+        { "syslinux", false, "syslinux", "ext4" },
+#if defined(GRUB2_BACKEND_ENABLED)
+        { "grub2", false, "grub2", "ext4" },
+#endif
+};
+
+typedef enum {
+        BENCH_COLD_UPDATE = 0,
+        BENCH_NOOP_UPDATE,
+        BENCH_ADD_KERNEL,
+        BENCH_LIST_KERNELS,
+        BENCH_LIST_KERNELS_LIVE,
+        BENCH_SET_KERNEL,
+        BENCH_GC,
+        BENCH_N_OPS
+} BenchOp;
+
+static const char *bench_op_names[BENCH_N_OPS] = {
+        [BENCH_COLD_UPDATE] = "cold-update",
+        [BENCH_NOOP_UPDATE] = "noop-update",
+        [BENCH_ADD_KERNEL] = "add-kernel",
+        [BENCH_LIST_KERNELS] = "list-kernels",
+        [BENCH_LIST_KERNELS_LIVE] = "list-kernels-live",
+        [BENCH_SET_KERNEL] = "set-kernel",
+        [BENCH_GC] = "gc",
+};
+
+typedef struct BenchResult {
+        double *ms;             /**<One per iteration */
+        CbmStats stats;         /**<Of the last iteration */
+        MemfsStats memfs;       /**<Of the last iteration, with -m */
+} BenchResult;
+
+static double bench_now(void)
+{
+        struct timespec ts = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Legacy backends need a GPT partition flagged as legacy bootable
+ */
+static inline int bench_devno_to_wholedisk(__cbm_unused__ dev_t dev,
+                                           __cbm_unused__ char *diskname,
+                                           __cbm_unused__ size_t len, dev_t *diskdevno)
+{
+        *diskdevno = makedev(8, 8);
+        return 0;
+}
+
+static inline unsigned long long bench_partition_get_flags(__cbm_unused__ blkid_partition par)
+{
+        return (1ULL << 2);
+}
+
+static inline const char *bench_partition_get_uuid(__cbm_unused__ blkid_partition par)
+{
+        return DEFAULT_PART_UUID;
+}
+
+static PlaygroundKernel bench_kernel(int index)
+{
+        return (PlaygroundKernel){ .version = index % 2 ? "5.1.0" : "5.0.0",
+                                   .ktype = index % 2 ? "lts" : "native",
+                                   .release = 100 + index,
+                                   .legacy_name = false };
+}
+
+/**
+ * The most recent kernel of the type of @index
+ */
+static int bench_newest_of_type(int kernels, int index)
+{
+        return index + ((kernels - 1 - index) / 2) * 2;
+}
+
+static bool bench_write_blob(const char *path, int kib, char fill)
+{
+        autofree(FILE) *f = NULL;
+        char block[1024];
+
+        memset(block, fill, sizeof(block));
+        f = fopen(path, "w");
+        if (!f) {
+                return false;
+        }
+        for (int i = 0; i < kib; i++) {
+                if (fwrite(block, sizeof(block), 1, f) != 1) {
+                        return false;
+                }
+        }
+        return fflush(f) == 0;
+}
+
+/**
+ * Push kernel @index into the root, with an initrd of the requested size
+ */
+static bool bench_push_kernel(PlaygroundConfig *config, const BenchParams *params, int index)
+{
+        PlaygroundKernel kernel = bench_kernel(index);
+        autofree(char) *initrd = NULL;
+
+        if (!push_kernel_update(config, &kernel)) {
+                return false;
+        }
+
+        initrd = string_printf("%s/%s/initrd-%s.%s.%s-%d",
+                               PLAYGROUND_ROOT,
+                               KERNEL_DIRECTORY,
+                               KERNEL_NAMESPACE,
+                               kernel.ktype,
+                               kernel.version,
+                               kernel.release);
+        return bench_write_blob(initrd, params->initrd_kib, (char)('a' + index % 26));
+}
+
+static bool bench_populate(const BenchBackend *backend, const BenchParams *params)
+{
+        PlaygroundConfig config = { .uefi = backend->uefi };
+        autofree(BootManager) *m = NULL;
+        autofree(char) *cmdline_dir = NULL;
+
+        m = prepare_playground(&config);
+        if (!m) {
+                return false;
+        }
+
+        for (int i = 0; i < params->kernels; i++) {
+                if (!bench_push_kernel(&config, params, i)) {
+                        return false;
+                }
+        }
+        for (int i = 0; i < params->kernels && i < 2; i++) {
+                PlaygroundKernel tip = bench_kernel(bench_newest_of_type(params->kernels, i));
+
+                if (!set_kernel_default(&tip)) {
+                        return false;
+                }
+        }
+
+        for (int i = 0; i < params->freestanding; i++) {
+                autofree(char) *path = string_printf("%s/%s/%02d-bench",
+                                                     PLAYGROUND_ROOT,
+                                                     INITRD_DIRECTORY,
+                                                     i);
+
+                if (!bench_write_blob(path, params->initrd_kib, (char)('A' + i % 26))) {
+                        return false;
+                }
+        }
+
+        cmdline_dir = string_printf("%s/%s/cmdline.d", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        if (!nc_mkdir_p(cmdline_dir, 00755)) {
+                return false;
+        }
+        for (int i = 0; i < params->cmdline_files; i++) {
+                autofree(char) *path = string_printf("%s/%05d.conf", cmdline_dir, i);
+                autofree(char) *text = string_printf("bench.p%d=%d\n", i, i);
+
+                if (!file_set_text(path, text)) {
+                        return false;
+                }
+        }
+
+        if (backend->forced) {
+                setenv("CBM_BOOTLOADER", backend->forced, 1);
+        } else {
+                unsetenv("CBM_BOOTLOADER");
+        }
+        return true;
+}
+
+/**
+ * A fresh BootManager, as set up by the command line for @uname
+ */
+static BootManager *bench_manager(bool image, const char *uname)
+{
+        BootManager *m = NULL;
+
+        cbm_topology_reset();
+
+        m = boot_manager_new();
+        if (!m || !boot_manager_set_prefix(m, PLAYGROUND_ROOT)) {
+                boot_manager_free(m);
+                return NULL;
+        }
+        boot_manager_set_boot_dir(m, PLAYGROUND_ROOT "/" BOOT_DIRECTORY);
+        boot_manager_set_image_mode(m, image);
+        if (uname && !boot_manager_set_uname(m, uname)) {
+                boot_manager_free(m);
+                return NULL;
+        }
+        if (!boot_manager_enumerate_initrds_freestanding(m)) {
+                boot_manager_free(m);
+                return NULL;
+        }
+        return m;
+}
+
+static bool bench_free_list(char **kernels)
+{
+        if (!kernels) {
+                return false;
+        }
+        for (char **k = kernels; *k; k++) {
+                free(*k);
+        }
+        free(kernels);
+        return true;
+}
+
+/**
+ * Whatever the package manager would have done before running @op
+ */
+static bool bench_prepare_step(BenchOp op, const BenchParams *params)
+{
+        PlaygroundConfig config = { 0 };
+        PlaygroundKernel newest = bench_kernel(params->kernels);
+
+        if (op != BENCH_ADD_KERNEL) {
+                return true;
+        }
+        return bench_push_kernel(&config, params, params->kernels) &&
+               set_kernel_default(&newest);
+}
+
+static bool bench_step(BenchOp op, const BenchParams *params)
+{
+        autofree(BootManager) *m = NULL;
+        PlaygroundKernel newest = bench_kernel(params->kernels);
+        autofree(char) *running = string_printf("%s-%d.%s",
+                                                newest.version,
+                                                newest.release,
+                                                newest.ktype);
+
+        switch (op) {
+        case BENCH_COLD_UPDATE:
+        case BENCH_NOOP_UPDATE:
+                m = bench_manager(true, NULL);
+                return m && boot_manager_update(m);
+        case BENCH_ADD_KERNEL:
+                m = bench_manager(true, NULL);
+                return m && boot_manager_update(m);
+        case BENCH_LIST_KERNELS:
+                m = bench_manager(true, NULL);
+                return m && bench_free_list(boot_manager_list_kernels_saved(m));
+        case BENCH_LIST_KERNELS_LIVE:
+                m = bench_manager(true, NULL);
+                return m && bench_free_list(boot_manager_list_kernels(m));
+        case BENCH_SET_KERNEL: {
+                PlaygroundKernel oldest = bench_kernel(0);
+                Kernel kern = { 0 };
+
+                kern.meta.ktype = (char *)oldest.ktype;
+                kern.meta.version = (char *)oldest.version;
+                kern.meta.release = oldest.release;
+                m = bench_manager(true, NULL);
+                return m && boot_manager_select_default_kernel(m, &kern);
+        }
+        case BENCH_GC:
+                /* Running the newest kernel, everything else is fair game */
+                m = bench_manager(false, running);
+                return m && boot_manager_update(m);
+        default:
+                return false;
+        }
+}
+
+static bool bench_backend(const BenchBackend *backend, const BenchParams *params,
+                          BenchResult *results)
+{
+        CbmBlkidOps blkid_ops = BlkidTestOps;
+        MemfsLatency latency = MEMFS_LATENCY_SLOW_ESP;
+
+        if (!backend->uefi) {
+                blkid_ops.devno_to_wholedisk = bench_devno_to_wholedisk;
+                blkid_ops.partition_get_flags = bench_partition_get_flags;
+                blkid_ops.partition_get_uuid = bench_partition_get_uuid;
+        }
+        cbm_blkid_set_vtable(&blkid_ops);
+        setenv("CBM_TEST_FSTYPE", backend->fstype, 1);
+
+        for (int i = 0; i < params->iterations; i++) {
+                if (!bench_populate(backend, params)) {
+                        fprintf(stderr, "%s: Failed to populate the root\n", backend->name);
+                        return false;
+                }
+                if (params->memfs &&
+                    !memfs_mount(PLAYGROUND_ROOT "/" BOOT_DIRECTORY, &latency, false)) {
+                        fprintf(stderr, "%s: Failed to mount the in-memory ESP\n", backend->name);
+                        return false;
+                }
+
+                for (int op = 0; op < BENCH_N_OPS; op++) {
+                        double start;
+
+                        if (!bench_prepare_step((BenchOp)op, params)) {
+                                fprintf(stderr,
+                                        "%s: Failed to prepare %s\n",
+                                        backend->name,
+                                        bench_op_names[op]);
+                                return false;
+                        }
+
+                        cbm_stats_reset();
+                        memfs_reset_stats();
+                        start = bench_now();
+                        if (!bench_step((BenchOp)op, params)) {
+                                fprintf(stderr,
+                                        "%s: %s failed\n",
+                                        backend->name,
+                                        bench_op_names[op]);
+                                memfs_unmount();
+                                return false;
+                        }
+                        results[op].ms[i] = (bench_now() - start) * 1000.0;
+                        cbm_stats_get(&results[op].stats);
+                        memfs_get_stats(&results[op].memfs);
+                }
+                memfs_unmount();
+        }
+
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        return true;
+}
+
+static int bench_compare_ms(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+static void bench_print(FILE *out, const BenchBackend *backend, const BenchParams *params,
+                        BenchResult *results, bool *first)
+{
+        for (int op = 0; op < BENCH_N_OPS; op++) {
+                double *ms = results[op].ms;
+                int n = params->iterations;
+
+                qsort(ms, (size_t)n, sizeof(double), bench_compare_ms);
+                fprintf(out,
+                        "%s    {\"backend\":\"%s\",\"operation\":\"%s\","
+                        "\"min_ms\":%.3f,\"median_ms\":%.3f,\"max_ms\":%.3f,"
+                        "\"bytes_written\":%lu,\"files_copied\":%lu,\"files_skipped\":%lu,"
+                        "\"dir_scans\":%lu",
+                        *first ? "" : ",\n",
+                        backend->name,
+                        bench_op_names[op],
+                        ms[0],
+                        n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2,
+                        ms[n - 1],
+                        results[op].stats.bytes_written,
+                        results[op].stats.files_copied,
+                        results[op].stats.files_skipped,
+                        results[op].stats.dir_scans);
+                if (params->memfs) {
+                        fprintf(out,
+                                ",\"simulated_ms\":%.3f,\"fsyncs\":%lu,\"syncs\":%lu",
+                                (double)results[op].memfs.simulated_ns / 1e6,
+                                results[op].memfs.fsyncs,
+                                results[op].memfs.syncs);
+                }
+                fprintf(out, "}");
+                *first = false;
+        }
+}
+
+static void bench_usage(const char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-k kernels] [-s initrd KiB] [-f freestanding initrds] "
+                "[-c cmdline.d files] [-n iterations] [-m] [-o output]\n",
+                progname);
+}
+
+int main(int argc, char **argv)
+{
+        BenchParams params = { .kernels = 8,
+                               .initrd_kib = 1024,
+                               .freestanding = 2,
+                               .cmdline_files = 16,
+                               .iterations = 3 };
+        BenchResult results[BENCH_N_OPS] = { { 0 } };
+        autofree(FILE) *devnull = NULL;
+        FILE *out = stdout;
+        const char *output = NULL;
+        bool first = true;
+        bool ret = true;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "k:s:f:c:n:mo:")) != -1) {
+                switch (opt) {
+                case 'k':
+                        params.kernels = atoi(optarg);
+                        break;
+                case 's':
+                        params.initrd_kib = atoi(optarg);
+                        break;
+                case 'f':
+                        params.freestanding = atoi(optarg);
+                        break;
+                case 'c':
+                        params.cmdline_files = atoi(optarg);
+                        break;
+                case 'n':
+                        params.iterations = atoi(optarg);
+                        break;
+                case 'm':
+                        params.memfs = true;
+                        break;
+                case 'o':
+                        output = optarg;
+                        break;
+                default:
+                        bench_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        /* Garbage collection needs something besides the defaults */
+        if (params.kernels < 3 || params.initrd_kib < 0 || params.freestanding < 0 ||
+            params.cmdline_files < 0 || params.iterations < 1) {
+                bench_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* Every simulated invocation logs the same, keep the numbers readable */
+        devnull = fopen("/dev/null", "w");
+        cbm_set_sync_filesystems(params.memfs);
+        cbm_log_init(devnull ? devnull : stderr);
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        for (int op = 0; op < BENCH_N_OPS; op++) {
+                results[op].ms = calloc((size_t)params.iterations, sizeof(double));
+                if (!results[op].ms) {
+                        DECLARE_OOM();
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (output) {
+                out = fopen(output, "w");
+                if (!out) {
+                        fprintf(stderr, "Cannot open %s: %s\n", output, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+        }
+
+        fprintf(out,
+                "{\n  \"kernels\":%d,\"initrd_kib\":%d,\"freestanding\":%d,"
+                "\"cmdline_files\":%d,\"iterations\":%d,\"memfs\":%s,\n  \"results\":[\n",
+                params.kernels,
+                params.initrd_kib,
+                params.freestanding,
+                params.cmdline_files,
+                params.iterations,
+                params.memfs ? "true" : "false");
+        for (size_t i = 0; i < ARRAY_SIZE(bench_backends); i++) {
+                if (!bench_backend(&bench_backends[i], &params, results)) {
+                        ret = false;
+                        break;
+                }
+                bench_print(out, &bench_backends[i], &params, results, &first);
+        }
+        fprintf(out, "\n  ]\n}\n");
+
+        if (out != stdout) {
+                fclose(out);
+        }
+        for (int op = 0; op < BENCH_N_OPS; op++) {
+                free(results[op].ms);
+        }
+        unsetenv("CBM_BOOTLOADER");
+        nc_rm_rf(PLAYGROUND_ROOT);
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,272 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootvar.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "util.h"
+
+#include "efivarfs-harness.h"
+
+#define EFIVARS_ROOT TOP_BUILD_DIR "/efivars"
+#define ESP_ROOT TOP_BUILD_DIR "/esp"
+#define SHIM_PATH "/EFI/org.clearlinux/shimx64.efi"
+
+static void bootvar_test_mount(unsigned int entries)
+{
+        nc_rm_rf(EFIVARS_ROOT);
+        fail_if(!nc_mkdir_p(ESP_ROOT, 00755), "Failed to create ESP");
+        fail_if(!efivarfs_mount(EFIVARS_ROOT, NULL, false), "Failed to stand in for efivarfs");
+        fail_if(!efivarfs_add_boot_entries(entries), "Failed to add boot entries");
+}
+
+/**
+ * Return the first number in BootOrder
+ */
+static unsigned int bootvar_test_first_in_order(void)
+{
+        uint8_t *order = NULL;
+        size_t size = 0;
+        unsigned int ret;
+
+        fail_if(!efivarfs_get_global("BootOrder", &order, &size), "BootOrder missing");
+        fail_if(size < 2, "BootOrder is empty");
+        ret = (unsigned int)(order[0] | order[1] << 8);
+        free(order);
+        return ret;
+}
+
+/**
+ * Entries are found by their payload, and only an identical one matches
+ */
+START_TEST(bootvar_test_lookup)
+{
+        char varname[9] = { 0 };
+
+        bootvar_test_mount(8);
+
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries");
+        fail_if(bootvar_has_boot_rec(ESP_ROOT, SHIM_PATH), "Found an entry that isn't there");
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry");
+        fail_if(!streq(varname, "Boot0008"), "Entry created as %s", varname);
+        bootvar_destroy();
+
+        /* A fresh snapshot finds it, and nothing else */
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries again");
+        fail_if(!bootvar_has_boot_rec(ESP_ROOT, SHIM_PATH), "Created entry not found");
+        fail_if(bootvar_has_boot_rec(ESP_ROOT, "/EFI/org.clearlinux/grubx64.efi"),
+                "Matched an entry for another loader");
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to look up the boot entry");
+        fail_if(!streq(varname, "Boot0008"), "Entry duplicated as %s", varname);
+        bootvar_destroy();
+
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * New entries take the lowest free numbers, filling gaps before appending,
+ * and each goes first in BootOrder
+ */
+START_TEST(bootvar_test_free_numbers)
+{
+        const char *loaders[] = {
+                "/EFI/a/bootx64.efi",
+                "/EFI/b/bootx64.efi",
+                "/EFI/c/bootx64.efi",
+        };
+        const char *expected[] = { "Boot0001", "Boot0003", "Boot0006" };
+        const unsigned int numbers[] = { 1, 3, 6 };
+        char varname[9] = { 0 };
+
+        bootvar_test_mount(6);
+        fail_if(!efivarfs_del_global("Boot0001"), "Failed to free Boot0001");
+        fail_if(!efivarfs_del_global("Boot0003"), "Failed to free Boot0003");
+
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries");
+        for (size_t i = 0; i < ARRAY_SIZE(loaders); i++) {
+                fail_if(bootvar_create(ESP_ROOT, loaders[i], varname, sizeof(varname)) != 0,
+                        "Failed to create %s",
+                        loaders[i]);
+                fail_if(!streq(varname, expected[i]),
+                        "%s created as %s, not %s",
+                        loaders[i],
+                        varname,
+                        expected[i]);
+                fail_if(bootvar_test_first_in_order() != numbers[i],
+                        "%s isn't first in BootOrder",
+                        varname);
+        }
+        bootvar_destroy();
+
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * The snapshot follows our own changes without being read again, but not
+ * those made behind its back until the next bootvar_init()
+ */
+START_TEST(bootvar_test_stale_snapshot)
+{
+        char varname[9] = { 0 };
+        uint8_t *data = NULL;
+        size_t size = 0;
+
+        bootvar_test_mount(2);
+
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries");
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry");
+        fail_if(!bootvar_has_boot_rec(ESP_ROOT, SHIM_PATH), "Created entry missing from snapshot");
+
+        /* Deleted by someone else, this snapshot still has it */
+        fail_if(!efivarfs_del_global(varname), "Failed to delete %s", varname);
+        fail_if(!bootvar_has_boot_rec(ESP_ROOT, SHIM_PATH), "Snapshot was read again");
+        bootvar_destroy();
+
+        /* The next one doesn't, and the entry is created again */
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries again");
+        fail_if(bootvar_has_boot_rec(ESP_ROOT, SHIM_PATH), "Deleted entry still found");
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry again");
+        fail_if(!streq(varname, "Boot0002"), "Entry created again as %s", varname);
+        fail_if(!efivarfs_get_global(varname, &data, &size), "%s wasn't stored", varname);
+        free(data);
+        bootvar_destroy();
+
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * Creating an entry that exists and is already first in BootOrder leaves
+ * the firmware alone
+ */
+START_TEST(bootvar_test_skip_identical_write)
+{
+        char varname[9] = { 0 };
+        EfivarfsStats efi_stats = { 0 };
+        CbmStats stats = { 0 };
+
+        bootvar_test_mount(4);
+
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries");
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry");
+        bootvar_destroy();
+
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries again");
+        cbm_stats_reset();
+        efivarfs_reset_stats();
+        fail_if(bootvar_create(ESP_ROOT, SHIM_PATH, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry again");
+        cbm_stats_get(&stats);
+        efivarfs_get_stats(&efi_stats);
+        fail_if(stats.efivar_writes != 0, "%lu EFI variables written", stats.efivar_writes);
+        fail_if(stats.efivar_writes_skipped != 1, "Skipped BootOrder write not counted");
+        fail_if(efi_stats.writes != 0, "efivarfs saw %lu writes", efi_stats.writes);
+        fail_if(bootvar_test_first_in_order() != 4, "%s isn't first in BootOrder", varname);
+        bootvar_destroy();
+
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * Setting a loader variable to what it already holds only reads it
+ */
+START_TEST(bootvar_test_skip_identical_loader_entry)
+{
+        CbmStats stats = { 0 };
+        char *entry = NULL;
+
+        nc_rm_rf(EFIVARS_ROOT);
+        fail_if(!efivarfs_mount(EFIVARS_ROOT, NULL, false), "Failed to stand in for efivarfs");
+
+        fail_if(bootvar_set_loader_entry("LoaderEntryDefault", "test.conf") != 0,
+                "Failed to set LoaderEntryDefault");
+        cbm_stats_reset();
+        fail_if(bootvar_set_loader_entry("LoaderEntryDefault", "test.conf") != 0,
+                "Failed to set LoaderEntryDefault again");
+        cbm_stats_get(&stats);
+        fail_if(stats.efivar_writes != 0, "Unchanged LoaderEntryDefault written");
+        fail_if(stats.efivar_writes_skipped != 1, "Skipped write not counted");
+        fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) != 0,
+                "LoaderEntryDefault went missing");
+        fail_if(!streq(entry, "test.conf"), "LoaderEntryDefault changed to %s", entry);
+        free(entry);
+
+        efivarfs_unmount();
+}
+END_TEST
+
+static Suite *core_suite(void)
+{
+        Suite *s = NULL;
+        TCase *tc = NULL;
+
+        s = suite_create("bootvar");
+        tc = tcase_create("bootvar_functions");
+        tcase_add_test(tc, bootvar_test_lookup);
+        tcase_add_test(tc, bootvar_test_free_numbers);
+        tcase_add_test(tc, bootvar_test_stale_snapshot);
+        tcase_add_test(tc, bootvar_test_skip_identical_write);
+        tcase_add_test(tc, bootvar_test_skip_identical_loader_entry);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+        int fail;
+
+        /* Ensure that logging is set up properly. */
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+
+        s = core_suite();
+        sr = srunner_create(s);
+        srunner_run_all(sr, CK_VERBOSE);
+        fail = srunner_ntests_failed(sr);
+        srunner_free(sr);
+
+        if (fail > 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
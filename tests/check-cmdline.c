@@ -105,6 +105,31 @@ START_TEST(cbm_cmdline_test_dirs_vendor_merged)
 }
 END_TEST
 
+START_TEST(cbm_cmdline_test_dirs_spacing)
+{
+        const char *dir = TOP_DIR "/tests/data/cmdline_spacing";
+
+        autofree(char) *p = NULL;
+
+        p = cbm_parse_cmdline_files(dir);
+        fail_if(!p, "Failed to parse cmdline dirs");
+        fail_if(!streq(p, "first  spaced\tline foo=\"a  b\" second line"),
+                "Spacing within a line was not kept: '%s'", p);
+}
+END_TEST
+
+START_TEST(cbm_cmdline_test_dirs_hidden)
+{
+        const char *dir = TOP_DIR "/tests/data/cmdline_hidden";
+
+        autofree(char) *p = NULL;
+
+        p = cbm_parse_cmdline_files(dir);
+        fail_if(!p, "Failed to parse cmdline dirs");
+        fail_if(!streq(p, "vendor visible local visible"), "Hidden files were merged: '%s'", p);
+}
+END_TEST
+
 START_TEST(cbm_cmdline_test_delete_middle)
 {
         const char *dir = TOP_DIR "/tests/data/cmdline_delete_middle";
@@ -125,7 +150,7 @@ START_TEST(cbm_cmdline_test_delete_ends)
         autofree(char) *p = strdup(cmdline);
 
         cbm_parse_cmdline_removal_files_directory(dir, p);
-        fail_if(!streq(p, "two three "), "Delete ends does not match");
+        fail_if(!streq(p, "two three"), "Delete ends does not match: '%s'", p);
 }
 END_TEST
 
@@ -141,6 +166,49 @@ START_TEST(cbm_cmdline_test_delete_all)
 }
 END_TEST
 
+START_TEST(cbm_cmdline_test_delete_tokens)
+{
+        const char *dir = TOP_DIR "/tests/data/cmdline_delete_tokens";
+        const char *cmdline = "quiet init=/bin/bash foo=\"a b\" rw quiet bash2\n";
+
+        autofree(char) *p = strdup(cmdline);
+
+        cbm_parse_cmdline_removal_files_directory(dir, p);
+        fail_if(!streq(p, "init=/bin/bash rw quiet bash2"), "Delete tokens does not match: '%s'", p);
+}
+END_TEST
+
+/**
+ * A removal line takes out the first occurrence only, repeating the line
+ * takes out the next one
+ */
+START_TEST(cbm_cmdline_test_delete_repeated)
+{
+        const char *dir = TOP_DIR "/tests/data/cmdline_delete_repeated";
+        const char *cmdline = "quiet rw quiet rw quiet\n";
+
+        autofree(char) *p = strdup(cmdline);
+
+        cbm_parse_cmdline_removal_files_directory(dir, p);
+        fail_if(!streq(p, "rw quiet"), "Delete repeated does not match: '%s'", p);
+}
+END_TEST
+
+/**
+ * Removing the final parameters leaves no whitespace behind
+ */
+START_TEST(cbm_cmdline_test_delete_last)
+{
+        const char *dir = TOP_DIR "/tests/data/cmdline_delete_last";
+        const char *cmdline = "one two three";
+
+        autofree(char) *p = strdup(cmdline);
+
+        cbm_parse_cmdline_removal_files_directory(dir, p);
+        fail_if(!streq(p, "one"), "Delete last does not match: '%s'", p);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -155,9 +223,14 @@ static Suite *core_suite(void)
         tcase_add_test(tc, cbm_cmdline_test_dirs);
         tcase_add_test(tc, cbm_cmdline_test_dirs_vendor_only);
         tcase_add_test(tc, cbm_cmdline_test_dirs_vendor_merged);
+        tcase_add_test(tc, cbm_cmdline_test_dirs_spacing);
+        tcase_add_test(tc, cbm_cmdline_test_dirs_hidden);
         tcase_add_test(tc, cbm_cmdline_test_delete_middle);
         tcase_add_test(tc, cbm_cmdline_test_delete_ends);
         tcase_add_test(tc, cbm_cmdline_test_delete_all);
+        tcase_add_test(tc, cbm_cmdline_test_delete_tokens);
+        tcase_add_test(tc, cbm_cmdline_test_delete_repeated);
+        tcase_add_test(tc, cbm_cmdline_test_delete_last);
         suite_add_tcase(s, tc);
 
         return s;
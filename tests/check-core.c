@@ -15,13 +15,18 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "bootman.h"
 #include "config.h"
 #include "files.h"
 #include "log.h"
+#include "metrics.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 #include "writer.h"
 
@@ -326,6 +331,110 @@ START_TEST(bootman_timeout_test)
 }
 END_TEST
 
+START_TEST(bootman_kernel_cmdline_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *list = NULL;
+        autofree(KernelArray) *relist = NULL;
+        const char *cmdline = NULL;
+        const char *conf_dir = TOP_BUILD_DIR "/tests/update_playground/" KERNEL_CONF_DIRECTORY;
+        autofree(char) *local_dir = string_printf("%s/cmdline.d", conf_dir);
+        autofree(char) *local_conf = string_printf("%s/10-test.conf", local_dir);
+
+        m = prepare_playground(&core_config);
+        list = boot_manager_get_kernels(m);
+        fail_if(!list || list->len < 1, "Failed to get kernels");
+
+        Kernel *k = nc_array_get(list, 0);
+        fail_if(k->meta.cmdline != NULL, "cmdline loaded before it was needed");
+
+        cmdline = boot_manager_get_kernel_cmdline(m, k);
+        fail_if(!cmdline, "Failed to load kernel cmdline");
+        fail_if(strncmp(cmdline, "cmdline-for-kernel", 18) != 0, "Unexpected cmdline: %s", cmdline);
+        fail_if(strstr(cmdline, "quiet") != NULL, "Unexpected global cmdline: %s", cmdline);
+        fail_if(boot_manager_get_kernel_cmdline(m, k) != cmdline, "Kernel cmdline not cached");
+
+        /* A new cmdline.d file must be picked up on the next set_prefix */
+        fail_if(!nc_mkdir_p(local_dir, 00755), "Failed to create cmdline.d");
+        fail_if(!file_set_text(local_conf, "quiet\n"), "Failed to write cmdline.d file");
+        fail_if(!boot_manager_set_prefix(m, TOP_BUILD_DIR "/tests/update_playground"),
+                "Failed to reset prefix");
+
+        relist = boot_manager_get_kernels(m);
+        fail_if(!relist || relist->len < 1, "Failed to get kernels");
+        cmdline = boot_manager_get_kernel_cmdline(m, nc_array_get(relist, 0));
+        fail_if(!cmdline || !streq(cmdline, "cmdline-for-kernel quiet"),
+                "Global cmdline not refreshed: %s",
+                cmdline);
+}
+END_TEST
+
+/**
+ * A first update copies every blob, a second one finds them all in place
+ */
+START_TEST(bootman_io_stats_test)
+{
+        autofree(BootManager) *m = NULL;
+        CbmStats stats = { 0 };
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        cbm_stats_get(&stats);
+        fail_if(stats.files_copied == 0, "No files copied by the first update");
+        fail_if(stats.bytes_written == 0, "No bytes written by the first update");
+        fail_if(stats.dir_scans == 0, "Kernel directory not scanned");
+        fail_if(stats.syncs == 0, "No syncs requested");
+
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to repeat image update");
+        cbm_stats_get(&stats);
+        fail_if(stats.files_copied != 0, "%lu files copied again", stats.files_copied);
+        fail_if(stats.files_skipped == 0, "Unchanged files not skipped");
+        fail_if(stats.bytes_compared == 0, "Unchanged files not compared");
+
+        cbm_stats_reset();
+        cbm_stats_get(&stats);
+        fail_if(stats.bytes_compared != 0 || stats.files_skipped != 0, "Counters not reset");
+}
+END_TEST
+
+/**
+ * The metrics file may come from the configuration, where an empty or blank
+ * file leaves metrics off
+ */
+START_TEST(bootman_metrics_config_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground";
+        const char *cfg = TOP_BUILD_DIR "/tests/update_playground/" KERNEL_CONF_DIRECTORY
+                                        "/metrics_file";
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        fail_if(!file_set_text(cfg, ""), "Failed to write empty metrics_file");
+        cbm_metrics_load_config(root);
+        fail_if(cbm_metrics_enabled(), "Empty metrics_file enabled metrics");
+
+        fail_if(!file_set_text(cfg, "\n"), "Failed to write blank metrics_file");
+        cbm_metrics_load_config(root);
+        fail_if(cbm_metrics_enabled(), "Blank metrics_file enabled metrics");
+
+        fail_if(!file_set_text(cfg, TOP_BUILD_DIR "/tests/update_playground/cbm.prom\n"),
+                "Failed to write metrics_file");
+        cbm_metrics_load_config(root);
+        fail_if(!cbm_metrics_enabled(), "metrics_file didn't enable metrics");
+
+        cbm_metrics_discard();
+        cbm_trace_discard();
+        unlink(cfg);
+}
+END_TEST
+
 START_TEST(bootman_writer_simple_test)
 {
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
@@ -388,6 +497,53 @@ START_TEST(bootman_writer_mut_test)
 }
 END_TEST
 
+START_TEST(bootman_log_held_test)
+{
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&buf, &len);
+        char *held = NULL;
+        char *error = NULL;
+
+        fail_if(!f, "Failed to open memory stream");
+        setenv("CBM_DEBUG", "4", 1);
+        cbm_log_init(f);
+
+        /* Below the level, nothing is written until an error */
+        LOG_DEBUG("Held message %d", 1);
+        LOG_INFO("Held message %d", 2);
+        fflush(f);
+        fail_if(len != 0, "Message below the log level written: %s", buf);
+
+        LOG_ERROR("Failed for real");
+        fflush(f);
+        held = strstr(buf, "Held message 1");
+        error = strstr(buf, "Failed for real");
+        fail_if(!held || !strstr(buf, "Held message 2"), "Held messages not dumped: %s", buf);
+        fail_if(!error || error < held, "Held messages not ahead of the error: %s", buf);
+
+        /* Dumped messages are forgotten */
+        LOG_FATAL("Failed again");
+        fflush(f);
+        fail_if(strstr(held + 1, "Held message 1") != NULL, "Held messages dumped twice");
+
+        /* Only the most recent ones are kept */
+        for (int i = 0; i < 300; i++) {
+                LOG_DEBUG("Filler %d", i);
+        }
+        cbm_log_dump_held();
+        fflush(f);
+        fail_if(!strstr(buf, "(44 older dropped)"), "Dropped messages not reported: %s", buf);
+        fail_if(strstr(buf, "Filler 43\n") != NULL, "Dropped message still dumped");
+        fail_if(!strstr(buf, "Filler 299\n"), "Latest message not dumped");
+
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+        fclose(f);
+        free(buf);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -406,6 +562,12 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_list_kernels_no_modules_test);
         tcase_add_test(tc, bootman_map_kernels_test);
         tcase_add_test(tc, bootman_timeout_test);
+        tcase_add_test(tc, bootman_kernel_cmdline_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_stats_functions");
+        tcase_add_test(tc, bootman_io_stats_test);
+        tcase_add_test(tc, bootman_metrics_config_test);
         suite_add_tcase(s, tc);
 
         tc = tcase_create("bootman_writer_functions");
@@ -414,6 +576,10 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_writer_mut_test);
         suite_add_tcase(s, tc);
 
+        tc = tcase_create("bootman_log_functions");
+        tcase_add_test(tc, bootman_log_held_test);
+        suite_add_tcase(s, tc);
+
         return s;
 }
 
@@ -11,6 +11,8 @@
 
 #define _GNU_SOURCE
 #include <check.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,8 +21,10 @@
 #include "util.h"
 
 #include "files.h"
+#include "fs_stub.h"
 #include "harness.h"
 #include "log.h"
+#include "memfs-harness.h"
 #include "nica/files.h"
 #include "system-harness.h"
 
@@ -58,6 +62,66 @@ START_TEST(bootman_match_test)
 }
 END_TEST
 
+START_TEST(bootman_empty_file_test)
+{
+        const char *empty = TOP_BUILD_DIR "/tests/empty-file";
+        const char *source_match = TOP_DIR "/tests/data/match";
+        autofree(char) *text = NULL;
+        int fd = -1;
+
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests", 00755), "Failed to create test directory");
+        fail_if(!file_set_text(empty, ""), "Failed to create empty file");
+
+        /* Nothing to map, but still readable */
+        fail_if(!file_get_text(empty, &text), "Failed to read empty file");
+        fail_if(!text || text[0] != '\0', "Empty file read as: %s", text);
+        fail_if(!cbm_files_match(empty, empty), "Empty file doesn't match itself");
+        fail_if(cbm_files_match(empty, source_match), "Empty file matches non empty one");
+
+        /* There is nothing to map, which fails cleanly rather than with MAP_FAILED */
+        fd = cbm_fs_open(empty, O_RDONLY, 0);
+        fail_if(fd < 0, "Failed to open empty file");
+        errno = 0;
+        fail_if(cbm_fs_mmap(fd, 0) != NULL || errno != EINVAL, "Mapped an empty file");
+        cbm_fs_close(fd);
+        fail_if(cbm_fs_mmap(-1, 16) != NULL, "Mapped a bad descriptor");
+
+        unlink(empty);
+}
+END_TEST
+
+/**
+ * Files held in memory fail to map like those on disk, and empty ones
+ * still read
+ */
+START_TEST(bootman_memfs_mmap_test)
+{
+        const char *root = TOP_BUILD_DIR "/tests/memfs";
+        autofree(char) *text = NULL;
+        int fd = -1;
+
+        nc_rm_rf(root);
+        fail_if(!memfs_mount(root, NULL, false), "Failed to mount the in-memory filesystem");
+
+        fail_if(!file_set_text(TOP_BUILD_DIR "/tests/memfs/text", "text\n"),
+                "Failed to write a file to memory");
+        fd = cbm_fs_open(TOP_BUILD_DIR "/tests/memfs/text", O_RDONLY, 0);
+        fail_if(fd < 0, "Failed to open a file in memory");
+        errno = 0;
+        fail_if(cbm_fs_mmap(fd, 0) != NULL || errno != EINVAL, "Mapped nothing from memory");
+        cbm_fs_close(fd);
+        fail_if(cbm_fs_mmap(-1, 16) != NULL, "Mapped a bad descriptor");
+
+        fail_if(!file_set_text(TOP_BUILD_DIR "/tests/memfs/empty", ""),
+                "Failed to write an empty file");
+        fail_if(!file_get_text(TOP_BUILD_DIR "/tests/memfs/empty", &text) || !streq(text, ""),
+                "Failed to read an empty file from memory");
+
+        memfs_unmount();
+        fail_if(nc_file_exists(TOP_BUILD_DIR "/tests/memfs/empty"), "Empty file reached the disk");
+}
+END_TEST
+
 START_TEST(bootman_find_boot)
 {
         set_test_system_uefi();
@@ -89,6 +153,8 @@ static Suite *core_suite(void)
         s = suite_create("bootman_files");
         tc = tcase_create("bootman_files");
         tcase_add_test(tc, bootman_match_test);
+        tcase_add_test(tc, bootman_empty_file_test);
+        tcase_add_test(tc, bootman_memfs_mmap_test);
         tcase_add_test(tc, bootman_mount_test);
         tcase_add_test(tc, bootman_find_boot);
         suite_add_tcase(s, tc);
@@ -251,6 +251,72 @@ static void internal_loader_test(bool image_mode)
                 "Auto-updated bootloader doesn't match source");
 }
 
+/**
+ * Count spawned commands to verify the install steps that were skipped
+ */
+static int legacy_system_calls = 0;
+
+static inline int legacy_counting_system(__cbm_unused__ const char *command)
+{
+        ++legacy_system_calls;
+        return 0;
+}
+
+/**
+ * Ensure a repeated install only touches the steps that are out of date.
+ *
+ * Scenario:
+ *
+ *      - Plant ldlinux files matching the shipped syslinux
+ *      - Install bootloader: the legacy_boot flag is set, nothing is spawned
+ *      - Install again: still nothing spawned, MBR left as is
+ *      - Bump the shipped ldlinux.c32 and verify the installer runs again
+ */
+START_TEST(bootman_legacy_install_idempotent)
+{
+        autofree(BootManager) *m = NULL;
+        PlaygroundConfig start_conf = { 0 };
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *syslinux_disk = PLAYGROUND_ROOT "/dev/leRootDevice";
+        const char *syslinux_orig = PLAYGROUND_ROOT "/dev/leRootDevice-orig";
+        const char *ldlinux_source = PLAYGROUND_ROOT "/usr/share/syslinux/ldlinux.c32";
+
+        m = prepare_playground(&start_conf);
+        fail_if(!m, "Fatal: Cannot initialise playground");
+
+        fail_if(!nc_mkdir_p(PLAYGROUND_ROOT "/usr/share/syslinux", 00755),
+                "Failed to create syslinux module directory");
+        fail_if(!file_set_text(ldlinux_source, "ldlinux-v1"), "Failed to plant ldlinux.c32");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" BOOT_DIRECTORY "/ldlinux.c32", "ldlinux-v1"),
+                "Failed to plant installed ldlinux.c32");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" BOOT_DIRECTORY "/ldlinux.sys", "ldlinux"),
+                "Failed to plant installed ldlinux.sys");
+
+        system_ops.system = legacy_counting_system;
+        cbm_system_set_vtable(&system_ops);
+        legacy_system_calls = 0;
+
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_INSTALL),
+                "Failed to install bootloader");
+        fail_if(legacy_system_calls != 0, "Install spawned commands for up to date state");
+
+        fail_if(!copy_file(syslinux_disk, syslinux_orig, 00644), "Failed to copy MBR");
+
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_INSTALL),
+                "Failed to reinstall bootloader");
+        fail_if(legacy_system_calls != 0, "Reinstall spawned commands for up to date state");
+        fail_if(!cbm_files_match(syslinux_disk, syslinux_orig), "Reinstall changed the MBR");
+
+        /* New syslinux shipped, installer must run again */
+        fail_if(!file_set_text(ldlinux_source, "ldlinux-v2"), "Failed to bump ldlinux.c32");
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_INSTALL),
+                "Failed to install updated bootloader");
+        fail_if(legacy_system_calls != 1, "Installer didn't run for outdated ldlinux.c32");
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
 START_TEST(bootman_legacy_update_image)
 {
         internal_loader_test(true);
@@ -277,6 +343,7 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_native);
+        tcase_add_test(tc, bootman_legacy_install_idempotent);
         suite_add_tcase(s, tc);
 
         return s;
@@ -0,0 +1,235 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lock.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+#define LOCK_ROOT TOP_BUILD_DIR "/lock"
+#define LOCK_PATH LOCK_ROOT "/update.lock"
+#define RUNS_PATH LOCK_ROOT "/runs"
+#define BUSY_PATH LOCK_ROOT "/busy"
+
+/* Exit status of a request that succeeded by sharing another's run */
+#define LOCK_TEST_ATTACHED 2
+
+/**
+ * Stand in for an update: records the run, and fails if another one is
+ * running at the same time.
+ */
+static bool lock_test_update(__cbm_unused__ void *userdata)
+{
+        int fd;
+        bool ret = true;
+
+        fd = open(BUSY_PATH, O_CREAT | O_EXCL | O_WRONLY, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        close(fd);
+
+        fd = open(RUNS_PATH, O_CREAT | O_APPEND | O_WRONLY, 00644);
+        if (fd < 0 || write(fd, "x", 1) != 1) {
+                ret = false;
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+
+        usleep(300000);
+        unlink(BUSY_PATH);
+
+        return ret;
+}
+
+static void lock_test_reset(void)
+{
+        fail_if(!nc_mkdir_p(LOCK_ROOT, 00755), "Failed to create lock directory");
+        unlink(LOCK_PATH);
+        unlink(LOCK_PATH ".queue");
+        unlink(LOCK_PATH ".state");
+        unlink(RUNS_PATH);
+        unlink(BUSY_PATH);
+}
+
+/**
+ * Release @n requests for @key at once, returning how many of them failed.
+ * The number that shared another run rather than running is stored in
+ * @attached when not NULL.
+ */
+static int lock_test_burst(int n, const char *key, int *attached)
+{
+        int gate[2];
+        int failed = 0;
+
+        fail_if(pipe(gate) != 0, "Failed to create pipe");
+
+        for (int i = 0; i < n; i++) {
+                pid_t pid = fork();
+                bool ran = false;
+                char c;
+
+                fail_if(pid < 0, "Failed to fork");
+                if (pid > 0) {
+                        continue;
+                }
+
+                close(gate[1]);
+                if (read(gate[0], &c, 1) < 0) {
+                        _exit(EXIT_FAILURE);
+                }
+                if (!cbm_update_lock_run(LOCK_PATH, key, lock_test_update, NULL, &ran)) {
+                        _exit(EXIT_FAILURE);
+                }
+                _exit(ran ? EXIT_SUCCESS : LOCK_TEST_ATTACHED);
+        }
+
+        close(gate[0]);
+        close(gate[1]);
+        if (attached) {
+                *attached = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+                int status = 0;
+
+                fail_if(wait(&status) < 0, "Failed to wait for request");
+                if (WIFEXITED(status) && WEXITSTATUS(status) == LOCK_TEST_ATTACHED) {
+                        if (attached) {
+                                (*attached)++;
+                        }
+                } else if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                        failed++;
+                }
+        }
+
+        return failed;
+}
+
+static off_t lock_test_runs(void)
+{
+        struct stat st = { 0 };
+
+        if (stat(RUNS_PATH, &st) != 0) {
+                return 0;
+        }
+        return st.st_size;
+}
+
+START_TEST(cbm_lock_test_coalesce)
+{
+        int attached = 0;
+
+        lock_test_reset();
+
+        fail_if(lock_test_burst(10, "update", &attached) != 0, "Coalesced requests failed");
+        fail_if(lock_test_runs() < 1, "Update never ran");
+        fail_if(lock_test_runs() > 2, "Burst of 10 requests ran %ld updates", (long)lock_test_runs());
+        /* Only the requests that ran have anything of their own to report */
+        fail_if(attached != 10 - lock_test_runs(),
+                "%d requests attached but %ld of 10 ran",
+                attached,
+                (long)lock_test_runs());
+
+        /* Nothing is pending any more, the next request runs by itself */
+        fail_if(lock_test_burst(1, "update", &attached) != 0, "Follow up request failed");
+        fail_if(attached != 0, "Follow up request didn't run itself");
+        fail_if(lock_test_runs() < 2, "Follow up request didn't run");
+}
+END_TEST
+
+START_TEST(cbm_lock_test_serialize)
+{
+        lock_test_reset();
+
+        /* Without a key every request runs, one at a time */
+        fail_if(lock_test_burst(3, NULL, NULL) != 0, "Serialized requests overlapped");
+        fail_if(lock_test_runs() != 3, "Serialized requests were skipped");
+}
+END_TEST
+
+START_TEST(cbm_lock_test_disabled)
+{
+        lock_test_reset();
+
+        fail_if(!cbm_update_lock_run(NULL, "update", lock_test_update, NULL, NULL),
+                "Unlocked request failed");
+        fail_if(lock_test_runs() != 1, "Unlocked request didn't run");
+        fail_if(nc_file_exists(LOCK_PATH), "Lock file created while disabled");
+
+        setenv("CBM_UPDATE_LOCK", "", 1);
+        fail_if(cbm_update_lock_path() != NULL, "Empty CBM_UPDATE_LOCK didn't disable the lock");
+        setenv("CBM_UPDATE_LOCK", LOCK_PATH, 1);
+        fail_if(!streq(cbm_update_lock_path(), LOCK_PATH), "CBM_UPDATE_LOCK not honoured");
+        unsetenv("CBM_UPDATE_LOCK");
+}
+END_TEST
+
+static Suite *core_suite(void)
+{
+        Suite *s = NULL;
+        TCase *tc = NULL;
+
+        s = suite_create("cbm_lock");
+        tc = tcase_create("cbm_lock_functions");
+        tcase_add_test(tc, cbm_lock_test_coalesce);
+        tcase_add_test(tc, cbm_lock_test_serialize);
+        tcase_add_test(tc, cbm_lock_test_disabled);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+        int fail;
+
+        /* Ensure that logging is set up properly. */
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+
+        s = core_suite();
+        sr = srunner_create(s);
+        srunner_run_all(sr, CK_VERBOSE);
+        fail = srunner_ntests_failed(sr);
+        srunner_free(sr);
+
+        if (fail > 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
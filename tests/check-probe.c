@@ -28,17 +28,22 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "blkid_stub.h"
 #include "bootloader.h"
 #include "bootman.h"
 #include "config.h"
 #include "files.h"
+#include "gpt.h"
+#include "library.h"
 #include "log.h"
+#include "nica/files.h"
 #include "probe.h"
 
 #include "blkid-harness.h"
@@ -211,6 +216,200 @@ START_TEST(bootman_probe_basic_none)
 }
 END_TEST
 
+/**
+ * Count every probe opened, to ensure devices are only probed once per run
+ */
+static int probe_count = 0;
+
+static inline blkid_probe counting_new_probe_from_filename(const char *filename)
+{
+        ++probe_count;
+        return test_blkid_new_probe_from_filename(filename);
+}
+
+/**
+ * Repeated probes are answered from the topology cache
+ */
+START_TEST(bootman_probe_cached)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        autofree(CbmDeviceProbe) *probe = NULL;
+        autofree(CbmDeviceProbe) *probe2 = NULL;
+        static CbmBlkidOps counting_blkid_ops;
+        int count = 0;
+
+        counting_blkid_ops = gpt_blkid_ops;
+        counting_blkid_ops.probe_new_from_filename = counting_new_probe_from_filename;
+        cbm_blkid_set_vtable(&counting_blkid_ops);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        m = prepare_playground(&config);
+        set_test_system_legacy();
+
+        probe = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!probe, "Failed to get probe for a valid rootfs");
+        fail_if(!probe->gpt, "GPT UEFI root not detected as GPT");
+        count = probe_count;
+        fail_if(count < 1, "Root device was never probed");
+
+        probe2 = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!probe2, "Failed to get cached probe for a valid rootfs");
+        fail_if(!probe2->gpt, "Cached GPT UEFI root not detected as GPT");
+        fail_if(!streq(probe2->part_uuid, probe->part_uuid), "Cached PartUUID differs");
+        fail_if(probe_count != count, "Root device probed again: %d != %d", probe_count, count);
+        fail_if(get_partition_index(PLAYGROUND_ROOT, PLAYGROUND_ROOT) != -1,
+                "Unexpected partition index without PartUUIDs");
+        fail_if(probe_count != count, "Partition table probed again");
+
+        /* Changing the vtable invalidates everything learned */
+        cbm_blkid_set_vtable(&counting_blkid_ops);
+        probe_count = 0;
+        cbm_probe_free(probe2);
+        probe2 = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!probe2, "Failed to reprobe a valid rootfs");
+        fail_if(probe_count < 1, "Root device not probed after a reset");
+}
+END_TEST
+
+#define GPT_FIXTURE TOP_DIR "/tests/data/gpt.img"
+
+/**
+ * Flip a single byte of a copy of the GPT fixture
+ */
+static char *corrupt_gpt_fixture(off_t offset)
+{
+        char *path = NULL;
+        unsigned char c = 0;
+        int fd = -1;
+
+        nc_mkdir_p(TOP_BUILD_DIR, 00755);
+        path = string_printf("%s/gpt-corrupt.img", TOP_BUILD_DIR);
+        fail_if(!copy_file(GPT_FIXTURE, path, 00644), "Failed to copy GPT fixture");
+
+        fd = open(path, O_RDWR);
+        fail_if(fd < 0, "Failed to open GPT fixture copy");
+        fail_if(pread(fd, &c, 1, offset) != 1, "Failed to read GPT fixture copy");
+        c ^= 0xFF;
+        fail_if(pwrite(fd, &c, 1, offset) != 1, "Failed to corrupt GPT fixture copy");
+        close(fd);
+
+        return path;
+}
+
+/**
+ * Parse the fixture disk image directly
+ */
+START_TEST(bootman_probe_gpt_read)
+{
+        autofree(CbmGptTable) *gpt = NULL;
+
+        gpt = cbm_gpt_read(GPT_FIXTURE);
+        fail_if(!gpt, "Failed to read GPT fixture");
+        fail_if(gpt->sector_size != 512, "Wrong sector size: %u", gpt->sector_size);
+        fail_if(!streq(gpt->disk_guid, "a1b2c3d4-e5f6-4789-8abc-def012345678"),
+                "Wrong disk GUID: %s",
+                gpt->disk_guid);
+        fail_if(gpt->n_partitions != 2, "Expected 2 partitions, got %d", gpt->n_partitions);
+
+        /* ESP */
+        fail_if(gpt->partitions[0].slot != 0, "Wrong ESP slot");
+        fail_if(!streq(gpt->partitions[0].type_guid, "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"),
+                "Wrong ESP type GUID: %s",
+                gpt->partitions[0].type_guid);
+        fail_if(!streq(gpt->partitions[0].unique_guid, "2b2c7f3e-5a0f-4f4e-9b1d-6f0e9a1c0e01"),
+                "Wrong ESP PartUUID: %s",
+                gpt->partitions[0].unique_guid);
+        fail_if(gpt->partitions[0].first_lba != 34 || gpt->partitions[0].last_lba != 63,
+                "Wrong ESP extent");
+        fail_if(gpt->partitions[0].attributes & CBM_GPT_ATTR_LEGACY_BOOT,
+                "ESP should not be legacy bootable");
+
+        /* root */
+        fail_if(gpt->partitions[1].slot != 1, "Wrong root slot");
+        fail_if(!streq(gpt->partitions[1].type_guid, "4f68bce3-e8cd-4c31-b87b-0f6a6d0f3af3"),
+                "Wrong root type GUID: %s",
+                gpt->partitions[1].type_guid);
+        fail_if(!streq(gpt->partitions[1].unique_guid, "8d6e4b2a-3c1f-4e7d-a5b9-0c2d4e6f8a10"),
+                "Wrong root PartUUID: %s",
+                gpt->partitions[1].unique_guid);
+        fail_if(!(gpt->partitions[1].attributes & CBM_GPT_ATTR_LEGACY_BOOT),
+                "root should be legacy bootable");
+}
+END_TEST
+
+/**
+ * Anything failing validation is left to libblkid
+ */
+START_TEST(bootman_probe_gpt_invalid)
+{
+        autofree(CbmGptTable) *gpt = NULL;
+        autofree(char) *entries = NULL;
+        autofree(char) *header = NULL;
+
+        /* Not a disk image at all */
+        gpt = cbm_gpt_read(TOP_DIR "/tests/data/gptmbr.bin");
+        fail_if(gpt, "Read a GPT from a bootloader blob");
+
+        /* Partition name within the entry array */
+        entries = corrupt_gpt_fixture(2 * 512 + 60);
+        gpt = cbm_gpt_read(entries);
+        fail_if(gpt, "Accepted a GPT with a corrupt entry array");
+
+        /* Disk GUID within the header */
+        header = corrupt_gpt_fixture(512 + 56);
+        gpt = cbm_gpt_read(header);
+        fail_if(gpt, "Accepted a GPT with a corrupt header");
+}
+END_TEST
+
+/**
+ * A valid GPT on the parent disk wins over libblkid
+ */
+START_TEST(bootman_probe_gpt_native)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        autofree(CbmDeviceProbe) *probe = NULL;
+        autofree(char) *disk = NULL;
+
+        /* libblkid would claim an MBR disk */
+        bootman_probe_set_mbr_vtables();
+
+        m = prepare_playground(&config);
+        set_test_system_legacy();
+
+        disk = string_printf("%s/leRootDevice", cbm_system_get_devfs_path());
+        fail_if(!copy_file(GPT_FIXTURE, disk, 00644), "Failed to install GPT fixture");
+
+        probe = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!probe, "Failed to get probe for a valid rootfs");
+        fail_if(!probe->gpt, "Native GPT not detected");
+        fail_if(get_partition_legacy_boot(PLAYGROUND_ROOT, 0), "ESP marked legacy bootable");
+        fail_if(!get_partition_legacy_boot(PLAYGROUND_ROOT, 1), "root not marked legacy bootable");
+}
+END_TEST
+
+START_TEST(bootman_probe_lazy_blkid)
+{
+        blkid_probe pr = NULL;
+        blkid_partlist parts = NULL;
+
+        cbm_blkid_reset_vtable();
+        fail_if(cbm_library_is_loaded(&cbm_libblkid), "libblkid loaded before first use");
+
+        pr = cbm_blkid_new_probe_from_filename(GPT_FIXTURE);
+        fail_if(!pr, "Failed to probe GPT fixture");
+        fail_if(!cbm_library_is_loaded(&cbm_libblkid), "libblkid not loaded on first use");
+
+        fail_if(cbm_blkid_probe_enable_partitions(pr, 1) != 0, "Failed to enable partitions");
+        parts = cbm_blkid_probe_get_partitions(pr);
+        fail_if(!parts, "Failed to get partitions");
+        fail_if(cbm_blkid_partlist_numof_partitions(parts) != 2, "Wrong number of partitions");
+        cbm_blkid_free_probe(pr);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -225,6 +424,17 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_probe_basic_none);
         suite_add_tcase(s, tc);
 
+        tc = tcase_create("bootman_probe_gpt");
+        tcase_add_test(tc, bootman_probe_gpt_read);
+        tcase_add_test(tc, bootman_probe_gpt_invalid);
+        tcase_add_test(tc, bootman_probe_gpt_native);
+        tcase_add_test(tc, bootman_probe_lazy_blkid);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_probe_cached");
+        tcase_add_test(tc, bootman_probe_cached);
+        suite_add_tcase(s, tc);
+
         return s;
 }
 
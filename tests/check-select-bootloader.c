@@ -40,6 +40,7 @@
 #include "log.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "null.h"
 #include "util.h"
 #include "writer.h"
 
@@ -73,8 +74,9 @@ static void bootman_select_set_default_vtables(void)
 static void ensure_bootloader_is(BootManager *manager, const char *expected)
 {
         fail_if(manager == NULL, "No BootManager");
-        fail_if(!manager->bootloader, "No bootloader is selected. Expected %s", expected);
-        const char *name = manager->bootloader->name;
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        fail_if(!bootloader, "No bootloader is selected. Expected %s", expected);
+        const char *name = bootloader->name;
         fail_if(!streq(name, expected), "Expected bootloader '%s', got '%s'", expected, name);
 }
 
@@ -400,6 +402,228 @@ START_TEST(bootman_select_edge_uefi_with_legacy_part_image)
 }
 END_TEST
 
+/**
+ * ############ BEGIN FORCED SELECTION TESTS #################
+ */
+
+#if defined(NULL_BACKEND_ENABLED)
+static PlaygroundKernel null_kernels[] = { { "4.2.1", "kvm", 121, false, false },
+                                           { "4.2.3", "kvm", 124, true, false } };
+
+/**
+ * CBM_BOOTLOADER=null must win over the capability checks, and an update
+ * must only ever record calls against it.
+ */
+START_TEST(bootman_select_forced_null)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm",
+                                           null_kernels,
+                                           ARRAY_SIZE(null_kernels),
+                                           .uefi = true };
+        NullBootLoaderStats stats = { 0 };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        bootman_select_set_default_vtables();
+
+        setenv("CBM_BOOTLOADER", NULL_BOOTLOADER_NAME, 1);
+        null_bootloader_reset();
+
+        m = prepare_playground(&config);
+        ensure_bootloader_is(m, NULL_BOOTLOADER_NAME);
+        boot_manager_set_image_mode(m, false);
+
+        fail_if(!boot_manager_update(m), "Failed to update with null bootloader");
+
+        null_bootloader_get_stats(&stats);
+        fail_if(stats.begin_transaction != 1, "Update did not begin a transaction");
+        fail_if(stats.commit != 1, "Update did not commit the transaction");
+        fail_if(stats.install_kernel != 0, "Batch hook was bypassed");
+        fail_if(stats.kernels_installed != ARRAY_SIZE(null_kernels),
+                "Expected %d kernels installed, got %u",
+                (int)ARRAY_SIZE(null_kernels),
+                stats.kernels_installed);
+        fail_if(stats.set_default_kernel < 1, "Default kernel was never set");
+        fail_if(nc_file_exists(PLAYGROUND_ROOT "/" BOOT_DIRECTORY "/loader"),
+                "Null bootloader wrote loader configuration");
+
+        unsetenv("CBM_BOOTLOADER");
+}
+END_TEST
+
+/**
+ * A kernel queued twice in one transaction reaches the batch hook once
+ */
+START_TEST(bootman_select_forced_null_duplicates)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm",
+                                           null_kernels,
+                                           ARRAY_SIZE(null_kernels),
+                                           .uefi = true };
+        NullBootLoaderStats stats = { 0 };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        bootman_select_set_default_vtables();
+
+        setenv("CBM_BOOTLOADER", NULL_BOOTLOADER_NAME, 1);
+        null_bootloader_reset();
+
+        m = prepare_playground(&config);
+        ensure_bootloader_is(m, NULL_BOOTLOADER_NAME);
+        boot_manager_set_image_mode(m, false);
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len != ARRAY_SIZE(null_kernels), "Failed to load kernels");
+
+        /* Lay out the tree first, only the second round is counted */
+        fail_if(!boot_manager_update(m), "Failed to update with null bootloader");
+        null_bootloader_reset();
+
+        fail_if(!boot_manager_begin_transaction(m), "Failed to begin a transaction");
+        for (int pass = 0; pass < 2; pass++) {
+                for (uint16_t i = 0; i < kernels->len; i++) {
+                        fail_if(!boot_manager_install_kernel(m, nc_array_get(kernels, i)),
+                                "Failed to queue kernel %u",
+                                i);
+                }
+        }
+        fail_if(!boot_manager_commit_transaction(m), "Failed to commit the transaction");
+
+        null_bootloader_get_stats(&stats);
+        fail_if(stats.kernels_installed != ARRAY_SIZE(null_kernels),
+                "Expected %d kernels installed, got %u",
+                (int)ARRAY_SIZE(null_kernels),
+                stats.kernels_installed);
+
+        unsetenv("CBM_BOOTLOADER");
+}
+END_TEST
+
+/**
+ * Return whether the blob of @kernel is still on the null bootloader's ESP
+ */
+static bool null_kernel_blob_exists(const Kernel *kernel)
+{
+        autofree(char) *path = NULL;
+
+        path = string_printf("%s/%s/EFI/%s/%s",
+                             PLAYGROUND_ROOT,
+                             BOOT_DIRECTORY,
+                             KERNEL_NAMESPACE,
+                             kernel->target.path);
+        return nc_file_exists(path);
+}
+
+/**
+ * Blobs queued for removal outlive a commit that fails part way, so no entry
+ * the bootloader kept is left pointing at a missing kernel
+ */
+START_TEST(bootman_select_forced_null_failed_removal)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm",
+                                           null_kernels,
+                                           ARRAY_SIZE(null_kernels),
+                                           .uefi = true };
+        NullBootLoaderStats stats = { 0 };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        bootman_select_set_default_vtables();
+
+        setenv("CBM_BOOTLOADER", NULL_BOOTLOADER_NAME, 1);
+        null_bootloader_reset();
+
+        m = prepare_playground(&config);
+        ensure_bootloader_is(m, NULL_BOOTLOADER_NAME);
+        boot_manager_set_image_mode(m, false);
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len != ARRAY_SIZE(null_kernels), "Failed to load kernels");
+
+        fail_if(!boot_manager_update(m), "Failed to update with null bootloader");
+        fail_if(!boot_manager_begin_transaction(m), "Failed to begin a transaction");
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                fail_if(!boot_manager_install_kernel(m, nc_array_get(kernels, i)),
+                        "Failed to install kernel %u",
+                        i);
+        }
+        fail_if(!boot_manager_commit_transaction(m), "Failed to commit the installs");
+
+        /* The bootloader drops one entry, then gives up */
+        null_bootloader_reset();
+        null_bootloader_fail_removals_after(1);
+        fail_if(!boot_manager_begin_transaction(m), "Failed to begin a transaction");
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+                fail_if(!boot_manager_remove_kernel(m, k), "Failed to queue kernel %u", i);
+                fail_if(!null_kernel_blob_exists(k),
+                        "Blob removed before commit: %s",
+                        k->target.path);
+        }
+        fail_if(boot_manager_commit_transaction(m), "Failed removal was committed");
+
+        null_bootloader_get_stats(&stats);
+        fail_if(stats.kernels_removed != 1, "Expected 1 kernel removed, got %u",
+                stats.kernels_removed);
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+                fail_if(!null_kernel_blob_exists(k),
+                        "Blob removed after a failed commit: %s",
+                        k->target.path);
+        }
+
+        /* Once the entries are gone, so are the blobs */
+        null_bootloader_reset();
+        fail_if(!boot_manager_begin_transaction(m), "Failed to begin a transaction");
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                fail_if(!boot_manager_remove_kernel(m, nc_array_get(kernels, i)),
+                        "Failed to queue kernel %u",
+                        i);
+        }
+        fail_if(!boot_manager_commit_transaction(m), "Failed to commit the removals");
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+                fail_if(null_kernel_blob_exists(k), "Blob left behind: %s", k->target.path);
+        }
+
+        unsetenv("CBM_BOOTLOADER");
+}
+END_TEST
+#else
+/**
+ * Without the null backend built in, asking for it is no different from
+ * asking for an unknown bootloader
+ */
+START_TEST(bootman_select_forced_null_disabled)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        bootman_select_set_default_vtables();
+
+        setenv("CBM_BOOTLOADER", NULL_BOOTLOADER_NAME, 1);
+        m = prepare_playground(&config);
+        ensure_bootloader_is(m, UEFI_BOOTLOADER_NAME);
+        unsetenv("CBM_BOOTLOADER");
+}
+END_TEST
+#endif
+
+/**
+ * An unknown CBM_BOOTLOADER is reported and ignored
+ */
+START_TEST(bootman_select_forced_unknown)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        bootman_select_set_default_vtables();
+
+        setenv("CBM_BOOTLOADER", "no-such-loader", 1);
+        m = prepare_playground(&config);
+        ensure_bootloader_is(m, UEFI_BOOTLOADER_NAME);
+        unsetenv("CBM_BOOTLOADER");
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -432,6 +656,18 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_select_edge_uefi_with_legacy_part_image);
         suite_add_tcase(s, tc);
 
+        /* CBM_BOOTLOADER */
+        tc = tcase_create("bootman_select_forced");
+#if defined(NULL_BACKEND_ENABLED)
+        tcase_add_test(tc, bootman_select_forced_null);
+        tcase_add_test(tc, bootman_select_forced_null_duplicates);
+        tcase_add_test(tc, bootman_select_forced_null_failed_removal);
+#else
+        tcase_add_test(tc, bootman_select_forced_null_disabled);
+#endif
+        tcase_add_test(tc, bootman_select_forced_unknown);
+        suite_add_tcase(s, tc);
+
         return s;
 }
 
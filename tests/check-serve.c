@@ -0,0 +1,395 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <check.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "ops/serve.h"
+#include "util.h"
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+
+static PlaygroundKernel serve_kernels[] = { { "4.2.1", "kvm", 121, true },
+                                            { "4.2.3", "native", 138, true } };
+
+static PlaygroundConfig serve_config = { "4.2.1-121.kvm",
+                                         serve_kernels,
+                                         ARRAY_SIZE(serve_kernels),
+                                         .uefi = true };
+
+/**
+ * Serve a freshly prepared playground
+ */
+static CbmServer *serve_test_start(void)
+{
+        autofree(BootManager) *m = NULL;
+        CbmServer *server = NULL;
+
+        m = prepare_playground(&serve_config);
+        fail_if(!m, "Failed to prepare update playground");
+        fail_if(!create_timeout_conf(), "Failed to write the timeout");
+
+        server = cbm_server_new(PLAYGROUND_ROOT, false);
+        fail_if(!server, "Failed to start serving the playground");
+        return server;
+}
+
+/**
+ * Send @argv to @server and return the reply, with what the command wrote
+ * to stdout and stderr in @out and @err if they are not NULL
+ */
+static int serve_test_request(CbmServer *server, int argc, char **argv, char **out, char **err)
+{
+        int sv[2] = { -1, -1 };
+        int out_pipe[2] = { -1, -1 };
+        int err_pipe[2] = { -1, -1 };
+        int fds[2];
+        int reply;
+        FILE *f = NULL;
+        size_t n = 0;
+
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0,
+                "Failed to create socketpair");
+        fail_if(pipe(out_pipe) < 0 || pipe(err_pipe) < 0, "Failed to create pipes");
+        fds[0] = out_pipe[1];
+        fds[1] = err_pipe[1];
+
+        fail_if(!cbm_serve_send_request(sv[0], argc, argv, fds), "Failed to send request");
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        reply = cbm_serve_read_reply(sv[0]);
+        close(sv[0]);
+        cbm_server_reap(server, true);
+
+        if (out) {
+                f = fdopen(out_pipe[0], "r");
+                fail_if(!f || getdelim(out, &n, '\0', f) < 0, "Nothing on stdout");
+                fclose(f);
+        } else {
+                close(out_pipe[0]);
+        }
+        if (err) {
+                n = 0;
+                f = fdopen(err_pipe[0], "r");
+                fail_if(!f, "Failed to read stderr");
+                if (getdelim(err, &n, '\0', f) < 0) {
+                        free(*err);
+                        *err = strdup("");
+                }
+                fclose(f);
+        } else {
+                close(err_pipe[0]);
+        }
+
+        return reply;
+}
+
+/**
+ * Send a request header for @len bytes of payload, with or without the
+ * descriptors that should come along with it
+ */
+static void serve_test_send_header(int fd, uint32_t len, bool with_fds)
+{
+        uint32_t header = htonl(len);
+        int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+        char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+        struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+        };
+        struct cmsghdr *cmsg = NULL;
+
+        if (with_fds) {
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+                memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        }
+
+        fail_if(sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header),
+                "Failed to send request header");
+}
+
+/**
+ * Requests are answered from the warm state, with the output going to the
+ * descriptors passed along and each request reporting only for itself
+ */
+START_TEST(serve_test_framing)
+{
+        char *get_timeout[] = { "get-timeout", "--path", PLAYGROUND_ROOT };
+        char *get_timeout_stats[] = { "get-timeout", "-s", "-p", PLAYGROUND_ROOT };
+        CbmServer *server = NULL;
+        char *out = NULL;
+        char *err = NULL;
+        int reply;
+
+        server = serve_test_start();
+
+        reply = serve_test_request(server, 3, get_timeout, &out, &err);
+        fail_if(reply != CBM_SERVE_OK, "get-timeout not served: %d", reply);
+        fail_if(!streq(out, "Timeout value: 5 seconds\n"), "Unexpected output: %s", out);
+        fail_if(strstr(err, "I/O statistics"), "Statistics without --stats: %s", err);
+        free(out);
+        free(err);
+
+        reply = serve_test_request(server, 4, get_timeout_stats, &out, &err);
+        fail_if(reply != CBM_SERVE_OK, "get-timeout --stats not served: %d", reply);
+        fail_if(!strstr(err, "I/O statistics"), "Statistics missing: %s", err);
+        free(out);
+        free(err);
+
+        /* The previous --stats stays with the request that asked for it */
+        reply = serve_test_request(server, 3, get_timeout, &out, &err);
+        fail_if(reply != CBM_SERVE_OK, "get-timeout not served again: %d", reply);
+        fail_if(strstr(err, "I/O statistics"), "--stats carried over: %s", err);
+        free(out);
+        free(err);
+
+        cbm_server_free(server);
+}
+END_TEST
+
+/**
+ * Requests the service can't run as asked are handed back to the client
+ */
+START_TEST(serve_test_declined)
+{
+        char *other_root[] = { "get-timeout" };
+        char *unknown[] = { "report-booted", "-p", PLAYGROUND_ROOT };
+        char *bad_option[] = { "get-timeout", "--frobnicate", "-p", PLAYGROUND_ROOT };
+        char *good[] = { "get-timeout", "-p", PLAYGROUND_ROOT };
+        CbmServer *server = NULL;
+        int reply;
+
+        server = serve_test_start();
+
+        reply = serve_test_request(server, 1, other_root, NULL, NULL);
+        fail_if(reply != CBM_SERVE_DECLINED, "Served another root: %d", reply);
+        reply = serve_test_request(server, 3, unknown, NULL, NULL);
+        fail_if(reply != CBM_SERVE_DECLINED, "Served an unknown command: %d", reply);
+        reply = serve_test_request(server, 4, bad_option, NULL, NULL);
+        fail_if(reply != CBM_SERVE_DECLINED, "Served a bad option: %d", reply);
+        reply = serve_test_request(server, 3, good, NULL, NULL);
+        fail_if(reply != CBM_SERVE_OK, "Declined a good request: %d", reply);
+
+        cbm_server_free(server);
+}
+END_TEST
+
+/**
+ * Commands needing root are only run for a peer that is root, as told by
+ * SO_PEERCRED rather than anything the client says
+ */
+START_TEST(serve_test_requires_root)
+{
+        char *update[] = { "update", "-p", PLAYGROUND_ROOT };
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        socklen_t addr_len;
+        CbmServer *server = NULL;
+        int listen_fd = -1;
+        int client = -1;
+        int status = 0;
+        pid_t pid;
+
+        server = serve_test_start();
+
+        /* Abstract, so that the peer needs no access to the build tree */
+        snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "cbm-check-serve-%d", getpid());
+        addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 +
+                               strlen(addr.sun_path + 1));
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        fail_if(listen_fd < 0, "Failed to create socket");
+        fail_if(bind(listen_fd, (struct sockaddr *)&addr, addr_len) < 0 || listen(listen_fd, 1) < 0,
+                "Failed to listen");
+
+        pid = fork();
+        fail_if(pid < 0, "Failed to fork");
+        if (pid == 0) {
+                int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+
+                if (getuid() == 0 && (setgid(65534) < 0 || setuid(65534) < 0)) {
+                        _exit(100);
+                }
+                if (fd < 0 || connect(fd, (struct sockaddr *)&addr, addr_len) < 0 ||
+                    !cbm_serve_send_request(fd, 3, update, fds)) {
+                        _exit(101);
+                }
+                _exit(cbm_serve_read_reply(fd) & 0xff);
+        }
+
+        client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        fail_if(client < 0, "Failed to accept");
+        cbm_server_handle(server, client);
+        close(client);
+        close(listen_fd);
+
+        fail_if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status), "Lost the client");
+        fail_if(WEXITSTATUS(status) != CBM_SERVE_DECLINED,
+                "update not declined for an unprivileged peer: %d",
+                WEXITSTATUS(status));
+
+        cbm_server_free(server);
+}
+END_TEST
+
+/**
+ * Malformed requests are dropped or declined, never run
+ */
+START_TEST(serve_test_malformed)
+{
+        const char unterminated[] = { 'g', 'e', 't', '-', 't', 'i', 'm', 'e', 'o', 'u', 't' };
+        int sv[2] = { -1, -1 };
+        CbmServer *server = NULL;
+
+        server = serve_test_start();
+
+        /* No descriptors to write to, dropped */
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, "socketpair failed");
+        fail_if(write(sv[0], "\0\0\0\4", 4) != 4, "Failed to write header");
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        fail_if(cbm_serve_read_reply(sv[0]) != -1, "Replied to a request without descriptors");
+        close(sv[0]);
+
+        /* Larger than any frame, dropped */
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, "socketpair failed");
+        serve_test_send_header(sv[0], 0xffffffff, true);
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        fail_if(cbm_serve_read_reply(sv[0]) != -1, "Replied to an oversized request");
+        close(sv[0]);
+
+        /* Shorter than announced, dropped */
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, "socketpair failed");
+        serve_test_send_header(sv[0], 64, true);
+        fail_if(write(sv[0], "update", 7) != 7, "Failed to write payload");
+        shutdown(sv[0], SHUT_WR);
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        fail_if(cbm_serve_read_reply(sv[0]) != -1, "Replied to a truncated request");
+        close(sv[0]);
+
+        /* Not NUL terminated, declined */
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, "socketpair failed");
+        serve_test_send_header(sv[0], sizeof(unterminated), true);
+        fail_if(write(sv[0], unterminated, sizeof(unterminated)) != sizeof(unterminated),
+                "Failed to write payload");
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        fail_if(cbm_serve_read_reply(sv[0]) != CBM_SERVE_DECLINED,
+                "Unterminated request not declined");
+        close(sv[0]);
+
+        /* Empty, declined */
+        fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, "socketpair failed");
+        serve_test_send_header(sv[0], 0, true);
+        cbm_server_handle(server, sv[1]);
+        close(sv[1]);
+        fail_if(cbm_serve_read_reply(sv[0]) != CBM_SERVE_DECLINED, "Empty request not declined");
+        close(sv[0]);
+
+        cbm_server_free(server);
+}
+END_TEST
+
+static Suite *core_suite(void)
+{
+        Suite *s = NULL;
+        TCase *tc = NULL;
+
+        s = suite_create("bootman_serve");
+        tc = tcase_create("bootman_serve_functions");
+        tcase_add_test(tc, serve_test_framing);
+        tcase_add_test(tc, serve_test_declined);
+        tcase_add_test(tc, serve_test_requires_root);
+        tcase_add_test(tc, serve_test_malformed);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+        int fail;
+
+        /* syncing can be problematic during test suite runs */
+        cbm_set_sync_filesystems(false);
+
+        /* Ensure that logging is set up properly. */
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+
+        /* Turn off the EFI variable manipulation. */
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+
+        /* Force detection of `fat` filesystem. */
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+
+        /* Nothing else is changing the playground */
+        setenv("CBM_UPDATE_LOCK", "", 1);
+
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        s = core_suite();
+        sr = srunner_create(s);
+        srunner_run_all(sr, CK_VERBOSE);
+        fail = srunner_ntests_failed(sr);
+        srunner_free(sr);
+
+        if (fail > 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
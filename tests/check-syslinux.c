@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/sysmacros.h>
 
 #include "bootman.h"
@@ -263,6 +264,67 @@ START_TEST(bootman_legacy_update_native)
 }
 END_TEST
 
+/**
+ * Drop the DEFAULT line from a syslinux.cfg
+ */
+static void strip_default(char *conf)
+{
+        char *line = strstr(conf, "DEFAULT ");
+        char *end = NULL;
+
+        if (!line) {
+                return;
+        }
+        end = strchr(line, '\n');
+        if (!end) {
+                *line = '\0';
+                return;
+        }
+        memmove(line, end + 1, strlen(end + 1) + 1);
+}
+
+/**
+ * Selecting an installed kernel only moves the DEFAULT line
+ */
+START_TEST(bootman_legacy_select_kernel)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *before = NULL;
+        autofree(char) *after = NULL;
+        const char *config = PLAYGROUND_ROOT "/" BOOT_DIRECTORY "/syslinux.cfg";
+        Kernel kern = { 0 };
+        int defaults = 0;
+
+        kern.meta.ktype = "kvm";
+        kern.meta.version = "4.2.1";
+        kern.meta.release = 121;
+
+        m = prepare_playground(&legacy_config);
+        fail_if(!m, "Fatal: Cannot initialise playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(!file_get_text(config, &before), "Failed to read syslinux.cfg");
+
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel");
+        fail_if(!file_get_text(config, &after), "Failed to read updated syslinux.cfg");
+        fail_if(!strstr(after,
+                        "DEFAULT " KERNEL_NAMESPACE ".kvm.4.2.1-121\n"
+                        "LABEL " KERNEL_NAMESPACE ".kvm.4.2.1-121\n"),
+                "DEFAULT not moved to the selected kernel");
+        for (const char *p = after; (p = strstr(p, "DEFAULT ")); p++) {
+                defaults++;
+        }
+        fail_if(defaults != 1, "Expected a single DEFAULT line, found %d", defaults);
+        strip_default(before);
+        strip_default(after);
+        fail_if(!streq(before, after), "Entries changed while selecting a kernel");
+
+        /* Not in the kernel directory at all */
+        kern.meta.release = 999;
+        fail_if(boot_manager_select_default_kernel(m, &kern), "Selected a missing kernel");
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -277,6 +339,7 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_native);
+        tcase_add_test(tc, bootman_legacy_select_kernel);
         suite_add_tcase(s, tc);
 
         return s;
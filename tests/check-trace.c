@@ -0,0 +1,188 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_PATH TOP_BUILD_DIR "/trace.json"
+
+static void trace_test_inner(void)
+{
+        CBM_TRACE_SCOPE("inner");
+}
+
+static void trace_test_outer(void)
+{
+        CBM_TRACE_SCOPE("outer");
+
+        trace_test_inner();
+        trace_test_inner();
+}
+
+/**
+ * Render the summary tree into a string for inspection
+ */
+static char *trace_test_report(void)
+{
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&buf, &len);
+
+        fail_if(!f, "Failed to open memory stream");
+        cbm_trace_report(f);
+        fclose(f);
+
+        return buf;
+}
+
+START_TEST(cbm_trace_test_disabled)
+{
+        autofree(char) *report = NULL;
+
+        fail_if(cbm_trace_enabled(), "Tracing enabled by default");
+        fail_if(cbm_trace_begin("ignored") >= 0, "Span opened while disabled");
+
+        trace_test_outer();
+        report = trace_test_report();
+        fail_if(strstr(report, "outer") != NULL, "Span recorded while disabled");
+}
+END_TEST
+
+START_TEST(cbm_trace_test_report)
+{
+        autofree(char) *report = NULL;
+
+        cbm_trace_enable_report();
+        fail_if(!cbm_trace_enabled(), "Report didn't enable tracing");
+
+        trace_test_outer();
+        trace_test_outer();
+
+        report = trace_test_report();
+        fail_if(!strstr(report, "\n  outer "), "Missing top level span: %s", report);
+        fail_if(!strstr(report, "\n    inner "), "Missing nested span: %s", report);
+        fail_if(!strstr(report, "(4 calls)"), "Nested spans not aggregated: %s", report);
+        fail_if(strstr(report, "\n  inner "), "Nested span reported at top level: %s", report);
+
+        cbm_trace_discard();
+        fail_if(cbm_trace_enabled(), "Discard didn't stop tracing");
+}
+END_TEST
+
+START_TEST(cbm_trace_test_unbalanced)
+{
+        autofree(char) *report = NULL;
+        CbmTraceSpan outer;
+
+        cbm_trace_enable_report();
+
+        /* Closing the outer span closes everything opened inside it */
+        outer = cbm_trace_begin("outer");
+        fail_if(outer < 0, "Failed to open span");
+        (void)cbm_trace_begin("inner");
+        (void)cbm_trace_begin("innermost");
+        cbm_trace_end(outer);
+        trace_test_inner();
+
+        report = trace_test_report();
+        fail_if(!strstr(report, "\n      innermost "), "Missing nested span: %s", report);
+        fail_if(!strstr(report, "\n  inner "), "Span after close still nested: %s", report);
+
+        cbm_trace_discard();
+}
+END_TEST
+
+START_TEST(cbm_trace_test_write)
+{
+        autofree(char) *text = NULL;
+
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR, 00755), "Failed to create test root");
+        unlink(TRACE_PATH);
+
+        setenv("CBM_TRACE", TRACE_PATH, 1);
+        cbm_trace_init();
+        unsetenv("CBM_TRACE");
+        fail_if(!cbm_trace_enabled(), "CBM_TRACE didn't enable tracing");
+
+        trace_test_outer();
+        cbm_trace_finish();
+        fail_if(cbm_trace_enabled(), "Tracing still enabled after finishing");
+
+        fail_if(!file_get_text(TRACE_PATH, &text), "Trace file not written");
+        fail_if(strncmp(text, "{\"traceEvents\":[", 16) != 0, "Not a trace event file: %s", text);
+        fail_if(!strstr(text, "\"name\":\"outer\""), "Missing outer span: %s", text);
+        fail_if(!strstr(text, "\"name\":\"inner\""), "Missing inner span: %s", text);
+        fail_if(!strstr(text, "\"ph\":\"X\""), "Spans not complete events: %s", text);
+}
+END_TEST
+
+static Suite *core_suite(void)
+{
+        Suite *s = NULL;
+        TCase *tc = NULL;
+
+        s = suite_create("cbm_trace");
+        tc = tcase_create("cbm_trace_functions");
+        tcase_add_test(tc, cbm_trace_test_disabled);
+        tcase_add_test(tc, cbm_trace_test_report);
+        tcase_add_test(tc, cbm_trace_test_unbalanced);
+        tcase_add_test(tc, cbm_trace_test_write);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+        int fail;
+
+        /* Ensure that logging is set up properly. */
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+
+        s = core_suite();
+        sr = srunner_create(s);
+        srunner_run_all(sr, CK_VERBOSE);
+        fail = srunner_ntests_failed(sr);
+        srunner_free(sr);
+
+        if (fail > 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -15,20 +15,34 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
 #include "config.h"
 #include "files.h"
 #include "log.h"
+#include "metrics.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 #include "writer.h"
 
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#include "bootvar.h"
+#include "efivarfs-harness.h"
+#endif
+
 #include "blkid-harness.h"
 #include "harness.h"
+#include "memfs-harness.h"
 #include "system-harness.h"
 
 #define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
@@ -569,6 +583,437 @@ START_TEST(bootman_uefi_set_kernel)
 }
 END_TEST
 
+/**
+ * Selecting an installed kernel rewrites loader.conf alone, one without an
+ * entry is reconciled the long way
+ */
+START_TEST(bootman_uefi_select_kernel)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *conf = NULL;
+        const char *loader_conf = BOOT_FULL "/loader/loader.conf";
+        const char *entry = BOOT_FULL "/loader/entries/" VENDOR_PREFIX "-kvm-4.2.3-124.conf";
+        Kernel kern = { 0 };
+
+        kern.meta.ktype = "kvm";
+        kern.meta.version = "4.2.3";
+        kern.meta.release = 124;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(!nc_file_exists(entry), "Missing entry for the kernel to select");
+
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel");
+        fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+        fail_if(!strstr(conf, "default " VENDOR_PREFIX "-kvm-4.2.3-124.conf"),
+                "loader.conf doesn't point at the selected kernel: %s", conf);
+        free(conf);
+        conf = NULL;
+
+        /* Without an entry the full path runs instead */
+        kern.meta.ktype = "native";
+        kern.meta.release = 138;
+        fail_if(unlink(BOOT_FULL "/loader/entries/" VENDOR_PREFIX "-native-4.2.3-138.conf") != 0,
+                "Failed to remove entry");
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to reconcile kernel");
+        fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+        fail_if(!strstr(conf, "default " VENDOR_PREFIX "-native-4.2.3-138.conf"),
+                "loader.conf doesn't point at the reconciled kernel: %s", conf);
+
+        kern.meta.release = 999;
+        fail_if(boot_manager_select_default_kernel(m, &kern), "Selected a missing kernel");
+}
+END_TEST
+
+START_TEST(bootman_uefi_saved_state)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *timeout = NULL;
+        autofree(char) *backend = NULL;
+        const char *state = PLAYGROUND_ROOT "/var/lib/kernel/boot-state";
+        const char *selected = "* " KERNEL_NAMESPACE ".kvm.4.2.3-124";
+        char **live = NULL;
+        char **saved = NULL;
+        bool found = false;
+        Kernel kern = { 0 };
+
+        kern.meta.ktype = "kvm";
+        kern.meta.version = "4.2.3";
+        kern.meta.release = 124;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        fail_if(boot_manager_list_kernels_saved(m) != NULL, "Saved state before any change");
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(!nc_file_exists(state), "Update didn't save the boot state");
+
+        /* The saved listing matches what the boot partition says */
+        live = boot_manager_list_kernels(m);
+        saved = boot_manager_list_kernels_saved(m);
+        fail_if(!live || !saved, "Failed to list kernels");
+        for (size_t i = 0; live[i] || saved[i]; i++) {
+                fail_if(!streq(live[i], saved[i]), "Saved listing differs: %s", saved[i]);
+        }
+        for (char **k = live; *k; k++) {
+                free(*k);
+        }
+        free(live);
+        for (char **k = saved; *k; k++) {
+                free(*k);
+        }
+        free(saved);
+
+        backend = boot_manager_get_saved_state(m, "backend");
+        fail_if(!backend || !*backend, "Backend wasn't recorded");
+
+        /* Later changes are reflected without another update */
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel");
+        fail_if(!boot_manager_set_timeout_value(m, 5), "Failed to set timeout");
+        timeout = boot_manager_get_saved_state(m, "timeout");
+        fail_if(!streq(timeout, "5"), "Saved timeout not updated: %s", timeout);
+
+        saved = boot_manager_list_kernels_saved(m);
+        fail_if(!saved, "Failed to list saved kernels");
+        for (char **k = saved; *k; k++) {
+                if (streq(*k, selected)) {
+                        found = true;
+                }
+                free(*k);
+        }
+        free(saved);
+        fail_if(!found, "Saved default not updated");
+
+        fail_if(!boot_manager_set_timeout_value(m, 0), "Failed to disable timeout");
+
+        /* An empty state file, as a crash could leave, counts as none saved */
+        fail_if(!file_set_text(state, ""), "Failed to empty the boot state");
+        fail_if(boot_manager_list_kernels_saved(m) != NULL, "Listed kernels from empty state");
+        fail_if(boot_manager_get_saved_state(m, "timeout") != NULL, "Read timeout from empty state");
+        fail_if(!boot_manager_set_timeout_value(m, 3), "Failed to set timeout on empty state");
+}
+END_TEST
+
+/**
+ * Updating an ESP held in memory installs the same files, charges for every
+ * flush and leaves the disk alone
+ */
+START_TEST(bootman_uefi_memfs)
+{
+        autofree(BootManager) *m = NULL;
+        MemfsLatency latency = MEMFS_LATENCY_SLOW_ESP;
+        MemfsStats stats = { 0 };
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+
+        fail_if(!memfs_mount(BOOT_FULL, &latency, false), "Failed to mount the in-memory ESP");
+        cbm_set_sync_filesystems(true);
+        fail_if(!boot_manager_update(m), "Failed to update the in-memory ESP");
+        cbm_set_sync_filesystems(false);
+
+        memfs_get_stats(&stats);
+        fail_if(stats.writes == 0 || stats.bytes_written == 0, "Nothing written to memory");
+        fail_if(stats.fsyncs == 0 || stats.syncs == 0, "No flushes accounted");
+        fail_if(stats.simulated_ns < stats.fsyncs * latency.fsync_ns + stats.syncs * latency.sync_ns,
+                "Flush latency not charged");
+
+        confirm_bootloader();
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_installed(m, &uefi_config, &uefi_kernels[i]),
+                        "Kernel %zu missing from the in-memory ESP",
+                        i);
+        }
+
+        memfs_unmount();
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_uninstalled(m, &uefi_kernels[i]),
+                        "Kernel %zu reached the disk",
+                        i);
+        }
+}
+END_TEST
+
+/**
+ * Each command replaces its own samples in the shared metrics file
+ */
+START_TEST(bootman_uefi_metrics)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *text = NULL;
+        const char *prom = PLAYGROUND_ROOT "/cbm.prom";
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+
+        cbm_metrics_set_output(prom);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        cbm_metrics_finish("update", true);
+        fail_if(cbm_metrics_enabled(), "Metrics still enabled after finishing");
+
+        fail_if(!file_get_text(prom, &text), "Metrics file not written");
+        fail_if(!strstr(text, "# TYPE cbm_last_run_success gauge\n"), "Missing type: %s", text);
+        fail_if(!strstr(text, "cbm_last_run_success{command=\"update\"} 1\n"),
+                "Missing success: %s",
+                text);
+        fail_if(!strstr(text, "cbm_last_success_timestamp_seconds{command=\"update\"} "),
+                "Missing success timestamp: %s",
+                text);
+        fail_if(strstr(text, "cbm_last_failure_timestamp_seconds{command"),
+                "Failure timestamp without a failure: %s",
+                text);
+        fail_if(!strstr(text, "phase=\"update/update_image\"}"), "Missing phase: %s", text);
+        fail_if(!strstr(text, "cbm_kernels{type=\"kvm\"} 2\n"), "Missing kernels: %s", text);
+        fail_if(!strstr(text, "\ncbm_boot_free_bytes "), "Missing boot space: %s", text);
+        free(text);
+        text = NULL;
+
+        /* Another command keeps what update recorded */
+        fail_if(!cbm_metrics_write(prom, "set-kernel", false), "Failed to write metrics");
+        fail_if(!file_get_text(prom, &text), "Metrics file not written");
+        fail_if(!strstr(text, "cbm_last_run_success{command=\"update\"} 1\n"),
+                "Update samples dropped: %s",
+                text);
+        fail_if(!strstr(text, "cbm_last_run_success{command=\"set-kernel\"} 0\n"),
+                "Missing failure: %s",
+                text);
+        fail_if(!strstr(text, "cbm_last_failure_timestamp_seconds{command=\"set-kernel\"} "),
+                "Missing failure timestamp: %s",
+                text);
+        fail_if(!strstr(text, "cbm_kernels{type=\"kvm\"} 2\n"), "Kernels dropped: %s", text);
+        free(text);
+        text = NULL;
+
+        /* A failed update still remembers its last success */
+        fail_if(!cbm_metrics_write(prom, "update", false), "Failed to write metrics");
+        fail_if(!file_get_text(prom, &text), "Metrics file not written");
+        fail_if(!strstr(text, "cbm_last_success_timestamp_seconds{command=\"update\"} "),
+                "Success timestamp lost: %s",
+                text);
+        fail_if(!strstr(text, "cbm_last_failure_timestamp_seconds{command=\"update\"} "),
+                "Missing failure timestamp: %s",
+                text);
+        fail_if(strstr(text, "cbm_last_run_success{command=\"update\"} 1\n"),
+                "Stale success kept: %s",
+                text);
+
+        cbm_trace_discard();
+}
+END_TEST
+
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#define EFIVARS_ROOT TOP_BUILD_DIR "/tests/efivars"
+#define DEFAULT_ENTRY_CONF PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/default_entry"
+
+/**
+ * Select the default through the loader variables, with a directory
+ * standing in for efivarfs.
+ */
+START_TEST(bootman_uefi_entry_variable)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *conf = NULL;
+        autofree(char) *new_conf = NULL;
+        autofree(char) *entry = NULL;
+        autofree(char) *default_kernel = NULL;
+        const char *loader_conf = BOOT_FULL "/loader/loader.conf";
+        Kernel kern = { 0 };
+
+        kern.meta.ktype = "kvm";
+        kern.meta.version = "4.2.3";
+        kern.meta.release = 124;
+
+        nc_rm_rf(EFIVARS_ROOT);
+        fail_if(!efivarfs_mount(EFIVARS_ROOT, NULL, false), "Failed to stand in for efivarfs");
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        fail_if(!file_set_text(DEFAULT_ENTRY_CONF, "efivar\n"), "Failed to write default_entry");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reload configuration");
+        boot_manager_set_update_efi_vars(m, true);
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        /* The default lives in the variable rather than loader.conf */
+        fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) != 0,
+                "LoaderEntryDefault wasn't set");
+        fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+        fail_if(strstr(conf, "default "), "loader.conf still holds the default: %s", conf);
+        free(entry);
+        entry = NULL;
+
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel");
+        fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) != 0,
+                "LoaderEntryDefault went missing");
+        fail_if(!streq(entry, VENDOR_PREFIX "-kvm-4.2.3-124.conf"),
+                "LoaderEntryDefault doesn't point at the selected kernel: %s", entry);
+
+        fail_if(!file_get_text(loader_conf, &new_conf), "Failed to read loader.conf");
+        fail_if(!streq(conf, new_conf), "Selecting a kernel rewrote loader.conf");
+        default_kernel = boot_manager_get_default_kernel(m);
+        fail_if(!streq(default_kernel, KERNEL_NAMESPACE ".kvm.4.2.3-124"),
+                "Default kernel not read from the variable: %s", default_kernel);
+        free(entry);
+        entry = NULL;
+
+        /* A one-shot selection leaves the persistent default alone */
+        fail_if(!file_set_text(DEFAULT_ENTRY_CONF, "oneshot\n"), "Failed to write default_entry");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reload configuration");
+        kern.meta.ktype = "native";
+        kern.meta.release = 138;
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel once");
+        fail_if(bootvar_get_loader_entry("LoaderEntryOneShot", &entry) != 0,
+                "LoaderEntryOneShot wasn't set");
+        fail_if(!streq(entry, VENDOR_PREFIX "-native-4.2.3-138.conf"),
+                "LoaderEntryOneShot doesn't point at the selected kernel: %s", entry);
+        free(entry);
+        entry = NULL;
+        fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) != 0 ||
+                    !streq(entry, VENDOR_PREFIX "-kvm-4.2.3-124.conf"),
+                "One-shot selection changed LoaderEntryDefault");
+        free(entry);
+        entry = NULL;
+
+        unlink(DEFAULT_ENTRY_CONF);
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * Whenever loader.conf holds the default, a LoaderEntryDefault left behind
+ * by an earlier configuration would override it and has to go.
+ */
+START_TEST(bootman_uefi_entry_variable_stale)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *conf = NULL;
+        char *entry = NULL;
+        const char *loader_conf = BOOT_FULL "/loader/loader.conf";
+        char *modes[] = { "conf\n", "oneshot\n", "efivar\n" };
+        Kernel kern = { 0 };
+
+        kern.meta.ktype = "kvm";
+        kern.meta.version = "4.2.3";
+        kern.meta.release = 124;
+
+        nc_rm_rf(EFIVARS_ROOT);
+        fail_if(!efivarfs_mount(EFIVARS_ROOT, NULL, false), "Failed to stand in for efivarfs");
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+
+        for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+                /* efivar mode only falls back to loader.conf with --no-efi-update */
+                bool update_efi_vars = !streq(modes[i], "efivar\n");
+
+                fail_if(!file_set_text(DEFAULT_ENTRY_CONF, modes[i]),
+                        "Failed to write default_entry");
+                fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT),
+                        "Failed to reload configuration");
+                boot_manager_set_update_efi_vars(m, update_efi_vars);
+                fail_if(bootvar_set_loader_entry("LoaderEntryDefault", "stale.conf") != 0,
+                        "Failed to seed LoaderEntryDefault");
+
+                fail_if(!boot_manager_update(m), "Failed to update image");
+                fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) != -ENOENT,
+                        "Stale LoaderEntryDefault kept with default_entry %s", modes[i]);
+                free(entry);
+                entry = NULL;
+                fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+                fail_if(!strstr(conf, "default "), "loader.conf lost the default: %s", conf);
+                free(conf);
+                conf = NULL;
+
+                /* Same again when only the selection changes, which in oneshot
+                 * mode leaves loader.conf and the persistent default alone */
+                if (streq(modes[i], "oneshot\n")) {
+                        continue;
+                }
+                fail_if(bootvar_set_loader_entry("LoaderEntryDefault", "stale.conf") != 0,
+                        "Failed to seed LoaderEntryDefault");
+                fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to select kernel");
+                fail_if(bootvar_get_loader_entry("LoaderEntryDefault", &entry) == 0,
+                        "Stale LoaderEntryDefault kept selecting with default_entry %s",
+                        modes[i]);
+                free(entry);
+                entry = NULL;
+        }
+
+        unlink(DEFAULT_ENTRY_CONF);
+        efivarfs_unmount();
+}
+END_TEST
+
+/**
+ * On a machine with dozens of boot entries the first free Boot#### number
+ * is taken and put first in BootOrder, with every entry read once. An entry
+ * that is already in place is found and nothing is written.
+ */
+START_TEST(bootman_uefi_boot_entries)
+{
+        const char *shim = "/EFI/org.clearlinux/shimx64.efi";
+        const unsigned int entries = 40;
+        uint8_t *order = NULL;
+        uint8_t *entry = NULL;
+        size_t size = 0;
+        char varname[9] = { 0 };
+        EfivarfsStats stats = { 0 };
+
+        nc_rm_rf(EFIVARS_ROOT);
+        fail_if(!efivarfs_mount(EFIVARS_ROOT, NULL, false), "Failed to stand in for efivarfs");
+        fail_if(!efivarfs_add_boot_entries(entries), "Failed to add boot entries");
+        fail_if(!efivarfs_del_global("Boot0007"), "Failed to free Boot0007");
+
+        /* one snapshot of BootOrder and the remaining entries */
+        efivarfs_reset_stats();
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries");
+        efivarfs_get_stats(&stats);
+        fail_if(stats.reads != entries, "%lu variables read", stats.reads);
+        fail_if(stats.enumerated != entries, "%lu variables listed", stats.enumerated);
+
+        fail_if(bootvar_has_boot_rec(BOOT_FULL, shim), "Found a boot entry before creating it");
+        fail_if(bootvar_create(BOOT_FULL, shim, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry");
+        fail_if(!streq(varname, "Boot0007"), "Free number not taken: %s", varname);
+        efivarfs_get_stats(&stats);
+        fail_if(stats.writes != 2, "%lu variables written", stats.writes);
+        fail_if(stats.reads != entries, "Variables read again after the snapshot");
+
+        fail_if(!efivarfs_get_global("Boot0007", &entry, &size), "Boot0007 wasn't stored");
+        fail_if(!efivarfs_get_global("BootOrder", &order, &size), "BootOrder went missing");
+        fail_if(size != entries * sizeof(uint16_t), "BootOrder holds %zu bytes", size);
+        fail_if(order[0] != 0x07 || order[1] != 0x00, "Boot0007 isn't first in BootOrder");
+        fail_if(!bootvar_has_boot_rec(BOOT_FULL, shim), "Created boot entry not found");
+        bootvar_destroy();
+
+        /* the entry is found again from a fresh snapshot */
+        efivarfs_reset_stats();
+        fail_if(bootvar_init() != 0, "Failed to read the boot entries again");
+        fail_if(bootvar_create(BOOT_FULL, shim, varname, sizeof(varname)) != 0,
+                "Failed to look up the boot entry");
+        fail_if(!streq(varname, "Boot0007"), "Boot entry duplicated as %s", varname);
+        efivarfs_get_stats(&stats);
+        fail_if(stats.writes != 0, "%lu variables written again", stats.writes);
+
+        /* with the gap filled, a new entry goes after the last one */
+        fail_if(bootvar_create(BOOT_FULL, "/EFI/other/grubx64.efi", varname, sizeof(varname)) != 0,
+                "Failed to create a second boot entry");
+        fail_if(!streq(varname, "Boot0028"), "Second entry created as %s", varname);
+        bootvar_destroy();
+
+        free(order);
+        free(entry);
+        efivarfs_unmount();
+}
+END_TEST
+#endif
+
 START_TEST(bootman_uefi_set_kernel_missing)
 {
         autofree(BootManager) *m = NULL;
@@ -588,6 +1033,356 @@ START_TEST(bootman_uefi_set_kernel_missing)
 }
 END_TEST
 
+static char *lease_mounted_at = NULL;
+static char *lease_last_target = NULL;
+static const char *lease_foreign = NULL;
+static int lease_mounts = 0;
+static int lease_umounts = 0;
+
+static int lease_mount(__cbm_unused__ const char *source, const char *target,
+                       __cbm_unused__ const char *filesystemtype,
+                       __cbm_unused__ unsigned long mountflags, __cbm_unused__ const void *data)
+{
+        free(lease_mounted_at);
+        lease_mounted_at = strdup(target);
+        free(lease_last_target);
+        lease_last_target = strdup(target);
+        lease_mounts++;
+        return 0;
+}
+
+static int lease_umount(const char *target)
+{
+        if (lease_mounted_at && streq(target, lease_mounted_at)) {
+                free(lease_mounted_at);
+                lease_mounted_at = NULL;
+        }
+        lease_umounts++;
+        return 0;
+}
+
+static bool lease_is_mounted(const char *target)
+{
+        if (lease_foreign && streq(target, lease_foreign)) {
+                return true;
+        }
+        return lease_mounted_at && streq(target, lease_mounted_at);
+}
+
+static char *lease_get_mountpoint_for_device(__cbm_unused__ const char *device)
+{
+        return lease_mounted_at ? strdup(lease_mounted_at) : NULL;
+}
+
+static int lease_reapers = 0;
+static char *lease_reaper_command = NULL;
+static int lease_reaper_status = 0;
+
+/* Stands in for systemd-run arming the reaper */
+static int lease_system(const char *command)
+{
+        lease_reapers++;
+        free(lease_reaper_command);
+        lease_reaper_command = strdup(command);
+        return lease_reaper_status;
+}
+
+static void lease_reset(void)
+{
+        free(lease_mounted_at);
+        lease_mounted_at = NULL;
+        free(lease_last_target);
+        lease_last_target = NULL;
+        lease_foreign = NULL;
+        lease_mounts = 0;
+        lease_umounts = 0;
+        lease_reapers = 0;
+        free(lease_reaper_command);
+        lease_reaper_command = NULL;
+        lease_reaper_status = 0;
+}
+
+/**
+ * With an esp_lease configured the first run mounts the ESP under the lease
+ * directory and leaves it mounted, the next one reuses that mount, and the
+ * reaper drops the lease once it has gone idle.
+ */
+START_TEST(bootman_uefi_esp_lease)
+{
+        autofree(BootManager) *m = NULL;
+        BootManager *m2 = NULL;
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *lease_dir = TOP_BUILD_DIR "/tests/esp-lease";
+        const char *empty_dir = PLAYGROUND_ROOT "/esp-unmounted";
+        const char *lease_file = TOP_BUILD_DIR "/tests/esp-lease/lease";
+        const char *lease_mnt = TOP_BUILD_DIR "/tests/esp-lease/mnt";
+        struct stat st = { 0 };
+        char **results = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        lease_reset();
+        nc_rm_rf(lease_dir);
+
+        system_ops.mount = lease_mount;
+        system_ops.umount = lease_umount;
+        system_ops.is_mounted = lease_is_mounted;
+        system_ops.get_mountpoint_for_device = lease_get_mountpoint_for_device;
+        system_ops.system = lease_system;
+        cbm_system_set_vtable(&system_ops);
+
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/esp_lease", "2"),
+                "Failed to configure the ESP lease");
+        fail_if(!nc_mkdir_p(empty_dir, 00755), "Failed to create unmounted boot dir");
+        fail_if(!boot_manager_set_boot_dir(m, empty_dir), "Failed to set boot dir");
+        boot_manager_set_esp_lease_dir(m, lease_dir);
+
+        results = boot_manager_list_kernels(m);
+        fail_if(!results, "Failed to get kernels");
+        for (char **r = results; *r; r++) {
+                free(*r);
+        }
+        free(results);
+        fail_if(lease_mounts != 1, "ESP wasn't mounted");
+        fail_if(!lease_mounted_at || !streq(lease_mounted_at, lease_mnt),
+                "ESP wasn't mounted at the lease mountpoint");
+        fail_if(!streq(boot_manager_get_boot_dir(m), lease_mnt),
+                "Boot dir doesn't point at the leased mount");
+        fail_if(lease_umounts != 0, "Leased ESP was unmounted");
+        fail_if(!nc_file_exists(lease_file), "No lease recorded");
+        fail_if(lease_reapers != 1, "No reaper for the fresh lease");
+        fail_if(!strstr(lease_reaper_command, "systemd-run ") ||
+                    !strstr(lease_reaper_command, "--on-active=2s ") ||
+                    !strstr(lease_reaper_command, " reap-esp-lease '" TOP_BUILD_DIR
+                                                  "/tests/esp-lease' 2"),
+                "Unexpected reaper timer: %s",
+                lease_reaper_command);
+        boot_manager_free(m);
+        m = NULL;
+
+        /* The next run, within the lease, picks up the mount */
+        m2 = boot_manager_new();
+        fail_if(!m2, "Failed to create second manager");
+        fail_if(!boot_manager_set_prefix(m2, PLAYGROUND_ROOT), "Failed to set prefix");
+        boot_manager_set_image_mode(m2, false);
+        fail_if(!boot_manager_set_boot_dir(m2, empty_dir), "Failed to set boot dir");
+        boot_manager_set_esp_lease_dir(m2, lease_dir);
+
+        results = boot_manager_list_kernels(m2);
+        fail_if(!results, "Failed to get kernels from the leased ESP");
+        for (char **r = results; *r; r++) {
+                free(*r);
+        }
+        free(results);
+        fail_if(lease_mounts != 1, "Leased ESP was mounted again");
+        fail_if(lease_umounts != 0, "Leased ESP was unmounted");
+        fail_if(lease_reapers != 1, "Reused lease started another reaper");
+        boot_manager_free(m2);
+
+        /* The timer firing early finds it still in use and arms itself again */
+        fail_if(!boot_manager_expire_esp_lease(lease_dir, 2), "Failed to rearm the reaper");
+        fail_if(lease_reapers != 2, "Reaper wasn't armed again");
+        fail_if(!nc_file_exists(lease_file), "Fresh lease was dropped");
+        fail_if(lease_umounts != 0, "Fresh lease was unmounted");
+
+        /* Idle now, the reaper keeps it until the timeout and then lets go */
+        fail_if(stat(lease_file, &st) != 0, "Lease went missing");
+        fail_if(boot_manager_reap_esp_lease(lease_file, lease_mnt, 2, st.st_mtime + 1) != 1,
+                "Lease reaped before going idle");
+        fail_if(!nc_file_exists(lease_file), "Busy lease was dropped");
+        fail_if(boot_manager_reap_esp_lease(lease_file, lease_mnt, 2, st.st_mtime + 2) != 0,
+                "Idle lease wasn't reaped");
+        fail_if(nc_file_exists(lease_file), "Idle lease file remains");
+        fail_if(lease_umounts != 1 || lease_mounted_at, "Idle ESP wasn't unmounted");
+
+        cbm_system_set_vtable(&SystemTestOps);
+        lease_reset();
+}
+END_TEST
+
+/**
+ * Something else already mounted on the lease mountpoint isn't ours to keep
+ * or unmount, so the ESP goes to the boot dir as it would without a lease.
+ */
+START_TEST(bootman_uefi_esp_lease_busy)
+{
+        autofree(BootManager) *m = NULL;
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *lease_dir = TOP_BUILD_DIR "/tests/esp-lease-busy";
+        const char *empty_dir = PLAYGROUND_ROOT "/esp-unmounted";
+        char **results = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        lease_reset();
+        nc_rm_rf(lease_dir);
+
+        system_ops.mount = lease_mount;
+        system_ops.umount = lease_umount;
+        system_ops.is_mounted = lease_is_mounted;
+        system_ops.get_mountpoint_for_device = lease_get_mountpoint_for_device;
+        system_ops.system = lease_system;
+        cbm_system_set_vtable(&system_ops);
+
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/esp_lease", "2"),
+                "Failed to configure the ESP lease");
+        fail_if(!nc_mkdir_p(empty_dir, 00755), "Failed to create unmounted boot dir");
+        fail_if(!boot_manager_set_boot_dir(m, empty_dir), "Failed to set boot dir");
+        boot_manager_set_esp_lease_dir(m, lease_dir);
+
+        /* Held by another device, so the ESP lookup doesn't report it */
+        lease_foreign = TOP_BUILD_DIR "/tests/esp-lease-busy/mnt";
+
+        results = boot_manager_list_kernels(m);
+        fail_if(!results, "Failed to get kernels");
+        for (char **r = results; *r; r++) {
+                free(*r);
+        }
+        free(results);
+        fail_if(lease_mounts != 1, "ESP wasn't mounted");
+        fail_if(!lease_last_target || !streq(lease_last_target, empty_dir),
+                "ESP wasn't mounted at the boot dir");
+        fail_if(lease_umounts != 1, "Fallback mount wasn't unmounted");
+        fail_if(nc_file_exists(TOP_BUILD_DIR "/tests/esp-lease-busy/lease"),
+                "Leased a mountpoint held by another device");
+        fail_if(lease_reapers != 0, "Started a reaper without a lease");
+
+        cbm_system_set_vtable(&SystemTestOps);
+        lease_reset();
+}
+END_TEST
+
+/**
+ * Without a timer to expire it, the ESP isn't leased at all
+ */
+START_TEST(bootman_uefi_esp_lease_no_timer)
+{
+        autofree(BootManager) *m = NULL;
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *lease_dir = TOP_BUILD_DIR "/tests/esp-lease-no-timer";
+        const char *empty_dir = PLAYGROUND_ROOT "/esp-unmounted";
+        char **results = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        lease_reset();
+        nc_rm_rf(lease_dir);
+
+        system_ops.mount = lease_mount;
+        system_ops.umount = lease_umount;
+        system_ops.is_mounted = lease_is_mounted;
+        system_ops.get_mountpoint_for_device = lease_get_mountpoint_for_device;
+        system_ops.system = lease_system;
+        cbm_system_set_vtable(&system_ops);
+        lease_reaper_status = 1;
+
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/esp_lease", "2"),
+                "Failed to configure the ESP lease");
+        fail_if(!nc_mkdir_p(empty_dir, 00755), "Failed to create unmounted boot dir");
+        fail_if(!boot_manager_set_boot_dir(m, empty_dir), "Failed to set boot dir");
+        boot_manager_set_esp_lease_dir(m, lease_dir);
+
+        results = boot_manager_list_kernels(m);
+        fail_if(!results, "Failed to get kernels");
+        for (char **r = results; *r; r++) {
+                free(*r);
+        }
+        free(results);
+        fail_if(lease_reapers != 1, "Reaper timer wasn't attempted");
+        fail_if(lease_mounts != 1, "ESP wasn't mounted");
+        fail_if(lease_umounts != 1 || lease_mounted_at, "Unwatched ESP was left mounted");
+        fail_if(nc_file_exists(TOP_BUILD_DIR "/tests/esp-lease-no-timer/lease"),
+                "Lease recorded without a timer");
+
+        cbm_system_set_vtable(&SystemTestOps);
+        lease_reset();
+}
+END_TEST
+
+static int select_mounts = 0;
+static int select_mount_depth = 0;
+static int select_mount_depth_max = 0;
+
+/* The partition holds a loader but no entries, and only shows while mounted */
+static int select_mount(__cbm_unused__ const char *source, const char *target,
+                        __cbm_unused__ const char *filesystemtype,
+                        __cbm_unused__ unsigned long mountflags, __cbm_unused__ const void *data)
+{
+        autofree(char) *loader = string_printf("%s/loader", target);
+
+        select_mounts++;
+        if (++select_mount_depth > select_mount_depth_max) {
+                select_mount_depth_max = select_mount_depth;
+        }
+        return nc_mkdir_p(loader, 00755) ? 0 : -1;
+}
+
+static int select_umount(const char *target)
+{
+        autofree(char) *loader = string_printf("%s/loader", target);
+
+        select_mount_depth--;
+        return nc_rm_rf(loader) ? 0 : -1;
+}
+
+static bool select_is_mounted(__cbm_unused__ const char *target)
+{
+        return false;
+}
+
+static char *select_get_mountpoint_for_device(__cbm_unused__ const char *device)
+{
+        return NULL;
+}
+
+/**
+ * Selecting a kernel that has no entry on the boot partition yet hands over
+ * to the full path without stacking a second mount on the first, and saves
+ * the kernel that path settled on
+ */
+START_TEST(bootman_uefi_select_kernel_no_entry)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *saved = NULL;
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *empty_dir = PLAYGROUND_ROOT "/esp-unmounted";
+        Kernel kern = { 0 };
+
+        kern.meta.ktype = "native";
+        kern.meta.version = "4.2.3";
+        kern.meta.release = 138;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        /* Nothing is on the freshly mounted partition yet */
+        system_ops.mount = select_mount;
+        system_ops.umount = select_umount;
+        system_ops.is_mounted = select_is_mounted;
+        system_ops.get_mountpoint_for_device = select_get_mountpoint_for_device;
+        cbm_system_set_vtable(&system_ops);
+        select_mounts = 0;
+        select_mount_depth = 0;
+        select_mount_depth_max = 0;
+        fail_if(!nc_mkdir_p(empty_dir, 00755), "Failed to create unmounted boot dir");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_set_boot_dir(m, empty_dir), "Failed to set boot dir");
+
+        fail_if(!boot_manager_select_default_kernel(m, &kern), "Failed to reconcile kernel");
+        fail_if(select_mounts != 2, "Full path reused our mount, %d mounts", select_mounts);
+        fail_if(select_mount_depth_max != 1, "Boot mounted %d deep", select_mount_depth_max);
+        fail_if(select_mount_depth != 0, "Boot left mounted");
+        saved = boot_manager_get_saved_state(m, "default");
+        fail_if(!saved || !streq(saved, KERNEL_NAMESPACE ".native.4.2.3-138"),
+                "Saved default isn't the reconciled kernel: %s",
+                saved);
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -610,6 +1405,19 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_uefi_list_kernels);
         tcase_add_test(tc, bootman_uefi_set_kernel);
         tcase_add_test(tc, bootman_uefi_set_kernel_missing);
+        tcase_add_test(tc, bootman_uefi_select_kernel);
+        tcase_add_test(tc, bootman_uefi_saved_state);
+        tcase_add_test(tc, bootman_uefi_memfs);
+        tcase_add_test(tc, bootman_uefi_metrics);
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        tcase_add_test(tc, bootman_uefi_entry_variable);
+        tcase_add_test(tc, bootman_uefi_entry_variable_stale);
+        tcase_add_test(tc, bootman_uefi_boot_entries);
+#endif
+        tcase_add_test(tc, bootman_uefi_esp_lease);
+        tcase_add_test(tc, bootman_uefi_esp_lease_busy);
+        tcase_add_test(tc, bootman_uefi_esp_lease_no_timer);
+        tcase_add_test(tc, bootman_uefi_select_kernel_no_entry);
         suite_add_tcase(s, tc);
 
         /* Tests without kernel modules */
@@ -0,0 +1,461 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "efivarfs-harness.h"
+#include "nica/files.h"
+#include "util.h"
+
+/**
+ * Largest variable we'll hold, efivar itself won't create anything bigger
+ */
+#define EFIVARFS_VAR_MAX 1024
+
+/**
+ * "Name-GUID", efivarfs limits the name part to the same
+ */
+#define EFIVARFS_NAME_MAX 1024
+#define EFIVARFS_GUID_LEN 36
+
+#define EFIVARFS_LOAD_OPTION_ACTIVE 0x1
+
+static struct {
+        char *dir;
+        EfivarfsLatency latency;
+        bool sleep;
+        EfivarfsStats stats;
+        DIR *listing; /**<Open while the variables are being listed */
+        efi_guid_t guid;
+        char name[EFIVARFS_NAME_MAX];
+} efivarfs = { 0 };
+
+static void efivarfs_charge(uint64_t ns)
+{
+        struct timespec ts = { 0 };
+
+        efivarfs.stats.simulated_ns += ns;
+        if (!efivarfs.sleep || ns == 0) {
+                return;
+        }
+        ts.tv_sec = (time_t)(ns / 1000000000ULL);
+        ts.tv_nsec = (long)(ns % 1000000000ULL);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+                ;
+        }
+}
+
+/**
+ * The last two groups of the GUID are stored as bytes, in the order they
+ * are printed.
+ */
+static void efivarfs_guid_to_str(const efi_guid_t *guid, char *out)
+{
+        const uint8_t *d = (const uint8_t *)&guid->d;
+
+        sprintf(out,
+                "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                guid->a,
+                guid->b,
+                guid->c,
+                d[0],
+                d[1],
+                guid->e[0],
+                guid->e[1],
+                guid->e[2],
+                guid->e[3],
+                guid->e[4],
+                guid->e[5]);
+}
+
+static bool efivarfs_str_to_guid(const char *str, efi_guid_t *guid)
+{
+        unsigned int a, b, c, d[2], e[6];
+        int n = 0;
+
+        if (strlen(str) != EFIVARFS_GUID_LEN) {
+                return false;
+        }
+        if (sscanf(str,
+                   "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%n",
+                   &a,
+                   &b,
+                   &c,
+                   &d[0],
+                   &d[1],
+                   &e[0],
+                   &e[1],
+                   &e[2],
+                   &e[3],
+                   &e[4],
+                   &e[5],
+                   &n) != 11 ||
+            n != EFIVARFS_GUID_LEN) {
+                return false;
+        }
+
+        memset(guid, 0, sizeof(efi_guid_t));
+        guid->a = a;
+        guid->b = (uint16_t)b;
+        guid->c = (uint16_t)c;
+        ((uint8_t *)&guid->d)[0] = (uint8_t)d[0];
+        ((uint8_t *)&guid->d)[1] = (uint8_t)d[1];
+        for (int i = 0; i < 6; i++) {
+                guid->e[i] = (uint8_t)e[i];
+        }
+        return true;
+}
+
+static char *efivarfs_path(efi_guid_t guid, const char *name)
+{
+        char guid_str[EFIVARFS_GUID_LEN + 1];
+
+        efivarfs_guid_to_str(&guid, guid_str);
+        return string_printf("%s/%s-%s", efivarfs.dir, name, guid_str);
+}
+
+static int efivarfs_read(efi_guid_t guid, const char *name, uint8_t **data, size_t *size,
+                         uint32_t *attrs)
+{
+        autofree(char) *path = efivarfs_path(guid, name);
+        uint8_t buf[sizeof(uint32_t) + EFIVARFS_VAR_MAX];
+        uint8_t *ret = NULL;
+        ssize_t len;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+        len = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (len < (ssize_t)sizeof(uint32_t)) {
+                errno = EIO;
+                return -1;
+        }
+
+        *size = (size_t)len - sizeof(uint32_t);
+        ret = malloc(*size ? *size : 1);
+        if (!ret) {
+                return -1;
+        }
+        memcpy(ret, buf + sizeof(uint32_t), *size);
+        memcpy(attrs, buf, sizeof(uint32_t));
+        *data = ret;
+        return 0;
+}
+
+static int efivarfs_write(efi_guid_t guid, const char *name, const uint8_t *data, size_t size,
+                          uint32_t attrs)
+{
+        autofree(char) *path = efivarfs_path(guid, name);
+        uint8_t buf[sizeof(uint32_t) + EFIVARFS_VAR_MAX];
+        size_t len = sizeof(uint32_t) + size;
+        ssize_t written;
+        int fd;
+
+        if (size > EFIVARFS_VAR_MAX) {
+                errno = ENOSPC;
+                return -1;
+        }
+        /* As efivarfs, writing only the attributes deletes the variable */
+        if (size == 0) {
+                return unlink(path);
+        }
+        memcpy(buf, &attrs, sizeof(uint32_t));
+        memcpy(buf + sizeof(uint32_t), data, size);
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return -1;
+        }
+        written = write(fd, buf, len);
+        close(fd);
+        if (written != (ssize_t)len) {
+                errno = EIO;
+                return -1;
+        }
+        return 0;
+}
+
+static int efivarfs_variables_supported(void)
+{
+        return 1;
+}
+
+static int efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data, size_t *size,
+                                 uint32_t *attrs)
+{
+        efivarfs.stats.reads++;
+        efivarfs_charge(efivarfs.latency.read_ns);
+        return efivarfs_read(guid, name, data, size, attrs);
+}
+
+static int efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data, size_t size,
+                                 uint32_t attrs, __cbm_unused__ mode_t mode)
+{
+        efivarfs.stats.writes++;
+        efivarfs_charge(efivarfs.latency.write_ns);
+        return efivarfs_write(guid, name, data, size, attrs);
+}
+
+/**
+ * As libefivar, returns 1 for every variable and 0 once they have all been
+ * listed, starting over on the next call.
+ */
+static int efivarfs_get_next_variable_name(efi_guid_t **guid, char **name)
+{
+        struct dirent *ent = NULL;
+
+        if (!efivarfs.listing) {
+                efivarfs.listing = opendir(efivarfs.dir);
+                if (!efivarfs.listing) {
+                        return -1;
+                }
+        }
+
+        while ((ent = readdir(efivarfs.listing)) != NULL) {
+                size_t len = strlen(ent->d_name);
+
+                if (len < EFIVARFS_GUID_LEN + 2 || len >= EFIVARFS_NAME_MAX ||
+                    ent->d_name[len - EFIVARFS_GUID_LEN - 1] != '-') {
+                        continue;
+                }
+                if (!efivarfs_str_to_guid(ent->d_name + len - EFIVARFS_GUID_LEN,
+                                          &efivarfs.guid)) {
+                        continue;
+                }
+                memcpy(efivarfs.name, ent->d_name, len - EFIVARFS_GUID_LEN - 1);
+                efivarfs.name[len - EFIVARFS_GUID_LEN - 1] = '\0';
+
+                efivarfs.stats.enumerated++;
+                efivarfs_charge(efivarfs.latency.enumerate_ns);
+                *guid = &efivarfs.guid;
+                *name = efivarfs.name;
+                return 1;
+        }
+
+        closedir(efivarfs.listing);
+        efivarfs.listing = NULL;
+        return 0;
+}
+
+/**
+ * Append @str to @buf as NUL terminated UCS-2
+ */
+static size_t efivarfs_put_ucs2(uint8_t *buf, const char *str)
+{
+        size_t len = 0;
+
+        for (const char *c = str;; c++) {
+                buf[len++] = (uint8_t)(*c == '/' ? '\\' : *c);
+                buf[len++] = 0;
+                if (*c == '\0') {
+                        break;
+                }
+        }
+        return len;
+}
+
+/**
+ * An EFI_LOAD_OPTION with a lone media file path node. The real thing
+ * starts with a hard drive node naming the ESP, which is assumed to be the
+ * only one here.
+ */
+static ssize_t efivarfs_load_option(const char *label, const char *path, uint8_t *data,
+                                    size_t size)
+{
+        uint8_t buf[EFIVARFS_VAR_MAX];
+        uint32_t attrs = EFIVARFS_LOAD_OPTION_ACTIVE;
+        uint16_t path_len = (uint16_t)(4 + (strlen(path) + 1) * 2);
+        uint16_t list_len = (uint16_t)(path_len + 4);
+        size_t len = 0;
+
+        if (sizeof(uint32_t) + sizeof(uint16_t) + (strlen(label) + 1) * 2 + list_len >
+            sizeof(buf)) {
+                errno = ENOSPC;
+                return -1;
+        }
+
+        memcpy(buf + len, &attrs, sizeof(uint32_t));
+        len += sizeof(uint32_t);
+        memcpy(buf + len, &list_len, sizeof(uint16_t));
+        len += sizeof(uint16_t);
+        len += efivarfs_put_ucs2(buf + len, label);
+
+        /* media device path, file path */
+        buf[len++] = 0x04;
+        buf[len++] = 0x04;
+        memcpy(buf + len, &path_len, sizeof(uint16_t));
+        len += sizeof(uint16_t);
+        len += efivarfs_put_ucs2(buf + len, path);
+
+        /* end of the entire device path */
+        buf[len++] = 0x7f;
+        buf[len++] = 0xff;
+        buf[len++] = 0x04;
+        buf[len++] = 0x00;
+
+        if (len > size) {
+                errno = ENOSPC;
+                return -1;
+        }
+        memcpy(data, buf, len);
+        return (ssize_t)len;
+}
+
+static ssize_t efivarfs_make_load_option(__cbm_unused__ const char *esp_mount_path,
+                                         const char *bootloader_esp_path, uint8_t *data,
+                                         size_t size)
+{
+        return efivarfs_load_option(UEFI_ENTRY_LABEL, bootloader_esp_path, data, size);
+}
+
+static CbmEfivarOps efivarfs_ops = {
+        .variables_supported = efivarfs_variables_supported,
+        .get_variable = efivarfs_get_variable,
+        .set_variable = efivarfs_set_variable,
+        .get_next_variable_name = efivarfs_get_next_variable_name,
+        .make_load_option = efivarfs_make_load_option,
+};
+
+bool efivarfs_mount(const char *dir, const EfivarfsLatency *latency, bool sleep)
+{
+        efivarfs_unmount();
+
+        if (!nc_mkdir_p(dir, 00755)) {
+                return false;
+        }
+        efivarfs.dir = strdup(dir);
+        if (!efivarfs.dir) {
+                return false;
+        }
+        if (latency) {
+                efivarfs.latency = *latency;
+        }
+        efivarfs.sleep = sleep;
+
+        cbm_efivar_set_vtable(&efivarfs_ops);
+        return true;
+}
+
+void efivarfs_unmount(void)
+{
+        if (!cbm_efivar_is_default_vtable()) {
+                cbm_efivar_reset_vtable();
+        }
+        if (efivarfs.listing) {
+                closedir(efivarfs.listing);
+        }
+        free(efivarfs.dir);
+        memset(&efivarfs, 0, sizeof(efivarfs));
+}
+
+bool efivarfs_add_boot_entries(unsigned int count)
+{
+        uint32_t attrs = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                         EFI_VARIABLE_RUNTIME_ACCESS;
+        uint16_t *order = NULL;
+        bool ret = false;
+
+        if (count > 0xFFFF) {
+                return false;
+        }
+        order = calloc(count ? count : 1, sizeof(uint16_t));
+        if (!order) {
+                return false;
+        }
+
+        for (unsigned int i = 0; i < count; i++) {
+                char name[9];
+                char label[32];
+                char path[64];
+                uint8_t data[EFIVARFS_VAR_MAX];
+                ssize_t len;
+
+                snprintf(name, sizeof(name), "Boot%04X", i);
+                snprintf(label, sizeof(label), "Vendor entry %u", i);
+                snprintf(path, sizeof(path), "/EFI/vendor%u/bootx64.efi", i);
+                len = efivarfs_load_option(label, path, data, sizeof(data));
+                if (len < 0 || efivarfs_write(EFI_GLOBAL_GUID, name, data, (size_t)len, attrs)) {
+                        goto out;
+                }
+                order[i] = (uint16_t)i;
+        }
+
+        ret = efivarfs_write(EFI_GLOBAL_GUID,
+                             "BootOrder",
+                             (uint8_t *)order,
+                             count * sizeof(uint16_t),
+                             attrs) == 0;
+out:
+        free(order);
+        return ret;
+}
+
+bool efivarfs_get_global(const char *name, uint8_t **data, size_t *size)
+{
+        uint32_t attrs = 0;
+
+        return efivarfs_read(EFI_GLOBAL_GUID, name, data, size, &attrs) == 0;
+}
+
+bool efivarfs_set_global(const char *name, const uint8_t *data, size_t size)
+{
+        uint32_t attrs = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                         EFI_VARIABLE_RUNTIME_ACCESS;
+
+        return efivarfs_write(EFI_GLOBAL_GUID, name, data, size, attrs) == 0;
+}
+
+bool efivarfs_del_global(const char *name)
+{
+        autofree(char) *path = efivarfs_path(EFI_GLOBAL_GUID, name);
+
+        return unlink(path) == 0;
+}
+
+void efivarfs_get_stats(EfivarfsStats *stats)
+{
+        if (stats) {
+                *stats = efivarfs.stats;
+        }
+}
+
+void efivarfs_reset_stats(void)
+{
+        memset(&efivarfs.stats, 0, sizeof(efivarfs.stats));
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,103 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "efivar_stub.h"
+
+/**
+ * Simulated cost of each firmware call
+ */
+typedef struct EfivarfsLatency {
+        uint64_t read_ns;      /**<Every variable read */
+        uint64_t write_ns;     /**<Every variable written */
+        uint64_t enumerate_ns; /**<Every name returned while listing the variables */
+} EfivarfsLatency;
+
+/**
+ * Typical firmware: reads trap into SMM for around a millisecond, writes
+ * reach the NVRAM flash and take tens of milliseconds
+ */
+#define EFIVARFS_LATENCY_FIRMWARE                                                                  \
+        {                                                                                          \
+                .read_ns = 1000000, .write_ns = 30000000, .enumerate_ns = 100000                   \
+        }
+
+/**
+ * Firmware calls served since mounting or the last reset
+ */
+typedef struct EfivarfsStats {
+        unsigned long reads;
+        unsigned long writes;
+        unsigned long enumerated;
+        uint64_t simulated_ns; /**<Total latency charged, slept or not */
+} EfivarfsStats;
+
+/**
+ * Stand in for the firmware through the EFI variable vtable, keeping each
+ * variable in @dir as efivarfs does: a file named "Name-GUID" holding the
+ * attributes followed by the payload. Anything already in @dir is kept.
+ * Setting a variable with no data deletes it.
+ *
+ * @latency may be NULL to make everything free. When @sleep is set the
+ * latency is slept for as well as being accounted.
+ */
+bool efivarfs_mount(const char *dir, const EfivarfsLatency *latency, bool sleep);
+
+/**
+ * Restore the default vtable, leaving the variables on disk
+ */
+void efivarfs_unmount(void);
+
+/**
+ * Store Boot0000 up to @count foreign boot entries, as another OS or the
+ * firmware itself would have left them, and list them all in BootOrder.
+ * This is free and not counted.
+ */
+bool efivarfs_add_boot_entries(unsigned int count);
+
+/**
+ * Read or write a variable with the global GUID directly, free and not
+ * counted. The data returned through @data should be freed.
+ */
+bool efivarfs_get_global(const char *name, uint8_t **data, size_t *size);
+bool efivarfs_set_global(const char *name, const uint8_t *data, size_t size);
+
+/**
+ * Remove a variable with the global GUID
+ */
+bool efivarfs_del_global(const char *name);
+
+/**
+ * Copy the counters since mounting or the last reset into @stats
+ */
+void efivarfs_get_stats(EfivarfsStats *stats);
+
+/**
+ * Zero the counters
+ */
+void efivarfs_reset_stats(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
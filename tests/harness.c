@@ -28,6 +28,7 @@
 #include "bootman_private.h"
 #undef _BOOTMAN_INTERNAL_
 #include "files.h"
+#include "fs_stub.h"
 #include "nica/files.h"
 
 #include "config.h"
@@ -92,11 +93,11 @@ static const char *module_modules[] = { "arch/dummy.ko", "crypto/dummy.ko", "dri
                                         "net/dummy.ko",  "sound/dummy.ko" };
 
 /**
- * Wrap nc_file_exists and spam to stderr
+ * Wrap cbm_fs_exists and spam to stderr
  */
 __cbm_inline__ static inline bool noisy_file_exists(const char *p)
 {
-        bool b = nc_file_exists(p);
+        bool b = cbm_fs_exists(p);
         if (b) {
                 return b;
         }
@@ -474,8 +475,9 @@ int kernel_installed_files_count(BootManager *manager, PlaygroundKernel *kernel)
         autofree(char) *initrd_file = NULL;
         autofree(char) *initrd_file_legacy = NULL;
         /* where the kernel files are expected to be found on the ESP */
-        const char *esp_path = manager->bootloader->get_kernel_destination
-                                   ? manager->bootloader->get_kernel_destination(manager)
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        const char *esp_path = bootloader->get_kernel_destination
+                                   ? bootloader->get_kernel_destination(manager)
                                    : "efi/" KERNEL_NAMESPACE;
         const char *vendor = NULL;
         int file_count = 0;
@@ -521,22 +523,22 @@ int kernel_installed_files_count(BootManager *manager, PlaygroundKernel *kernel)
                                   kernel->version,
                                   kernel->release);
 
-        if (nc_file_exists(conf_file)) {
+        if (cbm_fs_exists(conf_file)) {
                 ++file_count;
         }
 
         if (kernel->legacy_name) {
-                if (nc_file_exists(kernel_blob_legacy)) {
+                if (cbm_fs_exists(kernel_blob_legacy)) {
                         ++file_count;
                 }
-                if (nc_file_exists(initrd_file_legacy)) {
+                if (cbm_fs_exists(initrd_file_legacy)) {
                         ++file_count;
                 }
         } else {
-                if (nc_file_exists(kernel_blob)) {
+                if (cbm_fs_exists(kernel_blob)) {
                         ++file_count;
                 }
-                if (nc_file_exists(initrd_file)) {
+                if (cbm_fs_exists(initrd_file)) {
                         ++file_count;
                 }
         }
@@ -660,8 +662,9 @@ bool check_initrd_file_exist(BootManager *manager, const char *file_name)
         autofree(char) *initrd_file = NULL;
         struct stat st = { 0 };
         /* where the kernel files are expected to be found on the ESP */
-        const char *esp_path = manager->bootloader->get_kernel_destination
-                                   ? manager->bootloader->get_kernel_destination(manager)
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        const char *esp_path = bootloader->get_kernel_destination
+                                   ? bootloader->get_kernel_destination(manager)
                                    : "efi/" KERNEL_NAMESPACE;
 
         initrd_file = string_printf("%s/%s/freestanding-%s",
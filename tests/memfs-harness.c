@@ -0,0 +1,1265 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memfs-harness.h"
+#include "nica/array.h"
+#include "nica/hashmap.h"
+#include "util.h"
+
+/**
+ * Descriptors from here on are ours, anything below is a real one
+ */
+#define MEMFS_FD_BASE (1 << 24)
+#define MEMFS_MAX_FILES 256
+#define MEMFS_MAX_LINKS 40
+
+/**
+ * Chunk size used when sendfile() involves one of our descriptors
+ */
+#define MEMFS_COPY_CHUNK (64 * 1024)
+
+typedef struct MemfsNode {
+        mode_t mode;
+        char *data; /**<File contents or link target */
+        size_t len;
+        size_t alloc;
+        ino_t ino;
+        int refs; /**<The path and every open descriptor hold one */
+} MemfsNode;
+
+typedef struct MemfsFile {
+        MemfsNode *node; /**<NULL when the slot is free */
+        size_t offset;
+        int flags;
+} MemfsFile;
+
+typedef struct MemfsDir {
+        DIR *real; /**<Set when the disk is being listed */
+        NcArray *names;
+        int pos;
+        struct dirent ent;
+} MemfsDir;
+
+typedef struct MemfsMapping {
+        void *addr;
+        struct MemfsMapping *next;
+} MemfsMapping;
+
+static struct {
+        char *root;
+        size_t root_len;
+        NcHashmap *nodes; /**<Normalised path to MemfsNode */
+        MemfsFile files[MEMFS_MAX_FILES];
+        MemfsMapping *mappings;
+        MemfsLatency latency;
+        bool sleep;
+        dev_t dev;
+        ino_t next_ino;
+        MemfsStats stats;
+} memfs = { 0 };
+
+static void memfs_charge(uint64_t ns)
+{
+        struct timespec ts = { 0 };
+
+        memfs.stats.simulated_ns += ns;
+        if (!memfs.sleep || ns == 0) {
+                return;
+        }
+        ts.tv_sec = (time_t)(ns / 1000000000ULL);
+        ts.tv_nsec = (long)(ns % 1000000000ULL);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+                ;
+        }
+}
+
+static void memfs_charge_io(size_t bytes)
+{
+        memfs_charge(memfs.latency.io_ns + (uint64_t)bytes * memfs.latency.kib_ns / 1024);
+}
+
+static MemfsNode *memfs_node_new(mode_t mode)
+{
+        MemfsNode *node = calloc(1, sizeof(MemfsNode));
+
+        if (!node) {
+                return NULL;
+        }
+        node->mode = mode;
+        node->ino = ++memfs.next_ino;
+        node->refs = 1;
+        return node;
+}
+
+static void memfs_node_unref(void *v)
+{
+        MemfsNode *node = v;
+
+        if (!node || --node->refs > 0) {
+                return;
+        }
+        free(node->data);
+        free(node);
+}
+
+static bool memfs_node_set_data(MemfsNode *node, const void *data, size_t len)
+{
+        char *buf = malloc(len + 1);
+
+        if (!buf) {
+                return false;
+        }
+        memcpy(buf, data, len);
+        buf[len] = '\0';
+        free(node->data);
+        node->data = buf;
+        node->len = len;
+        node->alloc = len + 1;
+        return true;
+}
+
+/**
+ * Make @path absolute and collapse any ., .. and repeated slashes
+ */
+static char *memfs_normalize(const char *path)
+{
+        autofree(char) *abs = NULL;
+        char *out = NULL;
+        char *save = NULL;
+        size_t n = 0;
+
+        if (!path) {
+                errno = EFAULT;
+                return NULL;
+        }
+        if (path[0] == '/') {
+                abs = strdup(path);
+        } else {
+                char cwd[PATH_MAX];
+
+                if (!getcwd(cwd, sizeof(cwd))) {
+                        return NULL;
+                }
+                abs = string_printf("%s/%s", cwd, path);
+        }
+        if (!abs) {
+                return NULL;
+        }
+
+        out = calloc(1, strlen(abs) + 2);
+        if (!out) {
+                return NULL;
+        }
+        for (char *tok = strtok_r(abs, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+                if (streq(tok, ".")) {
+                        continue;
+                }
+                if (streq(tok, "..")) {
+                        while (n > 0 && out[n - 1] != '/') {
+                                n--;
+                        }
+                        if (n > 0) {
+                                n--;
+                        }
+                        out[n] = '\0';
+                        continue;
+                }
+                out[n++] = '/';
+                strcpy(out + n, tok);
+                n += strlen(tok);
+        }
+        if (n == 0) {
+                out[n++] = '/';
+        }
+        out[n] = '\0';
+        return out;
+}
+
+static bool memfs_owns(const char *norm)
+{
+        return memfs.root && strncmp(norm, memfs.root, memfs.root_len) == 0 &&
+               (norm[memfs.root_len] == '\0' || norm[memfs.root_len] == '/');
+}
+
+/**
+ * Whether @key is directly inside the directory @dir
+ */
+static bool memfs_is_child(const char *key, const char *dir)
+{
+        size_t len = strlen(dir);
+
+        return strncmp(key, dir, len) == 0 && key[len] == '/' && !strchr(key + len + 1, '/');
+}
+
+static bool memfs_is_descendant(const char *key, const char *dir)
+{
+        size_t len = strlen(dir);
+
+        return strncmp(key, dir, len) == 0 && key[len] == '/';
+}
+
+static char *memfs_parent(const char *norm)
+{
+        const char *slash = strrchr(norm, '/');
+
+        if (slash == norm) {
+                return strdup("/");
+        }
+        return strndup(norm, (size_t)(slash - norm));
+}
+
+static MemfsNode *memfs_get(const char *norm)
+{
+        return nc_hashmap_get(memfs.nodes, norm);
+}
+
+static bool memfs_parent_is_dir(const char *norm)
+{
+        autofree(char) *parent = memfs_parent(norm);
+        MemfsNode *node = parent ? memfs_get(parent) : NULL;
+
+        return node && S_ISDIR(node->mode);
+}
+
+static bool memfs_has_children(const char *norm)
+{
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+
+        nc_hashmap_iter_init(memfs.nodes, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                if (memfs_is_child(key, norm)) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static bool memfs_put(const char *norm, MemfsNode *node)
+{
+        char *key = strdup(norm);
+
+        if (!key || !nc_hashmap_put(memfs.nodes, key, node)) {
+                free(key);
+                memfs_node_unref(node);
+                errno = ENOMEM;
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Normalise @path and, when it is below the mount, follow a final symlink
+ * if @follow is set. Links leading out of the mount end up dangling.
+ *
+ * Returns NULL for paths that the disk should handle as given, with errno
+ * cleared, or NULL with errno set on failure.
+ */
+static char *memfs_path(const char *path, bool follow)
+{
+        char *norm = memfs_normalize(path);
+
+        if (!norm) {
+                return NULL;
+        }
+        if (!memfs_owns(norm)) {
+                free(norm);
+                errno = 0;
+                return NULL;
+        }
+
+        for (int i = 0; follow && i < MEMFS_MAX_LINKS; i++) {
+                MemfsNode *node = memfs_get(norm);
+                autofree(char) *target = NULL;
+
+                if (!node || !S_ISLNK(node->mode)) {
+                        break;
+                }
+                if (node->data[0] == '/') {
+                        target = strdup(node->data);
+                } else {
+                        autofree(char) *parent = memfs_parent(norm);
+                        target = string_printf("%s/%s", parent, node->data);
+                }
+                free(norm);
+                norm = memfs_normalize(target);
+                if (!norm) {
+                        return NULL;
+                }
+        }
+        return norm;
+}
+
+/**
+ * Lookup for functions following symlinks, where a link still found at the
+ * end of the chain is a loop
+ */
+static MemfsNode *memfs_get_followed(const char *norm)
+{
+        MemfsNode *node = memfs_get(norm);
+
+        if (!node) {
+                errno = ENOENT;
+                return NULL;
+        }
+        if (S_ISLNK(node->mode)) {
+                errno = ELOOP;
+                return NULL;
+        }
+        return node;
+}
+
+static void memfs_fill_stat(const MemfsNode *node, struct stat *st)
+{
+        memset(st, 0, sizeof(struct stat));
+        st->st_dev = memfs.dev;
+        st->st_ino = node->ino;
+        st->st_mode = node->mode;
+        st->st_nlink = S_ISDIR(node->mode) ? 2 : 1;
+        st->st_size = (off_t)node->len;
+        st->st_blksize = 4096;
+        st->st_blocks = (blkcnt_t)((node->len + 511) / 512);
+}
+
+static MemfsFile *memfs_file(int fd)
+{
+        MemfsFile *file = NULL;
+
+        if (fd < MEMFS_FD_BASE || fd >= MEMFS_FD_BASE + MEMFS_MAX_FILES) {
+                return NULL;
+        }
+        file = &memfs.files[fd - MEMFS_FD_BASE];
+        return file->node ? file : NULL;
+}
+
+static bool memfs_is_fd(int fd)
+{
+        return fd >= MEMFS_FD_BASE;
+}
+
+static int memfs_access(const char *path, int mode)
+{
+        autofree(char) *p = memfs_path(path, true);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : access(path, mode);
+        }
+        memfs.stats.lookups++;
+        memfs_charge(memfs.latency.lookup_ns);
+        node = memfs_get_followed(p);
+        if (!node) {
+                return -1;
+        }
+        if ((mode & X_OK) && !(node->mode & 0111)) {
+                errno = EACCES;
+                return -1;
+        }
+        return 0;
+}
+
+static int memfs_stat_common(const char *path, struct stat *st, bool follow)
+{
+        autofree(char) *p = memfs_path(path, follow);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                if (errno) {
+                        return -1;
+                }
+                return follow ? stat(path, st) : lstat(path, st);
+        }
+        memfs.stats.lookups++;
+        memfs_charge(memfs.latency.lookup_ns);
+        node = follow ? memfs_get_followed(p) : memfs_get(p);
+        if (!node) {
+                errno = follow ? errno : ENOENT;
+                return -1;
+        }
+        memfs_fill_stat(node, st);
+        return 0;
+}
+
+static int memfs_stat(const char *path, struct stat *st)
+{
+        return memfs_stat_common(path, st, true);
+}
+
+static int memfs_lstat(const char *path, struct stat *st)
+{
+        return memfs_stat_common(path, st, false);
+}
+
+static char *memfs_realpath(const char *path, char *resolved)
+{
+        autofree(char) *p = memfs_path(path, true);
+
+        if (!p) {
+                return errno ? NULL : realpath(path, resolved);
+        }
+        memfs.stats.lookups++;
+        memfs_charge(memfs.latency.lookup_ns);
+        if (!memfs_get_followed(p)) {
+                return NULL;
+        }
+        if (resolved) {
+                if (strlen(p) >= PATH_MAX) {
+                        errno = ENAMETOOLONG;
+                        return NULL;
+                }
+                return strcpy(resolved, p);
+        }
+        return strdup(p);
+}
+
+static ssize_t memfs_readlink(const char *path, char *buf, size_t size)
+{
+        autofree(char) *p = memfs_path(path, false);
+        MemfsNode *node = NULL;
+        size_t n;
+
+        if (!p) {
+                return errno ? -1 : readlink(path, buf, size);
+        }
+        memfs.stats.lookups++;
+        memfs_charge(memfs.latency.lookup_ns);
+        node = memfs_get(p);
+        if (!node) {
+                errno = ENOENT;
+                return -1;
+        }
+        if (!S_ISLNK(node->mode)) {
+                errno = EINVAL;
+                return -1;
+        }
+        n = node->len < size ? node->len : size;
+        memcpy(buf, node->data, n);
+        return (ssize_t)n;
+}
+
+/**
+ * Common checks before creating @p, charging for the operation
+ */
+static bool memfs_can_create(const char *p)
+{
+        memfs.stats.metadata_ops++;
+        memfs_charge(memfs.latency.metadata_ns);
+        if (memfs_get(p)) {
+                errno = EEXIST;
+                return false;
+        }
+        if (!memfs_parent_is_dir(p)) {
+                errno = ENOENT;
+                return false;
+        }
+        return true;
+}
+
+static int memfs_mkdir(const char *path, mode_t mode)
+{
+        autofree(char) *p = memfs_path(path, false);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : mkdir(path, mode);
+        }
+        if (!memfs_can_create(p)) {
+                return -1;
+        }
+        node = memfs_node_new(S_IFDIR | (mode & 07777));
+        if (!node) {
+                errno = ENOMEM;
+                return -1;
+        }
+        return memfs_put(p, node) ? 0 : -1;
+}
+
+static int memfs_rmdir(const char *path)
+{
+        autofree(char) *p = memfs_path(path, false);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : rmdir(path);
+        }
+        memfs.stats.metadata_ops++;
+        memfs_charge(memfs.latency.metadata_ns);
+        node = memfs_get(p);
+        if (!node) {
+                errno = ENOENT;
+                return -1;
+        }
+        if (!S_ISDIR(node->mode)) {
+                errno = ENOTDIR;
+                return -1;
+        }
+        if (streq(p, memfs.root)) {
+                errno = EBUSY;
+                return -1;
+        }
+        if (memfs_has_children(p)) {
+                errno = ENOTEMPTY;
+                return -1;
+        }
+        nc_hashmap_remove(memfs.nodes, p);
+        return 0;
+}
+
+static int memfs_unlink(const char *path)
+{
+        autofree(char) *p = memfs_path(path, false);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : unlink(path);
+        }
+        memfs.stats.metadata_ops++;
+        memfs_charge(memfs.latency.metadata_ns);
+        node = memfs_get(p);
+        if (!node) {
+                errno = ENOENT;
+                return -1;
+        }
+        if (S_ISDIR(node->mode)) {
+                errno = EISDIR;
+                return -1;
+        }
+        nc_hashmap_remove(memfs.nodes, p);
+        return 0;
+}
+
+/**
+ * Move the node at @from to @to, which must be free
+ */
+static bool memfs_move(const char *from, const char *to)
+{
+        MemfsNode *node = memfs_get(from);
+
+        node->refs++;
+        nc_hashmap_remove(memfs.nodes, from);
+        return memfs_put(to, node);
+}
+
+/**
+ * Move everything below the directory @from to below @to
+ */
+static bool memfs_move_children(const char *from, const char *to)
+{
+        NcArray *children = nc_array_new();
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+        size_t from_len = strlen(from);
+        bool ret = true;
+
+        if (!children) {
+                errno = ENOMEM;
+                return false;
+        }
+        nc_hashmap_iter_init(memfs.nodes, &iter);
+        while (ret && nc_hashmap_iter_next(&iter, &key, NULL)) {
+                if (memfs_is_descendant(key, from)) {
+                        ret = nc_array_add(children, strdup(key));
+                }
+        }
+        if (!ret) {
+                errno = ENOMEM;
+        }
+
+        for (int i = 0; ret && i < children->len; i++) {
+                const char *child = nc_array_get(children, i);
+                autofree(char) *moved = string_printf("%s%s", to, child + from_len);
+
+                ret = memfs_move(child, moved);
+        }
+
+        nc_array_free(&children, free);
+        return ret;
+}
+
+static int memfs_rename(const char *oldpath, const char *newpath)
+{
+        autofree(char) *from = memfs_path(oldpath, false);
+        int from_errno = errno;
+        autofree(char) *to = memfs_path(newpath, false);
+        int to_errno = errno;
+        MemfsNode *src = NULL;
+        MemfsNode *dst = NULL;
+
+        if ((!from && from_errno) || (!to && to_errno)) {
+                errno = from_errno ? from_errno : to_errno;
+                return -1;
+        }
+        if (!from && !to) {
+                return rename(oldpath, newpath);
+        }
+        if (!from || !to) {
+                errno = EXDEV;
+                return -1;
+        }
+
+        memfs.stats.metadata_ops++;
+        memfs_charge(memfs.latency.metadata_ns);
+        src = memfs_get(from);
+        if (!src) {
+                errno = ENOENT;
+                return -1;
+        }
+        if (streq(from, to)) {
+                return 0;
+        }
+        if (streq(from, memfs.root) || memfs_is_descendant(to, from)) {
+                errno = streq(from, memfs.root) ? EBUSY : EINVAL;
+                return -1;
+        }
+        if (!memfs_parent_is_dir(to)) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        dst = memfs_get(to);
+        if (dst) {
+                if (S_ISDIR(dst->mode) && !S_ISDIR(src->mode)) {
+                        errno = EISDIR;
+                        return -1;
+                }
+                if (!S_ISDIR(dst->mode) && S_ISDIR(src->mode)) {
+                        errno = ENOTDIR;
+                        return -1;
+                }
+                if (S_ISDIR(dst->mode) && memfs_has_children(to)) {
+                        errno = ENOTEMPTY;
+                        return -1;
+                }
+                nc_hashmap_remove(memfs.nodes, to);
+        }
+
+        /* Directories take everything below them along */
+        if (S_ISDIR(src->mode) && !memfs_move_children(from, to)) {
+                return -1;
+        }
+        return memfs_move(from, to) ? 0 : -1;
+}
+
+static int memfs_symlink(const char *target, const char *linkpath)
+{
+        autofree(char) *p = memfs_path(linkpath, false);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : symlink(target, linkpath);
+        }
+        if (!memfs_can_create(p)) {
+                return -1;
+        }
+        node = memfs_node_new(S_IFLNK | 0777);
+        if (!node || !memfs_node_set_data(node, target, strlen(target))) {
+                memfs_node_unref(node);
+                errno = ENOMEM;
+                return -1;
+        }
+        return memfs_put(p, node) ? 0 : -1;
+}
+
+static int memfs_chmod(const char *path, mode_t mode)
+{
+        autofree(char) *p = memfs_path(path, true);
+        MemfsNode *node = NULL;
+
+        if (!p) {
+                return errno ? -1 : chmod(path, mode);
+        }
+        memfs.stats.metadata_ops++;
+        memfs_charge(memfs.latency.metadata_ns);
+        node = memfs_get_followed(p);
+        if (!node) {
+                return -1;
+        }
+        node->mode = (node->mode & S_IFMT) | (mode & 07777);
+        return 0;
+}
+
+static int memfs_open(const char *path, int flags, mode_t mode)
+{
+        autofree(char) *p = memfs_path(path, true);
+        MemfsNode *node = NULL;
+        int access_mode = flags & O_ACCMODE;
+
+        if (!p) {
+                return errno ? -1 : open(path, flags, mode);
+        }
+        memfs.stats.opens++;
+        memfs_charge(memfs.latency.open_ns);
+
+        node = memfs_get(p);
+        if (node && (flags & O_CREAT) && (flags & O_EXCL)) {
+                errno = EEXIST;
+                return -1;
+        }
+        if (!node) {
+                if (!(flags & O_CREAT)) {
+                        errno = ENOENT;
+                        return -1;
+                }
+                if (!memfs_parent_is_dir(p)) {
+                        errno = ENOENT;
+                        return -1;
+                }
+                node = memfs_node_new(S_IFREG | (mode & 07777));
+                if (!node || !memfs_put(p, node)) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+        }
+        if (S_ISLNK(node->mode)) {
+                errno = ELOOP;
+                return -1;
+        }
+        if (S_ISDIR(node->mode) && access_mode != O_RDONLY) {
+                errno = EISDIR;
+                return -1;
+        }
+        if (!S_ISDIR(node->mode) && (flags & O_DIRECTORY)) {
+                errno = ENOTDIR;
+                return -1;
+        }
+        if ((flags & O_TRUNC) && access_mode != O_RDONLY) {
+                node->len = 0;
+        }
+
+        for (int i = 0; i < MEMFS_MAX_FILES; i++) {
+                MemfsFile *file = &memfs.files[i];
+
+                if (file->node) {
+                        continue;
+                }
+                node->refs++;
+                file->node = node;
+                file->offset = 0;
+                file->flags = flags;
+                return MEMFS_FD_BASE + i;
+        }
+        errno = EMFILE;
+        return -1;
+}
+
+static int memfs_close(int fd)
+{
+        MemfsFile *file = memfs_file(fd);
+
+        if (!memfs_is_fd(fd)) {
+                return close(fd);
+        }
+        if (!file) {
+                errno = EBADF;
+                return -1;
+        }
+        memfs_node_unref(file->node);
+        memset(file, 0, sizeof(MemfsFile));
+        return 0;
+}
+
+static ssize_t memfs_read(int fd, void *buf, size_t count)
+{
+        MemfsFile *file = memfs_file(fd);
+        size_t n = 0;
+
+        if (!memfs_is_fd(fd)) {
+                return read(fd, buf, count);
+        }
+        if (!file || (file->flags & O_ACCMODE) == O_WRONLY) {
+                errno = EBADF;
+                return -1;
+        }
+        if (S_ISDIR(file->node->mode)) {
+                errno = EISDIR;
+                return -1;
+        }
+        if (file->offset < file->node->len) {
+                n = file->node->len - file->offset;
+                n = n < count ? n : count;
+                memcpy(buf, file->node->data + file->offset, n);
+                file->offset += n;
+        }
+        memfs.stats.reads++;
+        memfs.stats.bytes_read += n;
+        memfs_charge_io(n);
+        return (ssize_t)n;
+}
+
+static ssize_t memfs_write(int fd, const void *buf, size_t count)
+{
+        MemfsFile *file = memfs_file(fd);
+        MemfsNode *node = NULL;
+        size_t end;
+
+        if (!memfs_is_fd(fd)) {
+                return write(fd, buf, count);
+        }
+        if (!file || (file->flags & O_ACCMODE) == O_RDONLY) {
+                errno = EBADF;
+                return -1;
+        }
+        node = file->node;
+        if (file->flags & O_APPEND) {
+                file->offset = node->len;
+        }
+
+        end = file->offset + count;
+        if (end + 1 > node->alloc) {
+                size_t alloc = node->alloc * 2 > end + 1 ? node->alloc * 2 : end + 1;
+                char *data = realloc(node->data, alloc);
+
+                if (!data) {
+                        errno = ENOSPC;
+                        return -1;
+                }
+                node->data = data;
+                node->alloc = alloc;
+        }
+        if (file->offset > node->len) {
+                memset(node->data + node->len, 0, file->offset - node->len);
+        }
+        memcpy(node->data + file->offset, buf, count);
+        file->offset = end;
+        if (end > node->len) {
+                node->len = end;
+        }
+        node->data[node->len] = '\0';
+
+        memfs.stats.writes++;
+        memfs.stats.bytes_written += count;
+        memfs_charge_io(count);
+        return (ssize_t)count;
+}
+
+static int memfs_fstat(int fd, struct stat *st)
+{
+        MemfsFile *file = memfs_file(fd);
+
+        if (!memfs_is_fd(fd)) {
+                return fstat(fd, st);
+        }
+        if (!file) {
+                errno = EBADF;
+                return -1;
+        }
+        memfs_fill_stat(file->node, st);
+        return 0;
+}
+
+static int memfs_fsync(int fd)
+{
+        if (!memfs_is_fd(fd)) {
+                return fsync(fd);
+        }
+        if (!memfs_file(fd)) {
+                errno = EBADF;
+                return -1;
+        }
+        memfs.stats.fsyncs++;
+        memfs_charge(memfs.latency.fsync_ns);
+        return 0;
+}
+
+static ssize_t memfs_sendfile(int out_fd, int in_fd, size_t count)
+{
+        char buf[MEMFS_COPY_CHUNK];
+        size_t total = 0;
+
+        if (!memfs_is_fd(out_fd) && !memfs_is_fd(in_fd)) {
+                return sendfile(out_fd, in_fd, NULL, count);
+        }
+
+        while (total < count) {
+                size_t want = count - total < sizeof(buf) ? count - total : sizeof(buf);
+                ssize_t r = memfs_read(in_fd, buf, want);
+
+                if (r < 0) {
+                        return total > 0 ? (ssize_t)total : -1;
+                }
+                if (r == 0) {
+                        break;
+                }
+                if (memfs_write(out_fd, buf, (size_t)r) != r) {
+                        return total > 0 ? (ssize_t)total : -1;
+                }
+                total += (size_t)r;
+        }
+        return (ssize_t)total;
+}
+
+static void *memfs_mmap(int fd, size_t length)
+{
+        MemfsFile *file = memfs_file(fd);
+        MemfsMapping *mapping = NULL;
+        char *buf = NULL;
+
+        if (length == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if (!memfs_is_fd(fd)) {
+                void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                return addr == MAP_FAILED ? NULL : addr;
+        }
+        if (!file) {
+                errno = EBADF;
+                return NULL;
+        }
+
+        /* A private copy, terminated like the zero fill of a real mapping */
+        buf = calloc(1, length + 1);
+        mapping = calloc(1, sizeof(MemfsMapping));
+        if (!buf || !mapping) {
+                free(buf);
+                free(mapping);
+                errno = ENOMEM;
+                return NULL;
+        }
+        memcpy(buf, file->node->data, length < file->node->len ? length : file->node->len);
+        mapping->addr = buf;
+        mapping->next = memfs.mappings;
+        memfs.mappings = mapping;
+
+        memfs.stats.reads++;
+        memfs.stats.bytes_read += length;
+        memfs_charge_io(length);
+        return buf;
+}
+
+static int memfs_munmap(void *addr, size_t length)
+{
+        for (MemfsMapping **m = &memfs.mappings; *m; m = &(*m)->next) {
+                MemfsMapping *mapping = *m;
+
+                if (mapping->addr != addr) {
+                        continue;
+                }
+                *m = mapping->next;
+                free(mapping->addr);
+                free(mapping);
+                return 0;
+        }
+        return munmap(addr, length);
+}
+
+static void *memfs_opendir(const char *path)
+{
+        autofree(char) *p = memfs_path(path, true);
+        MemfsDir *dir = NULL;
+        MemfsNode *node = NULL;
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+
+        if (!p && errno) {
+                return NULL;
+        }
+        dir = calloc(1, sizeof(MemfsDir));
+        if (!dir) {
+                return NULL;
+        }
+
+        if (!p) {
+                dir->real = opendir(path);
+                if (!dir->real) {
+                        free(dir);
+                        return NULL;
+                }
+                return dir;
+        }
+
+        memfs.stats.lookups++;
+        memfs_charge(memfs.latency.lookup_ns);
+        node = memfs_get_followed(p);
+        if (!node || !S_ISDIR(node->mode)) {
+                errno = node ? ENOTDIR : errno;
+                free(dir);
+                return NULL;
+        }
+
+        /* Snapshot the names, so the listing survives changes made while reading */
+        dir->names = nc_array_new();
+        if (!dir->names || !nc_array_add(dir->names, strdup(".")) ||
+            !nc_array_add(dir->names, strdup(".."))) {
+                goto oom;
+        }
+        nc_hashmap_iter_init(memfs.nodes, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                if (memfs_is_child(key, p) && !nc_array_add(dir->names, strdup(key))) {
+                        goto oom;
+                }
+        }
+        return dir;
+
+oom:
+        if (dir->names) {
+                nc_array_free(&dir->names, free);
+        }
+        free(dir);
+        errno = ENOMEM;
+        return NULL;
+}
+
+static struct dirent *memfs_readdir(void *v)
+{
+        MemfsDir *dir = v;
+        const char *name = NULL;
+        const char *slash = NULL;
+        MemfsNode *node = NULL;
+
+        if (dir->real) {
+                return readdir(dir->real);
+        }
+        if (dir->pos >= dir->names->len) {
+                return NULL;
+        }
+
+        name = nc_array_get(dir->names, dir->pos++);
+        slash = strrchr(name, '/');
+        node = slash ? memfs_get(name) : NULL;
+
+        memset(&dir->ent, 0, sizeof(dir->ent));
+        strncpy(dir->ent.d_name, slash ? slash + 1 : name, sizeof(dir->ent.d_name) - 1);
+        if (!slash) {
+                dir->ent.d_type = DT_DIR;
+        } else if (!node) {
+                /* Gone since opendir */
+                return memfs_readdir(v);
+        } else {
+                dir->ent.d_ino = node->ino;
+                dir->ent.d_type = S_ISDIR(node->mode) ? DT_DIR : S_ISLNK(node->mode) ? DT_LNK : DT_REG;
+        }
+        return &dir->ent;
+}
+
+static int memfs_closedir(void *v)
+{
+        MemfsDir *dir = v;
+        int ret = 0;
+
+        if (dir->real) {
+                ret = closedir(dir->real);
+        } else {
+                nc_array_free(&dir->names, free);
+        }
+        free(dir);
+        return ret;
+}
+
+static void memfs_sync(void)
+{
+        memfs.stats.syncs++;
+        memfs_charge(memfs.latency.sync_ns);
+}
+
+static CbmFsOps memfs_ops = {
+        .access = memfs_access,
+        .stat = memfs_stat,
+        .lstat = memfs_lstat,
+        .realpath = memfs_realpath,
+        .readlink = memfs_readlink,
+        .mkdir = memfs_mkdir,
+        .rmdir = memfs_rmdir,
+        .unlink = memfs_unlink,
+        .rename = memfs_rename,
+        .symlink = memfs_symlink,
+        .chmod = memfs_chmod,
+        .open = memfs_open,
+        .close = memfs_close,
+        .read = memfs_read,
+        .write = memfs_write,
+        .fstat = memfs_fstat,
+        .fsync = memfs_fsync,
+        .sendfile = memfs_sendfile,
+        .mmap = memfs_mmap,
+        .munmap = memfs_munmap,
+        .opendir = memfs_opendir,
+        .readdir = memfs_readdir,
+        .closedir = memfs_closedir,
+        .sync = memfs_sync,
+};
+
+/**
+ * Copy @path from the disk into memory, along with everything below it
+ */
+static bool memfs_seed(const char *path)
+{
+        struct stat st = { 0 };
+        MemfsNode *node = NULL;
+
+        if (lstat(path, &st) != 0) {
+                return false;
+        }
+        node = memfs_node_new(st.st_mode);
+        if (!node) {
+                return false;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t n = readlink(path, target, sizeof(target));
+
+                if (n < 0 || !memfs_node_set_data(node, target, (size_t)n)) {
+                        memfs_node_unref(node);
+                        return false;
+                }
+        } else if (S_ISREG(st.st_mode)) {
+                char *data = NULL;
+                ssize_t n;
+                int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+                data = fd >= 0 ? malloc((size_t)st.st_size + 1) : NULL;
+                n = data ? read(fd, data, (size_t)st.st_size) : -1;
+                if (fd >= 0) {
+                        close(fd);
+                }
+                if (n != st.st_size) {
+                        free(data);
+                        memfs_node_unref(node);
+                        return false;
+                }
+                data[n] = '\0';
+                node->data = data;
+                node->len = (size_t)n;
+                node->alloc = (size_t)n + 1;
+        } else if (!S_ISDIR(st.st_mode)) {
+                /* Nothing else lives on an ESP */
+                memfs_node_unref(node);
+                return true;
+        }
+
+        if (!memfs_put(path, node)) {
+                return false;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+                DIR *dir = opendir(path);
+                struct dirent *ent = NULL;
+                bool ret = true;
+
+                if (!dir) {
+                        return false;
+                }
+                while (ret && (ent = readdir(dir)) != NULL) {
+                        autofree(char) *child = NULL;
+
+                        if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                                continue;
+                        }
+                        child = string_printf("%s/%s", path, ent->d_name);
+                        ret = memfs_seed(child);
+                }
+                closedir(dir);
+                return ret;
+        }
+        return true;
+}
+
+bool memfs_mount(const char *root, const MemfsLatency *latency, bool sleep)
+{
+        struct stat st = { 0 };
+
+        memfs_unmount();
+
+        memfs.root = memfs_normalize(root);
+        if (!memfs.root || streq(memfs.root, "/")) {
+                memfs_unmount();
+                return false;
+        }
+        memfs.root_len = strlen(memfs.root);
+        memfs.nodes = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, memfs_node_unref);
+        if (!memfs.nodes) {
+                memfs_unmount();
+                return false;
+        }
+        if (latency) {
+                memfs.latency = *latency;
+        }
+        memfs.sleep = sleep;
+
+        if (stat(memfs.root, &st) == 0) {
+                memfs.dev = st.st_dev;
+                if (!S_ISDIR(st.st_mode) || !memfs_seed(memfs.root)) {
+                        memfs_unmount();
+                        return false;
+                }
+        } else {
+                MemfsNode *node = memfs_node_new(S_IFDIR | 00755);
+
+                if (!node || !memfs_put(memfs.root, node)) {
+                        memfs_unmount();
+                        return false;
+                }
+        }
+
+        cbm_fs_set_vtable(&memfs_ops);
+        return true;
+}
+
+void memfs_unmount(void)
+{
+        if (!cbm_fs_is_default_vtable()) {
+                cbm_fs_reset_vtable();
+        }
+
+        for (int i = 0; i < MEMFS_MAX_FILES; i++) {
+                memfs_node_unref(memfs.files[i].node);
+        }
+        while (memfs.mappings) {
+                MemfsMapping *next = memfs.mappings->next;
+
+                free(memfs.mappings->addr);
+                free(memfs.mappings);
+                memfs.mappings = next;
+        }
+        if (memfs.nodes) {
+                nc_hashmap_free(memfs.nodes);
+        }
+        free(memfs.root);
+        memset(&memfs, 0, sizeof(memfs));
+}
+
+void memfs_get_stats(MemfsStats *stats)
+{
+        *stats = memfs.stats;
+}
+
+void memfs_reset_stats(void)
+{
+        memset(&memfs.stats, 0, sizeof(memfs.stats));
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
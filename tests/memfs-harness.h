@@ -0,0 +1,94 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fs_stub.h"
+
+/**
+ * Simulated cost of each kind of operation on the in-memory filesystem
+ */
+typedef struct MemfsLatency {
+        uint64_t lookup_ns;   /**<stat, access, realpath, readlink, opendir */
+        uint64_t open_ns;     /**<open and close */
+        uint64_t metadata_ns; /**<mkdir, rmdir, unlink, rename, symlink, chmod */
+        uint64_t io_ns;       /**<Every read or write call */
+        uint64_t kib_ns;      /**<Every KiB read or written */
+        uint64_t fsync_ns;
+        uint64_t sync_ns;
+} MemfsLatency;
+
+/**
+ * A FAT ESP on slow flash: cheap lookups, 20MB/s writes and flushes that
+ * cost tens of milliseconds
+ */
+#define MEMFS_LATENCY_SLOW_ESP                                                                     \
+        {                                                                                          \
+                .lookup_ns = 20000, .open_ns = 50000, .metadata_ns = 500000, .io_ns = 10000,       \
+                .kib_ns = 50000, .fsync_ns = 20000000, .sync_ns = 50000000                         \
+        }
+
+/**
+ * Operations served from memory since mounting or the last reset
+ */
+typedef struct MemfsStats {
+        unsigned long lookups;
+        unsigned long opens;
+        unsigned long metadata_ops;
+        unsigned long reads;
+        unsigned long writes;
+        unsigned long fsyncs;
+        unsigned long syncs;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        uint64_t simulated_ns; /**<Total latency charged, slept or not */
+} MemfsStats;
+
+/**
+ * Serve everything below @root from memory through the file operations
+ * vtable, starting from a copy of what is on disk there now. Everything
+ * else passes through to the disk.
+ *
+ * @latency may be NULL to make everything free. When @sleep is set the
+ * latency is slept for as well as being accounted.
+ */
+bool memfs_mount(const char *root, const MemfsLatency *latency, bool sleep);
+
+/**
+ * Drop the in-memory filesystem and restore the default vtable
+ */
+void memfs_unmount(void);
+
+/**
+ * Copy the counters since mounting or the last reset into @stats
+ */
+void memfs_get_stats(MemfsStats *stats);
+
+/**
+ * Zero the counters
+ */
+void memfs_reset_stats(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */